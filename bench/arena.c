@@ -0,0 +1,292 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Arena benchmark. Runs the allocation pattern of request handlers:
+ * every thread handles requests that each allocate a random number
+ * of temporaries, mostly small strings and now and then a larger
+ * object, write them, and free them all when the request is done.
+ * Temporaries come from an arena per thread that is reset after
+ * every request (-a arena), or from malloc and free (-a malloc).
+ * Reports requests per second, the time per allocation, and the
+ * chunks the arenas grew to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <maxserver.h>
+
+/**
+ * Data structure representing the benchmark parameters.
+ */
+struct arena_args {
+	int arena;
+	unsigned long threads;
+	unsigned long requests;
+	size_t allocs;
+	size_t chunk_len;
+	unsigned int growth;
+	int poison;
+};
+
+/**
+ * Data structure representing the results of a thread.
+ */
+struct arena_result {
+	unsigned long long allocs;
+	struct maxserver_arena_stats stats;
+};
+
+/**
+ * Global variable holding the benchmark parameters.
+ */
+static struct arena_args args;
+
+/**
+ * Returns the monotonic time in seconds.
+ */
+static double arena_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Returns a pseudo-random number from the xorshift state 'state'.
+ */
+static unsigned long long arena_random(unsigned long long *state)
+{
+	unsigned long long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+/**
+ * Function that is run by every thread, with its result in 'arg'.
+ */
+static void *arena_thread(void *arg)
+{
+	struct arena_result *result = (struct arena_result *)arg;
+	unsigned long long state = 88172645463325252ULL +
+		(unsigned long long)(size_t)result * 7919;
+	struct maxserver_arena *arena = NULL;
+	unsigned long i;
+	size_t n, len, j;
+	void **ptrs;
+
+	ptrs = malloc(sizeof(void *) * args.allocs * 2);
+
+	if (ptrs == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (args.arena) {
+		arena = maxserver_arena_create(
+			args.chunk_len,
+			args.growth,
+			args.poison
+		);
+
+		if (arena == NULL) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < args.requests; ++i) {
+		n = 1 + arena_random(&state) % (args.allocs * 2);
+
+		for (j = 0; j < n; ++j) {
+			/* Header fields and strings, and every 16th
+			   time a parsed body or a reply. */
+			if (arena_random(&state) % 16 == 0) {
+				len = 512 + arena_random(&state) % 3584;
+			} else {
+				len = 16 + arena_random(&state) % 112;
+			}
+
+			ptrs[j] = args.arena ?
+				maxserver_arena_alloc(arena, len) :
+				malloc(len);
+
+			if (ptrs[j] == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+
+			memset(ptrs[j], (int)j, len < 64 ? len : 64);
+		}
+
+		if (args.arena) {
+			maxserver_arena_reset(arena);
+		} else {
+			for (j = 0; j < n; ++j) {
+				free(ptrs[j]);
+			}
+		}
+
+		result->allocs += n;
+	}
+
+	if (args.arena) {
+		maxserver_arena_stats(arena, &result->stats);
+		maxserver_arena_destroy(arena);
+	}
+
+	free(ptrs);
+
+	return NULL;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-a arena|malloc] [-t threads] [-n requests] "
+		"[-k allocs] [-c chunk_len] [-g growth] [-P]\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct arena_result *results;
+	unsigned long long allocs = 0;
+	size_t chunks = 0, bytes = 0, peak = 0;
+	pthread_t *tids;
+	double start, seconds, total;
+	unsigned long i;
+	int opt;
+
+	args.arena = 1;
+	args.threads = 4;
+	args.requests = 1000000;
+	args.allocs = 32;
+	args.chunk_len = 4096;
+	args.growth = 2;
+	args.poison = 0;
+
+	while ((opt = getopt(argc, argv, "a:t:n:k:c:g:P")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (strcmp(optarg, "malloc") == 0) {
+				args.arena = 0;
+			} else if (strcmp(optarg, "arena") != 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 't':
+			args.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			args.requests = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			args.allocs = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			args.chunk_len = strtoul(optarg, NULL, 10);
+			break;
+		case 'g':
+			args.growth = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			args.poison = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (args.threads == 0 || args.allocs == 0) {
+		usage(argv[0]);
+	}
+
+	results = calloc(args.threads, sizeof(struct arena_result));
+	tids = malloc(sizeof(pthread_t) * args.threads);
+
+	if (results == NULL || tids == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	start = arena_now();
+
+	for (i = 0; i < args.threads; ++i) {
+		pthread_create(&tids[i], NULL, arena_thread, &results[i]);
+	}
+
+	for (i = 0; i < args.threads; ++i) {
+		pthread_join(tids[i], NULL);
+		allocs += results[i].allocs;
+		chunks += results[i].stats.chunks;
+		bytes += results[i].stats.bytes;
+
+		if (results[i].stats.peak > peak) {
+			peak = results[i].stats.peak;
+		}
+	}
+
+	seconds = arena_now() - start;
+	total = (double)args.threads * (double)args.requests;
+
+	fprintf(
+		stderr,
+		"alloc=%s threads=%lu requests=%.0f allocs=%llu "
+		"time=%.3fs req/s=%.0f ns/alloc=%.1f\n",
+		args.arena ? (args.poison ? "arena-poison" : "arena") :
+			"malloc",
+		args.threads,
+		total,
+		allocs,
+		seconds,
+		total / seconds,
+		seconds * 1e9 / (double)allocs * (double)args.threads
+	);
+
+	if (args.arena) {
+		fprintf(
+			stderr,
+			"arena: chunks=%zu bytes=%.1fKiB peak=%.1fKiB\n",
+			chunks,
+			(double)bytes / 1024.0,
+			(double)peak / 1024.0
+		);
+	}
+
+	free(tids);
+	free(results);
+
+	return 0;
+}
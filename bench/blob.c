@@ -0,0 +1,445 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/**
+ * Bulk transfer benchmark. Runs a maxserver instance on loopback whose
+ * client threads, or fibers with '-d fiber', send a file to every
+ * client connection and close it, and downloads the file from several
+ * client threads. '-m' selects how the file is sent: copied through a
+ * user buffer with 'read' and 'maxserver_write' ('rw'), with
+ * 'maxserver_sendfile' ('sendfile'), or with 'maxserver_splice'
+ * through a pipe ('splice'). Reports throughput and the CPU time that
+ * the server and the client threads spent per gigabyte sent.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <maxserver.h>
+
+#define BLOB_BUF_LEN 65536
+#define BLOB_RECV_LEN 262144
+
+/**
+ * Data structure representing the benchmark parameters.
+ */
+struct blob_args {
+	const char *port;
+	const char *dispatch;
+	const char *mode;
+	struct maxserver_config config;
+	unsigned long threads;
+	unsigned long transfers;
+	size_t size;
+};
+
+/**
+ * Data structure representing a client thread, which downloads the
+ * file 'transfers' times and adds up the bytes it received and the
+ * CPU time it used in microseconds.
+ */
+struct blob_thread {
+	pthread_t tid;
+	unsigned long transfers;
+	unsigned long failed;
+	unsigned long long bytes;
+	unsigned long long cpu_us;
+};
+
+/**
+ * Global variable holding the benchmark parameters.
+ */
+static struct blob_args args;
+
+/**
+ * Global variable holding the path of the file that is sent.
+ */
+static char blob_path[] = "/tmp/maxserver-blob-XXXXXX";
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ */
+static unsigned long long blob_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+		(unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * Returns the user and system CPU time in microseconds that 'who',
+ * which is RUSAGE_SELF or RUSAGE_THREAD, has used.
+ */
+static unsigned long long blob_cpu_us(int who)
+{
+	struct rusage ru;
+
+	if (getrusage(who, &ru) == -1) {
+		return 0;
+	}
+
+	return (unsigned long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+		1000000ULL +
+		(unsigned long long)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+/**
+ * Sends the file to the client through a user buffer, which is
+ * allocated, since it would not fit on the stack of a fiber.
+ * Returns zero once the whole file is sent, and -1 otherwise.
+ */
+static int blob_send_rw(int cfd, int fd)
+{
+	char *buf;
+	ssize_t n;
+
+	buf = malloc(BLOB_BUF_LEN);
+
+	if (buf == NULL) {
+		return -1;
+	}
+
+	while ((n = read(fd, buf, BLOB_BUF_LEN)) > 0) {
+		if (maxserver_write(cfd, buf, (size_t)n) == -1) {
+			break;
+		}
+	}
+
+	free(buf);
+
+	return n == 0 ? 0 : -1;
+}
+
+/**
+ * Sends the file to every client connection in the way selected by
+ * '-m', and closes the client connection by returning.
+ */
+static void blob_server(int cfd, int sigpipe)
+{
+	struct maxserver_conn *conn = maxserver_conn_current();
+	ssize_t n = -1;
+	int fd;
+
+	(void)sigpipe;
+
+	/* Every client connection reads the file at its own offset. */
+	fd = open(blob_path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1) {
+		perror("open");
+		return;
+	}
+
+	if (strcmp(args.mode, "sendfile") == 0) {
+		n = maxserver_sendfile(conn, fd, 0, args.size);
+	} else if (strcmp(args.mode, "splice") == 0) {
+		n = maxserver_splice(conn, fd, args.size);
+	} else {
+		n = blob_send_rw(cfd, fd);
+	}
+
+	if (n == -1 && errno != EPIPE && errno != ECONNRESET &&
+		errno != ECANCELED) {
+		perror(args.mode);
+	}
+
+	close(fd);
+}
+
+/**
+ * Downloads the file from the server once.
+ * Returns the number of bytes received, or -1 if the connection
+ * failed.
+ */
+static long long blob_download(char *buf)
+{
+	struct sockaddr_in addr;
+	long long total = 0;
+	ssize_t n;
+	int sfd;
+
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(args.port));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (sfd == -1) {
+		return -1;
+	}
+
+	if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sfd);
+		return -1;
+	}
+
+	while ((n = read(sfd, buf, BLOB_RECV_LEN)) > 0) {
+		total += n;
+	}
+
+	close(sfd);
+
+	return n == 0 ? total : -1;
+}
+
+/**
+ * Runs client thread 'arg' until it has downloaded the file its
+ * number of times.
+ */
+static void *blob_thread(void *arg)
+{
+	struct blob_thread *t = (struct blob_thread *)arg;
+	unsigned long long cpu;
+	long long n;
+	unsigned long i;
+	char *buf;
+
+	buf = malloc(BLOB_RECV_LEN);
+
+	if (buf == NULL) {
+		t->failed = t->transfers;
+		return NULL;
+	}
+
+	cpu = blob_cpu_us(RUSAGE_THREAD);
+
+	for (i = 0; i < t->transfers; ++i) {
+		n = blob_download(buf);
+
+		if (n != (long long)args.size) {
+			++t->failed;
+		}
+
+		if (n > 0) {
+			t->bytes += (unsigned long long)n;
+		}
+	}
+
+	t->cpu_us = blob_cpu_us(RUSAGE_THREAD) - cpu;
+	free(buf);
+
+	return NULL;
+}
+
+/**
+ * Creates the file that is sent, of 'args.size' bytes.
+ * On success, zero is returned. On error, -1 is returned.
+ */
+static int blob_create()
+{
+	char buf[BLOB_BUF_LEN];
+	size_t off, chunk;
+	int fd;
+
+	fd = mkstemp(blob_path);
+
+	if (fd == -1) {
+		perror("mkstemp");
+		return -1;
+	}
+
+	memset(buf, 'x', BLOB_BUF_LEN);
+
+	for (off = 0; off < args.size; off += chunk) {
+		chunk = args.size - off < BLOB_BUF_LEN ? args.size - off :
+			BLOB_BUF_LEN;
+
+		if (write(fd, buf, chunk) != (ssize_t)chunk) {
+			perror("write");
+			close(fd);
+			return -1;
+		}
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-m rw|sendfile|splice] [-d thread|fiber] "
+		"[-s size_mib] [-n transfers] [-t threads] [-p port]\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	maxserver_t *server;
+	struct blob_thread *threads;
+	unsigned long long t0, cpu0, bytes = 0, client_us = 0, server_us;
+	unsigned long failed = 0;
+	double seconds, gb;
+	size_t i;
+	int opt;
+
+	args.port = "7360";
+	args.dispatch = "thread";
+	args.mode = "sendfile";
+	args.threads = 2;
+	args.transfers = 32;
+	args.size = 64 << 20;
+	maxserver_config_init(&args.config);
+	args.config.handle_stdin = 0;
+	args.config.handle_signals = 0;
+
+	while ((opt = getopt(argc, argv, "m:d:s:n:t:p:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "rw") != 0 &&
+				strcmp(optarg, "sendfile") != 0 &&
+				strcmp(optarg, "splice") != 0) {
+				usage(argv[0]);
+			}
+
+			args.mode = optarg;
+			break;
+		case 'd':
+			if (strcmp(optarg, "fiber") == 0) {
+				args.config.dispatch = MAXSERVER_DISPATCH_FIBER;
+			} else if (strcmp(optarg, "thread") != 0) {
+				usage(argv[0]);
+			}
+
+			args.dispatch = optarg;
+			break;
+		case 's':
+			args.size = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'n':
+			args.transfers = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			args.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			args.port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (args.threads == 0 || args.transfers < args.threads) {
+		usage(argv[0]);
+	}
+
+	if (blob_create() == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* Keep the server's per-connection messages off the
+	   terminal. */
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("freopen");
+		unlink(blob_path);
+		exit(EXIT_FAILURE);
+	}
+
+	server = maxserver_create(args.port, blob_server, &args.config);
+
+	if (server == NULL || maxserver_start(server) == -1) {
+		unlink(blob_path);
+		exit(EXIT_FAILURE);
+	}
+
+	threads = calloc(args.threads, sizeof(struct blob_thread));
+
+	if (threads == NULL) {
+		perror("calloc");
+		unlink(blob_path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Split the transfers evenly over the client threads. */
+	for (i = 0; i < args.threads; ++i) {
+		threads[i].transfers = args.transfers / args.threads +
+			(i < args.transfers % args.threads);
+	}
+
+	t0 = blob_now();
+	cpu0 = blob_cpu_us(RUSAGE_SELF);
+
+	for (i = 0; i < args.threads; ++i) {
+		pthread_create(&threads[i].tid, NULL, blob_thread, &threads[i]);
+	}
+
+	for (i = 0; i < args.threads; ++i) {
+		pthread_join(threads[i].tid, NULL);
+		bytes += threads[i].bytes;
+		client_us += threads[i].cpu_us;
+		failed += threads[i].failed;
+	}
+
+	/* The server used what the client threads did not. */
+	server_us = blob_cpu_us(RUSAGE_SELF) - cpu0;
+	server_us = server_us > client_us ? server_us - client_us : 0;
+	seconds = (double)(blob_now() - t0) / 1e9;
+	gb = (double)bytes / 1e9;
+
+	fprintf(
+		stderr,
+		"mode=%s dispatch=%s size=%zu transfers=%lu threads=%lu\n"
+		"bytes=%llu failed=%lu time=%.3fs throughput=%.2fGB/s "
+		"server_cpu=%.3fs/GB client_cpu=%.3fs/GB\n",
+		args.mode,
+		args.dispatch,
+		args.size,
+		args.transfers,
+		args.threads,
+		bytes,
+		failed,
+		seconds,
+		gb / seconds,
+		gb > 0 ? (double)server_us / 1e6 / gb : 0.0,
+		gb > 0 ? (double)client_us / 1e6 / gb : 0.0
+	);
+
+	maxserver_stop(server, 1000);
+	maxserver_destroy(server);
+	unlink(blob_path);
+	free(threads);
+
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
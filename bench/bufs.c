@@ -0,0 +1,353 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Buffer pool benchmark. Runs the allocation pattern of echo
+ * handlers: every client thread takes a buffer of a random size for
+ * each message, writes the message into it, and parks it in a slot
+ * shared by all threads until another message lands in the same
+ * slot, whose thread then returns it, so that buffers are mostly
+ * returned by other threads than took them. Sizes are spread evenly
+ * over powers of two up to the largest message. Takes buffers from
+ * the buffer pool of maxserver (-a pool) or from malloc (-a malloc),
+ * and reports throughput, the resident memory of the process
+ * afterwards, and the hit rate of the buffer pool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <maxserver.h>
+
+/**
+ * Data structure representing the benchmark parameters.
+ */
+struct bufs_args {
+	int pool;
+	unsigned long threads;
+	unsigned long messages;
+	size_t slots;
+	size_t max_len;
+	enum maxserver_hugepages hugepages;
+	const char *port;
+};
+
+/**
+ * Global variable holding the benchmark parameters.
+ */
+static struct bufs_args args;
+
+/**
+ * Global variable holding the slots that messages are parked in.
+ */
+static void **bufs_slots;
+
+/**
+ * Returns the monotonic time in seconds.
+ */
+static double bufs_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Returns a pseudo-random number from the xorshift state 'state'.
+ */
+static unsigned long long bufs_random(unsigned long long *state)
+{
+	unsigned long long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+/**
+ * Takes a buffer of 'len' bytes.
+ */
+static void *bufs_get(size_t len)
+{
+	return args.pool ? maxserver_buf_get(len) : malloc(len);
+}
+
+/**
+ * Returns buffer 'buf'.
+ */
+static void bufs_put(void *buf)
+{
+	if (args.pool) {
+		maxserver_buf_put(buf);
+	} else {
+		free(buf);
+	}
+}
+
+/**
+ * Function that is run by every client thread.
+ */
+static void *bufs_thread(void *arg)
+{
+	unsigned long long state = 88172645463325252ULL +
+		(unsigned long long)(size_t)arg * 7919;
+	unsigned long i;
+	size_t len, slot;
+	int bits = 0;
+	void *buf;
+
+	while (((size_t)1 << (bits + 1)) <= args.max_len) {
+		++bits;
+	}
+
+	for (i = 0; i < args.messages; ++i) {
+		/* Pick a power of two, then a length below it. */
+		len = (size_t)1 << (bufs_random(&state) % (bits + 1));
+		len = len / 2 + bufs_random(&state) % (len / 2 + 1);
+		len = len > 0 ? len : 1;
+
+		buf = bufs_get(len);
+
+		if (buf == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		/* Write a header and a trailer, as a message whose
+		   body is spliced or sent in place would. */
+		memset(buf, (int)i, len < 64 ? len : 64);
+		((char *)buf)[len - 1] = (char)i;
+
+		slot = bufs_random(&state) % args.slots;
+		buf = __atomic_exchange_n(
+			&bufs_slots[slot],
+			buf,
+			__ATOMIC_ACQ_REL
+		);
+
+		if (buf != NULL) {
+			bufs_put(buf);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Handles a client connection of the server that configures the
+ * buffer pool, which none is expected to make.
+ */
+static void bufs_server(int cfd, int sigpipe)
+{
+	(void)cfd;
+	(void)sigpipe;
+}
+
+/**
+ * Returns the resident memory of the process in bytes.
+ */
+static size_t bufs_rss()
+{
+	unsigned long size, resident = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+
+	if (f == NULL) {
+		return 0;
+	}
+
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+		resident = 0;
+	}
+
+	fclose(f);
+
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-a pool|malloc] [-t threads] [-n messages] "
+		"[-s slots] [-m max_len] [-H none|thp|hugetlb] [-p port]\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct maxserver_buf_stats stats;
+	struct maxserver_config config;
+	maxserver_t *server;
+	pthread_t *tids;
+	double start, seconds, total;
+	size_t rss;
+	unsigned long i;
+	int opt;
+
+	args.pool = 1;
+	args.threads = 4;
+	args.messages = 2000000;
+	args.slots = 4096;
+	args.max_len = 65536;
+	args.hugepages = MAXSERVER_HUGEPAGES_NONE;
+	args.port = "7361";
+
+	while ((opt = getopt(argc, argv, "a:t:n:s:m:H:p:")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (strcmp(optarg, "malloc") == 0) {
+				args.pool = 0;
+			} else if (strcmp(optarg, "pool") != 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 't':
+			args.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			args.messages = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			args.slots = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			args.max_len = strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			if (strcmp(optarg, "thp") == 0) {
+				args.hugepages =
+					MAXSERVER_HUGEPAGES_TRANSPARENT;
+			} else if (strcmp(optarg, "hugetlb") == 0) {
+				args.hugepages = MAXSERVER_HUGEPAGES_EXPLICIT;
+			} else if (strcmp(optarg, "none") != 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'p':
+			args.port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (args.threads == 0 || args.slots == 0 || args.max_len == 0) {
+		usage(argv[0]);
+	}
+
+	/* The buffer pool is configured by the first server that
+	   starts, so start one that takes no client connections. */
+	maxserver_config_init(&config);
+	config.buf_pool_hugepages = args.hugepages;
+	config.handle_stdin = 0;
+	config.handle_signals = 0;
+	server = maxserver_create(args.port, bufs_server, &config);
+
+	if (server == NULL || maxserver_start(server) == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	bufs_slots = calloc(args.slots, sizeof(void *));
+	tids = malloc(sizeof(pthread_t) * args.threads);
+
+	if (bufs_slots == NULL || tids == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	start = bufs_now();
+
+	for (i = 0; i < args.threads; ++i) {
+		pthread_create(&tids[i], NULL, bufs_thread, (void *)i);
+	}
+
+	for (i = 0; i < args.threads; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+
+	seconds = bufs_now() - start;
+	rss = bufs_rss();
+	total = (double)args.threads * (double)args.messages;
+
+	fprintf(
+		stderr,
+		"alloc=%s threads=%lu messages=%.0f max_len=%zu "
+		"time=%.3fs msg/s=%.0f ns/msg=%.1f rss=%.1fMiB\n",
+		args.pool ? "pool" : "malloc",
+		args.threads,
+		total,
+		args.max_len,
+		seconds,
+		total / seconds,
+		seconds * 1e9 / total * (double)args.threads,
+		(double)rss / 1048576.0
+	);
+
+	if (args.pool) {
+		maxserver_buf_stats(&stats);
+		fprintf(
+			stderr,
+			"pool: hit_rate=%.4f cache_hits=%llu depot_hits=%llu "
+			"carved=%llu fallbacks=%llu used=%.1fMiB "
+			"resident=%.1fMiB hugepages=%s\n",
+			stats.gets > 0 ?
+				(double)(stats.cache_hits + stats.depot_hits) /
+					(double)stats.gets :
+				0.0,
+			stats.cache_hits,
+			stats.depot_hits,
+			stats.carved,
+			stats.fallbacks,
+			(double)stats.region_used / 1048576.0,
+			(double)stats.resident / 1048576.0,
+			stats.hugepages == MAXSERVER_HUGEPAGES_NONE ? "none" :
+				stats.hugepages ==
+					MAXSERVER_HUGEPAGES_TRANSPARENT ?
+					"thp" : "hugetlb"
+		);
+	}
+
+	for (i = 0; i < args.slots; ++i) {
+		if (bufs_slots[i] != NULL) {
+			bufs_put(bufs_slots[i]);
+		}
+	}
+
+	maxserver_stop(server, 0);
+	maxserver_destroy(server);
+	free(tids);
+	free(bufs_slots);
+
+	return 0;
+}
@@ -0,0 +1,389 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Connection churn benchmark. Runs a maxserver instance on loopback
+ * and opens and closes short connections against it from several
+ * client threads, exchanging one byte per connection. Reports how
+ * often client connection slabs had to grow, which the slab length
+ * of '-l' avoids once it covers the connections open at once, and
+ * '-L' locks the slabs into memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <maxserver.h>
+
+/**
+ * Data structure representing the benchmark parameters.
+ */
+struct churn_args {
+	const char *port;
+	struct maxserver_config config;
+	unsigned long connections;
+	unsigned long clients;
+};
+
+/**
+ * Global variable holding the benchmark parameters.
+ */
+static struct churn_args args;
+
+/**
+ * Global variable holding the number of failed connections.
+ */
+static unsigned long failures = 0;
+
+/**
+ * Global variable protecting 'failures'.
+ */
+static pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Reads one byte from client and writes it back.
+ */
+static void churn_server(int cfd, int sigpipe __attribute__((unused)))
+{
+	char c;
+
+	if (read(cfd, &c, 1) == 1) {
+		write(cfd, &c, 1);
+	}
+}
+
+/**
+ * Connects to the server on loopback.
+ * On success, a file descriptor for the new socket is returned. On
+ * error, -1 is returned.
+ */
+static int churn_connect()
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int sfd;
+
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(args.port));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (sfd == -1) {
+		return -1;
+	}
+
+	setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+
+	if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sfd);
+		return -1;
+	}
+
+	return sfd;
+}
+
+/**
+ * Opens, uses and closes 'arg' connections.
+ */
+static void *churn_client_thread(void *arg)
+{
+	unsigned long n = *(unsigned long *)arg;
+	unsigned long failed = 0;
+	unsigned long i;
+	char c = 'x';
+	int sfd;
+
+	for (i = 0; i < n; ++i) {
+		sfd = churn_connect();
+
+		if (sfd == -1) {
+			++failed;
+			continue;
+		}
+
+		if (write(sfd, &c, 1) != 1 || read(sfd, &c, 1) != 1) {
+			++failed;
+		}
+
+		close(sfd);
+	}
+
+	pthread_mutex_lock(&failures_lock);
+	failures += failed;
+	pthread_mutex_unlock(&failures_lock);
+
+	return NULL;
+}
+
+/**
+ * Returns the difference between 'b' and 'a' in seconds.
+ */
+static double churn_seconds(const struct timespec *a, const struct timespec *b)
+{
+	return (double)(b->tv_sec - a->tv_sec) +
+		(double)(b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/**
+ * Returns user plus system CPU time of the process in seconds.
+ */
+static double churn_cpu_seconds()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return (double)ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		(double)ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-d thread|pool] [-n connections] "
+		"[-c clients] [-t min:max] [-s shards] [-b batch] "
+		"[-l slab_len] [-L] [-p port]\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	maxserver_t *server;
+	pthread_t *client_tids;
+	unsigned long *counts;
+	struct maxserver_pool_stats stats;
+	struct maxserver_accept_stats accepts[64];
+	struct maxserver_conn_stats conns;
+	size_t shards;
+	struct timespec start, end;
+	double cpu_start, cpu_end, seconds;
+	int opt;
+	int sfd;
+	unsigned long i;
+
+	args.port = "7357";
+	args.connections = 20000;
+	args.clients = 4;
+	maxserver_config_init(&args.config);
+	args.config.handle_stdin = 0;
+	args.config.handle_signals = 0;
+
+	while ((opt = getopt(argc, argv, "d:n:c:t:s:b:l:Lp:")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (strcmp(optarg, "pool") == 0) {
+				args.config.dispatch = MAXSERVER_DISPATCH_POOL;
+			} else if (strcmp(optarg, "thread") != 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'n':
+			args.connections = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			args.clients = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			if (sscanf(
+				optarg,
+				"%zu:%zu",
+				&args.config.pool_min_threads,
+				&args.config.pool_max_threads
+			) != 2) {
+				usage(argv[0]);
+			}
+			break;
+		case 's':
+			args.config.accept_shards = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			args.config.accept_batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			args.config.conn_slab_len = strtoul(optarg, NULL, 10);
+			break;
+		case 'L':
+			args.config.conn_slab_lock = 1;
+			break;
+		case 'p':
+			args.port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (args.clients == 0) {
+		usage(argv[0]);
+	}
+
+	/* Keep the server's per-connection messages off the
+	   terminal. */
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("freopen");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Start the server, and time how long it takes until it has
+	   served a first client connection. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	server = maxserver_create(args.port, churn_server, &args.config);
+
+	if (server == NULL || maxserver_start(server) == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	sfd = churn_connect();
+
+	if (sfd == -1) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+
+	if (write(sfd, "x", 1) != 1 || read(sfd, &opt, 1) != 1) {
+		perror("read");
+		exit(EXIT_FAILURE);
+	}
+
+	close(sfd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(
+		stderr,
+		"startup=%.3fms\n",
+		churn_seconds(&start, &end) * 1e3
+	);
+
+	client_tids = malloc(sizeof(pthread_t) * args.clients);
+	counts = malloc(sizeof(unsigned long) * args.clients);
+
+	if (client_tids == NULL || counts == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	cpu_start = churn_cpu_seconds();
+
+	for (i = 0; i < args.clients; ++i) {
+		counts[i] = args.connections / args.clients;
+		pthread_create(
+			&client_tids[i],
+			NULL,
+			churn_client_thread,
+			&counts[i]
+		);
+	}
+
+	for (i = 0; i < args.clients; ++i) {
+		pthread_join(client_tids[i], NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	cpu_end = churn_cpu_seconds();
+	seconds = churn_seconds(&start, &end);
+
+	fprintf(
+		stderr,
+		"dispatch=%s connections=%lu clients=%lu failed=%lu\n"
+		"time=%.3fs rate=%.0f conn/s cpu=%.3fs cpu/conn=%.2fus\n",
+		args.config.dispatch == MAXSERVER_DISPATCH_POOL ?
+			"pool" : "thread",
+		counts[0] * args.clients,
+		args.clients,
+		failures,
+		seconds,
+		(double)(counts[0] * args.clients) / seconds,
+		cpu_end - cpu_start,
+		(cpu_end - cpu_start) * 1e6 / (double)(counts[0] * args.clients)
+	);
+
+	if (maxserver_pool_stats(server, &stats) == 0) {
+		fprintf(
+			stderr,
+			"pool: threads=%zu spawned=%llu dispatched=%llu "
+			"queued_max=%zu saturated=%llu rejected=%llu\n",
+			stats.threads,
+			stats.spawned,
+			stats.dispatched,
+			stats.queued_max,
+			stats.saturated,
+			stats.rejected
+		);
+	}
+
+	if (maxserver_conn_stats(server, &conns) == 0) {
+		fprintf(
+			stderr,
+			"conns: allocs=%llu frees=%llu in_use=%zu "
+			"capacity=%zu grows=%llu bytes=%zu locked=%zu\n",
+			conns.allocs,
+			conns.frees,
+			conns.in_use,
+			conns.capacity,
+			conns.grows,
+			conns.bytes,
+			conns.locked
+		);
+	}
+
+	shards = maxserver_accept_stats(server, accepts, 64);
+
+	for (i = 0; i < shards && i < 64; ++i) {
+		fprintf(
+			stderr,
+			"shard %lu: accepts=%llu wakeups=%llu "
+			"accepts/wakeup=%.2f batch_max=%zu\n",
+			i,
+			accepts[i].accepts,
+			accepts[i].wakeups,
+			accepts[i].wakeups > 0 ?
+				(double)accepts[i].accepts /
+					(double)accepts[i].wakeups :
+				0.0,
+			accepts[i].batch_max
+		);
+	}
+
+	/* Stop the server. */
+	maxserver_stop(server, 1000);
+	maxserver_destroy(server);
+
+	free(client_tids);
+	free(counts);
+	return 0;
+}
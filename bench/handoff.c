@@ -0,0 +1,464 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Handoff microbenchmark. Passes items from producer threads to
+ * consumer threads through the lock-free ring that the worker pool
+ * queues client connections in, and through a mutex and condition
+ * variable queue like the one it replaced, and reports throughput and
+ * the latency from push to pop. Consumers that find the queue empty
+ * sleep, on the ring's futex or on the condition variable, like idle
+ * worker threads do. By default it runs 1, 8 and 32 producers with as
+ * many consumers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mpmc.h"
+
+/**
+ * Data structure representing the benchmark parameters.
+ */
+struct handoff_args {
+	unsigned long items;
+	size_t queue_len;
+	unsigned long threads;
+	unsigned int spins;
+};
+
+/**
+ * Data structure representing an item passed from a producer to a
+ * consumer. 'pushed' is the monotonic time in nanoseconds at which
+ * the producer queued it, and 'latency' the time until a consumer
+ * took it.
+ */
+struct handoff_item {
+	unsigned long long pushed;
+	unsigned long long latency;
+};
+
+/**
+ * Data structure representing a mutex and condition variable queue,
+ * as the worker pool used before the lock-free ring.
+ */
+struct handoff_lockq {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct handoff_item **items;
+	size_t len;
+	size_t head;
+	size_t count;
+};
+
+/**
+ * Data structure representing one run. 'ring' is used if it is not
+ * NULL, and 'lockq' otherwise. 'sleeps' counts the times consumers
+ * found the queue empty and slept.
+ */
+struct handoff_run {
+	struct mpmc *ring;
+	struct handoff_lockq lockq;
+	struct handoff_item *items;
+	unsigned long per_producer;
+	pthread_barrier_t barrier;
+	unsigned long long sleeps;
+	unsigned long long full;
+};
+
+/**
+ * Data structure representing a producer or consumer thread.
+ */
+struct handoff_thread {
+	pthread_t tid;
+	struct handoff_run *run;
+	unsigned long index;
+};
+
+/**
+ * Global variable holding the benchmark parameters.
+ */
+static struct handoff_args args;
+
+/**
+ * Global variable whose address consumers take as the signal to quit.
+ */
+static struct handoff_item handoff_stop;
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ */
+static unsigned long long handoff_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+		(unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * Queues 'item' in the queue of 'run', waiting while it is full.
+ */
+static void handoff_push(struct handoff_run *run, struct handoff_item *item)
+{
+	struct handoff_lockq *q = &run->lockq;
+
+	if (run->ring != NULL) {
+		/* A full ring is the caller's problem, as for the
+		   accept threads, so spin politely. */
+		while (mpmc_push(run->ring, item) == -1) {
+			__atomic_add_fetch(&run->full, 1, __ATOMIC_RELAXED);
+			sched_yield();
+		}
+
+		mpmc_wake(run->ring, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&q->lock);
+
+	while (q->count == q->len) {
+		++run->full;
+		pthread_cond_wait(&q->not_full, &q->lock);
+	}
+
+	q->items[(q->head + q->count) % q->len] = item;
+	++q->count;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Takes an item from the queue of 'run', sleeping while it is empty.
+ * Returns the item.
+ */
+static struct handoff_item *handoff_pop(struct handoff_run *run)
+{
+	struct handoff_lockq *q = &run->lockq;
+	struct handoff_item *item;
+	unsigned int seq;
+
+	if (run->ring != NULL) {
+		for (;;) {
+			item = mpmc_pop_spin(run->ring, args.spins);
+
+			if (item != NULL) {
+				return item;
+			}
+
+			seq = mpmc_wait_prepare(run->ring);
+			item = mpmc_pop(run->ring);
+
+			if (item != NULL) {
+				mpmc_wait_cancel(run->ring);
+				return item;
+			}
+
+			__atomic_add_fetch(&run->sleeps, 1, __ATOMIC_RELAXED);
+			mpmc_wait(run->ring, seq, NULL);
+		}
+	}
+
+	pthread_mutex_lock(&q->lock);
+
+	while (q->count == 0) {
+		++run->sleeps;
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	}
+
+	item = q->items[q->head];
+	q->head = (q->head + 1) % q->len;
+	--q->count;
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+
+	return item;
+}
+
+/**
+ * Queues this producer's share of the items.
+ */
+static void *handoff_producer(void *arg)
+{
+	struct handoff_thread *thread = (struct handoff_thread *)arg;
+	struct handoff_run *run = thread->run;
+	struct handoff_item *item;
+	unsigned long i;
+
+	pthread_barrier_wait(&run->barrier);
+
+	for (i = 0; i < run->per_producer; ++i) {
+		item = &run->items[thread->index * run->per_producer + i];
+		item->pushed = handoff_now();
+		handoff_push(run, item);
+	}
+
+	return NULL;
+}
+
+/**
+ * Takes items and records their latency until it takes 'handoff_stop'.
+ */
+static void *handoff_consumer(void *arg)
+{
+	struct handoff_thread *thread = (struct handoff_thread *)arg;
+	struct handoff_run *run = thread->run;
+	struct handoff_item *item;
+
+	pthread_barrier_wait(&run->barrier);
+
+	for (;;) {
+		item = handoff_pop(run);
+
+		if (item == &handoff_stop) {
+			break;
+		}
+
+		item->latency = handoff_now() - item->pushed;
+	}
+
+	return NULL;
+}
+
+/**
+ * Compares two latencies for qsort.
+ */
+static int handoff_compare(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Runs 'threads' producers and as many consumers over the lock-free
+ * ring if 'lockfree' is set, or over the mutex queue otherwise, and
+ * prints the results.
+ */
+static void handoff_run(int lockfree, unsigned long threads)
+{
+	struct handoff_run run;
+	struct handoff_thread *producers, *consumers;
+	unsigned long long *latencies;
+	unsigned long long start, end;
+	unsigned long total;
+	unsigned long i;
+	double seconds;
+
+	memset(&run, 0, sizeof(struct handoff_run));
+	run.per_producer = args.items / threads;
+	total = run.per_producer * threads;
+	run.items = calloc(total, sizeof(struct handoff_item));
+	latencies = malloc(sizeof(unsigned long long) * total);
+	producers = calloc(threads, sizeof(struct handoff_thread));
+	consumers = calloc(threads, sizeof(struct handoff_thread));
+
+	if (run.items == NULL || latencies == NULL ||
+		producers == NULL || consumers == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (lockfree) {
+		run.ring = mpmc_create(args.queue_len);
+
+		if (run.ring == NULL) {
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		run.lockq.items = malloc(
+			sizeof(struct handoff_item *) * args.queue_len
+		);
+
+		if (run.lockq.items == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+
+		run.lockq.len = args.queue_len;
+		pthread_mutex_init(&run.lockq.lock, NULL);
+		pthread_cond_init(&run.lockq.not_empty, NULL);
+		pthread_cond_init(&run.lockq.not_full, NULL);
+	}
+
+	/* Start every thread, and release them at once. */
+	pthread_barrier_init(&run.barrier, NULL, 2 * threads + 1);
+
+	for (i = 0; i < threads; ++i) {
+		consumers[i].run = &run;
+		consumers[i].index = i;
+		producers[i].run = &run;
+		producers[i].index = i;
+
+		if (pthread_create(
+			&consumers[i].tid,
+			NULL,
+			handoff_consumer,
+			&consumers[i]
+		) != 0 || pthread_create(
+			&producers[i].tid,
+			NULL,
+			handoff_producer,
+			&producers[i]
+		) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&run.barrier);
+	start = handoff_now();
+
+	for (i = 0; i < threads; ++i) {
+		pthread_join(producers[i].tid, NULL);
+	}
+
+	/* Every item has been queued. Queue one stop signal per
+	   consumer behind them. */
+	for (i = 0; i < threads; ++i) {
+		handoff_push(&run, &handoff_stop);
+	}
+
+	for (i = 0; i < threads; ++i) {
+		pthread_join(consumers[i].tid, NULL);
+	}
+
+	end = handoff_now();
+	seconds = (double)(end - start) / 1e9;
+
+	for (i = 0; i < total; ++i) {
+		latencies[i] = run.items[i].latency;
+	}
+
+	qsort(latencies, total, sizeof(unsigned long long), handoff_compare);
+
+	fprintf(
+		stderr,
+		"queue=%s producers=%lu consumers=%lu items=%lu "
+		"time=%.3fs items/s=%.0f sleeps=%llu full=%llu\n"
+		"latency p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+		lockfree ? "mpmc" : "mutex",
+		threads,
+		threads,
+		total,
+		seconds,
+		(double)total / seconds,
+		run.sleeps,
+		run.full,
+		(double)latencies[(total - 1) / 2] / 1e3,
+		(double)latencies[(total - 1) * 99 / 100] / 1e3,
+		(double)latencies[(total - 1) * 999 / 1000] / 1e3,
+		(double)latencies[total - 1] / 1e3
+	);
+
+	/* Free the run. */
+	pthread_barrier_destroy(&run.barrier);
+
+	if (lockfree) {
+		mpmc_destroy(run.ring);
+	} else {
+		pthread_cond_destroy(&run.lockq.not_full);
+		pthread_cond_destroy(&run.lockq.not_empty);
+		pthread_mutex_destroy(&run.lockq.lock);
+		free(run.lockq.items);
+	}
+
+	free(consumers);
+	free(producers);
+	free(latencies);
+	free(run.items);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-n items] [-q queue_len] [-t threads] "
+		"[-s spins]\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned long threads[] = {1, 8, 32};
+	size_t i;
+	int opt;
+
+	args.items = 1000000;
+	args.queue_len = 1024;
+	args.threads = 0;
+	args.spins = 16;
+
+	while ((opt = getopt(argc, argv, "n:q:t:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			args.items = strtoul(optarg, NULL, 10);
+			break;
+		case 'q':
+			args.queue_len = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			args.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			args.spins = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (args.queue_len == 0) {
+		usage(argv[0]);
+	}
+
+	if (args.threads > 0) {
+		if (args.items < args.threads) {
+			usage(argv[0]);
+		}
+
+		handoff_run(0, args.threads);
+		handoff_run(1, args.threads);
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i) {
+		if (args.items < threads[i]) {
+			usage(argv[0]);
+		}
+
+		handoff_run(0, threads[i]);
+		handoff_run(1, threads[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,385 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Idle connections memory benchmark. Runs a maxserver instance on
+ * loopback with one client thread per connection, or with one fiber
+ * per connection with '-d fiber', opens a number of connections
+ * against it from a child process and keeps them idle, and reports
+ * the resident and virtual memory of the server process, and how
+ * much resident memory each idle connection added.
+ * Client threads wait with 'maxserver_wait_readable', so the highest
+ * client socket reported may be far above FD_SETSIZE. Connections are
+ * spread over several loopback addresses, since one address only has
+ * room for as many connections as there are ephemeral ports.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <maxserver.h>
+
+#define IDLE_CONNECTIONS_PER_ADDR 20000
+
+/**
+ * Data structure representing the benchmark parameters.
+ */
+struct idle_args {
+	const char *port;
+	const char *dispatch;
+	struct maxserver_config config;
+	unsigned long connections;
+};
+
+/**
+ * Global variable holding the benchmark parameters.
+ */
+static struct idle_args args;
+
+/**
+ * Global variable holding the number of open client connections.
+ */
+static unsigned long open_connections = 0;
+
+/**
+ * Global variable holding the highest client socket file descriptor
+ * seen by a client thread.
+ */
+static int max_cfd = 0;
+
+/**
+ * Waits until the client closes the connection or the server quits.
+ */
+static void idle_server(int cfd, int sigpipe)
+{
+	int seen;
+
+	(void)sigpipe;
+	__atomic_add_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+
+	seen = __atomic_load_n(&max_cfd, __ATOMIC_RELAXED);
+
+	while (cfd > seen && !__atomic_compare_exchange_n(
+		&max_cfd,
+		&seen,
+		cfd,
+		1,
+		__ATOMIC_RELAXED,
+		__ATOMIC_RELAXED
+	)) {
+		continue;
+	}
+
+	maxserver_wait_readable(cfd, -1);
+
+	__atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Connects to the server on loopback address 127.0.0.'host'.
+ * On success, a file descriptor for the new socket is returned. On
+ * error, -1 is returned.
+ */
+static int idle_connect(unsigned long host)
+{
+	struct sockaddr_in addr;
+	int sfd;
+
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(args.port));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + host - 1);
+
+	sfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (sfd == -1) {
+		return -1;
+	}
+
+	if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sfd);
+		return -1;
+	}
+
+	return sfd;
+}
+
+/**
+ * Opens 'args.connections' connections and keeps them open until
+ * 'done' is closed. Runs in the child process.
+ */
+static void idle_client(int done)
+{
+	unsigned long opened = 0;
+	unsigned long tries = 0;
+	char c;
+
+	/* Retry while the server starts listening or its backlog is
+	   full. */
+	while (opened < args.connections && tries < 1000) {
+		if (idle_connect(1 + opened / IDLE_CONNECTIONS_PER_ADDR) == -1) {
+			++tries;
+			usleep(1000);
+			continue;
+		}
+
+		++opened;
+		tries = 0;
+	}
+
+	read(done, &c, 1);
+	_exit(opened == args.connections ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * Prints the lines of /proc/self/status that describe memory usage
+ * and threads.
+ */
+static void idle_print_status()
+{
+	char line[256];
+	FILE *status;
+
+	status = fopen("/proc/self/status", "r");
+
+	if (status == NULL) {
+		perror("fopen");
+		return;
+	}
+
+	while (fgets(line, sizeof(line), status) != NULL) {
+		if (strncmp(line, "VmSize:", 7) == 0 ||
+			strncmp(line, "VmRSS:", 6) == 0 ||
+			strncmp(line, "Threads:", 8) == 0) {
+			fputs(line, stderr);
+		}
+	}
+
+	fclose(status);
+}
+
+/**
+ * Returns the resident memory of the process in bytes, or zero if it
+ * cannot be read.
+ */
+static unsigned long idle_rss()
+{
+	unsigned long size, resident = 0;
+	FILE *statm;
+
+	statm = fopen("/proc/self/statm", "r");
+
+	if (statm == NULL) {
+		perror("fopen");
+		return 0;
+	}
+
+	if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+		resident = 0;
+	}
+
+	fclose(statm);
+
+	return resident * (unsigned long)sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Raises the soft limit on open files to the hard limit, and warns if
+ * it is still too low for 'connections' connections.
+ */
+static void idle_raise_nofile(unsigned long connections)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+		perror("getrlimit");
+		return;
+	}
+
+	rl.rlim_cur = rl.rlim_max;
+
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+		perror("setrlimit");
+		return;
+	}
+
+	if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < connections + 64) {
+		fprintf(
+			stderr,
+			"open files limit %llu is too low for %lu connections\n",
+			(unsigned long long)rl.rlim_cur,
+			connections
+		);
+	}
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-n connections] [-d thread|fiber] "
+		"[-S stack_size] [-g guard_size] [-p port]\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	maxserver_t *server;
+	unsigned long waited, rss, opened;
+	int done_pipe[2];
+	int status;
+	int opt;
+	pid_t pid;
+
+	args.port = "7358";
+	args.dispatch = "thread";
+	args.connections = 10000;
+	maxserver_config_init(&args.config);
+	args.config.handle_stdin = 0;
+	args.config.handle_signals = 0;
+
+	while ((opt = getopt(argc, argv, "n:d:S:g:p:")) != -1) {
+		switch (opt) {
+		case 'n':
+			args.connections = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			if (strcmp(optarg, "fiber") == 0) {
+				args.config.dispatch = MAXSERVER_DISPATCH_FIBER;
+			} else if (strcmp(optarg, "thread") != 0) {
+				usage(argv[0]);
+			}
+
+			args.dispatch = optarg;
+			break;
+		case 'S':
+			args.config.client_thread_stack_size =
+				strtoul(optarg, NULL, 0);
+			args.config.fiber_stack_size =
+				args.config.client_thread_stack_size;
+			break;
+		case 'g':
+			args.config.client_thread_guard_size =
+				strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			args.port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	idle_raise_nofile(args.connections);
+
+	/* Open the connections from a child process, so that the
+	   server process only holds its own sockets and the child is
+	   forked before any thread is started. */
+	if (pipe(done_pipe) == -1) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	pid = fork();
+
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	} else if (pid == 0) {
+		close(done_pipe[1]);
+		idle_client(done_pipe[0]);
+	}
+
+	close(done_pipe[0]);
+
+	/* Keep the server's per-connection messages off the
+	   terminal. */
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("freopen");
+		exit(EXIT_FAILURE);
+	}
+
+	rss = idle_rss();
+	server = maxserver_create(args.port, idle_server, &args.config);
+
+	if (server == NULL || maxserver_start(server) == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	/* Wait for every connection to reach its client thread, giving
+	   up after a minute. */
+	for (waited = 0; waited < 60000; ++waited) {
+		if (__atomic_load_n(&open_connections, __ATOMIC_RELAXED) >=
+			args.connections) {
+			break;
+		}
+
+		usleep(1000);
+	}
+
+	opened = __atomic_load_n(&open_connections, __ATOMIC_RELAXED);
+	fprintf(
+		stderr,
+		"dispatch=%s stack_size=%zu guard_size=%zu connections=%lu "
+		"open=%lu max_cfd=%d\n",
+		args.dispatch,
+		args.config.client_thread_stack_size,
+		args.config.client_thread_guard_size,
+		args.connections,
+		opened,
+		__atomic_load_n(&max_cfd, __ATOMIC_RELAXED)
+	);
+	idle_print_status();
+
+	/* Memory added since before the server started. */
+	if (opened > 0) {
+		fprintf(
+			stderr,
+			"rss_per_connection=%lu bytes\n",
+			(idle_rss() - rss) / opened
+		);
+	}
+
+	/* Close the connections and stop the server. */
+	close(done_pipe[1]);
+	waitpid(pid, &status, 0);
+	maxserver_stop(server, 1000);
+	maxserver_destroy(server);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "client failed to open every connection\n");
+		return EXIT_FAILURE;
+	}
+
+	return 0;
+}
@@ -0,0 +1,988 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Load generator. Drives the length-prefixed echo protocol of
+ * examples/echo_server from several threads, each running an epoll
+ * loop over its share of the client connections, and reports
+ * connections/s, requests/s and latency percentiles. By default it
+ * runs its own maxserver instance on loopback whose client threads
+ * keep connections alive for any number of requests. With '-d fiber'
+ * the same handler runs in fibers on a few scheduler threads, and with
+ * '-d epoll' or '-d uring' the instance runs event loop threads on the
+ * given backend instead of client threads. '-o' selects how client
+ * threads and fibers cork their replies.
+ *
+ * In closed-loop mode every connection sends its next request as soon
+ * as the previous response arrives. In open-loop mode ('-r') requests
+ * are issued at a fixed rate whether or not responses keep up, and
+ * latency is measured from when each request was due, so that a
+ * stalled server shows up in the tail instead of slowing the load
+ * down.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <maxserver.h>
+
+#define LOADGEN_MAX_EVENTS 256
+
+/**
+ * Number of bits of precision of the latency histogram. Values below
+ * 2^(LOADGEN_HIST_BITS + 1) nanoseconds are counted exactly, and
+ * larger values in buckets that are at most 1/2^LOADGEN_HIST_BITS of
+ * their value wide, as in HdrHistogram.
+ */
+#define LOADGEN_HIST_BITS 7
+#define LOADGEN_HIST_HALF (1 << LOADGEN_HIST_BITS)
+#define LOADGEN_HIST_LEN ((64 - LOADGEN_HIST_BITS + 1) * LOADGEN_HIST_HALF)
+
+/**
+ * Data structure representing the benchmark parameters. 'rate' is
+ * the number of requests per second over all threads, or zero for a
+ * closed loop.
+ */
+struct loadgen_args {
+	const char *port;
+	struct maxserver_config config;
+	const char *dispatch;
+	int evloop;
+	int external;
+	int churn;
+	unsigned long connections;
+	unsigned long threads;
+	unsigned long requests;
+	size_t msg_len;
+	unsigned long rate;
+};
+
+/**
+ * States of a load generator connection.
+ */
+enum loadgen_state {
+	LOADGEN_IDLE,
+	LOADGEN_CONNECTING,
+	LOADGEN_SENDING,
+	LOADGEN_RECEIVING
+};
+
+/**
+ * Data structure representing a load generator connection. 'fd' is
+ * -1 while the connection is closed. 'active' is set while a request
+ * is in progress, which was due at 'start' nanoseconds, and 'off' is
+ * the number of bytes of it sent or received so far.
+ */
+struct loadgen_conn {
+	int fd;
+	enum loadgen_state state;
+	int active;
+	size_t off;
+	unsigned long long start;
+};
+
+/**
+ * Data structure representing a load generator thread.
+ *
+ * 'idle' is a stack of connections without a request in progress.
+ * In open-loop mode, 'backlog' is a ring of the due times of requests
+ * that are due while every connection is busy.
+ */
+struct loadgen_thread {
+	pthread_t tid;
+	int epfd;
+	struct loadgen_conn *conns;
+	size_t conns_len;
+	struct loadgen_conn **idle;
+	size_t idle_len;
+	unsigned long long *backlog;
+	size_t backlog_head;
+	size_t backlog_len;
+	size_t backlog_cap;
+	char *sendbuf;
+	size_t sendlen;
+	char *recvbuf;
+	unsigned long quota;
+	unsigned long issued;
+	unsigned long completed;
+	unsigned long failed;
+	unsigned long connects;
+	unsigned long long next_due;
+	unsigned long long interval;
+	unsigned long long hist[LOADGEN_HIST_LEN];
+};
+
+/**
+ * Global variable holding the benchmark parameters.
+ */
+static struct loadgen_args args;
+
+/**
+ * Global variable holding the loopback address of the server.
+ */
+static struct sockaddr_in loadgen_addr;
+
+/**
+ * Global variable holding the time that every load generator thread
+ * starts at, in nanoseconds.
+ */
+static unsigned long long loadgen_t0;
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ */
+static unsigned long long loadgen_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+		(unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * Returns the histogram bucket of 'value'.
+ */
+static size_t loadgen_hist_index(unsigned long long value)
+{
+	int shift;
+
+	if (value < 2 * LOADGEN_HIST_HALF) {
+		return (size_t)value;
+	}
+
+	shift = 63 - __builtin_clzll(value) - LOADGEN_HIST_BITS;
+
+	return (size_t)shift * LOADGEN_HIST_HALF + (size_t)(value >> shift);
+}
+
+/**
+ * Returns the highest value counted in histogram bucket 'index'.
+ */
+static unsigned long long loadgen_hist_value(size_t index)
+{
+	size_t shift;
+
+	if (index < 2 * LOADGEN_HIST_HALF) {
+		return index;
+	}
+
+	shift = index / LOADGEN_HIST_HALF - 1;
+
+	return (((unsigned long long)(index - shift * LOADGEN_HIST_HALF) + 1)
+		<< shift) - 1;
+}
+
+/**
+ * Returns the value below which fraction 'p' of the values counted in
+ * 'hist' fall.
+ */
+static unsigned long long loadgen_hist_percentile(
+	const unsigned long long *hist,
+	unsigned long long total,
+	double p
+)
+{
+	unsigned long long target, seen = 0;
+	size_t i;
+
+	target = (unsigned long long)(p * (double)total + 0.5);
+
+	if (target == 0) {
+		target = 1;
+	}
+
+	for (i = 0; i < LOADGEN_HIST_LEN; ++i) {
+		seen += hist[i];
+
+		if (seen >= target) {
+			return loadgen_hist_value(i);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Serves requests of the echo protocol until the client closes the
+ * connection or the server quits, keeping the connection alive
+ * between requests. Requests that arrive together are parsed from the
+ * read-ahead buffer of the client connection without reading the
+ * client socket again, and their replies are queued without copying
+ * and sent with one system call. Waits through 'maxserver_frame_next',
+ * so it runs unchanged in client threads and in fibers.
+ */
+static void loadgen_server(int cfd, int sigpipe)
+{
+	struct maxserver_conn *conn = maxserver_conn_current();
+	struct maxserver_frame frame;
+
+	(void)sigpipe;
+
+	(void)cfd;
+
+	/* Replies point into the read-ahead buffer, and go out
+	   together once no more requests are buffered. */
+	while (maxserver_frame_next(conn, &frame) == 1) {
+		if (maxserver_conn_queue(conn, frame.data, frame.len) == -1) {
+			return;
+		}
+	}
+}
+
+/**
+ * Data structure representing the progress of an event loop client
+ * connection through its current request: 'hdr_off' bytes of the
+ * length header 'len' have been received, and 'left' bytes of client
+ * data remain to be echoed.
+ */
+struct loadgen_echo {
+	size_t len;
+	size_t hdr_off;
+	size_t left;
+};
+
+/**
+ * Allocates the request progress of a new event loop client
+ * connection.
+ */
+static int loadgen_echo_open(struct maxserver_conn *conn)
+{
+	struct loadgen_echo *echo;
+
+	echo = calloc(1, sizeof(struct loadgen_echo));
+
+	if (echo == NULL) {
+		return -1;
+	}
+
+	maxserver_conn_set_data(conn, echo);
+
+	return 0;
+}
+
+/**
+ * Echoes the client data of the requests in 'data', which may end in
+ * the middle of a request.
+ */
+static void loadgen_echo_data(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len
+)
+{
+	struct loadgen_echo *echo = maxserver_conn_data(conn);
+	const char *p = data;
+	size_t chunk;
+
+	while (len > 0) {
+		if (echo->hdr_off < sizeof(size_t)) {
+			/* Collect the length header. */
+			chunk = sizeof(size_t) - echo->hdr_off;
+			chunk = chunk < len ? chunk : len;
+			memcpy((char *)&echo->len + echo->hdr_off, p, chunk);
+			echo->hdr_off += chunk;
+			echo->left = echo->len;
+		} else {
+			/* Echo client data as it arrives. */
+			chunk = echo->left < len ? echo->left : len;
+
+			if (maxserver_conn_send(conn, p, chunk) == -1) {
+				return;
+			}
+
+			echo->left -= chunk;
+		}
+
+		p += chunk;
+		len -= chunk;
+
+		if (echo->hdr_off == sizeof(size_t) && echo->left == 0) {
+			echo->hdr_off = 0;
+		}
+	}
+}
+
+/**
+ * Frees the request progress of an event loop client connection.
+ */
+static void loadgen_echo_close(struct maxserver_conn *conn)
+{
+	free(maxserver_conn_data(conn));
+}
+
+static void loadgen_conn_idle(
+	struct loadgen_thread *t,
+	struct loadgen_conn *c
+);
+
+/**
+ * Closes 'c', failing its request if it has one in progress, and
+ * hands it on as idle.
+ */
+static void loadgen_conn_fail(
+	struct loadgen_thread *t,
+	struct loadgen_conn *c
+)
+{
+	if (c->fd != -1) {
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	if (c->active) {
+		++t->failed;
+	}
+
+	loadgen_conn_idle(t, c);
+}
+
+/**
+ * Sends as much of the request of 'c' as the socket takes.
+ */
+static void loadgen_conn_send(
+	struct loadgen_thread *t,
+	struct loadgen_conn *c
+)
+{
+	ssize_t res;
+
+	while (c->off < t->sendlen) {
+		res = write(c->fd, t->sendbuf + c->off, t->sendlen - c->off);
+
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno != EAGAIN) {
+				loadgen_conn_fail(t, c);
+			}
+
+			return;
+		}
+
+		c->off += (size_t)res;
+	}
+
+	/* Wait for the response, which arrives as an EPOLLIN edge. */
+	c->state = LOADGEN_RECEIVING;
+	c->off = 0;
+}
+
+/**
+ * Receives as much of the response of 'c' as has arrived, and
+ * completes its request once all of it has.
+ */
+static void loadgen_conn_receive(
+	struct loadgen_thread *t,
+	struct loadgen_conn *c
+)
+{
+	size_t idx;
+	ssize_t res;
+
+	while (c->off < args.msg_len) {
+		res = read(c->fd, t->recvbuf, args.msg_len - c->off);
+
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno != EAGAIN) {
+				loadgen_conn_fail(t, c);
+			}
+
+			return;
+		} else if (res == 0) {
+			loadgen_conn_fail(t, c);
+			return;
+		}
+
+		c->off += (size_t)res;
+	}
+
+	/* Record latency from when the request was due. */
+	idx = loadgen_hist_index(loadgen_now() - c->start);
+	++t->hist[idx < LOADGEN_HIST_LEN ? idx : LOADGEN_HIST_LEN - 1];
+	++t->completed;
+
+	if (args.churn) {
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	c->active = 0;
+	loadgen_conn_idle(t, c);
+}
+
+/**
+ * Opens a new non-blocking connection for 'c'.
+ */
+static void loadgen_conn_connect(
+	struct loadgen_thread *t,
+	struct loadgen_conn *c
+)
+{
+	struct epoll_event ev;
+	int one = 1;
+
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+	if (c->fd == -1) {
+		loadgen_conn_fail(t, c);
+		return;
+	}
+
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+
+	if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+		loadgen_conn_fail(t, c);
+		return;
+	}
+
+	c->state = LOADGEN_CONNECTING;
+
+	if (connect(
+		c->fd,
+		(struct sockaddr *)&loadgen_addr,
+		sizeof(loadgen_addr)
+	) == -1 && errno != EINPROGRESS) {
+		loadgen_conn_fail(t, c);
+	}
+}
+
+/**
+ * Starts a request on 'c' that was due at 'due' nanoseconds,
+ * connecting first if 'c' is closed.
+ */
+static void loadgen_conn_start(
+	struct loadgen_thread *t,
+	struct loadgen_conn *c,
+	unsigned long long due
+)
+{
+	c->active = 1;
+	c->start = due;
+	c->off = 0;
+
+	if (c->fd == -1) {
+		loadgen_conn_connect(t, c);
+	} else {
+		c->state = LOADGEN_SENDING;
+		loadgen_conn_send(t, c);
+	}
+}
+
+/**
+ * Hands 'c', which has no request in progress, the next request: a
+ * backlogged one in open-loop mode, or a new one in closed-loop mode.
+ * Otherwise, 'c' waits on the idle stack.
+ */
+static void loadgen_conn_idle(
+	struct loadgen_thread *t,
+	struct loadgen_conn *c
+)
+{
+	unsigned long long due;
+
+	c->state = LOADGEN_IDLE;
+	c->active = 0;
+
+	if (args.rate > 0 && t->backlog_len > 0) {
+		due = t->backlog[t->backlog_head];
+		t->backlog_head = (t->backlog_head + 1) % t->backlog_cap;
+		--t->backlog_len;
+		loadgen_conn_start(t, c, due);
+	} else if (args.rate == 0 && t->issued < t->quota) {
+		++t->issued;
+		loadgen_conn_start(t, c, loadgen_now());
+	} else {
+		t->idle[t->idle_len++] = c;
+	}
+}
+
+/**
+ * Appends due time 'due' to the backlog of 't'.
+ * On success, zero is returned. On error, -1 is returned.
+ */
+static int loadgen_backlog_push(
+	struct loadgen_thread *t,
+	unsigned long long due
+)
+{
+	unsigned long long *backlog;
+	size_t cap, i;
+
+	if (t->backlog_len == t->backlog_cap) {
+		cap = t->backlog_cap > 0 ? 2 * t->backlog_cap : 1024;
+		backlog = malloc(sizeof(unsigned long long) * cap);
+
+		if (backlog == NULL) {
+			return -1;
+		}
+
+		for (i = 0; i < t->backlog_len; ++i) {
+			backlog[i] = t->backlog[
+				(t->backlog_head + i) % t->backlog_cap
+			];
+		}
+
+		free(t->backlog);
+		t->backlog = backlog;
+		t->backlog_head = 0;
+		t->backlog_cap = cap;
+	}
+
+	t->backlog[(t->backlog_head + t->backlog_len) % t->backlog_cap] = due;
+	++t->backlog_len;
+
+	return 0;
+}
+
+/**
+ * Issues every request of 't' that is due by 'now' in open-loop mode.
+ */
+static void loadgen_issue_due(
+	struct loadgen_thread *t,
+	unsigned long long now
+)
+{
+	while (t->issued < t->quota && t->next_due <= now) {
+		++t->issued;
+
+		if (t->idle_len > 0) {
+			loadgen_conn_start(t, t->idle[--t->idle_len], t->next_due);
+		} else if (loadgen_backlog_push(t, t->next_due) == -1) {
+			++t->failed;
+		}
+
+		t->next_due += t->interval;
+	}
+}
+
+/**
+ * Handles epoll events 'events' of connection 'c'.
+ */
+static void loadgen_conn_event(
+	struct loadgen_thread *t,
+	struct loadgen_conn *c,
+	unsigned int events
+)
+{
+	socklen_t len = sizeof(int);
+	int err;
+
+	switch (c->state) {
+	case LOADGEN_CONNECTING:
+		if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+			return;
+		}
+
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+			err != 0) {
+			loadgen_conn_fail(t, c);
+			return;
+		}
+
+		++t->connects;
+
+		if (c->active) {
+			c->state = LOADGEN_SENDING;
+			loadgen_conn_send(t, c);
+		} else {
+			loadgen_conn_idle(t, c);
+		}
+		break;
+	case LOADGEN_SENDING:
+		loadgen_conn_send(t, c);
+		break;
+	case LOADGEN_RECEIVING:
+		loadgen_conn_receive(t, c);
+		break;
+	case LOADGEN_IDLE:
+		/* The server closed an idle connection, which is
+		   reopened by its next request. */
+		if (c->fd != -1 &&
+			(events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP))) {
+			close(c->fd);
+			c->fd = -1;
+		}
+		break;
+	}
+}
+
+/**
+ * Runs load generator thread 'arg' until its quota of requests has
+ * completed or failed.
+ */
+static void *loadgen_thread(void *arg)
+{
+	struct loadgen_thread *t = (struct loadgen_thread *)arg;
+	struct epoll_event events[LOADGEN_MAX_EVENTS];
+	unsigned long long now;
+	int timeout;
+	int n, i;
+	size_t j;
+
+	t->next_due = loadgen_t0;
+
+	/* Open persistent connections up front, and start closed-loop
+	   churn right away. */
+	for (j = 0; j < t->conns_len; ++j) {
+		if (!args.churn) {
+			loadgen_conn_connect(t, &t->conns[j]);
+		} else {
+			loadgen_conn_idle(t, &t->conns[j]);
+		}
+	}
+
+	while (t->completed + t->failed < t->quota) {
+		timeout = -1;
+
+		if (args.rate > 0 && t->issued < t->quota) {
+			now = loadgen_now();
+			loadgen_issue_due(t, now);
+
+			/* Sleep at most until the next request is due,
+			   rounding up to whole milliseconds. */
+			timeout = t->next_due > now ?
+				(int)((t->next_due - now + 999999) / 1000000) :
+				0;
+		}
+
+		n = epoll_wait(t->epfd, events, LOADGEN_MAX_EVENTS, timeout);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; ++i) {
+			loadgen_conn_event(
+				t,
+				(struct loadgen_conn *)events[i].data.ptr,
+				events[i].events
+			);
+		}
+	}
+
+	for (j = 0; j < t->conns_len; ++j) {
+		if (t->conns[j].fd != -1) {
+			close(t->conns[j].fd);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Initialises load generator thread 't' with 'conns_len' connections
+ * and 'quota' requests.
+ * On success, zero is returned. On error, -1 is returned.
+ */
+static int loadgen_thread_init(
+	struct loadgen_thread *t,
+	size_t conns_len,
+	unsigned long quota
+)
+{
+	size_t i;
+
+	memset(t, 0, sizeof(struct loadgen_thread));
+	t->conns_len = conns_len;
+	t->quota = quota;
+	t->interval = args.rate > 0 ?
+		1000000000ULL * args.threads / args.rate : 0;
+	t->epfd = epoll_create1(0);
+	t->conns = calloc(conns_len, sizeof(struct loadgen_conn));
+	t->idle = calloc(conns_len, sizeof(struct loadgen_conn *));
+	t->sendlen = sizeof(size_t) + args.msg_len;
+	t->sendbuf = malloc(t->sendlen);
+	t->recvbuf = malloc(args.msg_len > 0 ? args.msg_len : 1);
+
+	if (t->epfd == -1 || t->conns == NULL || t->idle == NULL ||
+		t->sendbuf == NULL || t->recvbuf == NULL) {
+		return -1;
+	}
+
+	memcpy(t->sendbuf, &args.msg_len, sizeof(size_t));
+	memset(t->sendbuf + sizeof(size_t), 'x', args.msg_len);
+
+	for (i = 0; i < conns_len; ++i) {
+		t->conns[i].fd = -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Global variable holding the callbacks of the event loop echo
+ * server.
+ */
+static const struct maxserver_evloop_callbacks loadgen_echo_callbacks = {
+	loadgen_echo_open,
+	NULL,
+	NULL,
+	loadgen_echo_close,
+	loadgen_echo_data
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-c connections] [-t threads] [-n requests] "
+		"[-m msg_size] [-r rate] [-k] "
+		"[-d thread|pool|fiber|epoll|uring] [-o none|more|tcp] "
+		"[-e] [-p port]\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	maxserver_t *server = NULL;
+	struct loadgen_thread *threads;
+	unsigned long long *hist;
+	unsigned long long total, t1;
+	unsigned long completed = 0, failed = 0, connects = 0;
+	double seconds;
+	size_t i, j;
+	int opt;
+
+	args.port = "7359";
+	args.dispatch = "thread";
+	args.connections = 32;
+	args.threads = 2;
+	args.requests = 200000;
+	args.msg_len = 64;
+	maxserver_config_init(&args.config);
+	args.config.handle_stdin = 0;
+	args.config.handle_signals = 0;
+
+	while ((opt = getopt(argc, argv, "c:t:n:m:r:kd:o:ep:")) != -1) {
+		switch (opt) {
+		case 'c':
+			args.connections = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			args.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			args.requests = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			args.msg_len = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			args.rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			args.churn = 1;
+			break;
+		case 'd':
+			if (strcmp(optarg, "pool") == 0) {
+				args.config.dispatch = MAXSERVER_DISPATCH_POOL;
+			} else if (strcmp(optarg, "fiber") == 0) {
+				args.config.dispatch = MAXSERVER_DISPATCH_FIBER;
+			} else if (strcmp(optarg, "epoll") == 0) {
+				args.evloop = 1;
+			} else if (strcmp(optarg, "uring") == 0) {
+				args.evloop = 1;
+				args.config.evloop_backend =
+					MAXSERVER_EVLOOP_URING;
+			} else if (strcmp(optarg, "thread") != 0) {
+				usage(argv[0]);
+			}
+
+			args.dispatch = optarg;
+			break;
+		case 'o':
+			if (strcmp(optarg, "more") == 0) {
+				args.config.output_cork =
+					MAXSERVER_CORK_MSG_MORE;
+			} else if (strcmp(optarg, "tcp") == 0) {
+				args.config.output_cork = MAXSERVER_CORK_TCP;
+			} else if (strcmp(optarg, "none") != 0) {
+				usage(argv[0]);
+			}
+
+			break;
+		case 'e':
+			args.external = 1;
+			break;
+		case 'p':
+			args.port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (args.threads == 0 || args.connections < args.threads ||
+		args.requests < args.threads) {
+		usage(argv[0]);
+	}
+
+	memset(&loadgen_addr, 0, sizeof(struct sockaddr_in));
+	loadgen_addr.sin_family = AF_INET;
+	loadgen_addr.sin_port = htons(atoi(args.port));
+	loadgen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	/* Start the server unless an external one is benchmarked,
+	   keeping its per-connection messages off the terminal. */
+	if (!args.external) {
+		if (freopen("/dev/null", "w", stdout) == NULL) {
+			perror("freopen");
+			exit(EXIT_FAILURE);
+		}
+
+		if (args.evloop) {
+			server = maxserver_create_evloop(
+				args.port,
+				&loadgen_echo_callbacks,
+				&args.config
+			);
+		} else {
+			server = maxserver_create(
+				args.port,
+				loadgen_server,
+				&args.config
+			);
+		}
+
+		if (server == NULL || maxserver_start(server) == -1) {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Split connections and requests evenly over the threads. */
+	threads = calloc(args.threads, sizeof(struct loadgen_thread));
+	hist = calloc(LOADGEN_HIST_LEN, sizeof(unsigned long long));
+
+	if (threads == NULL || hist == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < args.threads; ++i) {
+		if (loadgen_thread_init(
+			&threads[i],
+			args.connections / args.threads +
+				(i < args.connections % args.threads),
+			args.requests / args.threads
+		) == -1) {
+			perror("loadgen_thread_init");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	loadgen_t0 = loadgen_now();
+
+	for (i = 0; i < args.threads; ++i) {
+		pthread_create(&threads[i].tid, NULL, loadgen_thread, &threads[i]);
+	}
+
+	for (i = 0; i < args.threads; ++i) {
+		pthread_join(threads[i].tid, NULL);
+	}
+
+	t1 = loadgen_now();
+	seconds = (double)(t1 - loadgen_t0) / 1e9;
+
+	/* Merge the results of every thread. */
+	for (i = 0; i < args.threads; ++i) {
+		completed += threads[i].completed;
+		failed += threads[i].failed;
+		connects += threads[i].connects;
+
+		for (j = 0; j < LOADGEN_HIST_LEN; ++j) {
+			hist[j] += threads[i].hist[j];
+		}
+	}
+
+	total = completed;
+
+	fprintf(
+		stderr,
+		"server=%s mode=%s loop=%s connections=%lu threads=%lu msg=%zu "
+		"rate=%lu\n"
+		"requests=%lu failed=%lu time=%.3fs "
+		"conn/s=%.0f req/s=%.0f\n"
+		"latency p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+		args.external ? "external" : args.dispatch,
+		args.churn ? "churn" : "persistent",
+		args.rate > 0 ? "open" : "closed",
+		args.connections,
+		args.threads,
+		args.msg_len,
+		args.rate,
+		completed,
+		failed,
+		seconds,
+		(double)connects / seconds,
+		(double)completed / seconds,
+		(double)loadgen_hist_percentile(hist, total, 0.5) / 1e3,
+		(double)loadgen_hist_percentile(hist, total, 0.99) / 1e3,
+		(double)loadgen_hist_percentile(hist, total, 0.999) / 1e3,
+		(double)loadgen_hist_percentile(hist, total, 1.0) / 1e3
+	);
+
+	if (server != NULL) {
+		maxserver_stop(server, 1000);
+		maxserver_destroy(server);
+	}
+
+	for (i = 0; i < args.threads; ++i) {
+		close(threads[i].epfd);
+		free(threads[i].conns);
+		free(threads[i].idle);
+		free(threads[i].backlog);
+		free(threads[i].sendbuf);
+		free(threads[i].recvbuf);
+	}
+
+	free(threads);
+	free(hist);
+
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,456 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Skewed workload benchmark. Runs a maxserver worker pool on
+ * loopback whose handlers mostly take a short time, but sometimes a
+ * long one, and opens one short connection per request against it
+ * from several client threads. Reports latency percentiles over all
+ * requests and over the short ones, which are the ones held up when
+ * they are queued behind a long handler, for the shared,
+ * round-robin or work-stealing pool scheduler. Handlers wait rather
+ * than compute, as they would for a slow backend, so the schedulers
+ * can be compared on any number of CPUs.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <maxserver.h>
+
+#define SKEW_WORKERS_MAX 256
+
+/**
+ * Data structure representing the benchmark parameters. 'heavy' is
+ * the percentage of requests that take 'heavy_us' microseconds to
+ * handle, and the rest take 'light_us'.
+ */
+struct skew_args {
+	const char *port;
+	struct maxserver_config config;
+	const char *scheduler;
+	unsigned long requests;
+	unsigned long clients;
+	unsigned int heavy;
+	unsigned long heavy_us;
+	unsigned long light_us;
+};
+
+/**
+ * Data structure representing a client thread. 'latencies' holds the
+ * latency of each of its 'count' requests in nanoseconds, and
+ * 'heavy' whether the request was a heavy one.
+ */
+struct skew_client {
+	pthread_t tid;
+	unsigned int seed;
+	unsigned long count;
+	unsigned long long *latencies;
+	char *heavy;
+	unsigned long failed;
+};
+
+/**
+ * Global variable holding the benchmark parameters.
+ */
+static struct skew_args args;
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ */
+static unsigned long long skew_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+		(unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * Reads a request byte from client, waits as long as it asks for, or
+ * until the server stops, and writes it back.
+ */
+static void skew_server(int cfd, int sigpipe)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+	unsigned long us;
+	char c;
+
+	if (maxserver_wait_readable(cfd, -1) != 1 || read(cfd, &c, 1) != 1) {
+		return;
+	}
+
+	us = c == 'h' ? args.heavy_us : args.light_us;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (long)(us % 1000000) * 1000;
+	pfd.fd = sigpipe;
+	pfd.events = POLLIN;
+
+	if (ppoll(&pfd, 1, &ts, NULL) == 0) {
+		write(cfd, &c, 1);
+	}
+}
+
+/**
+ * Connects to the server on loopback.
+ * On success, a file descriptor for the new socket is returned. On
+ * error, -1 is returned.
+ */
+static int skew_connect()
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int sfd;
+
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(args.port));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (sfd == -1) {
+		return -1;
+	}
+
+	setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+
+	if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sfd);
+		return -1;
+	}
+
+	return sfd;
+}
+
+/**
+ * Sends the requests of one client thread, each on a new connection,
+ * and records their latencies.
+ */
+static void *skew_client_thread(void *arg)
+{
+	struct skew_client *client = (struct skew_client *)arg;
+	unsigned long long start;
+	unsigned long i;
+	char c;
+	int sfd;
+
+	for (i = 0; i < client->count; ++i) {
+		client->heavy[i] =
+			(unsigned int)rand_r(&client->seed) % 100 < args.heavy;
+		c = client->heavy[i] ? 'h' : 'l';
+		start = skew_now();
+		sfd = skew_connect();
+
+		if (sfd == -1) {
+			++client->failed;
+			client->latencies[i] = 0;
+			continue;
+		}
+
+		if (write(sfd, &c, 1) != 1 || read(sfd, &c, 1) != 1) {
+			++client->failed;
+		}
+
+		close(sfd);
+		client->latencies[i] = skew_now() - start;
+	}
+
+	return NULL;
+}
+
+/**
+ * Compares two latencies for qsort.
+ */
+static int skew_compare(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Sorts the 'len' latencies of 'latencies' and prints their
+ * percentiles, labelled 'label'.
+ */
+static void skew_report(
+	const char *label,
+	unsigned long long *latencies,
+	unsigned long len
+)
+{
+	if (len == 0) {
+		return;
+	}
+
+	qsort(latencies, len, sizeof(unsigned long long), skew_compare);
+	fprintf(
+		stderr,
+		"%s: requests=%lu p50=%.1fus p99=%.1fus p999=%.1fus "
+		"max=%.1fus\n",
+		label,
+		len,
+		(double)latencies[(len - 1) / 2] / 1e3,
+		(double)latencies[(len - 1) * 99 / 100] / 1e3,
+		(double)latencies[(len - 1) * 999 / 1000] / 1e3,
+		(double)latencies[len - 1] / 1e3
+	);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-s shared|rr|steal] [-n requests] "
+		"[-c clients] [-t threads] [-f heavy_percent] "
+		"[-H heavy_us] [-L light_us] [-p port]\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	maxserver_t *server;
+	struct skew_client *clients;
+	struct maxserver_pool_stats stats;
+	struct maxserver_pool_worker_stats workers[SKEW_WORKERS_MAX];
+	unsigned long long *all, *light;
+	unsigned long long start, end;
+	unsigned long per_client;
+	unsigned long n_all = 0, n_light = 0, failed = 0;
+	unsigned long i, j;
+	size_t threads;
+	double seconds;
+	int opt;
+
+	args.port = "7358";
+	args.scheduler = "steal";
+	args.requests = 10000;
+	args.clients = 6;
+	args.heavy = 2;
+	args.heavy_us = 10000;
+	args.light_us = 200;
+	maxserver_config_init(&args.config);
+	args.config.dispatch = MAXSERVER_DISPATCH_POOL;
+	args.config.pool_scheduler = MAXSERVER_POOL_STEALING;
+	args.config.pool_max_threads = 8;
+	args.config.handle_stdin = 0;
+	args.config.handle_signals = 0;
+
+	while ((opt = getopt(argc, argv, "s:n:c:t:f:H:L:p:")) != -1) {
+		switch (opt) {
+		case 's':
+			args.scheduler = optarg;
+
+			if (strcmp(optarg, "shared") == 0) {
+				args.config.pool_scheduler =
+					MAXSERVER_POOL_SHARED;
+			} else if (strcmp(optarg, "rr") == 0) {
+				args.config.pool_scheduler =
+					MAXSERVER_POOL_ROUND_ROBIN;
+			} else if (strcmp(optarg, "steal") == 0) {
+				args.config.pool_scheduler =
+					MAXSERVER_POOL_STEALING;
+			} else {
+				usage(argv[0]);
+			}
+			break;
+		case 'n':
+			args.requests = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			args.clients = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			args.config.pool_max_threads =
+				strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			args.heavy = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			args.heavy_us = strtoul(optarg, NULL, 10);
+			break;
+		case 'L':
+			args.light_us = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			args.port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (args.clients == 0 || args.requests < args.clients ||
+		args.config.pool_max_threads == 0) {
+		usage(argv[0]);
+	}
+
+	/* Keep the shared pool at its full size, like the others. */
+	args.config.pool_min_threads = args.config.pool_max_threads;
+
+	/* Keep the server's per-connection messages off the
+	   terminal. */
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("freopen");
+		exit(EXIT_FAILURE);
+	}
+
+	server = maxserver_create(args.port, skew_server, &args.config);
+
+	if (server == NULL || maxserver_start(server) == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	per_client = args.requests / args.clients;
+	clients = calloc(args.clients, sizeof(struct skew_client));
+	all = malloc(sizeof(unsigned long long) * per_client * args.clients);
+	light = malloc(sizeof(unsigned long long) * per_client * args.clients);
+
+	if (clients == NULL || all == NULL || light == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Every client thread draws its heavy requests from its own
+	   seed, so that every scheduler sees the same requests. */
+	start = skew_now();
+
+	for (i = 0; i < args.clients; ++i) {
+		clients[i].seed = (unsigned int)i + 1;
+		clients[i].count = per_client;
+		clients[i].latencies = malloc(
+			sizeof(unsigned long long) * per_client
+		);
+		clients[i].heavy = malloc(per_client);
+
+		if (clients[i].latencies == NULL || clients[i].heavy == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_create(
+			&clients[i].tid,
+			NULL,
+			skew_client_thread,
+			&clients[i]
+		);
+	}
+
+	for (i = 0; i < args.clients; ++i) {
+		pthread_join(clients[i].tid, NULL);
+	}
+
+	end = skew_now();
+	seconds = (double)(end - start) / 1e9;
+
+	for (i = 0; i < args.clients; ++i) {
+		failed += clients[i].failed;
+
+		for (j = 0; j < per_client; ++j) {
+			all[n_all++] = clients[i].latencies[j];
+
+			if (!clients[i].heavy[j]) {
+				light[n_light++] = clients[i].latencies[j];
+			}
+		}
+	}
+
+	fprintf(
+		stderr,
+		"scheduler=%s threads=%zu clients=%lu heavy=%u%% "
+		"heavy_us=%lu light_us=%lu failed=%lu\n"
+		"time=%.3fs rate=%.0f req/s\n",
+		args.scheduler,
+		args.config.pool_max_threads,
+		args.clients,
+		args.heavy,
+		args.heavy_us,
+		args.light_us,
+		failed,
+		seconds,
+		(double)n_all / seconds
+	);
+	skew_report("all", all, n_all);
+	skew_report("light", light, n_light);
+
+	if (maxserver_pool_stats(server, &stats) == 0) {
+		fprintf(
+			stderr,
+			"pool: dispatched=%llu queued_max=%zu saturated=%llu "
+			"rejected=%llu steals=%llu\n",
+			stats.dispatched,
+			stats.queued_max,
+			stats.saturated,
+			stats.rejected,
+			stats.steals
+		);
+	}
+
+	threads = maxserver_pool_worker_stats(
+		server,
+		workers,
+		SKEW_WORKERS_MAX
+	);
+
+	for (i = 0; i < threads && i < SKEW_WORKERS_MAX; ++i) {
+		fprintf(
+			stderr,
+			"worker %lu: handled=%llu steals=%llu queued_max=%zu\n",
+			i,
+			workers[i].handled,
+			workers[i].steals,
+			workers[i].queued_max
+		);
+	}
+
+	/* Stop the server. */
+	maxserver_stop(server, 1000);
+	maxserver_destroy(server);
+
+	for (i = 0; i < args.clients; ++i) {
+		free(clients[i].latencies);
+		free(clients[i].heavy);
+	}
+
+	free(clients);
+	free(all);
+	free(light);
+	return 0;
+}
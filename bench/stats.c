@@ -0,0 +1,470 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Metrics benchmark. First measures the cost of counting in the
+ * per-thread shards of the metrics module from several threads, per
+ * counter update and per timed handler invocation. Then runs an echo
+ * server in the process, on an event loop thread (-d epoll), which
+ * times every 'on_data' call, or on worker threads (-d pool), which
+ * count every read and write, with metrics turned off and on in
+ * alternating rounds, pipelines small requests to it over one
+ * loopback connection, and reports the median throughput of each,
+ * the overhead of the metrics, and the handler duration percentiles
+ * of 'maxserver_stats_snapshot'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <maxserver.h>
+
+#include "metrics.h"
+
+#define STATS_ROUNDS_MAX 64
+
+/**
+ * Data structure representing the benchmark parameters.
+ */
+struct stats_args {
+	int evloop;
+	unsigned long threads;
+	unsigned long ops;
+	unsigned long requests;
+	size_t window;
+	size_t len;
+	unsigned long rounds;
+	const char *port;
+};
+
+/**
+ * Global variable holding the benchmark parameters.
+ */
+static struct stats_args args;
+
+/**
+ * Global variable holding the metrics that the microbenchmark threads
+ * count in.
+ */
+static struct metrics *stats_metrics;
+
+/**
+ * Returns the monotonic time in seconds.
+ */
+static double stats_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Function that is run by every microbenchmark thread, which counts
+ * bytes if 'arg' is NULL and times handler invocations otherwise.
+ */
+static void *stats_thread(void *arg)
+{
+	unsigned long long start;
+	unsigned long i;
+
+	for (i = 0; i < args.ops; ++i) {
+		if (arg == NULL) {
+			metrics_add(stats_metrics, METRICS_BYTES_IN, 64);
+		} else {
+			start = metrics_start(stats_metrics);
+			metrics_handled(stats_metrics, start);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Runs the microbenchmark threads, timing handler invocations if
+ * 'handled' is non-zero, and returns the time per operation and
+ * thread in nanoseconds.
+ */
+static double stats_micro(int handled)
+{
+	pthread_t *tids;
+	double start, seconds;
+	unsigned long i;
+
+	tids = malloc(sizeof(pthread_t) * args.threads);
+
+	if (tids == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	start = stats_now();
+
+	for (i = 0; i < args.threads; ++i) {
+		pthread_create(
+			&tids[i],
+			NULL,
+			stats_thread,
+			handled ? (void *)&args : NULL
+		);
+	}
+
+	for (i = 0; i < args.threads; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+
+	seconds = stats_now() - start;
+	free(tids);
+
+	return seconds * 1e9 / (double)args.ops;
+}
+
+/**
+ * Echoes every chunk of data received on an event loop thread.
+ */
+static void stats_on_data(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len
+)
+{
+	maxserver_conn_send(conn, data, len);
+}
+
+/**
+ * Echoes everything received on a worker thread.
+ */
+static void stats_handler(int cfd, int sigpipe)
+{
+	char buf[16384];
+	ssize_t n;
+
+	(void)sigpipe;
+
+	for (;;) {
+		n = maxserver_read(cfd, buf, sizeof(buf));
+
+		if (n <= 0 || maxserver_write(cfd, buf, (size_t)n) == -1) {
+			return;
+		}
+	}
+}
+
+/**
+ * Connects to the server on the loopback interface.
+ * Returns the socket, or -1 on error.
+ */
+static int stats_connect()
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int sfd;
+
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(args.port));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (sfd == -1) {
+		return -1;
+	}
+
+	setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+
+	if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sfd);
+		return -1;
+	}
+
+	return sfd;
+}
+
+/**
+ * Sends 'args.requests' requests of 'args.len' bytes over 'sfd', in
+ * batches of 'args.window', and reads every echo back.
+ * On success, zero is returned. On error, -1 is returned.
+ */
+static int stats_client(int sfd)
+{
+	size_t batch = args.window * args.len;
+	unsigned long sent = 0;
+	size_t off;
+	ssize_t n;
+	char *out, *in;
+	int err = 0;
+
+	out = malloc(batch);
+	in = malloc(batch);
+
+	if (out == NULL || in == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(out, 'x', batch);
+
+	while (err == 0 && sent < args.requests) {
+		if (write(sfd, out, batch) != (ssize_t)batch) {
+			err = -1;
+			break;
+		}
+
+		for (off = 0; off < batch; off += (size_t)n) {
+			n = read(sfd, in + off, batch - off);
+
+			if (n <= 0) {
+				err = -1;
+				break;
+			}
+		}
+
+		sent += args.window;
+	}
+
+	free(out);
+	free(in);
+
+	return err;
+}
+
+/**
+ * Runs one round against a new server that keeps metrics if
+ * 'metrics' is non-zero, and prints its metrics if 'print' is also
+ * non-zero.
+ * Returns the requests per second.
+ */
+static double stats_round(int metrics, int print)
+{
+	struct maxserver_evloop_callbacks callbacks;
+	struct maxserver_config config;
+	struct maxserver_stats *stats;
+	maxserver_t *server;
+	double start, seconds;
+	int sfd, err, i;
+
+	maxserver_config_init(&config);
+	config.dispatch = MAXSERVER_DISPATCH_POOL;
+	config.pool_min_threads = 1;
+	config.evloop_threads = 1;
+	config.metrics = metrics;
+	config.handle_stdin = 0;
+	config.handle_signals = 0;
+
+	if (args.evloop) {
+		memset(&callbacks, 0, sizeof(callbacks));
+		callbacks.on_data = stats_on_data;
+		server = maxserver_create_evloop(
+			args.port,
+			&callbacks,
+			&config
+		);
+	} else {
+		server = maxserver_create(args.port, stats_handler, &config);
+	}
+
+	if (server == NULL || maxserver_start(server) == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	sfd = stats_connect();
+
+	if (sfd == -1) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+
+	start = stats_now();
+	err = stats_client(sfd);
+	seconds = stats_now() - start;
+
+	if (err == -1) {
+		fprintf(stderr, "echo failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	close(sfd);
+	stats = malloc(sizeof(struct maxserver_stats));
+
+	/* Wait for the connection to be handled to the end, so that the
+	   snapshot holds all of it. */
+	for (i = 0; print && stats != NULL && i < 1000; ++i) {
+		if (maxserver_stats_snapshot(server, stats) == -1 ||
+			stats->conns == 0) {
+			break;
+		}
+
+		usleep(1000);
+	}
+
+	if (print && stats != NULL && i < 1000) {
+		fprintf(
+			stderr,
+			"stats: accepts=%llu handled=%llu "
+			"bytes_in=%llu bytes_out=%llu spawns=%llu "
+			"p50=%lluns p99=%lluns p999=%lluns\n",
+			stats->accepts,
+			stats->handled,
+			stats->bytes_in,
+			stats->bytes_out,
+			stats->thread_spawns,
+			maxserver_stats_percentile(stats, 50.0),
+			maxserver_stats_percentile(stats, 99.0),
+			maxserver_stats_percentile(stats, 99.9)
+		);
+	}
+
+	free(stats);
+	maxserver_stop(server, 1000);
+	maxserver_destroy(server);
+
+	return (double)args.requests / seconds;
+}
+
+/**
+ * Compares two doubles for 'qsort'.
+ */
+static int stats_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-d epoll|pool] [-t threads] [-o ops] "
+		"[-n requests] [-w window] [-l len] [-r rounds] [-p port]\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	double off[STATS_ROUNDS_MAX], on[STATS_ROUNDS_MAX];
+	double add_ns, handled_ns;
+	unsigned long i;
+	int opt;
+
+	args.evloop = 1;
+	args.threads = 4;
+	args.ops = 10000000;
+	args.requests = 400000;
+	args.window = 16;
+	args.len = 64;
+	args.rounds = 5;
+	args.port = "7362";
+
+	while ((opt = getopt(argc, argv, "d:t:o:n:w:l:r:p:")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (strcmp(optarg, "pool") == 0) {
+				args.evloop = 0;
+			} else if (strcmp(optarg, "epoll") != 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 't':
+			args.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			args.ops = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			args.requests = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			args.window = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			args.len = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			args.rounds = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			args.port = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (args.threads == 0 || args.ops == 0 || args.window == 0 ||
+		args.len == 0 || args.rounds == 0 ||
+		args.rounds > STATS_ROUNDS_MAX) {
+		usage(argv[0]);
+	}
+
+	stats_metrics = metrics_create();
+
+	if (stats_metrics == NULL) {
+		exit(EXIT_FAILURE);
+	}
+
+	add_ns = stats_micro(0);
+	handled_ns = stats_micro(1);
+	metrics_destroy(stats_metrics);
+
+	fprintf(
+		stderr,
+		"micro: threads=%lu add ns/op=%.1f handled ns/op=%.1f\n",
+		args.threads,
+		add_ns,
+		handled_ns
+	);
+
+	/* Alternate, so that drift hits both alike. */
+	for (i = 0; i < args.rounds; ++i) {
+		off[i] = stats_round(0, 0);
+		on[i] = stats_round(1, i == args.rounds - 1);
+	}
+
+	qsort(off, args.rounds, sizeof(double), stats_cmp);
+	qsort(on, args.rounds, sizeof(double), stats_cmp);
+
+	fprintf(
+		stderr,
+		"server: dispatch=%s requests=%lu rounds=%lu "
+		"off req/s=%.0f on req/s=%.0f overhead=%.2f%%\n",
+		args.evloop ? "epoll" : "pool",
+		args.requests,
+		args.rounds,
+		off[args.rounds / 2],
+		on[args.rounds / 2],
+		(off[args.rounds / 2] - on[args.rounds / 2]) /
+			off[args.rounds / 2] * 100.0
+	);
+
+	return 0;
+}
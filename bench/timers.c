@@ -0,0 +1,435 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * Timer microbenchmark. Arms timers at random ticks, arms every one
+ * of them again further away, as a deadline that keeps moving, cancels
+ * every other one, and expires the rest tick by tick, on the timer
+ * wheel that client connection timeouts are kept on, and on a binary
+ * min-heap like the one fibers sleep on. Reports the time per
+ * operation of each phase and the memory used, and checks that every
+ * timer expires at its tick. By default it arms 1M timers within
+ * 60000 ticks, which is ten minutes of 10 ms ticks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "timer.h"
+
+/**
+ * Data structure representing the benchmark parameters.
+ */
+struct timers_args {
+	size_t timers;
+	unsigned long long span;
+};
+
+/**
+ * Data structure representing a timer on the heap, which keeps its
+ * position in 'index'.
+ */
+struct heap_timer {
+	unsigned long long expires;
+	size_t index;
+};
+
+/**
+ * Data structure representing a binary min-heap of 'len' timers.
+ */
+struct heap {
+	struct heap_timer **timers;
+	size_t len;
+};
+
+/**
+ * Data structure representing the time in nanoseconds of each phase
+ * of one run, and the timers that expired and that did so late or
+ * early.
+ */
+struct timers_result {
+	unsigned long long arm;
+	unsigned long long rearm;
+	unsigned long long cancel;
+	unsigned long long expire;
+	size_t expired;
+	size_t wrong;
+	size_t memory;
+};
+
+static struct timers_args args;
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ */
+static unsigned long long timers_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+		(unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * Returns a pseudo-random number from the xorshift state 'state'.
+ */
+static unsigned long long timers_random(unsigned long long *state)
+{
+	unsigned long long x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+/**
+ * Fills 'ticks' with 'len' random ticks in [1, 'span'], and 'later'
+ * with as many ticks that are at least as far away.
+ */
+static void timers_ticks(
+	unsigned long long *ticks,
+	unsigned long long *later,
+	size_t len,
+	unsigned long long span
+)
+{
+	unsigned long long state = 88172645463325252ULL;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		ticks[i] = 1 + timers_random(&state) % span;
+		later[i] = ticks[i] + timers_random(&state) % span;
+	}
+}
+
+/**
+ * Swaps the timers at 'a' and 'b' of 'heap'.
+ */
+static void heap_swap(struct heap *heap, size_t a, size_t b)
+{
+	struct heap_timer *timer = heap->timers[a];
+
+	heap->timers[a] = heap->timers[b];
+	heap->timers[b] = timer;
+	heap->timers[a]->index = a;
+	heap->timers[b]->index = b;
+}
+
+/**
+ * Restores the heap order of 'heap' around the timer at 'i'.
+ */
+static void heap_fix(struct heap *heap, size_t i)
+{
+	size_t child;
+
+	while (i > 0 && heap->timers[i]->expires <
+		heap->timers[(i - 1) / 2]->expires) {
+		heap_swap(heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	for (;;) {
+		child = 2 * i + 1;
+
+		if (child >= heap->len) {
+			break;
+		}
+
+		if (child + 1 < heap->len && heap->timers[child + 1]->expires <
+			heap->timers[child]->expires) {
+			++child;
+		}
+
+		if (heap->timers[i]->expires <= heap->timers[child]->expires) {
+			break;
+		}
+
+		heap_swap(heap, i, child);
+		i = child;
+	}
+}
+
+/**
+ * Arms 'timer' on 'heap' to expire at 'expires'.
+ */
+static void heap_arm(
+	struct heap *heap,
+	struct heap_timer *timer,
+	unsigned long long expires
+)
+{
+	timer->expires = expires;
+
+	if (timer->index == (size_t)-1) {
+		timer->index = heap->len;
+		heap->timers[heap->len++] = timer;
+	}
+
+	heap_fix(heap, timer->index);
+}
+
+/**
+ * Cancels 'timer' on 'heap'.
+ */
+static void heap_cancel(struct heap *heap, struct heap_timer *timer)
+{
+	size_t i = timer->index;
+
+	timer->index = (size_t)-1;
+
+	if (i == --heap->len) {
+		return;
+	}
+
+	heap->timers[i] = heap->timers[heap->len];
+	heap->timers[i]->index = i;
+	heap_fix(heap, i);
+}
+
+/**
+ * Runs the benchmark on a timer wheel into 'result'.
+ */
+static void timers_run_wheel(
+	const unsigned long long *ticks,
+	const unsigned long long *later,
+	struct timers_result *result
+)
+{
+	struct timer_wheel *wheel;
+	struct timer *timers, *timer;
+	unsigned long long start, tick, end = 2 * args.span;
+	size_t i;
+
+	wheel = malloc(sizeof(struct timer_wheel));
+	timers = malloc(sizeof(struct timer) * args.timers);
+
+	if (wheel == NULL || timers == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	timer_wheel_init(wheel, 1);
+
+	for (i = 0; i < args.timers; ++i) {
+		timer_init(&timers[i]);
+	}
+
+	start = timers_now();
+
+	for (i = 0; i < args.timers; ++i) {
+		timer_arm(wheel, &timers[i], ticks[i]);
+	}
+
+	result->arm = timers_now() - start;
+	start = timers_now();
+
+	for (i = 0; i < args.timers; ++i) {
+		timer_arm(wheel, &timers[i], later[i]);
+	}
+
+	result->rearm = timers_now() - start;
+	start = timers_now();
+
+	for (i = 0; i < args.timers; i += 2) {
+		timer_cancel(wheel, &timers[i]);
+	}
+
+	result->cancel = timers_now() - start;
+	start = timers_now();
+
+	for (tick = 1; tick <= end; ++tick) {
+		timer = timer_wheel_advance(wheel, tick);
+
+		for (; timer != NULL; timer = timer->next) {
+			if (timer->expires != tick) {
+				++result->wrong;
+			}
+
+			++result->expired;
+		}
+	}
+
+	result->expire = timers_now() - start;
+	result->memory = sizeof(struct timer_wheel) +
+		sizeof(struct timer) * args.timers;
+
+	free(timers);
+	free(wheel);
+}
+
+/**
+ * Runs the benchmark on a binary min-heap into 'result'.
+ */
+static void timers_run_heap(
+	const unsigned long long *ticks,
+	const unsigned long long *later,
+	struct timers_result *result
+)
+{
+	struct heap heap;
+	struct heap_timer *timers, *timer;
+	unsigned long long start, tick, end = 2 * args.span;
+	size_t i;
+
+	heap.timers = malloc(sizeof(struct heap_timer *) * args.timers);
+	heap.len = 0;
+	timers = malloc(sizeof(struct heap_timer) * args.timers);
+
+	if (heap.timers == NULL || timers == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < args.timers; ++i) {
+		timers[i].index = (size_t)-1;
+	}
+
+	start = timers_now();
+
+	for (i = 0; i < args.timers; ++i) {
+		heap_arm(&heap, &timers[i], ticks[i]);
+	}
+
+	result->arm = timers_now() - start;
+	start = timers_now();
+
+	for (i = 0; i < args.timers; ++i) {
+		heap_arm(&heap, &timers[i], later[i]);
+	}
+
+	result->rearm = timers_now() - start;
+	start = timers_now();
+
+	for (i = 0; i < args.timers; i += 2) {
+		heap_cancel(&heap, &timers[i]);
+	}
+
+	result->cancel = timers_now() - start;
+	start = timers_now();
+
+	for (tick = 1; tick <= end; ++tick) {
+		while (heap.len > 0 && heap.timers[0]->expires <= tick) {
+			timer = heap.timers[0];
+			heap_cancel(&heap, timer);
+
+			if (timer->expires != tick) {
+				++result->wrong;
+			}
+
+			++result->expired;
+		}
+	}
+
+	result->expire = timers_now() - start;
+	result->memory = (sizeof(struct heap_timer *) +
+		sizeof(struct heap_timer)) * args.timers;
+
+	free(timers);
+	free(heap.timers);
+}
+
+/**
+ * Prints 'result' of the run on 'name'.
+ */
+static void timers_report(
+	const char *name,
+	const struct timers_result *result
+)
+{
+	size_t cancelled = (args.timers + 1) / 2;
+
+	fprintf(
+		stderr,
+		"timers=%s count=%zu span=%llu arm=%.1fns rearm=%.1fns "
+		"cancel=%.1fns expire=%.1fns expired=%zu wrong=%zu "
+		"memory=%.1fMiB\n",
+		name,
+		args.timers,
+		args.span,
+		(double)result->arm / (double)args.timers,
+		(double)result->rearm / (double)args.timers,
+		(double)result->cancel / (double)cancelled,
+		(double)result->expire /
+			(double)(result->expired > 0 ? result->expired : 1),
+		result->expired,
+		result->wrong,
+		(double)result->memory / 1048576.0
+	);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-n timers] [-s span]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct timers_result wheel = {0}, heap = {0};
+	unsigned long long *ticks, *later;
+	int opt;
+
+	args.timers = 1000000;
+	args.span = 60000;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			args.timers = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			args.span = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (args.timers == 0 || args.span == 0) {
+		usage(argv[0]);
+	}
+
+	ticks = malloc(sizeof(unsigned long long) * args.timers);
+	later = malloc(sizeof(unsigned long long) * args.timers);
+
+	if (ticks == NULL || later == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		return EXIT_FAILURE;
+	}
+
+	timers_ticks(ticks, later, args.timers, args.span);
+	timers_run_wheel(ticks, later, &wheel);
+	timers_run_heap(ticks, later, &heap);
+	timers_report("wheel", &wheel);
+	timers_report("heap", &heap);
+
+	free(later);
+	free(ticks);
+
+	return wheel.wrong == 0 && heap.wrong == 0 ? 0 : EXIT_FAILURE;
+}
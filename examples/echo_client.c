@@ -20,21 +20,39 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 
 #include "client_socket.h"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+#define ECHO_CLIENT_IOV_LEN 64
+#define ECHO_CLIENT_BUF_LEN 65536
+
 /**
  * Global variable holding the self pipe.
  */
 static int self_pipe[2];
 
+/**
+ * Global variable holding the number of requests to send.
+ */
+static unsigned long requests = 1;
+
+/**
+ * Global variable holding the number of requests that may be in
+ * flight at once.
+ */
+static unsigned long window = 1;
+
 /**
  * Closes the self pipe.
  * On error, an appropriate error message is printed to standard
@@ -177,86 +195,277 @@ static int register_signal_handler()
 }
 
 /**
- * Writes 'len' and 'input' to server through 'sfd', and reads 'len'
- * bytes from server through 'sfd' and prints them to standard
- * output.
- * On success, zero is returned. On error, -1 is returned, and an
- * appropriate error message is printed to standard error.
+ * Sends as many copies of 'req', which is 'req_len' bytes long, to
+ * server through 'sfd' as the window allows, continuing from where
+ * '*sent' copies and '*sent_off' bytes of the next one were sent, with
+ * one system call per up to ECHO_CLIENT_IOV_LEN copies.
+ * On success, zero is returned, also when 'sfd' is full. On error, -1
+ * is returned, and an appropriate error message is printed to
+ * standard error.
  */
-static int echo_client_perform(int sfd, const char *input, size_t len)
+static int echo_client_send(
+	int sfd,
+	const char *req,
+	size_t req_len,
+	unsigned long *sent,
+	size_t *sent_off,
+	unsigned long received
+)
 {
-	char *echo;
+	struct iovec iov[ECHO_CLIENT_IOV_LEN];
+	unsigned long limit;
 	ssize_t res;
+	size_t n;
+	int i;
 
-	/* Write 'len' to server. */
-	res = write(sfd, &len, sizeof(size_t));
+	limit = received + window < requests ? received + window : requests;
 
-	if (res == -1) {
-		if (errno == EPIPE) {
-			fprintf(
-				stderr,
-				"write: connection closed by server.\n"
-			);
-		} else {
-			perror("write");
+	while (*sent < limit) {
+		/* Gather the rest of the current request and the
+		   following ones. */
+		iov[0].iov_base = (void *)(req + *sent_off);
+		iov[0].iov_len = req_len - *sent_off;
+
+		for (i = 1; i < ECHO_CLIENT_IOV_LEN &&
+			*sent + (unsigned long)i < limit; ++i) {
+			iov[i].iov_base = (void *)req;
+			iov[i].iov_len = req_len;
 		}
 
-		return -1;
-	} else if ((size_t)res < sizeof(size_t)) {
-		fprintf(stderr, "write: too few bytes written.\n");
-		return -1;
+		res = writev(sfd, iov, i);
+
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			} else if (errno == EPIPE) {
+				fprintf(
+					stderr,
+					"write: connection closed by server.\n"
+				);
+			} else {
+				perror("writev");
+			}
+
+			return -1;
+		}
+
+		/* Count the requests that were sent in full. */
+		n = *sent_off + (size_t)res;
+		*sent += n / req_len;
+		*sent_off = n % req_len;
 	}
 
-	/* Write 'input' to server. */
-	res = write(sfd, input, len);
+	return 0;
+}
 
-	if (res == -1) {
-		if (errno == EPIPE) {
-			fprintf(
-				stderr,
-				"write: connection closed by server.\n"
-			);
-		} else {
-			perror("write");
+/**
+ * Reads echoes from server through 'sfd' until it has no more data,
+ * checking them against 'len' bytes of 'input', and counts the echoes
+ * that are complete in '*received', and the bytes received of the
+ * next one in '*recv_off'.
+ * On success, zero is returned, also when 'sfd' is empty. On error,
+ * -1 is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+static int echo_client_receive(
+	int sfd,
+	const char *input,
+	size_t len,
+	char *buf,
+	unsigned long *received,
+	size_t *recv_off
+)
+{
+	size_t off, chunk;
+	ssize_t res;
+
+	for (;;) {
+		res = read(sfd, buf, ECHO_CLIENT_BUF_LEN);
+
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+
+			perror("read");
+			return -1;
+		} else if (res == 0) {
+			fprintf(stderr, "read: connection closed by server.\n");
+			return -1;
 		}
 
-		return -1;
-	} else if ((size_t)res < len) {
-		fprintf(stderr, "write: too few bytes written.\n");
+		/* Check server data against input, one echo at a
+		   time. */
+		for (off = 0; off < (size_t)res; off += chunk) {
+			chunk = (size_t)res - off;
+
+			if (chunk > len - *recv_off) {
+				chunk = len - *recv_off;
+			}
+
+			if (memcmp(buf + off, input + *recv_off, chunk) != 0) {
+				fprintf(
+					stderr,
+					"read: echo differs from input.\n"
+				);
+				return -1;
+			}
+
+			*recv_off += chunk;
+
+			if (*recv_off == len) {
+				++*received;
+				*recv_off = 0;
+			}
+		}
+	}
+}
+
+/**
+ * Writes 'len' and 'input' to server through 'sfd' 'requests' times
+ * over the same connection, keeping up to 'window' requests in flight
+ * without waiting for their echoes, reads 'len' bytes from server
+ * through 'sfd' for every request and checks them against 'input',
+ * and prints the echo to standard output. If more than one request is
+ * sent, the number of requests per second is printed to standard
+ * error.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int echo_client_perform(int sfd, const char *input, size_t len)
+{
+	struct pollfd fds[2];
+	struct timespec start, end;
+	unsigned long sent = 0, received = 0;
+	size_t sent_off = 0, recv_off = 0;
+	size_t req_len = sizeof(size_t) + len;
+	char *req, *buf;
+	double seconds;
+	int err;
+
+	if (len == 0) {
+		fprintf(stderr, "echo_client: input is empty.\n");
 		return -1;
 	}
 
-	/* Allocate echo buffer. */
-	echo = malloc(len + 1);
+	/* Build the request, length of client data followed by
+	   client data, once. */
+	req = malloc(req_len);
+	buf = malloc(ECHO_CLIENT_BUF_LEN);
 
-	if (echo == NULL) {
+	if (req == NULL || buf == NULL) {
 		perror("malloc");
+		free(req);
+		free(buf);
 		return -1;
 	}
 
-	/* Read server data. */
-	res = read(sfd, echo, len);
+	memcpy(req, &len, sizeof(size_t));
+	memcpy(req + sizeof(size_t), input, len);
 
-	if (res == -1) {
-		perror("read");
-		free(echo);
-		return -1;
-	} else if (res == 0) {
-		fprintf(stderr, "read: connection closed by server.\n");
-		free(echo);
+	/* Send and receive at the same time, so that neither side
+	   blocks on a full socket while the other waits. */
+	err = fcntl(sfd, F_SETFL, O_NONBLOCK);
+
+	if (err == -1) {
+		perror("fcntl");
+		free(req);
+		free(buf);
 		return -1;
-	} else if ((size_t)res < len) {
-		fprintf(stderr, "read: too few bytes read.\n");
-		free(echo);
+	}
+
+	fds[0].fd = sfd;
+	fds[1].fd = self_pipe[0];
+	fds[1].events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (received < requests) {
+		err = echo_client_send(
+			sfd,
+			req,
+			req_len,
+			&sent,
+			&sent_off,
+			received
+		);
+
+		if (err == -1) {
+			break;
+		}
+
+		/* Wait for echoes, and for room to send more requests
+		   if the window has room for them. */
+		fds[0].events = POLLIN;
+
+		if (sent < requests && sent < received + window) {
+			fds[0].events |= POLLOUT;
+		}
+
+		err = poll(fds, 2, -1);
+
+		if (err == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			perror("poll");
+			break;
+		}
+
+		if (fds[1].revents != 0) {
+			/* The self pipe has signalled the program to
+			   quit. */
+			break;
+		}
+
+		if (fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+			err = echo_client_receive(
+				sfd,
+				input,
+				len,
+				buf,
+				&received,
+				&recv_off
+			);
+
+			if (err == -1) {
+				break;
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(req);
+	free(buf);
+
+	if (err == -1) {
 		return -1;
 	}
 
-	echo[len] = '\0';
+	/* Print server data, which matches input. */
+	if (received > 0) {
+		fprintf(stdout, "%.*s\n", (int)len, input);
+	}
 
-	/* Print server data. */
-	fprintf(stdout, "%s\n", echo);
+	if (requests > 1) {
+		seconds = (double)(end.tv_sec - start.tv_sec) +
+			(double)(end.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(
+			stderr,
+			"requests=%lu window=%lu size=%zu time=%.3fs "
+			"req/s=%.0f\n",
+			received,
+			window,
+			len,
+			seconds,
+			(double)received / seconds
+		);
+	}
 
-	free(echo);
 	return 0;
 }
 
@@ -356,14 +565,37 @@ static int echo_client(int sfd)
 	return 0;
 }
 
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-n requests] [-w window] host port\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[])
 {
 	int sfd;
+	int opt;
 	int err;
 
-	if (argc != 3) {
-		fprintf(stderr, "usage: %s host port\n", argv[0]);
-		exit(EXIT_FAILURE);
+	while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+		switch (opt) {
+		case 'n':
+			requests = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			window = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 2 || requests == 0 || window == 0) {
+		usage(argv[0]);
 	}
 
 	/* Initialise the self pipe. */
@@ -382,7 +614,7 @@ int main(int argc, char *argv[])
 	}
 
 	/* Create client socket. */
-	sfd = client_socket(argv[1], argv[2]);
+	sfd = client_socket(argv[optind], argv[optind + 1]);
 
 	if (sfd == -1) {
 		close_self_pipe();
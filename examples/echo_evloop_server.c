@@ -0,0 +1,215 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <maxserver.h>
+
+/**
+ * Data structure representing the state of an echo client
+ * connection. The length of the client data is read into 'len', then
+ * the client data is read into 'echo', a buffer from the buffer pool
+ * of maxserver, and written back.
+ */
+struct echo_state {
+	size_t len;
+	size_t header_read;
+	char *echo;
+	size_t echo_read;
+	size_t echo_written;
+};
+
+/**
+ * Allocates the echo state of 'conn'.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int echo_open(struct maxserver_conn *conn)
+{
+	struct echo_state *state;
+
+	state = calloc(1, sizeof(struct echo_state));
+
+	if (state == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	maxserver_conn_set_data(conn, state);
+	return 0;
+}
+
+/**
+ * Writes as much of the client data as possible to client, and closes
+ * 'conn' when all of it has been written.
+ */
+static void echo_writable(struct maxserver_conn *conn)
+{
+	struct echo_state *state = maxserver_conn_data(conn);
+	ssize_t res;
+
+	if (state->echo == NULL || state->echo_read < state->len) {
+		return;
+	}
+
+	while (state->echo_written < state->len) {
+		res = write(
+			maxserver_conn_fd(conn),
+			state->echo + state->echo_written,
+			state->len - state->echo_written
+		);
+
+		if (res == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+
+			perror("write");
+			maxserver_conn_close(conn);
+			return;
+		}
+
+		state->echo_written += res;
+	}
+
+	maxserver_conn_close(conn);
+}
+
+/**
+ * Reads length of client data and client data from client, prints
+ * it to standard output once all of it has been read, and starts
+ * writing it back.
+ */
+static void echo_readable(struct maxserver_conn *conn)
+{
+	struct echo_state *state = maxserver_conn_data(conn);
+	int cfd = maxserver_conn_fd(conn);
+	ssize_t res;
+
+	/* Read length of client data. */
+	while (state->header_read < sizeof(size_t)) {
+		res = read(
+			cfd,
+			(char *)&state->len + state->header_read,
+			sizeof(size_t) - state->header_read
+		);
+
+		if (res == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("read");
+				maxserver_conn_close(conn);
+			}
+
+			return;
+		} else if (res == 0) {
+			maxserver_conn_close(conn);
+			return;
+		}
+
+		state->header_read += res;
+	}
+
+	/* Take echo buffer from the buffer pool. */
+	if (state->echo == NULL) {
+		state->echo = maxserver_buf_get(state->len + 1);
+
+		if (state->echo == NULL) {
+			maxserver_conn_close(conn);
+			return;
+		}
+	}
+
+	/* Read client data. */
+	while (state->echo_read < state->len) {
+		res = read(
+			cfd,
+			state->echo + state->echo_read,
+			state->len - state->echo_read
+		);
+
+		if (res == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("read");
+				maxserver_conn_close(conn);
+			}
+
+			return;
+		} else if (res == 0) {
+			fprintf(stderr, "read: connection closed by client.\n");
+			maxserver_conn_close(conn);
+			return;
+		}
+
+		state->echo_read += res;
+	}
+
+	if (state->echo_written == 0) {
+		state->echo[state->len] = '\0';
+
+		/* Print client data. */
+		fprintf(stdout, "%s\n", state->echo);
+	}
+
+	/* Write client data to client. */
+	echo_writable(conn);
+}
+
+/**
+ * Frees the echo state of 'conn'.
+ */
+static void echo_close(struct maxserver_conn *conn)
+{
+	struct echo_state *state = maxserver_conn_data(conn);
+
+	if (state->echo != NULL) {
+		maxserver_buf_put(state->echo);
+	}
+
+	free(state);
+}
+
+int main(int argc, char *argv[])
+{
+	struct maxserver_evloop_callbacks callbacks;
+	int err;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s port\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	callbacks.on_open = echo_open;
+	callbacks.on_readable = echo_readable;
+	callbacks.on_writable = echo_writable;
+	callbacks.on_close = echo_close;
+
+	/* Start server with the echo callbacks. */
+	err = maxserver_evloop(argv[1], &callbacks, NULL);
+
+	if (err == -1) {
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
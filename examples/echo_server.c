@@ -20,151 +20,132 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <sys/select.h>
 
 #include <maxserver.h>
 
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
+/**
+ * Global variable that is set if client data and closed connections
+ * should not be printed.
+ */
+static int quiet = 0;
 
 /**
  * Reads length of client data and client data from client through
- * 'cfd', and prints it to standard output and writes it to client
- * through 'cfd'.
+ * 'cfd' as frames until the client closes the connection, and prints
+ * every frame to standard output and echoes it to client through
+ * 'cfd'. 'maxserver_frame_next' collects each frame however the
+ * client data is split across reads, and returns frames that the
+ * client has pipelined without reading 'cfd' again. Echoes are
+ * queued without copying, and are sent with one system call once no
+ * more frames are buffered, before 'maxserver_frame_next' waits for
+ * more input. Waiting in 'maxserver_frame_next' also wakes when
+ * 'sigpipe' signals the thread to quit, and lets other client
+ * connections run in a fiber.
  * On error, an appropriate error message is printed to standard
  * error.
  */
-static void echo_server_perform(int cfd)
+static void echo_server(int cfd, int sigpipe)
 {
-	char *echo;
-	size_t len;
-	ssize_t res;
-
-	/* Read length of client data. */
-	res = read(cfd, &len, sizeof(size_t));
-
-	if (res == -1) {
-		perror("read");
-		return;
-	} else if (res == 0) {
-		fprintf(stderr, "read: connection closed by client.\n");
-		return;
-	} else if ((size_t)res < sizeof(size_t)) {
-		fprintf(stderr, "read: too few bytes read.\n");
-		return;
-	}
-
-	/* Allocate echo buffer. */
-	echo = malloc(len + 1);
-
-	if (echo == NULL) {
-		perror("malloc");
-		return;
-	}
+	struct maxserver_conn *conn = maxserver_conn_current();
+	struct maxserver_frame frame;
+	int err;
 
-	/* Read client data. */
-	res = read(cfd, echo, len);
-
-	if (res == -1) {
-		perror("read");
-		free(echo);
-		return;
-	} else if (res == 0) {
-		fprintf(stderr, "read: connection closed by client.\n");
-		free(echo);
-		return;
-	} else if ((size_t)res < len) {
-		fprintf(stderr, "read: too few bytes read.\n");
-		free(echo);
-		return;
-	}
+	(void)cfd;
+	(void)sigpipe;
 
-	echo[len] = '\0';
+	for (;;) {
+		/* Read length of client data and client data. */
+		err = maxserver_frame_next(conn, &frame);
+
+		if (err == 0) {
+			if (!quiet) {
+				fprintf(
+					stderr,
+					"read: connection closed by client.\n"
+				);
+			}
 
-	/* Print client data. */
-	fprintf(stdout, "%s\n", echo);
+			return;
+		} else if (err == -1) {
+			if (errno == EPROTO) {
+				fprintf(
+					stderr,
+					"read: connection closed by client "
+					"in the middle of a message.\n"
+				);
+			} else if (errno != ECANCELED) {
+				perror("maxserver_frame_next");
+			}
 
-	/* Write client data to client. */
-	res = write(cfd, echo, len);
+			return;
+		}
 
-	if (res == -1) {
-		if (errno == EPIPE) {
+		/* Print client data. */
+		if (!quiet) {
 			fprintf(
-				stderr,
-				"write: connection closed by client.\n"
+				stdout,
+				"%.*s\n",
+				(int)frame.len,
+				(const char *)frame.data
 			);
-		} else {
-			perror("write");
 		}
 
-		free(echo);
-		return;
-	} else if ((size_t)res < len) {
-		fprintf(stderr, "write: too few bytes written.\n");
-		free(echo);
-		return;
+		/* Queue client data to client. */
+		err = maxserver_conn_queue(conn, frame.data, frame.len);
+
+		if (err == -1) {
+			return;
+		}
 	}
+}
 
-	free(echo);
+static void usage(const char *argv0)
+{
+	fprintf(
+		stderr,
+		"usage: %s [-q] [-d thread|pool|fiber] port\n",
+		argv0
+	);
+	exit(EXIT_FAILURE);
 }
 
-/**
- * Waits for input from either 'cfd' or 'sigpipe', and calls
- * 'echo_server_perform' if 'cfd' has input first.
- * On error, an appropriate error message is printed to standard
- * error.
- */
-static void echo_server(int cfd, int sigpipe)
+int main(int argc, char *argv[])
 {
-	fd_set rfds;
-	int maxfd;
+	struct maxserver_config config;
+	int opt;
 	int err;
 
-	/* Set up file descriptor set. */
-	FD_ZERO(&rfds);
-	FD_SET(cfd, &rfds);
-	FD_SET(sigpipe, &rfds);
-	maxfd = MAX(cfd, sigpipe);
-
-	/* Wait for input from either 'cfd' or 'sigpipe'. */
-	for (;;) {
-		err = select(maxfd + 1, &rfds, NULL, NULL, NULL);
+	maxserver_config_init(&config);
 
-		if (err == -1) {
-			/* If error is caused by interrupting signal,
-			   try again. Otherwise, print error message
-			   and break. */
-			if (errno == EINTR) {
-				continue;
-			} else {
-				perror("select");
-				break;
-			}
-		} else if (FD_ISSET(sigpipe, &rfds)) {
-			/* 'sigpipe' has signalled the thread to
-			   quit. */
+	while ((opt = getopt(argc, argv, "qd:")) != -1) {
+		switch (opt) {
+		case 'q':
+			quiet = 1;
 			break;
-		} else if (FD_ISSET(cfd, &rfds)) {
-			/* Input is available from 'cfd', perform
-			   echo server. */
-			echo_server_perform(cfd);
+		case 'd':
+			if (strcmp(optarg, "pool") == 0) {
+				config.dispatch = MAXSERVER_DISPATCH_POOL;
+			} else if (strcmp(optarg, "fiber") == 0) {
+				config.dispatch = MAXSERVER_DISPATCH_FIBER;
+			} else if (strcmp(optarg, "thread") != 0) {
+				usage(argv[0]);
+			}
+
 			break;
+		default:
+			usage(argv[0]);
 		}
 	}
-}
 
-int main(int argc, char *argv[])
-{
-	int err;
-
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s port\n", argv[0]);
-		exit(EXIT_FAILURE);
+	if (optind != argc - 1) {
+		usage(argv[0]);
 	}
 
 	/* Start server with 'echo_server' as the client thread. */
-	err = maxserver(argv[1], echo_server);
+	err = maxserver_with_config(argv[optind], echo_server, &config);
 
 	if (err == -1) {
 		exit(EXIT_FAILURE);
@@ -18,208 +18,361 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include "accept_thread.h"
 
-#include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
 #include "print_error.h"
-#include "client_thread.h"
+#include "log.h"
+#include "conn.h"
+#include "metrics.h"
 
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define ACCEPT_THREAD_BACKOFF_MS 100
 
 /**
- * Data structure representing the accept thread argument.
+ * Data structure representing an accept thread. 'conns' holds the
+ * client connections accepted in one wakeup, which are allocated from
+ * 'slab' and counted in 'metrics'. 'backoff' is set while accepting
+ * fails for lack of file descriptors or memory. 'accepts', 'wakeups'
+ * and 'batch_max' are written by the accept thread and may be read by
+ * any thread.
  */
-struct accept_thread_arg {
+struct accept_thread {
+	pthread_t tid;
 	int sfd;
 	int sigpipe;
-	void (*client_thread)(int cfd, int sigpipe);
+	int flags;
+	size_t batch;
+	struct maxserver_conn **conns;
+	struct slab *slab;
+	struct metrics *metrics;
+	size_t (*dispatch)(
+		struct maxserver_conn **conns,
+		size_t len,
+		void *arg
+	);
+	void *dispatch_arg;
+	int backoff;
+	unsigned long long accepts;
+	unsigned long long wakeups;
+	size_t batch_max;
 };
 
 /**
- * Global variable holding the thread ID of accept thread.
- */
-static pthread_t accept_thread_id;
-
-/**
- * Calls 'client_thread' on every incoming client connection until
- * accept thread is signalled to quit.
+ * Accepts client connections from the non-blocking server socket of
+ * 'at' until the backlog is drained or 'at->batch' client
+ * connections have been accepted, and stores them in 'at->conns'.
+ * Sets 'at->backoff' if accepting fails for lack of file descriptors
+ * or memory, and clears it once accepting succeeds or the backlog is
+ * drained.
+ * Returns the number of client connections accepted.
  */
-static void accept_thread(
-	int sfd,
-	int sigpipe,
-	void (*client_thread)(int cfd, int sigpipe)
-)
+static size_t accept_thread_drain(struct accept_thread *at)
 {
-	fd_set rfds, rfds_copy;
-	int maxfd;
 	struct sockaddr_storage addr;
 	socklen_t addrlen;
+#if MAXSERVER_LOG_LEVEL >= LOG_LEVEL_INFO
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+	int err;
+#endif
+	struct maxserver_conn *conn;
+	size_t len = 0;
 	int cfd;
+
+	while (len < at->batch) {
+		/* Accept client connection. */
+		addrlen = sizeof(struct sockaddr_storage);
+		cfd = accept4(
+			at->sfd,
+			(struct sockaddr *)&addr,
+			&addrlen,
+			at->flags | SOCK_CLOEXEC
+		);
+
+		if (cfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				at->backoff = 0;
+				break;
+			}
+
+			metrics_add(at->metrics, METRICS_ACCEPT_ERRORS, 1);
+
+			/* These errors leave the backlog readable, so
+			   only the first of a row is reported. */
+			if (!at->backoff) {
+				print_error_errno("accept_thread:accept4");
+			}
+
+			at->backoff =
+				errno == EMFILE ||
+				errno == ENFILE ||
+				errno == ENOBUFS ||
+				errno == ENOMEM;
+			break;
+		}
+
+		at->backoff = 0;
+		metrics_add(at->metrics, METRICS_ACCEPTS, 1);
+
+		/* Keep the raw client address with the client
+		   connection. */
+		conn = conn_create(
+			at->slab,
+			cfd,
+			(struct sockaddr *)&addr,
+			addrlen
+		);
+
+		if (conn == NULL) {
+			close(cfd);
+			continue;
+		}
+
+#if MAXSERVER_LOG_LEVEL >= LOG_LEVEL_INFO
+		/* Log numeric address of client, which never involves a
+		   name lookup. */
+		err = maxserver_conn_peer_numeric(
+			conn,
+			hbuf,
+			NI_MAXHOST,
+			sbuf,
+			NI_MAXSERV
+		);
+
+		if (err == 0) {
+			log_info("accepted connection from %s:%s", hbuf, sbuf);
+		}
+#endif
+
+		at->conns[len++] = conn;
+	}
+
+	return len;
+}
+
+/**
+ * Drains the backlog of the server socket of 'at' every time it
+ * becomes readable, and dispatches the accepted client connections
+ * in one batch, until accept thread is signalled to quit. While
+ * 'at->backoff' is set, the server socket is not polled, and the
+ * backlog is drained again every ACCEPT_THREAD_BACKOFF_MS
+ * milliseconds instead.
+ */
+static void accept_thread(struct accept_thread *at)
+{
+	struct pollfd fds[2];
+	size_t len, taken;
 	int err;
 
-	/* Initialise 'rfds' and add 'sfd' and signal pipe. */
-	FD_ZERO(&rfds);
-	FD_ZERO(&rfds_copy);
-	FD_SET(sfd, &rfds);
-	FD_SET(sigpipe, &rfds);
-	maxfd = MAX(sfd, sigpipe);
+	fds[0].fd = at->sfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = at->sigpipe;
+	fds[1].events = POLLIN;
 
 	for (;;) {
-		rfds_copy = rfds;
-		err = select(maxfd + 1, &rfds_copy, NULL, NULL, NULL);
+		/* Negative file descriptors are ignored by 'poll'. */
+		fds[0].fd = at->backoff ? -1 : at->sfd;
+		err = poll(fds, 2, at->backoff ? ACCEPT_THREAD_BACKOFF_MS : -1);
 
 		if (err == -1) {
 			if (errno == EINTR) {
 				continue;
 			}
 
-			print_error_errno("accept_thread:select");
+			print_error_errno("accept_thread:poll");
 			return;
 		}
 
-		if (FD_ISSET(sigpipe, &rfds_copy)) {
+		if (fds[1].revents != 0) {
 			break;
 		}
 
-		/* Accept client connection. */
-		addrlen = sizeof(struct sockaddr_storage);
-		cfd = accept(sfd, (struct sockaddr *)&addr, &addrlen);
+		len = accept_thread_drain(at);
 
-		if (cfd == -1) {
-			print_error_errno("accept_thread:accept");
+		/* Retries that accept nothing are not wakeups. */
+		if (len == 0 && at->backoff) {
 			continue;
 		}
 
-		/* Get name information of client. */
-		err = getnameinfo(
-			(struct sockaddr *)&addr,
-			addrlen,
-			hbuf,
-			NI_MAXHOST,
-			sbuf,
-			NI_MAXSERV,
-			0
+		__atomic_store_n(
+			&at->wakeups,
+			at->wakeups + 1,
+			__ATOMIC_RELAXED
+		);
+		__atomic_store_n(
+			&at->accepts,
+			at->accepts + len,
+			__ATOMIC_RELAXED
 		);
 
-		if (err != 0) {
-			print_error_gai("accept_thread:getnameinfo", err);
-			close(cfd);
-			continue;
+		if (len > at->batch_max) {
+			__atomic_store_n(&at->batch_max, len, __ATOMIC_RELAXED);
 		}
 
-		/* Print name information of client. */
-		fprintf(
-			stdout,
-			"accepted connection from %s:%s\n",
-			hbuf,
-			sbuf
-		);
+		if (len == 0) {
+			continue;
+		}
 
-		/* Start client thread. */
-		err = client_thread_start(cfd, client_thread, sigpipe);
+		/* Dispatch client connections, and close the ones that
+		   could not be dispatched. */
+		taken = at->dispatch(at->conns, len, at->dispatch_arg);
 
-		if (err == -1) {
-			close(cfd);
-			continue;
+		for (; taken < len; ++taken) {
+			close(at->conns[taken]->fd);
+			conn_destroy(at->conns[taken]);
 		}
 	}
 }
 
 /**
- * Calls accept thread and manages dynamically allocated data 'arg'.
+ * Calls accept thread with 'arg'.
  */
 static void *accept_thread_starter(void *arg)
 {
-	struct accept_thread_arg *at_arg;
-
-	at_arg = (struct accept_thread_arg *)arg;
-	accept_thread(at_arg->sfd, at_arg->sigpipe, at_arg->client_thread);
-	free(at_arg);
+	accept_thread((struct accept_thread *)arg);
 	pthread_exit(NULL);
 }
 
 /**
- * Starts accept thread using server socket file descriptor 'sfd',
- * and calls 'client_thread' on every incoming client connection.
- * On success, zero is returned. On error, -1 is returned, and an
- * appropriate error message is printed to standard error.
+ * Starts accept thread using non-blocking server socket file
+ * descriptor 'sfd'. Every time 'sfd' becomes readable, the accept
+ * thread accepts up to 'batch' client connections with 'accept4' and
+ * socket flags 'flags', allocates them from 'slab', which it owns
+ * from now on, counts them in 'metrics', which may be NULL, and calls
+ * 'dispatch' with 'dispatch_arg' on all of them at once. 'dispatch'
+ * returns how many client connections at the front of 'conns' it has
+ * taken ownership of, and the rest are closed. If 'cpu' is not -1,
+ * the accept thread is pinned to CPU 'cpu'.
+ * On success, a pointer to the new accept thread is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
  */
-int accept_thread_start(
+struct accept_thread *accept_thread_start(
 	int sfd,
 	int sigpipe,
-	void (*client_thread)(int cfd, int sigpipe)
+	int cpu,
+	size_t batch,
+	int flags,
+	struct slab *slab,
+	struct metrics *metrics,
+	size_t (*dispatch)(
+		struct maxserver_conn **conns,
+		size_t len,
+		void *arg
+	),
+	void *dispatch_arg
 )
 {
-	struct accept_thread_arg *at_arg;
+	struct accept_thread *at;
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
 	int err;
 
-	/* Initialise client threads data structures. */
-	err = client_threads_init();
+	/* Allocate accept thread data structure. */
+	at = calloc(1, sizeof(struct accept_thread));
 
-	if (err == -1) {
-		return -1;
+	if (at == NULL) {
+		print_error_errno("accept_thread_start:calloc");
+		return NULL;
 	}
 
-	/* Allocate accept thread argument data structure. */
-	at_arg = malloc(sizeof(struct accept_thread_arg));
+	at->batch = batch > 0 ? batch : 1;
+	at->conns = malloc(sizeof(struct maxserver_conn *) * at->batch);
 
-	if (at_arg == NULL) {
+	if (at->conns == NULL) {
 		print_error_errno("accept_thread_start:malloc");
-		client_threads_stop();
-		client_threads_clear();
-		return -1;
+		free(at);
+		return NULL;
 	}
 
-	at_arg->sfd = sfd;
-	at_arg->sigpipe = sigpipe;
-	at_arg->client_thread = client_thread;
+	at->sfd = sfd;
+	at->sigpipe = sigpipe;
+	at->flags = flags;
+	at->slab = slab;
+	at->metrics = metrics;
+	at->dispatch = dispatch;
+	at->dispatch_arg = dispatch_arg;
+
+	/* Pin accept thread to 'cpu'. */
+	pthread_attr_init(&attr);
+
+	if (cpu != -1) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		err = pthread_attr_setaffinity_np(
+			&attr,
+			sizeof(cpu_set_t),
+			&cpuset
+		);
+
+		if (err != 0) {
+			print_error(
+				"accept_thread_start:"
+				"pthread_attr_setaffinity_np",
+				err
+			);
+		}
+	}
 
 	/* Start accept thread. */
-	err = pthread_create(
-		&accept_thread_id,
-		NULL,
-		accept_thread_starter,
-		at_arg
-	);
+	err = pthread_create(&at->tid, &attr, accept_thread_starter, at);
+	pthread_attr_destroy(&attr);
 
 	if (err != 0) {
 		print_error("accept_thread_start:pthread_create", err);
-		free(at_arg);
-		client_threads_stop();
-		client_threads_clear();
-		return -1;
+		free(at->conns);
+		free(at);
+		return NULL;
 	}
 
-	return 0;
+	return at;
 }
 
 /**
- * Stops accept thread, and any thread spawned by accept thread.
+ * Waits for 'at' to quit after 'sigpipe' has been signalled, and
+ * frees 'at'.
  */
-void accept_thread_stop()
+void accept_thread_stop(struct accept_thread *at)
 {
 	int err;
 
 	/* Wait for accept thread to quit. */
-	err = pthread_join(accept_thread_id, NULL);
+	err = pthread_join(at->tid, NULL);
 
 	if (err != 0) {
 		print_error("accept_thread_stop:pthread_join", err);
 	}
 
-	/* Stop client threads. */
-	client_threads_stop();
+	free(at->conns);
+	free(at);
+}
 
-	/* Clear client threads data structures. */
-	client_threads_clear();
+/**
+ * Stores the number of client connections accepted by 'at', the
+ * number of times it woke up to a readable server socket, and the
+ * most client connections it accepted in one wakeup in 'stats'. May
+ * be called from any thread.
+ */
+void accept_thread_stats(
+	const struct accept_thread *at,
+	struct maxserver_accept_stats *stats
+)
+{
+	stats->accepts = __atomic_load_n(&at->accepts, __ATOMIC_RELAXED);
+	stats->wakeups = __atomic_load_n(&at->wakeups, __ATOMIC_RELAXED);
+	stats->batch_max = __atomic_load_n(&at->batch_max, __ATOMIC_RELAXED);
 }
@@ -21,21 +21,63 @@
 #ifndef ACCEPT_THREAD_H
 #define ACCEPT_THREAD_H
 
+#include <stddef.h>
+
+#include "maxserver.h"
+
+struct slab;
+struct metrics;
+
+/**
+ * Opaque data structure representing an accept thread.
+ */
+struct accept_thread;
+
 /**
- * Starts accept thread using server socket file descriptor 'sfd',
- * and calls 'client_thread' on every incoming client connection.
- * On success, zero is returned. On error, -1 is returned, and an
- * appropriate error message is printed to standard error.
+ * Starts accept thread using non-blocking server socket file
+ * descriptor 'sfd'. Every time 'sfd' becomes readable, the accept
+ * thread accepts up to 'batch' client connections with 'accept4' and
+ * socket flags 'flags', allocates them from 'slab', which it owns
+ * from now on, counts them in 'metrics', which may be NULL, and calls
+ * 'dispatch' with 'dispatch_arg' on all of them at once. 'dispatch'
+ * returns how many client connections at the front of 'conns' it has
+ * taken ownership of, and the rest are closed. If 'cpu' is not -1,
+ * the accept thread is pinned to CPU 'cpu'.
+ * On success, a pointer to the new accept thread is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
  */
-int accept_thread_start(
+struct accept_thread *accept_thread_start(
 	int sfd,
 	int sigpipe,
-	void (*client_thread)(int cfd, int sigpipe)
+	int cpu,
+	size_t batch,
+	int flags,
+	struct slab *slab,
+	struct metrics *metrics,
+	size_t (*dispatch)(
+		struct maxserver_conn **conns,
+		size_t len,
+		void *arg
+	),
+	void *dispatch_arg
 );
 
 /**
- * Stops accept thread, and any thread spawned by accept thread.
+ * Waits for 'at' to quit after 'sigpipe' has been signalled, and
+ * frees 'at'.
  */
-void accept_thread_stop();
+void accept_thread_stop(struct accept_thread *at);
+
+/**
+ * Stores the number of client connections accepted by 'at', the
+ * number of times it woke up to a readable server socket, and the
+ * most client connections it accepted in one wakeup in 'stats'. May
+ * be called from any thread.
+ */
+void accept_thread_stats(
+	const struct accept_thread *at,
+	struct maxserver_accept_stats *stats
+);
 
 #endif
@@ -0,0 +1,316 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "arena.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "print_error.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK_LEN 4096
+#define ARENA_CHUNK_MAX 1048576
+#define ARENA_POISON 0xa5
+
+/**
+ * Data structure at the start of every chunk of an arena, followed
+ * by 'len' bytes to allocate from.
+ */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t len;
+};
+
+/**
+ * Initialises 'arena' without taking any memory, with chunks of
+ * 'chunk_len' bytes that grow by a factor of 'growth', and poisoned
+ * freed memory if 'poison' is non-zero. A 'chunk_len' of zero means
+ * 4 KiB, and a 'growth' of zero means one.
+ */
+void arena_init(
+	struct maxserver_arena *arena,
+	size_t chunk_len,
+	unsigned int growth,
+	int poison
+)
+{
+	memset(arena, 0, sizeof(struct maxserver_arena));
+
+	if (chunk_len == 0) {
+		chunk_len = ARENA_CHUNK_LEN;
+	}
+
+	/* Every chunk has room for its header and one allocation. */
+	if (chunk_len < sizeof(struct arena_chunk) + ARENA_ALIGN) {
+		chunk_len = sizeof(struct arena_chunk) + ARENA_ALIGN;
+	}
+
+	arena->next_len = chunk_len < ARENA_CHUNK_MAX ?
+		chunk_len :
+		ARENA_CHUNK_MAX;
+	arena->growth = growth > 0 ? growth : 1;
+	arena->poison = poison;
+}
+
+/**
+ * Returns every chunk of 'arena' to the buffer pool, freeing all of
+ * its allocations. 'arena' may be used again afterwards.
+ */
+void arena_clear(struct maxserver_arena *arena)
+{
+	struct arena_chunk *chunk, *next;
+
+	for (chunk = arena->head; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		maxserver_buf_put(chunk);
+	}
+
+	arena->ptr = NULL;
+	arena->end = NULL;
+	arena->chunk = NULL;
+	arena->head = NULL;
+	arena->chunks = 0;
+	arena->bytes = 0;
+	arena->used = 0;
+}
+
+/**
+ * Takes a new chunk with room for at least 'len' bytes from the
+ * buffer pool for 'arena', and links it in after the current chunk,
+ * so that it is kept in front of the chunks that are left over from
+ * before the last reset.
+ * On success, a pointer to the new chunk is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+static struct arena_chunk *arena_chunk_add(
+	struct maxserver_arena *arena,
+	size_t len
+)
+{
+	struct arena_chunk *chunk;
+	size_t bytes = arena->next_len;
+
+	/* Allocations larger than a chunk get a chunk of their own. */
+	if (len > bytes - sizeof(struct arena_chunk)) {
+		bytes = sizeof(struct arena_chunk) + len;
+	}
+
+	chunk = maxserver_buf_get(bytes);
+
+	if (chunk == NULL) {
+		return NULL;
+	}
+
+	chunk->len = maxserver_buf_size(chunk) - sizeof(struct arena_chunk);
+
+	if (arena->poison) {
+		memset(chunk + 1, ARENA_POISON, chunk->len);
+	}
+
+	if (arena->chunk == NULL) {
+		chunk->next = NULL;
+		arena->head = chunk;
+	} else {
+		chunk->next = arena->chunk->next;
+		arena->chunk->next = chunk;
+	}
+
+	if (arena->next_len <= ARENA_CHUNK_MAX / arena->growth) {
+		arena->next_len *= arena->growth;
+	} else {
+		arena->next_len = ARENA_CHUNK_MAX;
+	}
+
+	++arena->chunks;
+	arena->bytes += chunk->len;
+
+	return chunk;
+}
+
+/**
+ * Allocates 'len' bytes, already rounded up to the alignment, from
+ * the chunk after the current chunk of 'arena', or from a new chunk
+ * if that is missing or too small.
+ * On success, a pointer to the allocated memory is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
+ */
+static void *arena_alloc_chunk(struct maxserver_arena *arena, size_t len)
+{
+	struct arena_chunk *chunk;
+
+	/* Rounding up wrapped around. */
+	if (len == 0 || len > SIZE_MAX - ARENA_CHUNK_MAX) {
+		print_error("maxserver_arena_alloc", ENOMEM);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	chunk = arena->chunk != NULL ? arena->chunk->next : NULL;
+
+	if (chunk == NULL || chunk->len < len) {
+		chunk = arena_chunk_add(arena, len);
+
+		if (chunk == NULL) {
+			return NULL;
+		}
+	}
+
+	arena->chunk = chunk;
+	arena->ptr = (char *)(chunk + 1) + len;
+	arena->end = (char *)(chunk + 1) + chunk->len;
+	++arena->allocs;
+	arena->used += len;
+
+	return chunk + 1;
+}
+
+/**
+ * Creates an arena of its own, which takes chunks of 'chunk_len'
+ * bytes from the buffer pool as it needs them, and makes every new
+ * chunk 'growth' times as large as the one before, up to 1 MiB. A
+ * 'chunk_len' of zero means 4 KiB, and a 'growth' of zero or one
+ * keeps every chunk the same size. If 'poison' is non-zero, memory is
+ * overwritten with a pattern when it is freed, so that use after a
+ * reset shows.
+ * On success, a pointer to the new arena is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct maxserver_arena *maxserver_arena_create(
+	size_t chunk_len,
+	unsigned int growth,
+	int poison
+)
+{
+	struct maxserver_arena *arena;
+
+	arena = malloc(sizeof(struct maxserver_arena));
+
+	if (arena == NULL) {
+		print_error_errno("maxserver_arena_create:malloc");
+		return NULL;
+	}
+
+	arena_init(arena, chunk_len, growth, poison);
+
+	return arena;
+}
+
+/**
+ * Frees 'arena', created with 'maxserver_arena_create', and all of
+ * its allocations.
+ */
+void maxserver_arena_destroy(struct maxserver_arena *arena)
+{
+	arena_clear(arena);
+	free(arena);
+}
+
+/**
+ * Allocates 'len' bytes from 'arena', aligned to 16 bytes. The
+ * memory stays valid until 'arena' is reset, and is never freed on
+ * its own. An arena may only be used by one thread at a time.
+ * On success, a pointer to the allocated memory is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
+ */
+void *maxserver_arena_alloc(struct maxserver_arena *arena, size_t len)
+{
+	char *ptr = arena->ptr;
+
+	/* Empty allocations get room of their own, as with 'malloc'. */
+	len = len > 0 ?
+		(len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) :
+		ARENA_ALIGN;
+
+	if (len == 0 || len > (size_t)(arena->end - ptr)) {
+		return arena_alloc_chunk(arena, len);
+	}
+
+	arena->ptr = ptr + len;
+	++arena->allocs;
+	arena->used += len;
+
+	return ptr;
+}
+
+/**
+ * Overwrites the memory that 'arena' has handed out since it was last
+ * reset with a pattern.
+ */
+static void arena_poison(struct maxserver_arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	for (chunk = arena->head; chunk != arena->chunk; chunk = chunk->next) {
+		memset(chunk + 1, ARENA_POISON, chunk->len);
+	}
+
+	memset(chunk + 1, ARENA_POISON, (size_t)(arena->ptr -
+		(char *)(chunk + 1)));
+}
+
+/**
+ * Frees every allocation of 'arena' at once, in constant time unless
+ * it poisons freed memory. Its chunks are kept for the allocations
+ * that follow.
+ */
+void maxserver_arena_reset(struct maxserver_arena *arena)
+{
+	++arena->resets;
+
+	if (arena->chunk == NULL) {
+		return;
+	}
+
+	if (arena->poison) {
+		arena_poison(arena);
+	}
+
+	if (arena->used > arena->peak) {
+		arena->peak = arena->used;
+	}
+
+	arena->chunk = arena->head;
+	arena->ptr = (char *)(arena->head + 1);
+	arena->end = arena->ptr + arena->head->len;
+	arena->used = 0;
+}
+
+/**
+ * Stores statistics of 'arena' in 'stats'.
+ */
+void maxserver_arena_stats(
+	const struct maxserver_arena *arena,
+	struct maxserver_arena_stats *stats
+)
+{
+	stats->allocs = arena->allocs;
+	stats->resets = arena->resets;
+	stats->chunks = arena->chunks;
+	stats->bytes = arena->bytes;
+	stats->used = arena->used;
+	stats->peak = arena->used > arena->peak ? arena->used : arena->peak;
+}
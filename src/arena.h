@@ -0,0 +1,79 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#include "maxserver.h"
+
+struct arena_chunk;
+
+/**
+ * Data structure representing a bump arena, whose allocations are all
+ * freed at once when it is reset.
+ *
+ * Memory is bumped off 'ptr' up to 'end' in chunk 'chunk', and the
+ * chunks from 'head' on are kept across resets, so that an arena that
+ * is reset after every request stops taking chunks from the buffer
+ * pool once it has grown to fit the largest request. The next new
+ * chunk is 'next_len' bytes, which is multiplied by 'growth' every
+ * time a chunk is added. If 'poison' is non-zero, freed memory is
+ * overwritten with a pattern. Client connections embed an arena, so
+ * that a client connection that never allocates from it costs
+ * nothing more.
+ */
+struct maxserver_arena {
+	char *ptr;
+	char *end;
+	struct arena_chunk *chunk;
+	struct arena_chunk *head;
+	size_t next_len;
+	unsigned int growth;
+	int poison;
+	unsigned long long allocs;
+	unsigned long long resets;
+	size_t chunks;
+	size_t bytes;
+	size_t used;
+	size_t peak;
+};
+
+/**
+ * Initialises 'arena' without taking any memory, with chunks of
+ * 'chunk_len' bytes that grow by a factor of 'growth', and poisoned
+ * freed memory if 'poison' is non-zero. A 'chunk_len' of zero means
+ * 4 KiB, and a 'growth' of zero means one.
+ */
+void arena_init(
+	struct maxserver_arena *arena,
+	size_t chunk_len,
+	unsigned int growth,
+	int poison
+);
+
+/**
+ * Returns every chunk of 'arena' to the buffer pool, freeing all of
+ * its allocations. 'arena' may be used again afterwards.
+ */
+void arena_clear(struct maxserver_arena *arena);
+
+#endif
@@ -0,0 +1,750 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include "buf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "print_error.h"
+#include "log.h"
+
+#define BUF_HEAD_LEN 64
+#define BUF_MIN_SHIFT 6
+#define BUF_MAX_SHIFT 20
+#define BUF_CLASSES (BUF_MAX_SHIFT - BUF_MIN_SHIFT + 1)
+#define BUF_CACHE_BYTES 262144
+#define BUF_CACHE_MIN 4
+#define BUF_CACHE_MAX 64
+#define BUF_FOLD_OPS 256
+#define BUF_POOL_LEN 268435456
+#define BUF_HUGEPAGE_LEN 2097152
+
+/**
+ * Where a buffer comes from: carved from the region of the buffer
+ * pool, allocated because the region was full, or mapped on its own
+ * because it is larger than every size class.
+ */
+enum buf_origin {
+	BUF_ORIGIN_REGION,
+	BUF_ORIGIN_MALLOC,
+	BUF_ORIGIN_MMAP
+};
+
+/**
+ * Data structure taking the cache line in front of every buffer.
+ * 'next' links the buffer into a free list while it is free.
+ */
+struct buf_head {
+	unsigned int refs;
+	unsigned char cls;
+	unsigned char origin;
+	size_t size;
+	struct buf_head *next;
+};
+
+/**
+ * Data structure representing the buffers of one size class that no
+ * thread caches.
+ */
+struct buf_depot {
+	pthread_mutex_t lock;
+	struct buf_head *free;
+	size_t len;
+} __attribute__((aligned(64)));
+
+/**
+ * Data structure representing the buffer cache of a thread, with
+ * 'lens[i]' buffers of size class 'i' in 'free[i]', and counts that
+ * have not been added to the totals of the buffer pool yet.
+ */
+struct buf_cache {
+	struct buf_head *free[BUF_CLASSES];
+	size_t lens[BUF_CLASSES];
+	int registered;
+	unsigned long long gets;
+	unsigned long long puts;
+	unsigned long long cache_hits;
+	unsigned long long depot_hits;
+	unsigned long long carved;
+	unsigned long long fallbacks;
+};
+
+/**
+ * Data structure representing the buffer pool. Buffers are carved
+ * from 'region', of which 'used' bytes are taken, and never go back
+ * to the system. 'lock' protects setting it up.
+ */
+struct buf_pool {
+	pthread_mutex_t lock;
+	int configured;
+	int ready;
+	size_t len;
+	enum maxserver_hugepages hugepages;
+	char *region;
+	size_t used;
+	struct buf_depot depots[BUF_CLASSES];
+	unsigned long long gets;
+	unsigned long long puts;
+	unsigned long long cache_hits;
+	unsigned long long depot_hits;
+	unsigned long long carved;
+	unsigned long long fallbacks;
+};
+
+/**
+ * Global variable holding the buffer pool, which lives as long as the
+ * process.
+ */
+static struct buf_pool buf_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.len = BUF_POOL_LEN,
+	.hugepages = MAXSERVER_HUGEPAGES_NONE
+};
+
+/**
+ * Global variable holding the key whose destructor returns the cached
+ * buffers of an exiting thread to the depots.
+ */
+static pthread_key_t buf_key;
+
+/**
+ * Global variable making sure that 'buf_key' is created once.
+ */
+static pthread_once_t buf_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Thread-local variable holding the buffer cache of the calling
+ * thread.
+ */
+static __thread struct buf_cache buf_cache_self;
+
+/**
+ * Returns the number of buffers of size class 'cls' that a thread
+ * caches at most, which is half as many when it trades with the
+ * depot.
+ */
+static size_t buf_cache_cap(int cls)
+{
+	size_t cap = BUF_CACHE_BYTES >> (cls + BUF_MIN_SHIFT);
+
+	if (cap < BUF_CACHE_MIN) {
+		return BUF_CACHE_MIN;
+	}
+
+	return cap > BUF_CACHE_MAX ? BUF_CACHE_MAX : cap;
+}
+
+/**
+ * Makes the buffer pool reserve 'len' bytes of address space, backed
+ * by pages as described by 'hugepages', unless it has already been
+ * configured or set up. A 'len' of zero keeps the default.
+ */
+void buf_pool_configure(size_t len, enum maxserver_hugepages hugepages)
+{
+	pthread_mutex_lock(&buf_pool.lock);
+
+	if (!buf_pool.configured && !buf_pool.ready) {
+		if (len > 0) {
+			buf_pool.len = len;
+		}
+
+		buf_pool.hugepages = hugepages;
+		buf_pool.configured = 1;
+	}
+
+	pthread_mutex_unlock(&buf_pool.lock);
+}
+
+/**
+ * Maps 'len' bytes aligned to a huge page, with MAP_HUGETLB if
+ * 'hugetlb' is non-zero.
+ * Returns a pointer to the mapping, or MAP_FAILED with errno set.
+ */
+static char *buf_region_map(size_t len, int hugetlb)
+{
+	char *map, *region;
+	size_t head;
+
+	/* Huge pages are aligned by the kernel, and reserved up front,
+	   so that the mapping fails rather than faults if there are too
+	   few. */
+	if (hugetlb) {
+		return mmap(
+			NULL,
+			len,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+			-1,
+			0
+		);
+	}
+
+	/* Map a huge page more, and trim it to alignment, so that
+	   transparent huge pages can back all of the region. */
+	map = mmap(
+		NULL,
+		len + BUF_HUGEPAGE_LEN,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		-1,
+		0
+	);
+
+	if (map == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+
+	region = (char *)(((size_t)map + BUF_HUGEPAGE_LEN - 1) &
+		~(size_t)(BUF_HUGEPAGE_LEN - 1));
+	head = (size_t)(region - map);
+
+	if (head > 0) {
+		munmap(map, head);
+	}
+
+	munmap(region + len, BUF_HUGEPAGE_LEN - head);
+
+	return region;
+}
+
+/**
+ * Sets up the buffer pool on first use.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int buf_pool_setup()
+{
+	size_t len;
+	char *region;
+	int i;
+
+	if (__atomic_load_n(&buf_pool.ready, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&buf_pool.lock);
+
+	if (buf_pool.ready) {
+		pthread_mutex_unlock(&buf_pool.lock);
+		return 0;
+	}
+
+	len = (buf_pool.len + BUF_HUGEPAGE_LEN - 1) &
+		~(size_t)(BUF_HUGEPAGE_LEN - 1);
+	region = MAP_FAILED;
+
+	if (buf_pool.hugepages == MAXSERVER_HUGEPAGES_EXPLICIT) {
+		region = buf_region_map(len, 1);
+
+		if (region == MAP_FAILED) {
+			log_warn(
+				"buffer pool: no huge pages, "
+				"falling back to normal pages"
+			);
+			buf_pool.hugepages = MAXSERVER_HUGEPAGES_NONE;
+		}
+	}
+
+	if (region == MAP_FAILED) {
+		region = buf_region_map(len, 0);
+	}
+
+	if (region == MAP_FAILED) {
+		print_error_errno("buf_pool_setup:mmap");
+		pthread_mutex_unlock(&buf_pool.lock);
+		return -1;
+	}
+
+	if (buf_pool.hugepages == MAXSERVER_HUGEPAGES_TRANSPARENT &&
+		madvise(region, len, MADV_HUGEPAGE) == -1) {
+		log_warn("buffer pool: no transparent huge pages");
+		buf_pool.hugepages = MAXSERVER_HUGEPAGES_NONE;
+	}
+
+	for (i = 0; i < BUF_CLASSES; ++i) {
+		pthread_mutex_init(&buf_pool.depots[i].lock, NULL);
+	}
+
+	buf_pool.region = region;
+	buf_pool.len = len;
+	__atomic_store_n(&buf_pool.ready, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&buf_pool.lock);
+
+	return 0;
+}
+
+/**
+ * Adds the counts of 'cache' to the totals of the buffer pool.
+ */
+static void buf_cache_fold(struct buf_cache *cache)
+{
+	__atomic_add_fetch(&buf_pool.gets, cache->gets, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&buf_pool.puts, cache->puts, __ATOMIC_RELAXED);
+	__atomic_add_fetch(
+		&buf_pool.cache_hits,
+		cache->cache_hits,
+		__ATOMIC_RELAXED
+	);
+	__atomic_add_fetch(
+		&buf_pool.depot_hits,
+		cache->depot_hits,
+		__ATOMIC_RELAXED
+	);
+	__atomic_add_fetch(&buf_pool.carved, cache->carved, __ATOMIC_RELAXED);
+	__atomic_add_fetch(
+		&buf_pool.fallbacks,
+		cache->fallbacks,
+		__ATOMIC_RELAXED
+	);
+
+	cache->gets = 0;
+	cache->puts = 0;
+	cache->cache_hits = 0;
+	cache->depot_hits = 0;
+	cache->carved = 0;
+	cache->fallbacks = 0;
+}
+
+/**
+ * Moves up to 'len' buffers of size class 'cls' from 'cache' to their
+ * depot.
+ */
+static void buf_cache_drain(struct buf_cache *cache, int cls, size_t len)
+{
+	struct buf_depot *depot = &buf_pool.depots[cls];
+	struct buf_head *first, *last;
+	size_t n = 1;
+
+	first = cache->free[cls];
+
+	if (first == NULL || len == 0) {
+		return;
+	}
+
+	/* Cut the first 'len' buffers off the free list, and link them
+	   in front of the depot at once. */
+	for (last = first; n < len && last->next != NULL; ++n) {
+		last = last->next;
+	}
+
+	cache->free[cls] = last->next;
+	cache->lens[cls] -= n;
+
+	pthread_mutex_lock(&depot->lock);
+	last->next = depot->free;
+	depot->free = first;
+	depot->len += n;
+	pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * Moves up to 'len' buffers of size class 'cls' from their depot to
+ * 'cache'.
+ * Returns the number of buffers moved.
+ */
+static size_t buf_cache_refill(struct buf_cache *cache, int cls, size_t len)
+{
+	struct buf_depot *depot = &buf_pool.depots[cls];
+	struct buf_head *first, *last;
+	size_t n = 1;
+
+	pthread_mutex_lock(&depot->lock);
+	first = depot->free;
+
+	if (first == NULL) {
+		pthread_mutex_unlock(&depot->lock);
+		return 0;
+	}
+
+	for (last = first; n < len && last->next != NULL; ++n) {
+		last = last->next;
+	}
+
+	depot->free = last->next;
+	depot->len -= n;
+	pthread_mutex_unlock(&depot->lock);
+
+	last->next = cache->free[cls];
+	cache->free[cls] = first;
+	cache->lens[cls] += n;
+
+	return n;
+}
+
+/**
+ * Returns every buffer cached by the exiting thread whose cache is
+ * 'arg' to the depots, and adds its counts to the totals.
+ */
+static void buf_cache_release(void *arg)
+{
+	struct buf_cache *cache = (struct buf_cache *)arg;
+	int i;
+
+	for (i = 0; i < BUF_CLASSES; ++i) {
+		buf_cache_drain(cache, i, cache->lens[i]);
+	}
+
+	buf_cache_fold(cache);
+	cache->registered = 0;
+}
+
+/**
+ * Creates the key that releases buffer caches of exiting threads.
+ */
+static void buf_key_create()
+{
+	pthread_key_create(&buf_key, buf_cache_release);
+}
+
+/**
+ * Returns the buffer cache of the calling thread, making sure that it
+ * is released when the thread exits.
+ */
+static struct buf_cache *buf_cache_get()
+{
+	struct buf_cache *cache = &buf_cache_self;
+
+	if (!cache->registered) {
+		pthread_once(&buf_key_once, buf_key_create);
+		pthread_setspecific(buf_key, cache);
+		cache->registered = 1;
+	}
+
+	return cache;
+}
+
+/**
+ * Returns the size class of buffers of 'len' bytes.
+ */
+static int buf_class(size_t len)
+{
+	int cls = 0;
+
+	while (((size_t)1 << (cls + BUF_MIN_SHIFT)) < len) {
+		++cls;
+	}
+
+	return cls;
+}
+
+/**
+ * Carves a new buffer of size class 'cls' from the region of the
+ * buffer pool.
+ * Returns NULL if the region is full.
+ */
+static struct buf_head *buf_carve(int cls)
+{
+	size_t len = BUF_HEAD_LEN + ((size_t)1 << (cls + BUF_MIN_SHIFT));
+	size_t off;
+
+	off = __atomic_fetch_add(&buf_pool.used, len, __ATOMIC_RELAXED);
+
+	if (off + len > buf_pool.len) {
+		__atomic_fetch_sub(&buf_pool.used, len, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	return (struct buf_head *)(buf_pool.region + off);
+}
+
+/**
+ * Allocates a buffer of 'size' bytes outside the region of the
+ * buffer pool, mapped on its own if it is larger than every size
+ * class.
+ * Returns NULL on error, after printing an appropriate error message
+ * to standard error.
+ */
+static struct buf_head *buf_fallback(size_t size, int cls)
+{
+	struct buf_head *head;
+	void *map;
+
+	if (cls < BUF_CLASSES) {
+		head = aligned_alloc(BUF_HEAD_LEN, BUF_HEAD_LEN + size);
+
+		if (head == NULL) {
+			print_error_errno("maxserver_buf_get:aligned_alloc");
+			return NULL;
+		}
+
+		head->origin = BUF_ORIGIN_MALLOC;
+		return head;
+	}
+
+	map = mmap(
+		NULL,
+		BUF_HEAD_LEN + size,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+
+	if (map == MAP_FAILED) {
+		print_error_errno("maxserver_buf_get:mmap");
+		return NULL;
+	}
+
+	head = (struct buf_head *)map;
+	head->origin = BUF_ORIGIN_MMAP;
+
+	return head;
+}
+
+/**
+ * Takes a buffer of size class 'cls' for 'cache': a cached buffer,
+ * or half a cache of buffers from the depot, or a new buffer carved
+ * from the region of the buffer pool.
+ * Returns NULL if the region is full.
+ */
+static struct buf_head *buf_cache_take(struct buf_cache *cache, int cls)
+{
+	struct buf_head *head;
+
+	if (cache->free[cls] != NULL) {
+		++cache->cache_hits;
+	} else if (buf_cache_refill(cache, cls, buf_cache_cap(cls) / 2) > 0) {
+		++cache->depot_hits;
+	} else {
+		head = buf_carve(cls);
+
+		if (head != NULL) {
+			++cache->carved;
+			head->origin = BUF_ORIGIN_REGION;
+			head->cls = (unsigned char)cls;
+		}
+
+		return head;
+	}
+
+	head = cache->free[cls];
+	cache->free[cls] = head->next;
+	--cache->lens[cls];
+
+	return head;
+}
+
+/**
+ * Takes a buffer of at least 'len' bytes from the buffer pool, with
+ * one reference. Buffers come in power-of-two sizes from 64 bytes to
+ * 1 MiB, and larger ones are mapped on their own. Every thread caches
+ * a few buffers of each size, so that buffers are mostly taken and
+ * returned without synchronisation, and buffers may be returned by
+ * any thread.
+ * On success, a pointer to the buffer is returned, aligned to a cache
+ * line. On error, NULL is returned, and an appropriate error message
+ * is printed to standard error.
+ */
+void *maxserver_buf_get(size_t len)
+{
+	struct buf_cache *cache;
+	struct buf_head *head = NULL;
+	size_t size;
+	int cls;
+
+	if (buf_pool_setup() == -1) {
+		return NULL;
+	}
+
+	cache = buf_cache_get();
+	cls = buf_class(len);
+	size = cls < BUF_CLASSES ? (size_t)1 << (cls + BUF_MIN_SHIFT) : len;
+
+	if (cls < BUF_CLASSES) {
+		head = buf_cache_take(cache, cls);
+	}
+
+	if (head == NULL) {
+		head = buf_fallback(size, cls);
+
+		if (head == NULL) {
+			return NULL;
+		}
+
+		++cache->fallbacks;
+		head->cls = (unsigned char)cls;
+	}
+
+	if (++cache->gets >= BUF_FOLD_OPS) {
+		buf_cache_fold(cache);
+	}
+
+	head->refs = 1;
+	head->size = size;
+	head->next = NULL;
+
+	return (char *)head + BUF_HEAD_LEN;
+}
+
+/**
+ * Adds a reference to buffer 'buf', so that it can be shared, for
+ * instance by queueing it to several client connections. Every
+ * reference is returned with 'maxserver_buf_put'.
+ * Returns 'buf'.
+ */
+void *maxserver_buf_ref(void *buf)
+{
+	struct buf_head *head = (struct buf_head *)((char *)buf -
+		BUF_HEAD_LEN);
+
+	__atomic_add_fetch(&head->refs, 1, __ATOMIC_RELAXED);
+
+	return buf;
+}
+
+/**
+ * Removes a reference to buffer 'buf', and returns it to the buffer
+ * pool once no reference is left. A buffer queued with
+ * 'maxserver_conn_queue' must not be returned before the output
+ * chain has been flushed. May be called from any thread.
+ */
+void maxserver_buf_put(void *buf)
+{
+	struct buf_head *head = (struct buf_head *)((char *)buf -
+		BUF_HEAD_LEN);
+	struct buf_cache *cache;
+	int cls;
+
+	if (__atomic_sub_fetch(&head->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	cache = buf_cache_get();
+
+	if (++cache->puts >= BUF_FOLD_OPS) {
+		buf_cache_fold(cache);
+	}
+
+	if (head->origin == BUF_ORIGIN_MALLOC) {
+		free(head);
+		return;
+	}
+
+	if (head->origin == BUF_ORIGIN_MMAP) {
+		munmap(head, BUF_HEAD_LEN + head->size);
+		return;
+	}
+
+	/* Cache the buffer, and hand half of the cache to the depot
+	   once it runs over. */
+	cls = head->cls;
+	head->next = cache->free[cls];
+	cache->free[cls] = head;
+
+	if (++cache->lens[cls] > buf_cache_cap(cls)) {
+		buf_cache_drain(cache, cls, buf_cache_cap(cls) / 2);
+	}
+}
+
+/**
+ * Returns the size of buffer 'buf', which may be more than was asked
+ * for.
+ */
+size_t maxserver_buf_size(const void *buf)
+{
+	const struct buf_head *head = (const struct buf_head *)(
+		(const char *)buf - BUF_HEAD_LEN
+	);
+
+	return head->size;
+}
+
+/**
+ * Returns the number of bytes of the first 'len' bytes of the region
+ * of the buffer pool that are backed by memory.
+ */
+static size_t buf_pool_resident(size_t len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned char *vec;
+	size_t pages, resident = 0, i;
+
+	pages = (len + (size_t)page - 1) / (size_t)page;
+
+	if (pages == 0) {
+		return 0;
+	}
+
+	vec = malloc(pages);
+
+	if (vec == NULL) {
+		return 0;
+	}
+
+	if (mincore(buf_pool.region, pages * (size_t)page, vec) == 0) {
+		for (i = 0; i < pages; ++i) {
+			resident += vec[i] & 1;
+		}
+	}
+
+	free(vec);
+
+	return resident * (size_t)page;
+}
+
+/**
+ * Stores statistics of the buffer pool in 'stats'.
+ */
+void maxserver_buf_stats(struct maxserver_buf_stats *stats)
+{
+	/* Count the calling thread's own operations right away. */
+	if (buf_cache_self.registered) {
+		buf_cache_fold(&buf_cache_self);
+	}
+
+	memset(stats, 0, sizeof(struct maxserver_buf_stats));
+	stats->gets = __atomic_load_n(&buf_pool.gets, __ATOMIC_RELAXED);
+	stats->puts = __atomic_load_n(&buf_pool.puts, __ATOMIC_RELAXED);
+	stats->cache_hits = __atomic_load_n(
+		&buf_pool.cache_hits,
+		__ATOMIC_RELAXED
+	);
+	stats->depot_hits = __atomic_load_n(
+		&buf_pool.depot_hits,
+		__ATOMIC_RELAXED
+	);
+	stats->carved = __atomic_load_n(&buf_pool.carved, __ATOMIC_RELAXED);
+	stats->fallbacks = __atomic_load_n(
+		&buf_pool.fallbacks,
+		__ATOMIC_RELAXED
+	);
+
+	pthread_mutex_lock(&buf_pool.lock);
+	stats->region_len = buf_pool.len;
+	stats->hugepages = buf_pool.hugepages;
+
+	if (buf_pool.ready) {
+		stats->region_used = __atomic_load_n(
+			&buf_pool.used,
+			__ATOMIC_RELAXED
+		);
+		stats->resident = buf_pool_resident(stats->region_used);
+	}
+
+	pthread_mutex_unlock(&buf_pool.lock);
+}
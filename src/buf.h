@@ -0,0 +1,36 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BUF_H
+#define BUF_H
+
+#include <stddef.h>
+
+#include "maxserver.h"
+
+/**
+ * Makes the buffer pool reserve 'len' bytes of address space, backed
+ * by pages as described by 'hugepages', unless it has already been
+ * configured or set up. A 'len' of zero keeps the default.
+ */
+void buf_pool_configure(size_t len, enum maxserver_hugepages hugepages);
+
+#endif
@@ -18,155 +18,353 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include "client_thread.h"
 
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sched.h>
 #include <pthread.h>
 
 #include "print_error.h"
+#include "conn.h"
+#include "metrics.h"
 
-#define CLIENT_THREADS_ALLOC_INIT 64
+#define CLIENT_SLOTS_CHUNK_LEN 1024
+#define CLIENT_SLOTS_CHUNKS_MAX 4096
+#define CLIENT_SLOT_NONE ((size_t)-1)
 
 /**
- * Data structure representing a client thread.
+ * States of a slot in the client threads registry. A slot is
+ * STARTING from when it is reserved until its thread ID is known,
+ * RUNNING until its client thread returns, and FINISHED until the
+ * client thread joiner has joined it.
  */
-struct client_thread {
-	pthread_t tid;
-	int finished;
+enum client_slot_state {
+	CLIENT_SLOT_FREE,
+	CLIENT_SLOT_STARTING,
+	CLIENT_SLOT_RUNNING,
+	CLIENT_SLOT_FINISHED
 };
 
 /**
- * Data structure representing the client thread argument.
+ * Data structure representing a slot in the client threads registry,
+ * which also serves as the client thread argument. 'exited' is set if
+ * the client thread returns while the slot is still STARTING. 'next'
+ * links the slot into the free list or the finished list of its
+ * shard.
  */
-struct client_thread_arg {
+struct client_slot {
 	pthread_t tid;
-	int cfd;
+	enum client_slot_state state;
+	int exited;
+	size_t next;
+	struct client_threads *threads;
+	size_t shard;
+	size_t index;
+	struct maxserver_conn *conn;
 	void (*client_thread)(int cfd, int sigpipe);
 	int sigpipe;
+	int cpu;
 };
 
 /**
- * Forward declaration of function to remove 'tid' from client
- * threads array.
+ * Data structure representing a shard of the client threads registry.
+ * Slots are allocated in chunks that are never moved, so a slot can
+ * be found from its index in constant time and client threads can
+ * refer to their slot without holding 'lock'.
  */
-static void client_threads_remove(pthread_t tid);
+struct client_shard {
+	pthread_mutex_t lock;
+	struct client_slot **chunks;
+	size_t len;
+	size_t live;
+	size_t free_head;
+	size_t finished_head;
+	size_t finished_tail;
+} __attribute__((aligned(64)));
 
 /**
- * Global variable holding client threads pipe.
+ * Data structure representing a client threads registry. 'pipe'
+ * signals the client thread joiner, and 'cpus' holds the CPUs that
+ * client threads are pinned to in turn, of which 'cpus_next' have
+ * been handed out. Client threads are counted in 'metrics' when they
+ * are started and joined.
  */
-static int client_threads_pipe[2];
+struct client_threads {
+	struct client_shard *shards;
+	size_t shards_len;
+	int pipe[2];
+	pthread_t joiner_id;
+	pthread_attr_t attr;
+	enum maxserver_affinity affinity;
+	int *cpus;
+	size_t cpus_len;
+	size_t cpus_next;
+	struct metrics *metrics;
+};
 
 /**
- * Global variable holding client threads mutex lock.
+ * Thread-local variable caching the CPU that the calling thread is
+ * pinned to, -1 if it is not pinned to a single CPU, or -2 if not yet
+ * known.
  */
-static pthread_mutex_t client_threads_lock;
+static __thread int client_thread_caller_cpu = -2;
 
 /**
- * Global variable holding client threads array.
+ * Returns slot 'index' of 'shard'.
  */
-static struct client_thread *client_threads;
+static struct client_slot *client_slot(
+	struct client_shard *shard,
+	size_t index
+)
+{
+	return &shard->chunks[index / CLIENT_SLOTS_CHUNK_LEN][
+		index % CLIENT_SLOTS_CHUNK_LEN
+	];
+}
 
 /**
- * Global variable holding client threads array length.
+ * Appends 'slot' to the finished list of 'shard'. Must be called with
+ * the shard mutex lock held.
+ * Returns non-zero if the finished list was empty, in which case the
+ * client thread joiner must be signalled.
  */
-static size_t client_threads_len = 0;
+static int client_shard_push_finished(
+	struct client_shard *shard,
+	struct client_slot *slot
+)
+{
+	int was_empty;
 
-/**
- * Global variable holding client threads array allocated length.
- */
-static size_t client_threads_alloc = CLIENT_THREADS_ALLOC_INIT;
+	slot->state = CLIENT_SLOT_FINISHED;
+	slot->next = CLIENT_SLOT_NONE;
+	was_empty = shard->finished_head == CLIENT_SLOT_NONE;
+
+	if (was_empty) {
+		shard->finished_head = slot->index;
+	} else {
+		client_slot(shard, shard->finished_tail)->next = slot->index;
+	}
+
+	shard->finished_tail = slot->index;
+
+	return was_empty;
+}
 
 /**
- * Global variable holding the thread ID of client thread joiner.
+ * Signals the client thread joiner of 'threads' to join finished
+ * client threads.
  */
-static pthread_t client_thread_joiner_id;
+static void client_thread_joiner_signal(struct client_threads *threads)
+{
+	char sig = 0;
+
+	write(threads->pipe[1], &sig, 1);
+}
 
 /**
- * Finds and removes finished client thread from client threads array.
+ * Reserves a slot in shard 'shard' of 'threads' for a new client
+ * thread.
+ * On success, a pointer to the slot is returned. On error, NULL is
+ * returned, and an appropriate error message is printed to standard
+ * error.
  */
-static void client_thread_joiner_perform()
+static struct client_slot *client_threads_add(
+	struct client_threads *threads,
+	size_t shard_index
+)
 {
-	pthread_t tid;
-	int err;
-	size_t i;
-
-	/* Obtain client threads mutex lock. */
-	err = pthread_mutex_lock(&client_threads_lock);
+	struct client_shard *shard = &threads->shards[shard_index];
+	struct client_slot *slot;
+	size_t index;
+	size_t chunk;
+
+	pthread_mutex_lock(&shard->lock);
+
+	if (shard->free_head != CLIENT_SLOT_NONE) {
+		/* Reuse a free slot. */
+		index = shard->free_head;
+		slot = client_slot(shard, index);
+		shard->free_head = slot->next;
+	} else {
+		/* Take a new slot, allocating a new chunk of slots if
+		   needed. */
+		index = shard->len;
+		chunk = index / CLIENT_SLOTS_CHUNK_LEN;
+
+		if (chunk == CLIENT_SLOTS_CHUNKS_MAX) {
+			pthread_mutex_unlock(&shard->lock);
+			print_error_str(
+				"client_threads_add",
+				"Too many client threads."
+			);
+			return NULL;
+		}
 
-	if (err != 0) {
-		print_error(
-			"client_thread_joiner_perform:pthread_mutex_lock",
-			err
-		);
-		return;
-	}
+		if (index % CLIENT_SLOTS_CHUNK_LEN == 0) {
+			shard->chunks[chunk] = calloc(
+				CLIENT_SLOTS_CHUNK_LEN,
+				sizeof(struct client_slot)
+			);
 
-	/* Find finished client thread in client threads array. */
-	for (i = 0; i < client_threads_len; ++i) {
-		if (client_threads[i].finished == 1) {
-			break;
+			if (shard->chunks[chunk] == NULL) {
+				pthread_mutex_unlock(&shard->lock);
+				print_error_errno("client_threads_add:calloc");
+				return NULL;
+			}
 		}
+
+		++shard->len;
+		slot = client_slot(shard, index);
+		slot->threads = threads;
+		slot->shard = shard_index;
+		slot->index = index;
 	}
 
-	if (i == client_threads_len) {
-		/**
-		 * No client thread is finished in client threads array.
-		 */
+	slot->state = CLIENT_SLOT_STARTING;
+	slot->exited = 0;
+	++shard->live;
 
-		/* Release client threads mutex lock. */
-		err = pthread_mutex_unlock(&client_threads_lock);
+	pthread_mutex_unlock(&shard->lock);
 
-		if (err != 0) {
-			print_error(
-				"client_thread_joiner_perform:"
-				"pthread_mutex_unlock",
-				err
-			);
-		}
+	return slot;
+}
+
+/**
+ * Returns 'slot' to the free list of its shard. Must be called with
+ * the shard mutex lock held.
+ */
+static void client_threads_remove_locked(struct client_slot *slot)
+{
+	struct client_shard *shard = &slot->threads->shards[slot->shard];
 
-		return;
+	slot->state = CLIENT_SLOT_FREE;
+	slot->conn = NULL;
+	slot->next = shard->free_head;
+	shard->free_head = slot->index;
+	--shard->live;
+}
+
+/**
+ * Publishes the thread ID of the client thread in 'slot' once it has
+ * been started.
+ */
+static void client_threads_started(struct client_slot *slot)
+{
+	struct client_shard *shard = &slot->threads->shards[slot->shard];
+	int signal = 0;
+
+	pthread_mutex_lock(&shard->lock);
+
+	if (slot->exited) {
+		/* Client thread has already returned. */
+		signal = client_shard_push_finished(shard, slot);
+	} else {
+		slot->state = CLIENT_SLOT_RUNNING;
 	}
 
-	/* Save ID of finished client thread. */
-	tid = client_threads[i].tid;
+	pthread_mutex_unlock(&shard->lock);
 
-	/* Release client threads mutex lock. */
-	err = pthread_mutex_unlock(&client_threads_lock);
+	if (signal) {
+		client_thread_joiner_signal(slot->threads);
+	}
+}
 
-	if (err != 0) {
-		print_error(
-			"client_thread_joiner_perform:pthread_mutex_unlock",
-			err
-		);
+/**
+ * Marks the client thread in 'slot' as finished.
+ */
+static void client_threads_finish(struct client_slot *slot)
+{
+	struct client_threads *threads = slot->threads;
+	struct client_shard *shard = &threads->shards[slot->shard];
+	int signal = 0;
+
+	pthread_mutex_lock(&shard->lock);
+
+	if (slot->state == CLIENT_SLOT_RUNNING) {
+		signal = client_shard_push_finished(shard, slot);
+	} else {
+		/* The thread ID is not known yet, so leave it to
+		   'client_threads_started' to finish the slot. */
+		slot->exited = 1;
 	}
 
-	/* Join finished client thread. */
-	err = pthread_join(tid, NULL);
+	pthread_mutex_unlock(&shard->lock);
 
-	if (err != 0) {
-		print_error(
-			"client_thread_joiner_perform:pthread_join",
-			err
-		);
+	/* Signal client thread joiner only when the finished list
+	   becomes non-empty, since it empties the whole list. */
+	if (signal) {
+		client_thread_joiner_signal(threads);
 	}
+}
+
+/**
+ * Joins every finished client thread of 'threads' and frees its slot.
+ */
+static void client_thread_joiner_perform(struct client_threads *threads)
+{
+	struct client_shard *shard;
+	struct client_slot *slot;
+	size_t index, next;
+	int err;
+	size_t i;
+
+	for (i = 0; i < threads->shards_len; ++i) {
+		shard = &threads->shards[i];
 
-	/* Remove finished client thread from client threads array. */
-	client_threads_remove(tid);
+		/* Take the whole finished list of the shard. */
+		pthread_mutex_lock(&shard->lock);
+		index = shard->finished_head;
+		shard->finished_head = CLIENT_SLOT_NONE;
+		shard->finished_tail = CLIENT_SLOT_NONE;
+		pthread_mutex_unlock(&shard->lock);
+
+		/* Join finished client threads. Nobody else touches
+		   finished slots. */
+		while (index != CLIENT_SLOT_NONE) {
+			slot = client_slot(shard, index);
+			next = slot->next;
+
+			err = pthread_join(slot->tid, NULL);
+
+			if (err != 0) {
+				print_error(
+					"client_thread_joiner_perform:"
+					"pthread_join",
+					err
+				);
+			} else {
+				metrics_add(
+					threads->metrics,
+					METRICS_THREAD_JOINS,
+					1
+				);
+			}
+
+			pthread_mutex_lock(&shard->lock);
+			client_threads_remove_locked(slot);
+			pthread_mutex_unlock(&shard->lock);
+
+			index = next;
+		}
+	}
 }
 
 /**
- * Joins client threads that signal that they are finished.
+ * Joins client threads of 'arg' that signal that they are finished.
  */
-static void *client_thread_joiner(void *arg __attribute__((unused)))
+static void *client_thread_joiner(void *arg)
 {
+	struct client_threads *threads = (struct client_threads *)arg;
 	char c;
 	ssize_t n_read;
 
 	for (;;) {
 		/* Read byte from client threads pipe. */
-		n_read = read(client_threads_pipe[0], &c, 1);
+		n_read = read(threads->pipe[0], &c, 1);
 
 		if (n_read == -1) {
 			/* If error is caused by interrupting signal,
@@ -184,7 +382,7 @@ static void *client_thread_joiner(void *arg __attribute__((unused)))
 		}
 
 		if (c == 0) {
-			client_thread_joiner_perform();
+			client_thread_joiner_perform(threads);
 		} else if (c == 1) {
 			/* If client thread joiner was signalled to
 			   quit, break. */
@@ -196,508 +394,477 @@ static void *client_thread_joiner(void *arg __attribute__((unused)))
 }
 
 /**
- * Initialises client threads data structures.
+ * Initialises the attributes that client threads of 'threads' are
+ * started with from 'attr'.
  * On success, zero is returned. On error, -1 is returned, and an
  * appropriate error message is printed to standard error.
  */
-int client_threads_init()
+static int client_threads_attr_init(
+	struct client_threads *threads,
+	const struct client_thread_attr *attr
+)
 {
+	struct sched_param param;
+	cpu_set_t cpuset;
+	int cpu;
 	int err;
 
-	/* Initialise client threads pipe. */
-	err = pipe(client_threads_pipe);
-
-	if (err == -1) {
-		print_error_errno("client_threads_init:pipe");
-		return -1;
-	}
-
-	/* Initialise client threads mutex lock. */
-	err = pthread_mutex_init(&client_threads_lock, NULL);
+	err = pthread_attr_init(&threads->attr);
 
 	if (err != 0) {
-		print_error("client_threads_init:pthread_mutex_init", err);
-
-		/* Clear client threads pipe. */
-		err = close(client_threads_pipe[0]);
-
-		if (err == -1) {
-			print_error_errno("client_threads_init:close");
-		}
-
-		err = close(client_threads_pipe[1]);
-
-		if (err == -1) {
-			print_error_errno("client_threads_init:close");
-		}
-
+		print_error("client_threads_attr_init:pthread_attr_init", err);
 		return -1;
 	}
 
-	/* Initialise client threads array. */
-	client_threads = malloc(
-		sizeof(struct client_thread) * client_threads_alloc
-	);
-
-	if (client_threads == NULL) {
-		print_error_errno("client_threads_init:malloc");
-
-		/* Clear client threads mutex lock. */
-		err = pthread_mutex_destroy(&client_threads_lock);
+	/* Set stack size and guard size. */
+	if (attr->stack_size != 0) {
+		err = pthread_attr_setstacksize(
+			&threads->attr,
+			attr->stack_size
+		);
 
 		if (err != 0) {
 			print_error(
-				"client_threads_init:"
-				"pthread_mutex_destroy",
+				"client_threads_attr_init:"
+				"pthread_attr_setstacksize",
 				err
 			);
+			goto error;
 		}
+	}
 
-		/* Clear client threads pipe. */
-		err = close(client_threads_pipe[0]);
-
-		if (err == -1) {
-			print_error_errno("client_threads_init:close");
-		}
-
-		err = close(client_threads_pipe[1]);
+	if (attr->guard_size != 0) {
+		err = pthread_attr_setguardsize(
+			&threads->attr,
+			attr->guard_size
+		);
 
-		if (err == -1) {
-			print_error_errno("client_threads_init:close");
+		if (err != 0) {
+			print_error(
+				"client_threads_attr_init:"
+				"pthread_attr_setguardsize",
+				err
+			);
+			goto error;
 		}
-
-		return -1;
 	}
 
-	/* Start client thread joiner. */
-	err = pthread_create(
-		&client_thread_joiner_id,
-		NULL,
-		client_thread_joiner,
-		NULL
-	);
+	/* Set scheduling policy, unless client threads should inherit
+	   it. */
+	if (attr->sched_policy != SCHED_OTHER || attr->sched_priority != 0) {
+		param.sched_priority = attr->sched_priority;
 
-	if (err != 0) {
-		print_error("client_threads_init:pthread_create", err);
+		err = pthread_attr_setinheritsched(
+			&threads->attr,
+			PTHREAD_EXPLICIT_SCHED
+		);
 
-		/* Clear client threads array. */
-		free(client_threads);
+		if (err == 0) {
+			err = pthread_attr_setschedpolicy(
+				&threads->attr,
+				attr->sched_policy
+			);
+		}
 
-		/* Clear client threads mutex lock. */
-		err = pthread_mutex_destroy(&client_threads_lock);
+		if (err == 0) {
+			err = pthread_attr_setschedparam(
+				&threads->attr,
+				&param
+			);
+		}
 
 		if (err != 0) {
 			print_error(
-				"client_threads_init:"
-				"pthread_mutex_destroy",
+				"client_threads_attr_init:"
+				"pthread_attr_setschedparam",
 				err
 			);
+			goto error;
 		}
+	}
 
-		/* Clear client threads pipe. */
-		err = close(client_threads_pipe[0]);
+	/* Collect the CPUs to pin client threads to in turn. */
+	threads->affinity = attr->affinity;
+	threads->cpus = NULL;
+	threads->cpus_len = 0;
+	threads->cpus_next = 0;
 
-		if (err == -1) {
-			print_error_errno("client_threads_init:close");
+	if (attr->affinity == MAXSERVER_AFFINITY_ROUND_ROBIN) {
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuset) == -1) {
+			print_error_errno(
+				"client_threads_attr_init:sched_getaffinity"
+			);
+			goto error;
 		}
 
-		err = close(client_threads_pipe[1]);
+		threads->cpus = malloc(
+			sizeof(int) * (size_t)CPU_COUNT(&cpuset)
+		);
 
-		if (err == -1) {
-			print_error_errno("client_threads_init:close");
+		if (threads->cpus == NULL) {
+			print_error_errno("client_threads_attr_init:malloc");
+			goto error;
 		}
 
-		return -1;
+		for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &cpuset)) {
+				threads->cpus[threads->cpus_len++] = cpu;
+			}
+		}
 	}
 
 	return 0;
+
+error:
+	pthread_attr_destroy(&threads->attr);
+	return -1;
 }
 
 /**
- * Clears client threads data structures.
+ * Returns the CPU that a client thread of 'threads' started by the
+ * calling thread should be pinned to, or -1 if it should not be
+ * pinned.
  */
-void client_threads_clear()
+static int client_thread_cpu(struct client_threads *threads)
 {
-	int err;
-
-	/* Clear client threads array. */
-	free(client_threads);
-
-	/* Clear client threads mutex lock. */
-	err = pthread_mutex_destroy(&client_threads_lock);
-
-	if (err != 0) {
-		print_error(
-			"client_threads_clear:pthread_mutex_destroy",
-			err
+	cpu_set_t cpuset;
+	size_t next;
+	int cpu;
+
+	switch (threads->affinity) {
+	case MAXSERVER_AFFINITY_ROUND_ROBIN:
+		next = __atomic_fetch_add(
+			&threads->cpus_next,
+			1,
+			__ATOMIC_RELAXED
 		);
-	}
-
-	/* Clear client threads pipe. */
-	err = close(client_threads_pipe[0]);
 
-	if (err == -1) {
-		print_error_errno("client_threads_clear:close");
-	}
-
-	err = close(client_threads_pipe[1]);
+		return threads->cpus[next % threads->cpus_len];
+	case MAXSERVER_AFFINITY_ACCEPT_SHARD:
+		/* Accept threads are pinned to a single CPU when there
+		   is more than one accept shard. */
+		if (client_thread_caller_cpu == -2) {
+			client_thread_caller_cpu = -1;
+
+			if (pthread_getaffinity_np(
+				pthread_self(),
+				sizeof(cpu_set_t),
+				&cpuset
+			) == 0 && CPU_COUNT(&cpuset) == 1) {
+				for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+					if (CPU_ISSET(cpu, &cpuset)) {
+						client_thread_caller_cpu = cpu;
+						break;
+					}
+				}
+			}
+		}
 
-	if (err == -1) {
-		print_error_errno("client_threads_clear:close");
+		return client_thread_caller_cpu;
+	default:
+		return -1;
 	}
 }
 
 /**
- * Adds 'tid' to client threads array.
- * On success, zero is returned. On error, -1 is returned, and an
- * appropriate error message is printed to standard error.
+ * Frees 'threads' and the shards of its registry, and clears its
+ * attributes.
  */
-static int client_threads_add(pthread_t tid)
+static void client_threads_free(struct client_threads *threads)
 {
-	struct client_thread *tmp_array;
-	size_t tmp_alloc;
-	int err;
-
-	/* Obtain client threads mutex lock. */
-	err = pthread_mutex_lock(&client_threads_lock);
-
-	if (err != 0) {
-		print_error("client_threads_add:pthread_mutex_lock", err);
-		return -1;
-	}
-
-	/**
-	 * Ensure that there is enough space for one more element in
-	 * client threads array.
-	 */
+	size_t i, j;
 
-	if (client_threads_len == client_threads_alloc) {
-		tmp_alloc = client_threads_alloc * 2;
-		tmp_array = realloc(
-			client_threads,
-			sizeof(struct client_thread) * tmp_alloc
-		);
-
-		if (tmp_array == NULL) {
-			print_error_errno("client_threads_add:realloc");
-
-			/* Release client threads mutex lock. */
-			err = pthread_mutex_unlock(&client_threads_lock);
-
-			if (err != 0) {
-				print_error(
-					"client_threads_add:"
-					"pthread_mutex_unlock",
-					err
-				);
-			}
-
-			return -1;
+	for (i = 0; i < threads->shards_len; ++i) {
+		for (j = 0; j < CLIENT_SLOTS_CHUNKS_MAX; ++j) {
+			free(threads->shards[i].chunks[j]);
 		}
 
-		client_threads = tmp_array;
-		client_threads_alloc = tmp_alloc;
-	}
-
-	/* Insert 'tid' into client threads array. */
-	client_threads[client_threads_len].tid = tid;
-	client_threads[client_threads_len].finished = 0;
-
-	/* Update length of client threads array. */
-	++client_threads_len;
-
-	/* Release client threads mutex lock. */
-	err = pthread_mutex_unlock(&client_threads_lock);
-
-	if (err != 0) {
-		print_error(
-			"client_threads_add:pthread_mutex_unlock",
-			err
-		);
+		free(threads->shards[i].chunks);
+		pthread_mutex_destroy(&threads->shards[i].lock);
 	}
 
-	return 0;
+	pthread_attr_destroy(&threads->attr);
+	free(threads->shards);
+	free(threads->cpus);
+	free(threads);
 }
 
 /**
- * Marks 'tid' as finished in client threads array.
+ * Creates a client threads registry split into 'shards'
+ * independently locked shards, whose client threads are started with
+ * attributes 'attr' and counted in 'metrics', which may be NULL, when
+ * they are started and joined, and starts its client thread joiner.
+ * On success, a pointer to the new client threads registry is
+ * returned. On error, NULL is returned, and an appropriate error
+ * message is printed to standard error.
  */
-static void client_threads_finish(pthread_t tid)
+struct client_threads *client_threads_create(
+	size_t shards,
+	const struct client_thread_attr *attr,
+	struct metrics *metrics
+)
 {
-	char sig = 0;
+	struct client_threads *threads;
+	struct client_shard *shard;
 	int err;
-	size_t i;
-
-	/* Obtain client threads mutex lock. */
-	err = pthread_mutex_lock(&client_threads_lock);
 
-	if (err != 0) {
-		print_error(
-			"client_threads_finish:pthread_mutex_lock",
-			err
-		);
-		return;
+	if (shards == 0) {
+		shards = 1;
 	}
 
-	/* Find 'tid' in client threads array. */
-	for (i = 0; i < client_threads_len; ++i) {
-		if (client_threads[i].tid == tid) {
-			break;
-		}
-	}
-
-	if (i == client_threads_len) {
-		/**
-		 * 'tid' is not in client threads array.
-		 */
+	threads = calloc(1, sizeof(struct client_threads));
 
-		/* Release client threads mutex lock. */
-		err = pthread_mutex_unlock(&client_threads_lock);
-
-		if (err != 0) {
-			print_error(
-				"client_threads_finish:"
-				"pthread_mutex_unlock",
-				err
-			);
-		}
-
-		return;
+	if (threads == NULL) {
+		print_error_errno("client_threads_create:calloc");
+		return NULL;
 	}
 
-	/* Mark 'tid' as finished. */
-	client_threads[i].finished = 1;
-
-	/* Signal client thread joiner to join this thread. */
-	write(client_threads_pipe[1], &sig, 1);
-
-	/* Release client threads mutex lock. */
-	err = pthread_mutex_unlock(&client_threads_lock);
-
-	if (err != 0) {
-		print_error(
-			"client_threads_finish:pthread_mutex_unlock",
-			err
-		);
+	/* Initialise client thread attributes. */
+	if (client_threads_attr_init(threads, attr) == -1) {
+		free(threads);
+		return NULL;
 	}
-}
-
-/**
- * Removes 'tid' from client threads array.
- */
-static void client_threads_remove(pthread_t tid)
-{
-	int err;
-	size_t i;
-
-	/* Obtain client threads mutex lock. */
-	err = pthread_mutex_lock(&client_threads_lock);
 
-	if (err != 0) {
-		print_error(
-			"client_threads_remove:pthread_mutex_lock",
-			err
-		);
-		return;
-	}
+	threads->metrics = metrics;
 
-	/**
-	 * Remove 'tid' from client threads array.
-	 */
+	/* Initialise shards of the client threads registry. */
+	threads->shards = aligned_alloc(
+		64,
+		sizeof(struct client_shard) * shards
+	);
 
-	/* Find 'tid' in client threads array. */
-	for (i = 0; i < client_threads_len; ++i) {
-		if (client_threads[i].tid == tid) {
-			break;
-		}
+	if (threads->shards == NULL) {
+		print_error_errno("client_threads_create:aligned_alloc");
+		client_threads_free(threads);
+		return NULL;
 	}
 
-	if (i == client_threads_len) {
-		/**
-		 * 'tid' is not in client threads array.
-		 */
-
-		/* Release client threads mutex lock. */
-		err = pthread_mutex_unlock(&client_threads_lock);
+	while (threads->shards_len < shards) {
+		shard = &threads->shards[threads->shards_len];
+		shard->chunks = calloc(
+			CLIENT_SLOTS_CHUNKS_MAX,
+			sizeof(struct client_slot *)
+		);
 
-		if (err != 0) {
-			print_error(
-				"client_threads_remove:"
-				"pthread_mutex_unlock",
-				err
-			);
+		if (shard->chunks == NULL) {
+			print_error_errno("client_threads_create:calloc");
+			client_threads_free(threads);
+			return NULL;
 		}
 
-		return;
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->len = 0;
+		shard->live = 0;
+		shard->free_head = CLIENT_SLOT_NONE;
+		shard->finished_head = CLIENT_SLOT_NONE;
+		shard->finished_tail = CLIENT_SLOT_NONE;
+		++threads->shards_len;
 	}
 
-	/* Move elements after 'tid' one step to the left in client
-	   threads array. */
-	for (; i < client_threads_len - 1; ++i) {
-		client_threads[i].tid = client_threads[i + 1].tid;
-		client_threads[i].finished = client_threads[i + 1].finished;
-	}
+	/* Initialise client threads pipe. */
+	err = pipe(threads->pipe);
 
-	/* Update length of client threads array. */
-	--client_threads_len;
+	if (err == -1) {
+		print_error_errno("client_threads_create:pipe");
+		client_threads_free(threads);
+		return NULL;
+	}
 
-	/* Release client threads mutex lock. */
-	err = pthread_mutex_unlock(&client_threads_lock);
+	/* Start client thread joiner. */
+	err = pthread_create(
+		&threads->joiner_id,
+		NULL,
+		client_thread_joiner,
+		threads
+	);
 
 	if (err != 0) {
-		print_error(
-			"client_threads_remove:pthread_mutex_unlock",
-			err
-		);
+		print_error("client_threads_create:pthread_create", err);
+		close(threads->pipe[0]);
+		close(threads->pipe[1]);
+		client_threads_free(threads);
+		return NULL;
 	}
+
+	return threads;
 }
 
 /**
- * Calls client thread and manages dynamically allocated data 'arg'.
+ * Calls client thread and marks its slot 'arg' as finished.
  */
 static void *client_thread_starter(void *arg)
 {
-	struct client_thread_arg *ct_arg;
+	struct client_slot *slot;
+	cpu_set_t cpuset;
 	int err;
 
-	ct_arg = (struct client_thread_arg *)arg;
+	slot = (struct client_slot *)arg;
 
-	/* Insert 'ct_arg->tid' into client threads array. */
-	err = client_threads_add(ct_arg->tid);
+	/* Pin client thread to its CPU before it does any work. */
+	if (slot->cpu != -1) {
+		CPU_ZERO(&cpuset);
+		CPU_SET(slot->cpu, &cpuset);
+		err = pthread_setaffinity_np(
+			pthread_self(),
+			sizeof(cpu_set_t),
+			&cpuset
+		);
 
-	if (err == -1) {
-		close(ct_arg->cfd);
-		free(ct_arg);
-		pthread_exit(NULL);
+		if (err != 0) {
+			print_error(
+				"client_thread_starter:pthread_setaffinity_np",
+				err
+			);
+		}
 	}
 
-	/* Call client thread. */
-	ct_arg->client_thread(ct_arg->cfd, ct_arg->sigpipe);
+	/* Call client thread, which closes and frees 'slot->conn'. */
+	conn_handle(slot->conn, slot->client_thread, slot->sigpipe);
 
-	/* Mark 'ct_arg->tid' as finished in client threads array. */
-	client_threads_finish(ct_arg->tid);
+	/* Mark client thread as finished in client threads
+	   registry. */
+	client_threads_finish(slot);
 
-	close(ct_arg->cfd);
-	free(ct_arg);
 	pthread_exit(NULL);
 }
 
 /**
- * Starts client thread using client socket file descriptor 'cfd' and
- * calls 'client_thread'.
- * On success, zero is returned. On error, -1 is returned, and an
- * appropriate error message is printed to standard error.
+ * Starts a client thread in 'threads' that calls 'client_thread' on
+ * client connection 'conn', and closes and frees 'conn' when it
+ * returns.
+ * On success, zero is returned. On error, -1 is returned, an
+ * appropriate error message is printed to standard error, and the
+ * caller remains responsible for 'conn'.
  */
 int client_thread_start(
-	int cfd,
+	struct client_threads *threads,
+	struct maxserver_conn *conn,
 	void (*client_thread)(int cfd, int sigpipe),
 	int sigpipe
 )
 {
-	struct client_thread_arg *ct_arg;
+	struct client_shard *shard;
+	struct client_slot *slot;
+	size_t shard_index = 0;
+	pthread_t tid;
+	int cpu;
 	int err;
 
-	/* Allocate client thread argument data structure. */
-	ct_arg = malloc(sizeof(struct client_thread_arg));
+	/* Pick the shard of the calling CPU, so that client threads
+	   started on different CPUs do not contend on the same shard
+	   mutex lock. */
+	if (threads->shards_len > 1) {
+		cpu = sched_getcpu();
+		shard_index = cpu > 0 ? (size_t)cpu % threads->shards_len : 0;
+	}
+
+	/* Reserve slot in client threads registry. */
+	slot = client_threads_add(threads, shard_index);
 
-	if (ct_arg == NULL) {
-		print_error_errno("client_thread_start:malloc");
+	if (slot == NULL) {
 		return -1;
 	}
 
-	ct_arg->cfd = cfd;
-	ct_arg->client_thread = client_thread;
-	ct_arg->sigpipe = sigpipe;
+	shard = &threads->shards[shard_index];
+	slot->conn = conn;
+	slot->client_thread = client_thread;
+	slot->sigpipe = sigpipe;
+	slot->cpu = client_thread_cpu(threads);
 
 	/* Start client thread. */
 	err = pthread_create(
-		&ct_arg->tid,
-		NULL,
+		&tid,
+		&threads->attr,
 		client_thread_starter,
-		ct_arg
+		slot
 	);
 
 	if (err != 0) {
 		print_error("client_thread_start:pthread_create", err);
-		free(ct_arg);
+
+		pthread_mutex_lock(&shard->lock);
+		client_threads_remove_locked(slot);
+		pthread_mutex_unlock(&shard->lock);
+
 		return -1;
 	}
 
+	slot->tid = tid;
+	client_threads_started(slot);
+	metrics_add(threads->metrics, METRICS_THREAD_SPAWNS, 1);
+
 	return 0;
 }
 
 /**
- * Stops all client threads.
+ * Waits for every client thread of 'threads' to quit, stops its
+ * client thread joiner, and frees 'threads'. No client thread may be
+ * started in 'threads' any more.
  */
-void client_threads_stop()
+void client_threads_destroy(struct client_threads *threads)
 {
 	char sig = 1;
-	pthread_t tid;
+	struct client_shard *shard;
+	struct client_slot *slot;
 	int err;
+	size_t i, j;
 
 	/* Signal client thread joiner to quit. */
-	write(client_threads_pipe[1], &sig, 1);
+	write(threads->pipe[1], &sig, 1);
 
 	/* Join client thread joiner. */
-	err = pthread_join(client_thread_joiner_id, NULL);
+	err = pthread_join(threads->joiner_id, NULL);
 
 	if (err != 0) {
-		print_error("client_threads_stop:pthread_join", err);
+		print_error("client_threads_destroy:pthread_join", err);
 	}
 
-	/* Wait for all remaining client threads to quit. */
-	for (;;) {
-		/* Obtain client threads mutex lock. */
-		err = pthread_mutex_lock(&client_threads_lock);
+	/* Wait for all remaining client threads to quit. No client
+	   thread is started any more, so every used slot has a known
+	   thread ID. */
+	for (i = 0; i < threads->shards_len; ++i) {
+		shard = &threads->shards[i];
 
-		if (err != 0) {
-			print_error(
-				"client_threads_stop:pthread_mutex_lock",
-				err
-			);
-			return;
-		}
+		for (j = 0; j < shard->len && shard->live > 0; ++j) {
+			slot = client_slot(shard, j);
+
+			if (slot->state == CLIENT_SLOT_FREE) {
+				continue;
+			}
 
-		if (client_threads_len == 0) {
-			/* Release client threads mutex lock. */
-			err = pthread_mutex_unlock(&client_threads_lock);
+			err = pthread_join(slot->tid, NULL);
 
 			if (err != 0) {
 				print_error(
-					"client_threads_stop:"
-					"pthread_mutex_unlock",
+					"client_threads_destroy:pthread_join",
 					err
 				);
+			} else {
+				metrics_add(
+					threads->metrics,
+					METRICS_THREAD_JOINS,
+					1
+				);
 			}
 
-			break;
+			pthread_mutex_lock(&shard->lock);
+			client_threads_remove_locked(slot);
+			pthread_mutex_unlock(&shard->lock);
 		}
+	}
 
-		tid = client_threads[0].tid;
-
-		/* Release client threads mutex lock. */
-		err = pthread_mutex_unlock(&client_threads_lock);
-
-		if (err != 0) {
-			print_error(
-				"client_threads_stop:pthread_mutex_unlock",
-				err
-			);
-			return;
-		}
+	/* Clear client threads pipe. */
+	err = close(threads->pipe[0]);
 
-		/* Wait for client thread to quit. */
-		err = pthread_join(tid, NULL);
+	if (err == -1) {
+		print_error_errno("client_threads_destroy:close");
+	}
 
-		if (err != 0) {
-			print_error(
-				"client_threads_stop:pthread_join",
-				err
-			);
-			return;
-		}
+	err = close(threads->pipe[1]);
 
-		/* Remove client thread from client threads array. */
-		client_threads_remove(tid);
+	if (err == -1) {
+		print_error_errno("client_threads_destroy:close");
 	}
+
+	client_threads_free(threads);
 }
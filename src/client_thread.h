@@ -21,33 +21,65 @@
 #ifndef CLIENT_THREAD_H
 #define CLIENT_THREAD_H
 
+#include <stddef.h>
+
+#include "maxserver.h"
+
+struct metrics;
+
 /**
- * Initialises client threads data structures.
- * On success, zero is returned. On error, -1 is returned, and an
- * appropriate error message is printed to standard error.
+ * Data structure representing the attributes of client threads, as
+ * described for the fields of 'struct maxserver_config' with the same
+ * names.
  */
-int client_threads_init();
+struct client_thread_attr {
+	size_t stack_size;
+	size_t guard_size;
+	enum maxserver_affinity affinity;
+	int sched_policy;
+	int sched_priority;
+};
 
 /**
- * Clears client threads data structures.
+ * Opaque data structure representing a client threads registry.
  */
-void client_threads_clear();
+struct client_threads;
+
+/**
+ * Creates a client threads registry split into 'shards'
+ * independently locked shards, whose client threads are started with
+ * attributes 'attr' and counted in 'metrics', which may be NULL, when
+ * they are started and joined, and starts its client thread joiner.
+ * On success, a pointer to the new client threads registry is
+ * returned. On error, NULL is returned, and an appropriate error
+ * message is printed to standard error.
+ */
+struct client_threads *client_threads_create(
+	size_t shards,
+	const struct client_thread_attr *attr,
+	struct metrics *metrics
+);
 
 /**
- * Starts client thread using client socket file descriptor 'cfd' and
- * calls 'client_thread'.
- * On success, zero is returned. On error, -1 is returned, and an
- * appropriate error message is printed to standard error.
+ * Starts a client thread in 'threads' that calls 'client_thread' on
+ * client connection 'conn', and closes and frees 'conn' when it
+ * returns.
+ * On success, zero is returned. On error, -1 is returned, an
+ * appropriate error message is printed to standard error, and the
+ * caller remains responsible for 'conn'.
  */
 int client_thread_start(
-	int cfd,
+	struct client_threads *threads,
+	struct maxserver_conn *conn,
 	void (*client_thread)(int cfd, int sigpipe),
 	int sigpipe
 );
 
 /**
- * Stops all client threads.
+ * Waits for every client thread of 'threads' to quit, stops its
+ * client thread joiner, and frees 'threads'. No client thread may be
+ * started in 'threads' any more.
  */
-void client_threads_stop();
+void client_threads_destroy(struct client_threads *threads);
 
 #endif
@@ -0,0 +1,1309 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "conn.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "print_error.h"
+#include "fiber.h"
+#include "deadline.h"
+#include "metrics.h"
+#include "slab.h"
+
+#define CONN_IN_CAP 16384
+#define CONN_FRAME_MAX 16777216
+#define CONN_CHAIN_CAP 16
+#define CONN_CHAIN_FLUSH_LEN 65536
+#define CONN_COPIES_CAP 256
+#define CONN_TRANSFER_CHUNK 1048576
+#define CONN_COUNT_FLUSH_LEN 65536
+#define CONN_SEND_HIGH 1048576
+#define CONN_SEND_LOW 262144
+
+/**
+ * Thread-local variable holding the client connection that the
+ * calling client thread is handling.
+ */
+static __thread struct maxserver_conn *conn_current = NULL;
+
+/**
+ * Adds the bytes counted in 'conn' to its metrics.
+ */
+static void conn_metrics_flush(struct maxserver_conn *conn)
+{
+	if (conn->bytes_in > 0) {
+		metrics_add(conn->metrics, METRICS_BYTES_IN, conn->bytes_in);
+		conn->bytes_in = 0;
+	}
+
+	if (conn->bytes_out > 0) {
+		metrics_add(conn->metrics, METRICS_BYTES_OUT, conn->bytes_out);
+		conn->bytes_out = 0;
+	}
+}
+
+/**
+ * Allocates a client connection from 'slab', which must be owned by
+ * the calling thread, for client socket file descriptor 'fd'
+ * connected from address 'addr'.
+ * On success, a pointer to the new client connection is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
+ */
+struct maxserver_conn *conn_create(
+	struct slab *slab,
+	int fd,
+	const struct sockaddr *addr,
+	socklen_t addrlen
+)
+{
+	struct maxserver_conn *conn;
+
+	conn = slab_alloc(slab);
+
+	if (conn == NULL) {
+		return NULL;
+	}
+
+	memset(conn, 0, sizeof(struct maxserver_conn));
+	conn->fd = fd;
+	conn->in_cap = CONN_IN_CAP;
+	conn->frame_max = CONN_FRAME_MAX;
+	conn->send_high = CONN_SEND_HIGH;
+	conn->send_low = CONN_SEND_LOW;
+	conn->pipe[0] = -1;
+	conn->pipe[1] = -1;
+	arena_init(&conn->arena, 0, 0, 0);
+	timer_init(&conn->timer);
+
+	if (addrlen > sizeof(struct sockaddr_storage)) {
+		addrlen = sizeof(struct sockaddr_storage);
+	}
+
+	memcpy(&conn->addr, addr, addrlen);
+	conn->addrlen = addrlen;
+
+	return conn;
+}
+
+/**
+ * Frees 'conn', its arena and its buffered input and output,
+ * including any unsent output chain, and closes its splice pipe,
+ * without closing its client socket. Decrements the open client
+ * connections counter of its server if it has been dispatched, and
+ * signals the idle pipe of the server when it drops to zero. May be
+ * called from any thread.
+ */
+void conn_destroy(struct maxserver_conn *conn)
+{
+	uint64_t one = 1;
+
+	/* Add the bytes counted last before the client connection stops
+	   counting as open, so that a snapshot taken after it has them. */
+	conn_metrics_flush(conn);
+
+	/* Wake a stop waiting for the last client connection. */
+	if (conn->open != NULL &&
+		__atomic_sub_fetch(conn->open, 1, __ATOMIC_RELEASE) == 0) {
+		write(conn->idlepipe, &one, sizeof(uint64_t));
+	}
+
+	if (conn->pipe[0] != -1) {
+		close(conn->pipe[0]);
+		close(conn->pipe[1]);
+	}
+
+	arena_clear(&conn->arena);
+	free(conn->in);
+	free(conn->chain);
+	free(conn->chain_copied);
+	free(conn->copies);
+	free(conn->out);
+	slab_free(conn);
+}
+
+/**
+ * Calls 'client_thread' on 'conn' with 'conn' as the calling thread's
+ * current client connection, and flushes its output chain, closes it
+ * and frees it when 'client_thread' returns. The call counts as one
+ * handler invocation in the metrics of 'conn'.
+ */
+void conn_handle(
+	struct maxserver_conn *conn,
+	void (*client_thread)(int cfd, int sigpipe),
+	int sigpipe
+)
+{
+	unsigned long long start;
+
+	conn_current = conn;
+	deadlines_conn_start(conn);
+	start = metrics_start(conn->metrics);
+	client_thread(conn->fd, sigpipe);
+	metrics_handled(conn->metrics, start);
+
+	if (conn_output_pending(conn)) {
+		maxserver_conn_flush(conn);
+	}
+
+	conn_current = NULL;
+
+	/* The timer thread may shut the client socket down until its
+	   deadlines are cancelled. */
+	deadlines_conn_stop(conn);
+	close(conn->fd);
+	conn_destroy(conn);
+}
+
+/**
+ * Makes 'conn' the calling thread's current client connection. Used
+ * by the fiber scheduler, whose threads switch between client
+ * connections.
+ */
+void conn_set_current(struct maxserver_conn *conn)
+{
+	conn_current = conn;
+}
+
+/**
+ * Returns the client connection that the calling client thread is
+ * handling, or NULL if it is not handling any.
+ */
+struct maxserver_conn *maxserver_conn_current()
+{
+	return conn_current;
+}
+
+/**
+ * Returns the client socket file descriptor of 'conn'.
+ */
+int maxserver_conn_fd(const struct maxserver_conn *conn)
+{
+	return conn->fd;
+}
+
+/**
+ * Returns the user data of 'conn', which is NULL until set with
+ * 'maxserver_conn_set_data'.
+ */
+void *maxserver_conn_data(const struct maxserver_conn *conn)
+{
+	return conn->data;
+}
+
+/**
+ * Sets the user data of 'conn' to 'data'.
+ */
+void maxserver_conn_set_data(struct maxserver_conn *conn, void *data)
+{
+	conn->data = data;
+}
+
+/**
+ * Closes 'conn' once the current callback returns. 'on_close' is
+ * called before the client socket is closed. May only be called from
+ * a callback of 'conn'.
+ */
+void maxserver_conn_close(struct maxserver_conn *conn)
+{
+	conn->closing = 1;
+}
+
+/**
+ * Sends 'len' bytes of 'data' to 'conn'. Event loops copy 'data' and
+ * send it in order once the client socket is writable, so the call
+ * never blocks and 'data' may be reused when it returns. Client
+ * threads block until every byte has been written, and fibers wait
+ * for it while other fibers run. If the client socket fails, an
+ * event loop closes 'conn' once the current callback returns.
+ * Once an event loop has more than 'send_high_water' bytes queued
+ * for 'conn', it throttles 'conn': it stops reading the client
+ * socket, and calls neither 'on_data' nor 'on_readable' for data that
+ * it has not received yet, until fewer than 'send_low_water' bytes
+ * are queued.
+ * On success, zero is returned, or 1 if 'data' was queued but 'conn'
+ * is throttled, so that the caller should stop sending. On error, -1
+ * is returned, and an appropriate error message is printed to
+ * standard error unless the client has gone away.
+ */
+int maxserver_conn_send(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len
+)
+{
+	if (conn->send != NULL) {
+		return conn->send(conn, data, len);
+	}
+
+	/* Send after any queued output. Fibers yield while the client
+	   socket is full. */
+	if (conn_output_pending(conn)) {
+		if (maxserver_conn_queue_copy(conn, data, len) == -1) {
+			return -1;
+		}
+
+		return maxserver_conn_flush(conn);
+	}
+
+	if (maxserver_write(conn->fd, data, len) == -1) {
+		if (errno != EPIPE && errno != ECONNRESET &&
+			errno != ECANCELED) {
+			print_error_errno(
+				"maxserver_conn_send:maxserver_write"
+			);
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Makes room in the read-ahead buffer of 'conn' for 'need' bytes
+ * from the start of its unread data, moving the unread data to the
+ * front of the buffer, and growing the buffer if it is too small.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int conn_in_reserve(struct maxserver_conn *conn, size_t need)
+{
+	size_t avail = conn->in_len - conn->in_off;
+	size_t cap;
+	char *in;
+
+	if (conn->in_off + need <= conn->in_cap && conn->in != NULL) {
+		return 0;
+	}
+
+	if (need > conn->in_cap || conn->in == NULL) {
+		/* Grow at least twofold, keeping only the unread
+		   data. */
+		cap = conn->in_cap;
+
+		if (cap < need) {
+			cap = cap * 2 < need ? need : cap * 2;
+		}
+
+		in = malloc(cap);
+
+		if (in == NULL) {
+			print_error_errno("conn_in_reserve:malloc");
+			return -1;
+		}
+
+		if (avail > 0) {
+			memcpy(in, conn->in + conn->in_off, avail);
+		}
+
+		free(conn->in);
+		conn->in = in;
+		conn->in_cap = cap;
+	} else {
+		memmove(conn->in, conn->in + conn->in_off, avail);
+	}
+
+	conn->in_off = 0;
+	conn->in_len = avail;
+
+	return 0;
+}
+
+/**
+ * Returns the next frame received from 'conn' in 'frame'. A frame is
+ * a length of type size_t, in host byte order, followed by that many
+ * bytes of data. Input is read ahead into a buffer of the client
+ * connection, so frames that arrive together are returned without
+ * reading the client socket again. 'frame' points into that buffer,
+ * and is only valid until the next call, unless it is queued with
+ * 'maxserver_conn_queue', since the output chain is flushed before
+ * the buffer is refilled. Waits for input like
+ * 'maxserver_read'. May only be called from the client thread or
+ * fiber of 'conn', and should not be mixed with reading the client
+ * socket directly.
+ * Returns 1 if a frame was returned, and 0 if the client closed the
+ * connection between frames. On error, -1 is returned, and errno is
+ * set appropriately: to ECANCELED if the server is stopping, to
+ * EPROTO if the client closed the connection in the middle of a
+ * frame, and to EMSGSIZE if a frame is longer than 'frame_max_len'.
+ * An appropriate error message is printed to standard error if
+ * memory runs out.
+ */
+int maxserver_frame_next(
+	struct maxserver_conn *conn,
+	struct maxserver_frame *frame
+)
+{
+	size_t avail, len, need;
+	ssize_t n;
+
+	/* Drop the frame returned last, and the memory that the handler
+	   allocated for it unless queued output may point into it. */
+	conn->in_off += conn->in_frame;
+	conn->in_frame = 0;
+
+	if (!conn_output_pending(conn)) {
+		maxserver_arena_reset(&conn->arena);
+	}
+
+	for (;;) {
+		avail = conn->in_len - conn->in_off;
+		need = sizeof(size_t);
+
+		/* Parse the frame in place once it is complete. */
+		if (avail >= sizeof(size_t)) {
+			memcpy(&len, conn->in + conn->in_off, sizeof(size_t));
+
+			if (len > conn->frame_max) {
+				errno = EMSGSIZE;
+				return -1;
+			}
+
+			need += len;
+
+			if (avail >= need) {
+				frame->data = conn->in + conn->in_off +
+					sizeof(size_t);
+				frame->len = len;
+				conn->in_frame = need;
+				deadlines_frame_end(conn);
+				return 1;
+			}
+		}
+
+		/* Queued output may point into the buffer or the arena,
+		   and the client may wait for it before sending more. */
+		if (conn_output_pending(conn)) {
+			if (maxserver_conn_flush(conn) == -1) {
+				if (deadlines_expired(conn)) {
+					errno = ETIMEDOUT;
+				}
+
+				return -1;
+			}
+
+			maxserver_arena_reset(&conn->arena);
+		}
+
+		/* The client has started a frame, which has to arrive
+		   within the read timeout. */
+		if (avail > 0) {
+			deadlines_frame_begin(conn);
+		}
+
+		if (conn_in_reserve(conn, need) == -1) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		/* Read as much as the buffer holds. */
+		n = maxserver_read(
+			conn->fd,
+			conn->in + conn->in_len,
+			conn->in_cap - conn->in_len
+		);
+
+		if (n == -1) {
+			return -1;
+		}
+
+		if (n == 0) {
+			if (avail == 0) {
+				return 0;
+			}
+
+			errno = EPROTO;
+			return -1;
+		}
+
+		conn->in_len += (size_t)n;
+	}
+}
+
+/**
+ * Returns the number of bytes received from 'conn' that
+ * 'maxserver_frame_next' has read ahead but not returned yet.
+ */
+size_t maxserver_conn_buffered(const struct maxserver_conn *conn)
+{
+	return conn->in_len - conn->in_off - conn->in_frame;
+}
+
+/**
+ * Returns the arena of 'conn', for memory that the handler only needs
+ * while it handles one request. The arena is reset whenever
+ * 'maxserver_frame_next' is called, unless queued output may still
+ * point into it, in which case it is reset once the output chain has
+ * been flushed, and after every callback of 'maxserver_evloop'. It
+ * is freed with 'conn'.
+ */
+struct maxserver_arena *maxserver_conn_arena(struct maxserver_conn *conn)
+{
+	return &conn->arena;
+}
+
+/**
+ * Returns non-zero if 'conn' has queued output or is corked, so that
+ * 'maxserver_conn_flush' has something to do.
+ */
+int conn_output_pending(const struct maxserver_conn *conn)
+{
+	return conn->chain_len > 0 || conn->corked;
+}
+
+/**
+ * Counts 'in' bytes received from and 'out' bytes sent to the client
+ * of 'conn'. The counts are kept in 'conn' and added to its metrics
+ * once they reach a batch, or when 'conn' is freed, so that counting
+ * takes no atomic operation per read or write. Must be called by the
+ * thread that owns 'conn'.
+ */
+void conn_count(struct maxserver_conn *conn, size_t in, size_t out)
+{
+	conn->bytes_in += in;
+	conn->bytes_out += out;
+
+	if (conn->bytes_in + conn->bytes_out >= CONN_COUNT_FLUSH_LEN) {
+		conn_metrics_flush(conn);
+	}
+}
+
+/**
+ * Sets or clears TCP_CORK on the client socket of 'conn', as 'corked'
+ * says. Client sockets that are not TCP sockets are left alone.
+ */
+static void conn_cork(struct maxserver_conn *conn, int corked)
+{
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &corked, sizeof(int));
+	conn->corked = corked;
+}
+
+/**
+ * Makes room in the output chain of 'conn' for one more entry.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int conn_chain_reserve(struct maxserver_conn *conn)
+{
+	struct iovec *chain;
+	unsigned char *copied;
+	size_t cap;
+
+	if (conn->chain_len < conn->chain_cap) {
+		return 0;
+	}
+
+	cap = conn->chain_cap == 0 ? CONN_CHAIN_CAP : conn->chain_cap * 2;
+
+	if (cap > IOV_MAX) {
+		cap = IOV_MAX;
+	}
+
+	chain = realloc(conn->chain, sizeof(struct iovec) * cap);
+
+	if (chain == NULL) {
+		print_error_errno("conn_chain_reserve:realloc");
+		return -1;
+	}
+
+	conn->chain = chain;
+	copied = realloc(conn->chain_copied, cap);
+
+	if (copied == NULL) {
+		print_error_errno("conn_chain_reserve:realloc");
+		return -1;
+	}
+
+	conn->chain_copied = copied;
+	conn->chain_cap = cap;
+
+	return 0;
+}
+
+/**
+ * Sends the output chain of 'conn' with as few 'sendmsg' calls as
+ * the client socket allows, and empties it whether or not sending
+ * succeeds. If 'more' is set, it is sent with MSG_MORE. If 'keep' is
+ * also set, the last entry is kept for the next send, so that the
+ * kernel never holds back the end of the output.
+ * On success, zero is returned. On error, -1 is returned, and errno
+ * is set appropriately.
+ */
+static int conn_chain_send(struct maxserver_conn *conn, int more, int keep)
+{
+	struct iovec *chain = conn->chain;
+	struct iovec last;
+	struct msghdr msg;
+	size_t len = conn->chain_len;
+	size_t i = 0, sent = 0;
+	ssize_t n;
+	int flags = MSG_NOSIGNAL;
+	int err = 0;
+
+	if (more) {
+		flags |= MSG_MORE;
+	}
+
+	if (keep) {
+		--len;
+	}
+
+	while (i < len) {
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = &chain[i];
+		msg.msg_iovlen = len - i;
+		n = sendmsg(conn->fd, &msg, flags);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+				maxserver_wait_writable(conn->fd, -1) == 1) {
+				continue;
+			}
+
+			err = -1;
+			break;
+		}
+
+		sent += (size_t)n;
+
+		/* Skip the entries that were sent, and the sent part
+		   of the first one that was not. */
+		while (i < len && (size_t)n >= chain[i].iov_len) {
+			n -= (ssize_t)chain[i].iov_len;
+			++i;
+		}
+
+		if (n > 0) {
+			chain[i].iov_base = (char *)chain[i].iov_base + n;
+			chain[i].iov_len -= (size_t)n;
+		}
+	}
+
+	conn->chain_len = 0;
+	conn->chain_bytes = 0;
+	conn->copies_len = 0;
+	conn_count(conn, 0, sent);
+
+	if (!keep || err == -1) {
+		return err;
+	}
+
+	/* Keep the last entry at the front of the output chain, and
+	   of the copies if it is a copy. */
+	last = chain[len];
+	conn->chain_copied[0] = conn->chain_copied[len];
+
+	if (conn->chain_copied[0]) {
+		memmove(conn->copies, last.iov_base, last.iov_len);
+		last.iov_base = conn->copies;
+		conn->copies_len = last.iov_len;
+	}
+
+	chain[0] = last;
+	conn->chain_len = 1;
+	conn->chain_bytes = last.iov_len;
+
+	return 0;
+}
+
+/**
+ * Sends the output chain of 'conn' early once it holds IOV_MAX
+ * entries or CONN_CHAIN_FLUSH_LEN bytes, all but its last entry with
+ * MSG_MORE if 'conn' is configured with it.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error unless the
+ * client has gone away.
+ */
+static int conn_chain_check(struct maxserver_conn *conn)
+{
+	int more = conn->cork == MAXSERVER_CORK_MSG_MORE;
+
+	if (conn->chain_len < IOV_MAX &&
+		conn->chain_bytes < CONN_CHAIN_FLUSH_LEN) {
+		return 0;
+	}
+
+	/* A single entry is sent with whatever follows it. */
+	if (more && conn->chain_len == 1) {
+		return 0;
+	}
+
+	if (conn_chain_send(conn, more, more) == -1) {
+		if (errno != EPIPE && errno != ECONNRESET &&
+			errno != ECANCELED) {
+			print_error_errno("conn_chain_check:sendmsg");
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Appends an entry of 'len' bytes at 'data' to the output chain of
+ * 'conn', which points into its copies if 'copied' is set, and sets
+ * TCP_CORK first if 'conn' is configured with it.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int conn_chain_append(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len,
+	int copied
+)
+{
+	if (conn_chain_reserve(conn) == -1) {
+		return -1;
+	}
+
+	if (conn->cork == MAXSERVER_CORK_TCP && !conn->corked) {
+		conn_cork(conn, 1);
+	}
+
+	conn->chain[conn->chain_len].iov_base = (void *)data;
+	conn->chain[conn->chain_len].iov_len = len;
+	conn->chain_copied[conn->chain_len] = (unsigned char)copied;
+	++conn->chain_len;
+	conn->chain_bytes += len;
+
+	return 0;
+}
+
+/**
+ * Queues 'len' bytes of 'data' to the output chain of 'conn' without
+ * copying them, so 'data' must stay valid until the output chain is
+ * flushed. The output chain is flushed with 'maxserver_conn_flush',
+ * before the client thread or fiber of 'conn' waits for input from
+ * it, and when its client thread or fiber returns, and is sent early
+ * once it holds IOV_MAX entries or 64 KiB. May only be called from
+ * the client thread or fiber of 'conn'.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error unless the
+ * client has gone away.
+ */
+int maxserver_conn_queue(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len
+)
+{
+	if (len == 0) {
+		return 0;
+	}
+
+	if (conn_chain_append(conn, data, len, 0) == -1) {
+		return -1;
+	}
+
+	return conn_chain_check(conn);
+}
+
+/**
+ * Works like 'maxserver_conn_queue', but copies 'data', so that it
+ * may be reused at once. Small pieces queued in a row, such as
+ * headers, share one entry of the output chain.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error unless the
+ * client has gone away.
+ */
+int maxserver_conn_queue_copy(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len
+)
+{
+	struct iovec *last;
+	char *copies, *copy;
+	size_t cap, i;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	/* Grow the copies, moving the entries that point into
+	   them. */
+	if (conn->copies_len + len > conn->copies_cap) {
+		cap = conn->copies_cap == 0 ? CONN_COPIES_CAP :
+			conn->copies_cap * 2;
+
+		while (cap < conn->copies_len + len) {
+			cap *= 2;
+		}
+
+		copies = malloc(cap);
+
+		if (copies == NULL) {
+			print_error_errno("maxserver_conn_queue_copy:malloc");
+			return -1;
+		}
+
+		memcpy(copies, conn->copies, conn->copies_len);
+
+		for (i = 0; i < conn->chain_len; ++i) {
+			if (conn->chain_copied[i]) {
+				conn->chain[i].iov_base = copies +
+					((char *)conn->chain[i].iov_base -
+					conn->copies);
+			}
+		}
+
+		free(conn->copies);
+		conn->copies = copies;
+		conn->copies_cap = cap;
+	}
+
+	copy = conn->copies + conn->copies_len;
+	memcpy(copy, data, len);
+	conn->copies_len += len;
+
+	/* Extend the last entry if it ends where the copy starts. */
+	last = conn->chain_len > 0 ? &conn->chain[conn->chain_len - 1] :
+		NULL;
+
+	if (last != NULL && conn->chain_copied[conn->chain_len - 1] &&
+		(char *)last->iov_base + last->iov_len == copy) {
+		last->iov_len += len;
+		conn->chain_bytes += len;
+	} else if (conn_chain_append(conn, copy, len, 1) == -1) {
+		conn->copies_len -= len;
+		return -1;
+	}
+
+	return conn_chain_check(conn);
+}
+
+/**
+ * Sends the output chain of 'conn' with as few system calls as
+ * possible, waiting while the client socket is full like
+ * 'maxserver_write', and clears TCP_CORK if 'conn' is corked so that
+ * the last segment goes out at once.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error unless the
+ * client has gone away.
+ */
+int maxserver_conn_flush(struct maxserver_conn *conn)
+{
+	int err;
+
+	err = conn_chain_send(conn, 0, 0);
+
+	if (err == -1 && errno != EPIPE && errno != ECONNRESET &&
+		errno != ECANCELED) {
+		print_error_errno("maxserver_conn_flush:sendmsg");
+	}
+
+	if (conn->corked) {
+		conn_cork(conn, 0);
+	}
+
+	return err;
+}
+
+/**
+ * Sends the output chain of 'conn' ahead of a transfer of 'len' bytes
+ * that follows it at once, with MSG_MORE unless 'len' is zero, so that
+ * short output such as headers shares segments with the start of the
+ * transfer. TCP_CORK is left as it is, and is cleared by the next
+ * flush.
+ * On success, zero is returned. On error, -1 is returned, and errno
+ * is set appropriately.
+ */
+static int conn_transfer_start(struct maxserver_conn *conn, size_t len)
+{
+	if (conn->chain_len == 0) {
+		return 0;
+	}
+
+	return conn_chain_send(conn, len > 0, 0);
+}
+
+/**
+ * Makes the client socket of 'conn' non-blocking for a transfer, so
+ * that a client thread waits for it to become writable with
+ * 'maxserver_wait_writable', which wakes as soon as the server stops,
+ * instead of blocking in a chunk that the client does not read.
+ * Returns the previous file status flags of the client socket. On
+ * error, -1 is returned, and errno is set appropriately.
+ */
+static int conn_transfer_nonblock(struct maxserver_conn *conn)
+{
+	int flags;
+
+	flags = fcntl(conn->fd, F_GETFL);
+
+	if (flags == -1 || (flags & O_NONBLOCK)) {
+		return flags;
+	}
+
+	if (fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return -1;
+	}
+
+	return flags;
+}
+
+/**
+ * Restores file status flags 'flags' of the client socket of 'conn'
+ * after a transfer, and counts 'sent' bytes sent by it. errno is left
+ * unchanged.
+ */
+static void conn_transfer_end(
+	struct maxserver_conn *conn,
+	int flags,
+	size_t sent
+)
+{
+	int err = errno;
+
+	if (!(flags & O_NONBLOCK)) {
+		fcntl(conn->fd, F_SETFL, flags);
+	}
+
+	conn_count(conn, 0, sent);
+	errno = err;
+}
+
+/**
+ * Sends up to 'len' bytes of file 'fd' from offset 'off' to 'conn'
+ * with 'sendfile', after any queued output, so that the data never
+ * passes through user space. The client socket is non-blocking during
+ * the transfer, and a client thread or fiber waits while it is full
+ * like 'maxserver_write', so that both wake as soon as the server
+ * stops. The file offset of 'fd' is left unchanged. May only be
+ * called from the client thread or fiber of 'conn'.
+ * Returns the number of bytes sent, which is less than 'len' only if
+ * the file ends first. On error, -1 is returned, and errno is set
+ * appropriately, to ECANCELED if the server is stopping. Some of the
+ * bytes may have been sent.
+ */
+ssize_t maxserver_sendfile(
+	struct maxserver_conn *conn,
+	int fd,
+	off_t off,
+	size_t len
+)
+{
+	size_t sent = 0, chunk;
+	ssize_t n;
+	int flags;
+
+	if (conn_transfer_start(conn, len) == -1) {
+		return -1;
+	}
+
+	flags = conn_transfer_nonblock(conn);
+
+	if (flags == -1) {
+		return -1;
+	}
+
+	while (sent < len) {
+		chunk = len - sent;
+
+		if (chunk > CONN_TRANSFER_CHUNK) {
+			chunk = CONN_TRANSFER_CHUNK;
+		}
+
+		n = sendfile(conn->fd, fd, &off, chunk);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+				maxserver_wait_writable(conn->fd, -1) == 1) {
+				continue;
+			}
+
+			conn_transfer_end(conn, flags, sent);
+			return -1;
+		}
+
+		if (n == 0) {
+			break;
+		}
+
+		sent += (size_t)n;
+	}
+
+	conn_transfer_end(conn, flags, sent);
+
+	return (ssize_t)sent;
+}
+
+/**
+ * Opens the splice pipe of 'conn' unless it is open, and makes it
+ * hold CONN_TRANSFER_CHUNK bytes if the system allows it.
+ * On success, zero is returned. On error, -1 is returned, and errno
+ * is set appropriately.
+ */
+static int conn_pipe_open(struct maxserver_conn *conn)
+{
+	int len;
+
+	if (conn->pipe[0] != -1) {
+		return 0;
+	}
+
+	if (pipe2(conn->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+		conn->pipe[0] = -1;
+		conn->pipe[1] = -1;
+		return -1;
+	}
+
+	/* Keep the default size if the system limits pipes. */
+	fcntl(conn->pipe[1], F_SETPIPE_SZ, CONN_TRANSFER_CHUNK);
+	len = fcntl(conn->pipe[1], F_GETPIPE_SZ);
+	conn->pipe_len = len > 0 ? (size_t)len : 4096;
+
+	return 0;
+}
+
+/**
+ * Closes the splice pipe of 'conn', discarding anything left in it.
+ */
+static void conn_pipe_close(struct maxserver_conn *conn)
+{
+	if (conn->pipe[0] != -1) {
+		close(conn->pipe[0]);
+		close(conn->pipe[1]);
+		conn->pipe[0] = -1;
+		conn->pipe[1] = -1;
+	}
+}
+
+/**
+ * Waits for whichever end of a splice from 'fd' to the client socket
+ * of 'conn' held it up with EAGAIN.
+ * Returns 1 once it is ready, and -1 with errno set to ECANCELED if
+ * the server is stopping. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int conn_splice_wait(struct maxserver_conn *conn, int fd)
+{
+	int ready;
+
+	ready = maxserver_wait_writable(conn->fd, 0);
+
+	if (ready == 1) {
+		return maxserver_wait_readable(fd, -1);
+	} else if (ready == 0) {
+		return maxserver_wait_writable(conn->fd, -1);
+	}
+
+	return -1;
+}
+
+/**
+ * Moves up to 'len' bytes from pipe 'fd' to the non-blocking client
+ * socket of 'conn' with 'splice', without a pipe of its own, and adds
+ * the number of bytes moved to 'sent'.
+ * On success, zero is returned. On error, -1 is returned, and errno
+ * is set appropriately.
+ */
+static int conn_splice_pipe(
+	struct maxserver_conn *conn,
+	int fd,
+	size_t len,
+	size_t *sent
+)
+{
+	int blocking = !fiber_running();
+	size_t chunk;
+	ssize_t n;
+
+	while (len > 0) {
+		/* Client threads wait for 'fd', so that a splice from
+		   a blocking pipe cannot outlast a stop. */
+		if (blocking && maxserver_wait_readable(fd, -1) == -1) {
+			return -1;
+		}
+
+		chunk = len;
+
+		if (chunk > CONN_TRANSFER_CHUNK) {
+			chunk = CONN_TRANSFER_CHUNK;
+		}
+
+		n = splice(
+			fd,
+			NULL,
+			conn->fd,
+			NULL,
+			chunk,
+			SPLICE_F_MOVE | (chunk < len ? SPLICE_F_MORE : 0)
+		);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+				conn_splice_wait(conn, fd) == 1) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		if (n == 0) {
+			break;
+		}
+
+		*sent += (size_t)n;
+		len -= (size_t)n;
+	}
+
+	return 0;
+}
+
+/**
+ * Moves all 'len' bytes in the splice pipe of 'conn' to its
+ * non-blocking client socket, with SPLICE_F_MORE if 'more' is set,
+ * and adds the number of bytes moved to 'sent'.
+ * On success, zero is returned. On error, -1 is returned, and errno
+ * is set appropriately.
+ */
+static int conn_pipe_drain(
+	struct maxserver_conn *conn,
+	size_t len,
+	int more,
+	size_t *sent
+)
+{
+	unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+	ssize_t n;
+
+	if (more) {
+		flags |= SPLICE_F_MORE;
+	}
+
+	while (len > 0) {
+		n = splice(conn->pipe[0], NULL, conn->fd, NULL, len, flags);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+				maxserver_wait_writable(conn->fd, -1) == 1) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		*sent += (size_t)n;
+		len -= (size_t)n;
+	}
+
+	return 0;
+}
+
+/**
+ * Moves up to 'len' bytes from 'fd' to the non-blocking client socket
+ * of 'conn' with 'splice', through the splice pipe of 'conn', which
+ * is empty between calls, and adds the number of bytes moved to
+ * 'sent'. The splice pipe is closed if draining it fails, since it
+ * may still hold bytes that were not sent.
+ * On success, zero is returned. On error, -1 is returned, and errno
+ * is set appropriately.
+ */
+static int conn_splice_through(
+	struct maxserver_conn *conn,
+	int fd,
+	size_t len,
+	size_t *sent
+)
+{
+	int blocking = !fiber_running();
+	size_t chunk;
+	ssize_t n;
+
+	if (conn_pipe_open(conn) == -1) {
+		return -1;
+	}
+
+	while (len > 0) {
+		if (blocking && maxserver_wait_readable(fd, -1) == -1) {
+			return -1;
+		}
+
+		chunk = len;
+
+		if (chunk > conn->pipe_len) {
+			chunk = conn->pipe_len;
+		}
+
+		/* Fill the pipe, which is empty, from 'fd'. */
+		n = splice(
+			fd,
+			NULL,
+			conn->pipe[1],
+			NULL,
+			chunk,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+		);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+				maxserver_wait_readable(fd, -1) == 1) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		if (n == 0) {
+			break;
+		}
+
+		/* Drain the pipe into the client socket. */
+		len -= (size_t)n;
+
+		if (conn_pipe_drain(conn, (size_t)n, len > 0, sent) == -1) {
+			conn_pipe_close(conn);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Moves up to 'len' bytes from 'fd', which may be a pipe, a socket or
+ * a file, at its current offset, to 'conn' with 'splice', after any
+ * queued output, so that the data never passes through user space.
+ * Pipes are spliced to the client socket directly, and anything else
+ * through a pipe that 'conn' keeps for the purpose. The client socket
+ * is non-blocking during the transfer. Waits for 'fd' and the client
+ * socket like 'maxserver_read' and 'maxserver_write', so a socket or
+ * pipe 'fd' should be non-blocking in a fiber. May only be called
+ * from the client thread or fiber of 'conn'.
+ * Returns the number of bytes moved, which is less than 'len' only at
+ * end-of-file. On error, -1 is returned, and errno is set
+ * appropriately, to ECANCELED if the server is stopping. Some of the
+ * bytes may have been moved.
+ */
+ssize_t maxserver_splice(struct maxserver_conn *conn, int fd, size_t len)
+{
+	struct stat st;
+	size_t sent = 0;
+	int flags, err;
+
+	if (fstat(fd, &st) == -1 || conn_transfer_start(conn, len) == -1) {
+		return -1;
+	}
+
+	flags = conn_transfer_nonblock(conn);
+
+	if (flags == -1) {
+		return -1;
+	}
+
+	if (S_ISFIFO(st.st_mode)) {
+		err = conn_splice_pipe(conn, fd, len, &sent);
+	} else {
+		err = conn_splice_through(conn, fd, len, &sent);
+	}
+
+	conn_transfer_end(conn, flags, sent);
+
+	return err == -1 ? -1 : (ssize_t)sent;
+}
+
+/**
+ * Returns the address that 'conn' is connected from, and stores its
+ * length in 'addrlen' if 'addrlen' is not NULL.
+ */
+const struct sockaddr *maxserver_conn_peer(
+	const struct maxserver_conn *conn,
+	socklen_t *addrlen
+)
+{
+	if (addrlen != NULL) {
+		*addrlen = conn->addrlen;
+	}
+
+	return (const struct sockaddr *)&conn->addr;
+}
+
+/**
+ * Formats the numeric host and port of the address that 'conn' is
+ * connected from into 'host' and 'serv', which have room for
+ * 'hostlen' and 'servlen' bytes. Either may be NULL. Never blocks.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_conn_peer_numeric(
+	const struct maxserver_conn *conn,
+	char *host,
+	size_t hostlen,
+	char *serv,
+	size_t servlen
+)
+{
+	int err;
+
+	err = getnameinfo(
+		(const struct sockaddr *)&conn->addr,
+		conn->addrlen,
+		host,
+		host != NULL ? hostlen : 0,
+		serv,
+		serv != NULL ? servlen : 0,
+		NI_NUMERICHOST | NI_NUMERICSERV
+	);
+
+	if (err != 0) {
+		print_error_gai("maxserver_conn_peer_numeric:getnameinfo", err);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,204 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CONN_H
+#define CONN_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "maxserver.h"
+#include "timer.h"
+
+struct evloop_reactor;
+struct deadlines;
+struct metrics;
+struct slab;
+struct uring_thread;
+struct uring_send;
+struct maxserver;
+
+/**
+ * Data structure representing a client connection. 'send' is set by
+ * the event loop that owns the client connection, and is called by
+ * 'maxserver_conn_send'. If it is NULL, data is written directly to
+ * the blocking client socket.
+ */
+struct maxserver_conn {
+	int fd;
+	void *data;
+	int closing;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct maxserver *server;
+	size_t *open;
+	int idlepipe;
+	int (*send)(struct maxserver_conn *conn, const void *data, size_t len);
+
+	/* Read-ahead buffer of 'maxserver_frame_next', allocated with
+	   'in_cap' bytes on first use. The frame returned last takes
+	   'in_frame' bytes at 'in_off', and 'in_len' bytes are
+	   buffered in all. */
+	char *in;
+	size_t in_off;
+	size_t in_len;
+	size_t in_cap;
+	size_t in_frame;
+	size_t frame_max;
+
+	/* Output chain of 'maxserver_conn_queue', with 'chain_len' of
+	   'chain_cap' entries holding 'chain_bytes' bytes in all.
+	   Entries whose 'chain_copied' flag is set point into
+	   'copies', which holds 'copies_len' of 'copies_cap' bytes.
+	   'corked' is set while TCP_CORK is set on the client
+	   socket. */
+	struct iovec *chain;
+	unsigned char *chain_copied;
+	size_t chain_len;
+	size_t chain_cap;
+	size_t chain_bytes;
+	char *copies;
+	size_t copies_len;
+	size_t copies_cap;
+	enum maxserver_cork cork;
+	int corked;
+
+	/* Event loops throttle the client connection, setting
+	   'throttled', once more than 'send_high' bytes of output are
+	   queued, and stop reading its client socket until fewer than
+	   'send_low' bytes are queued. */
+	size_t send_high;
+	size_t send_low;
+	int throttled;
+
+	/* Pipe of 'maxserver_splice', opened on first use with room for
+	   'pipe_len' bytes. Both ends are -1 until then. */
+	int pipe[2];
+	size_t pipe_len;
+
+	/* Arena of 'maxserver_conn_arena', which takes no memory until
+	   it is first allocated from. */
+	struct maxserver_arena arena;
+
+	/* Deadlines of the server, or NULL if it has none. 'idle_at',
+	   'read_at' and 'handler_at' are the idle, read and handler
+	   deadlines, or zero if not running, and 'timer' is armed
+	   on a timer wheel of 'deadlines' at 'timer_at', or zero.
+	   'timed_out' is set once a deadline has passed. */
+	struct deadlines *deadlines;
+	struct timer timer;
+	unsigned long long idle_at;
+	unsigned long long read_at;
+	unsigned long long handler_at;
+	unsigned long long timer_at;
+	int timed_out;
+
+	/* Metrics of the server, or NULL if it keeps none. 'bytes_in'
+	   and 'bytes_out' count bytes received and sent that have not
+	   been added to 'metrics' yet. */
+	struct metrics *metrics;
+	size_t bytes_in;
+	size_t bytes_out;
+
+	/* Fields owned by the event loop. The fiber scheduler also
+	   links submitted client connections with 'next'. */
+	struct evloop_reactor *reactor;
+	struct maxserver_conn *prev;
+	struct maxserver_conn *next;
+	int opened;
+	char *out;
+	size_t out_len;
+	size_t out_cap;
+
+	/* Fields owned by the io_uring event loop, which also links its
+	   client connections with 'prev' and 'next'. */
+	struct uring_thread *uring;
+	struct uring_send *sends;
+	struct uring_send *sends_tail;
+	unsigned int sends_inflight;
+	size_t sends_bytes;
+	int recv_armed;
+	int recv_cancelled;
+	int closed;
+};
+
+/**
+ * Allocates a client connection from 'slab', which must be owned by
+ * the calling thread, for client socket file descriptor 'fd'
+ * connected from address 'addr'.
+ * On success, a pointer to the new client connection is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
+ */
+struct maxserver_conn *conn_create(
+	struct slab *slab,
+	int fd,
+	const struct sockaddr *addr,
+	socklen_t addrlen
+);
+
+/**
+ * Frees 'conn', its arena and its buffered input and output,
+ * including any unsent output chain, and closes its splice pipe,
+ * without closing its client socket. Decrements the open client
+ * connections counter of its server if it has been dispatched, and
+ * signals the idle pipe of the server when it drops to zero. May be
+ * called from any thread.
+ */
+void conn_destroy(struct maxserver_conn *conn);
+
+/**
+ * Calls 'client_thread' on 'conn' with 'conn' as the calling thread's
+ * current client connection, and flushes its output chain, closes it
+ * and frees it when 'client_thread' returns. The call counts as one
+ * handler invocation in the metrics of 'conn'.
+ */
+void conn_handle(
+	struct maxserver_conn *conn,
+	void (*client_thread)(int cfd, int sigpipe),
+	int sigpipe
+);
+
+/**
+ * Makes 'conn' the calling thread's current client connection. Used
+ * by the fiber scheduler, whose threads switch between client
+ * connections.
+ */
+void conn_set_current(struct maxserver_conn *conn);
+
+/**
+ * Returns non-zero if 'conn' has queued output or is corked, so that
+ * 'maxserver_conn_flush' has something to do.
+ */
+int conn_output_pending(const struct maxserver_conn *conn);
+
+/**
+ * Counts 'in' bytes received from and 'out' bytes sent to the client
+ * of 'conn'. The counts are kept in 'conn' and added to its metrics
+ * once they reach a batch, or when 'conn' is freed, so that counting
+ * takes no atomic operation per read or write. Must be called by the
+ * thread that owns 'conn'.
+ */
+void conn_count(struct maxserver_conn *conn, size_t in, size_t out);
+
+#endif
@@ -0,0 +1,472 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "deadline.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "print_error.h"
+#include "log.h"
+#include "timer.h"
+#include "conn.h"
+
+#define DEADLINE_TICK_MS 10
+
+/**
+ * Data structure representing a timer wheel of the deadlines, whose
+ * timers are the client connections that hash to it.
+ */
+struct deadline_wheel {
+	pthread_mutex_t lock;
+	struct timer_wheel wheel;
+} __attribute__((aligned(64)));
+
+/**
+ * Data structure representing the deadlines of the client
+ * connections of a server.
+ *
+ * Deadlines are kept in milliseconds since 'start', plus one, so that
+ * zero means no deadline. 'now' is the time that the timer thread saw
+ * last, which client connections set their deadlines from instead of
+ * reading the clock, so deadlines may pass up to DEADLINE_TICK_MS
+ * milliseconds early.
+ */
+struct deadlines {
+	pthread_t tid;
+	struct deadline_wheel *wheels;
+	size_t wheels_len;
+	unsigned int idle_ms;
+	unsigned int read_ms;
+	unsigned int handler_ms;
+	int sigpipe;
+	unsigned long long start;
+	unsigned long long now;
+};
+
+/**
+ * Returns the CLOCK_MONOTONIC time in milliseconds.
+ */
+static unsigned long long deadlines_clock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Returns the timer wheel that 'conn' is kept on.
+ */
+static struct deadline_wheel *deadlines_wheel(
+	const struct maxserver_conn *conn
+)
+{
+	struct deadlines *deadlines = conn->deadlines;
+
+	return &deadlines->wheels[(size_t)conn->fd % deadlines->wheels_len];
+}
+
+/**
+ * Returns the client connection that 'timer' is the timer of.
+ */
+static struct maxserver_conn *deadlines_timer_conn(struct timer *timer)
+{
+	return (struct maxserver_conn *)((char *)timer -
+		offsetof(struct maxserver_conn, timer));
+}
+
+/**
+ * Returns the earliest deadline of 'conn', or zero if it has none.
+ */
+static unsigned long long deadlines_next(const struct maxserver_conn *conn)
+{
+	unsigned long long at[3], next = 0;
+	int i;
+
+	at[0] = __atomic_load_n(&conn->idle_at, __ATOMIC_SEQ_CST);
+	at[1] = __atomic_load_n(&conn->read_at, __ATOMIC_SEQ_CST);
+	at[2] = __atomic_load_n(&conn->handler_at, __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < 3; ++i) {
+		if (at[i] != 0 && (next == 0 || at[i] < next)) {
+			next = at[i];
+		}
+	}
+
+	return next;
+}
+
+/**
+ * Sets deadline 'at' of 'conn' to 'due'. The timer of 'conn' is only
+ * armed again if it is not armed or expires after 'due', since it
+ * arms itself again for whatever deadline is left when it expires.
+ */
+static void deadlines_set(
+	struct maxserver_conn *conn,
+	unsigned long long *at,
+	unsigned long long due
+)
+{
+	struct deadline_wheel *wheel;
+	unsigned long long timer_at;
+
+	/* Pairs with the timer thread clearing 'timer_at' before it
+	   reads the deadlines, so that either sees the other. */
+	__atomic_store_n(at, due, __ATOMIC_SEQ_CST);
+	timer_at = __atomic_load_n(&conn->timer_at, __ATOMIC_SEQ_CST);
+
+	if (timer_at != 0 && timer_at <= due) {
+		return;
+	}
+
+	wheel = deadlines_wheel(conn);
+	pthread_mutex_lock(&wheel->lock);
+
+	if (!__atomic_load_n(&conn->timed_out, __ATOMIC_RELAXED) &&
+		(conn->timer_at == 0 || conn->timer_at > due)) {
+		timer_arm(&wheel->wheel, &conn->timer, due);
+		__atomic_store_n(&conn->timer_at, due, __ATOMIC_SEQ_CST);
+	}
+
+	pthread_mutex_unlock(&wheel->lock);
+}
+
+/**
+ * Handles the expiry of the timer of 'conn' at 'now' on 'wheel',
+ * whose lock must be held: shuts down the client socket of 'conn' if
+ * a deadline has passed, and arms the timer again for the earliest
+ * deadline left otherwise. The client socket stays open until the
+ * client connection is stopped, which takes the same lock.
+ */
+static void deadlines_expire(
+	struct deadline_wheel *wheel,
+	struct maxserver_conn *conn,
+	unsigned long long now
+)
+{
+	unsigned long long next;
+	const char *which;
+
+	__atomic_store_n(&conn->timer_at, 0, __ATOMIC_SEQ_CST);
+	next = deadlines_next(conn);
+
+	if (next == 0) {
+		return;
+	}
+
+	if (next > now) {
+		timer_arm(&wheel->wheel, &conn->timer, next);
+		__atomic_store_n(&conn->timer_at, next, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	if (next == __atomic_load_n(&conn->handler_at, __ATOMIC_RELAXED)) {
+		which = "handler";
+	} else if (next == __atomic_load_n(&conn->read_at, __ATOMIC_RELAXED)) {
+		which = "read";
+	} else {
+		which = "idle";
+	}
+
+	/* Wake whatever waits on the client socket, which finds it
+	   timed out. */
+	__atomic_store_n(&conn->timed_out, 1, __ATOMIC_RELEASE);
+	shutdown(conn->fd, SHUT_RDWR);
+	log_info("closed client connection %d: %s timeout", conn->fd, which);
+}
+
+/**
+ * Turns the timer wheels of 'arg' every DEADLINE_TICK_MS
+ * milliseconds until its signal pipe becomes readable.
+ */
+static void *deadlines_thread(void *arg)
+{
+	struct deadlines *deadlines = (struct deadlines *)arg;
+	struct deadline_wheel *wheel;
+	struct timer *timer, *next;
+	struct pollfd pfd;
+	unsigned long long now;
+	size_t i;
+	int err;
+
+	pfd.fd = deadlines->sigpipe;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		err = poll(&pfd, 1, DEADLINE_TICK_MS);
+
+		if (err == -1 && errno != EINTR) {
+			print_error_errno("deadlines_thread:poll");
+			break;
+		}
+
+		if (err > 0) {
+			break;
+		}
+
+		now = deadlines_clock() - deadlines->start + 1;
+		__atomic_store_n(&deadlines->now, now, __ATOMIC_RELAXED);
+
+		for (i = 0; i < deadlines->wheels_len; ++i) {
+			wheel = &deadlines->wheels[i];
+			pthread_mutex_lock(&wheel->lock);
+			timer = timer_wheel_advance(&wheel->wheel, now);
+
+			for (; timer != NULL; timer = next) {
+				next = timer->next;
+				deadlines_expire(
+					wheel,
+					deadlines_timer_conn(timer),
+					now
+				);
+			}
+
+			pthread_mutex_unlock(&wheel->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Creates deadlines with 'shards' independently locked timer wheels,
+ * and starts a timer thread that turns them until 'sigpipe' becomes
+ * readable. A client connection times out once it has waited on its
+ * client socket for 'idle_ms' milliseconds, once it has taken
+ * 'read_ms' milliseconds to send a frame that it has started, or
+ * once its client thread has run for 'handler_ms' milliseconds, where
+ * zero disables each deadline.
+ * On success, a pointer to the new deadlines is returned. On error,
+ * NULL is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct deadlines *deadlines_create(
+	size_t shards,
+	unsigned int idle_ms,
+	unsigned int read_ms,
+	unsigned int handler_ms,
+	int sigpipe
+)
+{
+	struct deadlines *deadlines;
+	size_t i;
+	int err;
+
+	if (shards == 0) {
+		shards = 1;
+	}
+
+	deadlines = calloc(1, sizeof(struct deadlines));
+
+	if (deadlines == NULL) {
+		print_error_errno("deadlines_create:calloc");
+		return NULL;
+	}
+
+	deadlines->wheels = aligned_alloc(
+		64,
+		sizeof(struct deadline_wheel) * shards
+	);
+
+	if (deadlines->wheels == NULL) {
+		print_error_errno("deadlines_create:aligned_alloc");
+		free(deadlines);
+		return NULL;
+	}
+
+	deadlines->wheels_len = shards;
+	deadlines->idle_ms = idle_ms;
+	deadlines->read_ms = read_ms;
+	deadlines->handler_ms = handler_ms;
+	deadlines->sigpipe = sigpipe;
+	deadlines->start = deadlines_clock();
+	deadlines->now = 1;
+
+	for (i = 0; i < shards; ++i) {
+		pthread_mutex_init(&deadlines->wheels[i].lock, NULL);
+		timer_wheel_init(&deadlines->wheels[i].wheel, 1);
+	}
+
+	/* Start timer thread. */
+	err = pthread_create(
+		&deadlines->tid,
+		NULL,
+		deadlines_thread,
+		deadlines
+	);
+
+	if (err != 0) {
+		print_error("deadlines_create:pthread_create", err);
+
+		for (i = 0; i < shards; ++i) {
+			pthread_mutex_destroy(&deadlines->wheels[i].lock);
+		}
+
+		free(deadlines->wheels);
+		free(deadlines);
+		return NULL;
+	}
+
+	return deadlines;
+}
+
+/**
+ * Waits for the timer thread of 'deadlines' to quit, and frees
+ * 'deadlines'. The caller must already have signalled 'sigpipe', and
+ * every client connection must have been stopped.
+ */
+void deadlines_destroy(struct deadlines *deadlines)
+{
+	size_t i;
+	int err;
+
+	err = pthread_join(deadlines->tid, NULL);
+
+	if (err != 0) {
+		print_error("deadlines_destroy:pthread_join", err);
+	}
+
+	for (i = 0; i < deadlines->wheels_len; ++i) {
+		pthread_mutex_destroy(&deadlines->wheels[i].lock);
+	}
+
+	free(deadlines->wheels);
+	free(deadlines);
+}
+
+/**
+ * Returns the time that 'deadlines' saw last, in milliseconds.
+ */
+static unsigned long long deadlines_now(const struct deadlines *deadlines)
+{
+	return __atomic_load_n(&deadlines->now, __ATOMIC_RELAXED);
+}
+
+/**
+ * Starts the handler deadline of 'conn'. Does nothing if 'conn' has
+ * no deadlines, as for every function below.
+ */
+void deadlines_conn_start(struct maxserver_conn *conn)
+{
+	struct deadlines *deadlines = conn->deadlines;
+
+	if (deadlines != NULL && deadlines->handler_ms != 0) {
+		deadlines_set(
+			conn,
+			&conn->handler_at,
+			deadlines_now(deadlines) + deadlines->handler_ms
+		);
+	}
+}
+
+/**
+ * Cancels every deadline of 'conn'. Must be called before its client
+ * socket is closed.
+ */
+void deadlines_conn_stop(struct maxserver_conn *conn)
+{
+	struct deadline_wheel *wheel;
+
+	if (conn->deadlines == NULL) {
+		return;
+	}
+
+	wheel = deadlines_wheel(conn);
+	pthread_mutex_lock(&wheel->lock);
+	timer_cancel(&wheel->wheel, &conn->timer);
+	conn->timer_at = 0;
+	conn->idle_at = 0;
+	conn->read_at = 0;
+	conn->handler_at = 0;
+	pthread_mutex_unlock(&wheel->lock);
+}
+
+/**
+ * Starts the idle deadline of 'conn' while it waits on its client
+ * socket, or restarts it if it is running.
+ */
+void deadlines_wait_begin(struct maxserver_conn *conn)
+{
+	struct deadlines *deadlines = conn->deadlines;
+
+	if (deadlines != NULL && deadlines->idle_ms != 0) {
+		deadlines_set(
+			conn,
+			&conn->idle_at,
+			deadlines_now(deadlines) + deadlines->idle_ms
+		);
+	}
+}
+
+/**
+ * Ends the idle deadline of 'conn'.
+ */
+void deadlines_wait_end(struct maxserver_conn *conn)
+{
+	if (conn->deadlines != NULL) {
+		__atomic_store_n(&conn->idle_at, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Starts the read deadline of 'conn' when the client has started a
+ * frame, unless it is already running.
+ */
+void deadlines_frame_begin(struct maxserver_conn *conn)
+{
+	struct deadlines *deadlines = conn->deadlines;
+
+	if (deadlines != NULL && deadlines->read_ms != 0 &&
+		__atomic_load_n(&conn->read_at, __ATOMIC_RELAXED) == 0) {
+		deadlines_set(
+			conn,
+			&conn->read_at,
+			deadlines_now(deadlines) + deadlines->read_ms
+		);
+	}
+}
+
+/**
+ * Ends the read deadline of 'conn' once the frame is complete.
+ */
+void deadlines_frame_end(struct maxserver_conn *conn)
+{
+	if (conn->deadlines != NULL) {
+		__atomic_store_n(&conn->read_at, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Returns non-zero if a deadline of 'conn' has passed, which shuts
+ * down its client socket.
+ */
+int deadlines_expired(const struct maxserver_conn *conn)
+{
+	return conn->deadlines != NULL &&
+		__atomic_load_n(&conn->timed_out, __ATOMIC_ACQUIRE);
+}
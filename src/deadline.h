@@ -0,0 +1,103 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <stddef.h>
+
+#include "maxserver.h"
+
+/**
+ * Opaque data structure representing the deadlines of the client
+ * connections of a server, kept on timer wheels that a timer thread
+ * turns.
+ */
+struct deadlines;
+
+/**
+ * Creates deadlines with 'shards' independently locked timer wheels,
+ * and starts a timer thread that turns them until 'sigpipe' becomes
+ * readable. A client connection times out once it has waited on its
+ * client socket for 'idle_ms' milliseconds, once it has taken
+ * 'read_ms' milliseconds to send a frame that it has started, or
+ * once its client thread has run for 'handler_ms' milliseconds, where
+ * zero disables each deadline.
+ * On success, a pointer to the new deadlines is returned. On error,
+ * NULL is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct deadlines *deadlines_create(
+	size_t shards,
+	unsigned int idle_ms,
+	unsigned int read_ms,
+	unsigned int handler_ms,
+	int sigpipe
+);
+
+/**
+ * Waits for the timer thread of 'deadlines' to quit, and frees
+ * 'deadlines'. The caller must already have signalled 'sigpipe', and
+ * every client connection must have been stopped.
+ */
+void deadlines_destroy(struct deadlines *deadlines);
+
+/**
+ * Starts the handler deadline of 'conn'. Does nothing if 'conn' has
+ * no deadlines, as for every function below.
+ */
+void deadlines_conn_start(struct maxserver_conn *conn);
+
+/**
+ * Cancels every deadline of 'conn'. Must be called before its client
+ * socket is closed.
+ */
+void deadlines_conn_stop(struct maxserver_conn *conn);
+
+/**
+ * Starts the idle deadline of 'conn' while it waits on its client
+ * socket, or restarts it if it is running.
+ */
+void deadlines_wait_begin(struct maxserver_conn *conn);
+
+/**
+ * Ends the idle deadline of 'conn'.
+ */
+void deadlines_wait_end(struct maxserver_conn *conn);
+
+/**
+ * Starts the read deadline of 'conn' when the client has started a
+ * frame, unless it is already running.
+ */
+void deadlines_frame_begin(struct maxserver_conn *conn);
+
+/**
+ * Ends the read deadline of 'conn' once the frame is complete.
+ */
+void deadlines_frame_end(struct maxserver_conn *conn);
+
+/**
+ * Returns non-zero if a deadline of 'conn' has passed, which shuts
+ * down its client socket.
+ */
+int deadlines_expired(const struct maxserver_conn *conn);
+
+#endif
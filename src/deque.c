@@ -0,0 +1,243 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "deque.h"
+
+#include <stdlib.h>
+
+#include "print_error.h"
+
+#define DEQUE_CACHE_LINE 64
+
+/**
+ * Data structure representing a bounded deque after Chase and Lev,
+ * with the memory orderings of Lê et al., "Correct and Efficient
+ * Work-Stealing for Weak Memory Models". 'top' only grows, through
+ * compare-and-swap by thieves and by the owner taking the last item,
+ * and 'bottom' is only written by the owner. They live on separate
+ * cache lines. The capacity is a power of two, so that positions map
+ * to slots with 'mask'.
+ */
+struct deque {
+	long top;
+	char top_pad[DEQUE_CACHE_LINE - sizeof(long)];
+	long bottom;
+	char bottom_pad[DEQUE_CACHE_LINE - sizeof(long)];
+	size_t mask;
+	void **items;
+};
+
+/**
+ * Creates a deque that holds at least 'len' pointers.
+ * On success, a pointer to the new deque is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct deque *deque_create(size_t len)
+{
+	struct deque *deque;
+	void *mem;
+	size_t cap;
+	int err;
+
+	if (len == 0 || len > ((size_t)-1 >> 2)) {
+		print_error_str("deque_create", "Invalid deque length.");
+		return NULL;
+	}
+
+	/* Round the capacity up to a power of two. */
+	for (cap = 1; cap < len; cap <<= 1) {
+	}
+
+	err = posix_memalign(&mem, DEQUE_CACHE_LINE, sizeof(struct deque));
+
+	if (err != 0) {
+		print_error("deque_create:posix_memalign", err);
+		return NULL;
+	}
+
+	deque = (struct deque *)mem;
+	deque->items = calloc(cap, sizeof(void *));
+
+	if (deque->items == NULL) {
+		print_error_errno("deque_create:calloc");
+		free(deque);
+		return NULL;
+	}
+
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->mask = cap - 1;
+
+	return deque;
+}
+
+/**
+ * Returns the number of pointers that 'deque' can hold.
+ */
+size_t deque_capacity(struct deque *deque)
+{
+	return deque->mask + 1;
+}
+
+/**
+ * Adds 'item' to the bottom of 'deque'. Must only be called by the
+ * owner thread.
+ * On success, zero is returned. If 'deque' is full, -1 is returned.
+ */
+int deque_push(struct deque *deque, void *item)
+{
+	long bottom;
+	long top;
+
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+	if ((size_t)(bottom - top) > deque->mask) {
+		return -1;
+	}
+
+	/* Store the item before publishing it to thieves. */
+	__atomic_store_n(
+		&deque->items[(size_t)bottom & deque->mask],
+		item,
+		__ATOMIC_RELAXED
+	);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/**
+ * Removes the pointer at the bottom of 'deque', which is the one most
+ * recently pushed. Must only be called by the owner thread.
+ * Returns the pointer, or NULL if 'deque' is empty or a thief took
+ * the last pointer first.
+ */
+void *deque_pop(struct deque *deque)
+{
+	long bottom;
+	long top;
+	void *item;
+
+	/* Reserve the bottom item, then see whether thieves have
+	   reached it. */
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (top > bottom) {
+		/* Empty. */
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	item = __atomic_load_n(
+		&deque->items[(size_t)bottom & deque->mask],
+		__ATOMIC_RELAXED
+	);
+
+	if (top == bottom) {
+		/* Last item, race thieves for it. */
+		if (!__atomic_compare_exchange_n(
+			&deque->top,
+			&top,
+			top + 1,
+			0,
+			__ATOMIC_SEQ_CST,
+			__ATOMIC_RELAXED
+		)) {
+			item = NULL;
+		}
+
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+
+	return item;
+}
+
+/**
+ * Removes the pointer at the top of 'deque', which is the one least
+ * recently pushed, without taking any lock. May be called by any
+ * thread.
+ * Returns the pointer, or NULL if 'deque' is empty or another thread
+ * took the pointer first.
+ */
+void *deque_steal(struct deque *deque)
+{
+	long bottom;
+	long top;
+	void *item;
+
+	top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+	if (top >= bottom) {
+		return NULL;
+	}
+
+	/* Read the item before claiming it, since the owner may reuse
+	   the slot as soon as 'top' has moved. */
+	item = __atomic_load_n(
+		&deque->items[(size_t)top & deque->mask],
+		__ATOMIC_RELAXED
+	);
+
+	if (!__atomic_compare_exchange_n(
+		&deque->top,
+		&top,
+		top + 1,
+		0,
+		__ATOMIC_SEQ_CST,
+		__ATOMIC_RELAXED
+	)) {
+		return NULL;
+	}
+
+	return item;
+}
+
+/**
+ * Returns the number of pointers in 'deque'. The count is only a
+ * snapshot while the owner or thieves are running.
+ */
+size_t deque_count(struct deque *deque)
+{
+	long bottom;
+	long top;
+
+	top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+
+	return bottom > top ? (size_t)(bottom - top) : 0;
+}
+
+/**
+ * Frees 'deque'. Pointers still in it are not touched.
+ */
+void deque_destroy(struct deque *deque)
+{
+	free(deque->items);
+	free(deque);
+}
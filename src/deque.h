@@ -0,0 +1,82 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stddef.h>
+
+/**
+ * Opaque data structure representing a bounded Chase-Lev work-stealing
+ * deque of pointers. One owner thread pushes and pops at the bottom,
+ * and any thread may steal from the top.
+ */
+struct deque;
+
+/**
+ * Creates a deque that holds at least 'len' pointers.
+ * On success, a pointer to the new deque is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct deque *deque_create(size_t len);
+
+/**
+ * Returns the number of pointers that 'deque' can hold.
+ */
+size_t deque_capacity(struct deque *deque);
+
+/**
+ * Adds 'item' to the bottom of 'deque'. Must only be called by the
+ * owner thread.
+ * On success, zero is returned. If 'deque' is full, -1 is returned.
+ */
+int deque_push(struct deque *deque, void *item);
+
+/**
+ * Removes the pointer at the bottom of 'deque', which is the one most
+ * recently pushed. Must only be called by the owner thread.
+ * Returns the pointer, or NULL if 'deque' is empty or a thief took
+ * the last pointer first.
+ */
+void *deque_pop(struct deque *deque);
+
+/**
+ * Removes the pointer at the top of 'deque', which is the one least
+ * recently pushed, without taking any lock. May be called by any
+ * thread.
+ * Returns the pointer, or NULL if 'deque' is empty or another thread
+ * took the pointer first.
+ */
+void *deque_steal(struct deque *deque);
+
+/**
+ * Returns the number of pointers in 'deque'. The count is only a
+ * snapshot while the owner or thieves are running.
+ */
+size_t deque_count(struct deque *deque);
+
+/**
+ * Frees 'deque'. Pointers still in it are not touched.
+ */
+void deque_destroy(struct deque *deque);
+
+#endif
@@ -0,0 +1,609 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "evloop.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "print_error.h"
+#include "conn.h"
+#include "deadline.h"
+#include "metrics.h"
+
+#define EVLOOP_MAX_EVENTS 256
+#define EVLOOP_READ_BUF_LEN 16384
+
+/**
+ * Data structure representing an event loop thread. 'conns' links
+ * every client connection owned by the thread, and is protected by
+ * 'lock' since client connections are inserted by the accept thread.
+ * 'buf' receives the data passed to 'on_data'.
+ */
+struct evloop_reactor {
+	pthread_t tid;
+	int started;
+	int epfd;
+	pthread_mutex_t lock;
+	struct maxserver_conn *conns;
+	struct evloop *evloop;
+	char buf[EVLOOP_READ_BUF_LEN];
+};
+
+/**
+ * Data structure representing a set of event loop threads.
+ */
+struct evloop {
+	struct maxserver_evloop_callbacks callbacks;
+	struct evloop_reactor *reactors;
+	size_t threads;
+	size_t next;
+	int sigpipe;
+};
+
+/**
+ * Inserts 'conn' into the client connections of 'reactor'.
+ */
+static void evloop_conns_insert(
+	struct evloop_reactor *reactor,
+	struct maxserver_conn *conn
+)
+{
+	pthread_mutex_lock(&reactor->lock);
+
+	conn->reactor = reactor;
+	conn->prev = NULL;
+	conn->next = reactor->conns;
+
+	if (reactor->conns != NULL) {
+		reactor->conns->prev = conn;
+	}
+
+	reactor->conns = conn;
+
+	pthread_mutex_unlock(&reactor->lock);
+}
+
+/**
+ * Removes 'conn' from the client connections of its event loop
+ * thread.
+ */
+static void evloop_conns_remove(struct maxserver_conn *conn)
+{
+	struct evloop_reactor *reactor = conn->reactor;
+
+	pthread_mutex_lock(&reactor->lock);
+
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	} else {
+		reactor->conns = conn->next;
+	}
+
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+
+	pthread_mutex_unlock(&reactor->lock);
+}
+
+/**
+ * Writes as much of the buffered output of 'conn' as the client
+ * socket accepts, and marks 'conn' as closing if writing fails.
+ */
+static void evloop_conn_flush(struct maxserver_conn *conn)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < conn->out_len) {
+		n = write(conn->fd, conn->out + off, conn->out_len - off);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				conn->closing = 1;
+			}
+
+			break;
+		}
+
+		off += (size_t)n;
+	}
+
+	conn_count(conn, 0, off);
+	memmove(conn->out, conn->out + off, conn->out_len - off);
+	conn->out_len -= off;
+}
+
+/**
+ * Sends 'len' bytes of 'data' to 'conn', and buffers whatever the
+ * client socket does not accept until it becomes writable. Output is
+ * only written directly when nothing is buffered, so it is never
+ * reordered. Ends the read deadline of 'conn', since the client has
+ * been answered, and throttles 'conn' once more than 'send_high'
+ * bytes are buffered.
+ * On success, zero is returned, or 1 if 'conn' is throttled. On
+ * error, -1 is returned, and an appropriate error message is printed
+ * to standard error if the output could not be buffered.
+ */
+static int evloop_conn_send(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len
+)
+{
+	const char *p = data;
+	size_t cap;
+	char *out;
+	ssize_t n;
+
+	if (conn->closing) {
+		return -1;
+	}
+
+	deadlines_frame_end(conn);
+
+	/* Write directly while nothing is buffered. */
+	while (conn->out_len == 0 && len > 0) {
+		n = write(conn->fd, p, len);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				conn->closing = 1;
+				return -1;
+			}
+
+			break;
+		}
+
+		p += n;
+		len -= (size_t)n;
+		conn_count(conn, 0, (size_t)n);
+	}
+
+	if (len == 0) {
+		return conn->throttled;
+	}
+
+	/* Buffer the rest until the client socket is writable. */
+	if (conn->out_len + len > conn->out_cap) {
+		cap = conn->out_cap > 0 ? conn->out_cap * 2 : len;
+
+		while (cap < conn->out_len + len) {
+			cap *= 2;
+		}
+
+		out = realloc(conn->out, cap);
+
+		if (out == NULL) {
+			print_error_errno("evloop_conn_send:realloc");
+			conn->closing = 1;
+			return -1;
+		}
+
+		conn->out = out;
+		conn->out_cap = cap;
+	}
+
+	memcpy(conn->out + conn->out_len, p, len);
+	conn->out_len += len;
+
+	if (conn->out_len > conn->send_high) {
+		conn->throttled = 1;
+	}
+
+	return conn->throttled;
+}
+
+/**
+ * Reads from the client socket of 'conn' until it would block, and
+ * calls 'on_data' with every chunk read, counting each call as a
+ * handler invocation and resetting the arena of 'conn' after it.
+ * Every chunk restarts the idle deadline of 'conn', and starts its
+ * read deadline unless it is running. Stops early once 'conn' is
+ * throttled. Marks 'conn' as closing on end-of-file or error.
+ */
+static void evloop_conn_read(
+	struct evloop *evloop,
+	struct maxserver_conn *conn
+)
+{
+	char *buf = conn->reactor->buf;
+	unsigned long long start;
+	ssize_t n;
+
+	while (!conn->closing && !conn->throttled) {
+		n = read(conn->fd, buf, EVLOOP_READ_BUF_LEN);
+
+		if (n > 0) {
+			conn_count(conn, (size_t)n, 0);
+			deadlines_wait_begin(conn);
+			deadlines_frame_begin(conn);
+			start = metrics_start(conn->metrics);
+			evloop->callbacks.on_data(conn, buf, (size_t)n);
+			metrics_handled(conn->metrics, start);
+			maxserver_arena_reset(&conn->arena);
+		} else if (n == 0) {
+			conn->closing = 1;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		} else if (errno != EINTR) {
+			conn->closing = 1;
+		}
+	}
+}
+
+/**
+ * Calls 'on_close' if 'conn' has been opened, cancels its deadlines,
+ * and closes and frees 'conn'. Buffered output that the client socket
+ * accepts without blocking is written first.
+ */
+static void evloop_conn_close(
+	struct evloop *evloop,
+	struct maxserver_conn *conn
+)
+{
+	if (conn->opened && evloop->callbacks.on_close != NULL) {
+		evloop->callbacks.on_close(conn);
+	}
+
+	if (conn->out_len > 0) {
+		evloop_conn_flush(conn);
+	}
+
+	evloop_conns_remove(conn);
+	deadlines_conn_stop(conn);
+	close(conn->fd);
+	conn_destroy(conn);
+}
+
+/**
+ * Calls the callbacks of 'conn' corresponding to 'events'.
+ */
+static void evloop_conn_events(
+	struct evloop *evloop,
+	struct maxserver_conn *conn,
+	unsigned int events
+)
+{
+	unsigned long long start;
+	int err;
+
+	/* The first event of a client connection opens it. */
+	if (!conn->opened) {
+		if (evloop->callbacks.on_open != NULL) {
+			err = evloop->callbacks.on_open(conn);
+
+			if (err == -1) {
+				evloop_conn_close(evloop, conn);
+				return;
+			}
+		}
+
+		conn->opened = 1;
+		deadlines_wait_begin(conn);
+	}
+
+	/* Buffered output goes out before any callback adds more. */
+	if (!conn->closing && (events & EPOLLOUT) && conn->out_len > 0) {
+		evloop_conn_flush(conn);
+	}
+
+	/* Client sockets are edge-triggered, so the input left unread
+	   while 'conn' was throttled is read as soon as it is not. */
+	if (conn->throttled && conn->out_len < conn->send_low) {
+		conn->throttled = 0;
+		events |= EPOLLIN;
+	}
+
+	if (
+		!conn->closing &&
+		!conn->throttled &&
+		(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+	) {
+		if (evloop->callbacks.on_data != NULL) {
+			evloop_conn_read(evloop, conn);
+		} else if (evloop->callbacks.on_readable != NULL) {
+			deadlines_wait_begin(conn);
+			deadlines_frame_begin(conn);
+			start = metrics_start(conn->metrics);
+			evloop->callbacks.on_readable(conn);
+			metrics_handled(conn->metrics, start);
+		}
+	}
+
+	if (
+		!conn->closing &&
+		(events & EPOLLOUT) &&
+		evloop->callbacks.on_writable != NULL
+	) {
+		start = metrics_start(conn->metrics);
+		evloop->callbacks.on_writable(conn);
+		metrics_handled(conn->metrics, start);
+	}
+
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		conn->closing = 1;
+	}
+
+	/* Whatever the callbacks allocated from the arena dies with
+	   them. */
+	maxserver_arena_reset(&conn->arena);
+
+	if (conn->closing) {
+		evloop_conn_close(evloop, conn);
+	}
+}
+
+/**
+ * Dispatches events of the client connections of 'arg' until the
+ * signal pipe becomes readable.
+ */
+static void *evloop_reactor_thread(void *arg)
+{
+	struct evloop_reactor *reactor;
+	struct epoll_event events[EVLOOP_MAX_EVENTS];
+	int quit = 0;
+	int n, i;
+
+	reactor = (struct evloop_reactor *)arg;
+
+	while (!quit) {
+		n = epoll_wait(reactor->epfd, events, EVLOOP_MAX_EVENTS, -1);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			print_error_errno("evloop_reactor_thread:epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; ++i) {
+			/* The signal pipe is registered without a
+			   client connection. */
+			if (events[i].data.ptr == NULL) {
+				quit = 1;
+				continue;
+			}
+
+			evloop_conn_events(
+				reactor->evloop,
+				events[i].data.ptr,
+				events[i].events
+			);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Cancels and joins started event loop threads, and frees 'evloop'.
+ * Used when the event loop threads have not been given any client
+ * connection.
+ */
+static void evloop_abort(struct evloop *evloop)
+{
+	struct evloop_reactor *reactor;
+	size_t i;
+
+	for (i = 0; i < evloop->threads; ++i) {
+		reactor = &evloop->reactors[i];
+
+		if (reactor->started) {
+			pthread_cancel(reactor->tid);
+			pthread_join(reactor->tid, NULL);
+		}
+
+		if (reactor->epfd != -1) {
+			close(reactor->epfd);
+			pthread_mutex_destroy(&reactor->lock);
+		}
+	}
+
+	free(evloop->reactors);
+	free(evloop);
+}
+
+/**
+ * Creates 'threads' event loop threads that call 'callbacks' on
+ * client connections submitted to them, and quit when 'sigpipe'
+ * becomes readable.
+ * On success, a pointer to the new event loop is returned. On error,
+ * NULL is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct evloop *evloop_create(
+	size_t threads,
+	const struct maxserver_evloop_callbacks *callbacks,
+	int sigpipe
+)
+{
+	struct evloop *evloop;
+	struct evloop_reactor *reactor;
+	struct epoll_event ev;
+	int err;
+	size_t i;
+
+	if (threads == 0) {
+		print_error_str(
+			"evloop_create",
+			"Invalid number of event loop threads."
+		);
+		return NULL;
+	}
+
+	/* Allocate event loop data structures. */
+	evloop = calloc(1, sizeof(struct evloop));
+
+	if (evloop == NULL) {
+		print_error_errno("evloop_create:calloc");
+		return NULL;
+	}
+
+	evloop->reactors = calloc(threads, sizeof(struct evloop_reactor));
+
+	if (evloop->reactors == NULL) {
+		print_error_errno("evloop_create:calloc");
+		free(evloop);
+		return NULL;
+	}
+
+	evloop->callbacks = *callbacks;
+	evloop->threads = threads;
+	evloop->sigpipe = sigpipe;
+
+	for (i = 0; i < threads; ++i) {
+		evloop->reactors[i].epfd = -1;
+	}
+
+	for (i = 0; i < threads; ++i) {
+		reactor = &evloop->reactors[i];
+		reactor->evloop = evloop;
+
+		/* Create epoll instance watching the signal pipe. */
+		reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+		if (reactor->epfd == -1) {
+			print_error_errno("evloop_create:epoll_create1");
+			evloop_abort(evloop);
+			return NULL;
+		}
+
+		pthread_mutex_init(&reactor->lock, NULL);
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		err = epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, sigpipe, &ev);
+
+		if (err == -1) {
+			print_error_errno("evloop_create:epoll_ctl");
+			evloop_abort(evloop);
+			return NULL;
+		}
+
+		/* Start event loop thread. */
+		err = pthread_create(
+			&reactor->tid,
+			NULL,
+			evloop_reactor_thread,
+			reactor
+		);
+
+		if (err != 0) {
+			print_error("evloop_create:pthread_create", err);
+			evloop_abort(evloop);
+			return NULL;
+		}
+
+		reactor->started = 1;
+	}
+
+	return evloop;
+}
+
+/**
+ * Hands 'conn', whose client socket must be non-blocking, to one of
+ * the event loop threads of 'evloop', which calls 'on_open' from its
+ * own thread.
+ * On success, zero is returned. On error, -1 is returned, an
+ * appropriate error message is printed to standard error, and the
+ * caller remains responsible for 'conn'.
+ */
+int evloop_submit(struct evloop *evloop, struct maxserver_conn *conn)
+{
+	struct evloop_reactor *reactor;
+	struct epoll_event ev;
+	int cfd = conn->fd;
+	int err;
+
+	/* Pick event loop thread in round-robin order. Every accept
+	   thread submits, so the counter is advanced atomically. */
+	reactor = &evloop->reactors[
+		__atomic_fetch_add(&evloop->next, 1, __ATOMIC_RELAXED) %
+		evloop->threads
+	];
+
+	conn->send = evloop_conn_send;
+	evloop_conns_insert(reactor, conn);
+
+	/* Register client socket. Since it is writable right away, the
+	   event loop thread gets an event that opens it. */
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	err = epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, cfd, &ev);
+
+	if (err == -1) {
+		print_error_errno("evloop_submit:epoll_ctl");
+		evloop_conns_remove(conn);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Waits for the event loop threads of 'evloop' to quit, closes every
+ * remaining client connection and frees 'evloop'. The caller must
+ * already have signalled 'sigpipe'.
+ */
+void evloop_destroy(struct evloop *evloop)
+{
+	struct evloop_reactor *reactor;
+	int err;
+	size_t i;
+
+	for (i = 0; i < evloop->threads; ++i) {
+		reactor = &evloop->reactors[i];
+
+		/* Wait for event loop thread to quit. */
+		err = pthread_join(reactor->tid, NULL);
+
+		if (err != 0) {
+			print_error("evloop_destroy:pthread_join", err);
+		}
+
+		/* Close remaining client connections. */
+		while (reactor->conns != NULL) {
+			evloop_conn_close(evloop, reactor->conns);
+		}
+
+		close(reactor->epfd);
+		pthread_mutex_destroy(&reactor->lock);
+	}
+
+	free(evloop->reactors);
+	free(evloop);
+}
@@ -0,0 +1,66 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stddef.h>
+
+#include "maxserver.h"
+
+/**
+ * Opaque data structure representing a set of epoll event loop
+ * threads.
+ */
+struct evloop;
+
+/**
+ * Creates 'threads' event loop threads that call 'callbacks' on
+ * client connections submitted to them, and quit when 'sigpipe'
+ * becomes readable.
+ * On success, a pointer to the new event loop is returned. On error,
+ * NULL is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct evloop *evloop_create(
+	size_t threads,
+	const struct maxserver_evloop_callbacks *callbacks,
+	int sigpipe
+);
+
+/**
+ * Hands 'conn', whose client socket must be non-blocking, to one of
+ * the event loop threads of 'evloop', which calls 'on_open' from its
+ * own thread.
+ * On success, zero is returned. On error, -1 is returned, an
+ * appropriate error message is printed to standard error, and the
+ * caller remains responsible for 'conn'.
+ */
+int evloop_submit(struct evloop *evloop, struct maxserver_conn *conn);
+
+/**
+ * Waits for the event loop threads of 'evloop' to quit, closes every
+ * remaining client connection and frees 'evloop'. The caller must
+ * already have signalled 'sigpipe'.
+ */
+void evloop_destroy(struct evloop *evloop);
+
+#endif
@@ -0,0 +1,1120 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include "fiber.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#include "print_error.h"
+#include "conn.h"
+#include "deadline.h"
+
+#define FIBER_MAX_EVENTS 256
+#define FIBER_CACHE_LEN 64
+#define FIBER_STACK_MIN 16384
+
+#if defined(__x86_64__)
+
+/**
+ * Data structure representing a suspended execution context, which
+ * is the stack pointer that 'fiber_switch' saved the callee-saved
+ * registers and the floating-point control words below.
+ */
+struct fiber_context {
+	void *sp;
+};
+
+/**
+ * Saves the callee-saved registers and the floating-point control
+ * words of the caller on its stack, stores its stack pointer in
+ * 'save', and resumes the context suspended at stack pointer 'sp'.
+ * Returns when the caller is resumed in turn.
+ */
+void fiber_switch(void **save, void *sp)
+	__attribute__((visibility("hidden")));
+
+/**
+ * Entry point of a new fiber, resumed by 'fiber_switch' on the stack
+ * built by 'fiber_context_init'. Calls the function in r12 with the
+ * argument in rbx.
+ */
+void fiber_trampoline()
+	__attribute__((visibility("hidden")));
+
+__asm__(
+	".pushsection .text\n"
+	".globl fiber_switch\n"
+	".hidden fiber_switch\n"
+	".type fiber_switch, @function\n"
+	"fiber_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size fiber_switch, .-fiber_switch\n"
+	".globl fiber_trampoline\n"
+	".hidden fiber_trampoline\n"
+	".type fiber_trampoline, @function\n"
+	"fiber_trampoline:\n"
+	"	movq %rbx, %rdi\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size fiber_trampoline, .-fiber_trampoline\n"
+	".popsection\n"
+);
+
+#else
+
+/**
+ * Data structure representing a suspended execution context.
+ */
+struct fiber_context {
+	ucontext_t uc;
+};
+
+#endif
+
+/**
+ * States of a fiber.
+ */
+enum fiber_state {
+	FIBER_READY,
+	FIBER_RUNNING,
+	FIBER_WAITING,
+	FIBER_DONE
+};
+
+/**
+ * Data structure representing a fiber, which runs 'client_thread' on
+ * 'conn' on its own stack. It lives at the top of the memory mapping
+ * 'map' of 'map_len' bytes, whose lowest page is a guard page and the
+ * rest is the stack.
+ *
+ * 'fd' is the file descriptor that the fiber has registered with the
+ * epoll instance of its scheduler thread, or -1, and 'waiting_fd' is
+ * set while the registration is armed. 'timer' is the index plus one
+ * of the fiber in the timer heap of its scheduler thread, or zero.
+ * 'prev' and 'next' link every fiber of the scheduler thread, and
+ * 'ready_next' links ready fibers and cached fibers.
+ */
+struct fiber {
+	struct fiber_context ctx;
+	struct fiber_thread *thread;
+	struct maxserver_conn *conn;
+	enum fiber_state state;
+	int fd;
+	int waiting_fd;
+	int result;
+	unsigned long long deadline;
+	size_t timer;
+	struct fiber *prev;
+	struct fiber *next;
+	struct fiber *ready_next;
+	void *map;
+	size_t map_len;
+};
+
+/**
+ * Data structure representing a scheduler thread. 'incoming' links
+ * the client connections submitted by accept threads with their
+ * 'next' field, and is protected by 'lock'. The eventfd 'event'
+ * becomes readable when 'incoming' stops being empty.
+ *
+ * Every other field is only used by the scheduler thread. 'ctx' is
+ * its own context while a fiber runs, 'fibers' links every fiber,
+ * 'ready' and 'ready_tail' the fibers waiting to run in order, and
+ * 'cache' up to FIBER_CACHE_LEN returned fibers whose stacks are
+ * reused. 'timers' is a binary min-heap of waiting fibers ordered by
+ * deadline.
+ */
+struct fiber_thread {
+	pthread_t tid;
+	int started;
+	int epfd;
+	int event;
+	pthread_mutex_t lock;
+	struct maxserver_conn *incoming;
+	struct maxserver_conn *incoming_tail;
+	struct fiber_sched *sched;
+	struct fiber_context ctx;
+	struct fiber *current;
+	struct fiber *fibers;
+	struct fiber *ready;
+	struct fiber *ready_tail;
+	struct fiber *cache;
+	size_t cache_len;
+	struct fiber **timers;
+	size_t timers_len;
+	size_t timers_cap;
+	int stopping;
+};
+
+/**
+ * Data structure representing a set of scheduler threads.
+ */
+struct fiber_sched {
+	struct fiber_thread *threads;
+	size_t len;
+	size_t next;
+	size_t stack_size;
+	void (*client_thread)(int cfd, int sigpipe);
+	int sigpipe;
+};
+
+/**
+ * Thread-local variable holding the scheduler thread that the calling
+ * thread is, or NULL if it is not a scheduler thread.
+ */
+static __thread struct fiber_thread *fiber_thread_current = NULL;
+
+/**
+ * Returns the current time of CLOCK_MONOTONIC in nanoseconds.
+ */
+static unsigned long long fiber_now()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (unsigned long long)now.tv_sec * 1000000000 +
+		(unsigned long long)now.tv_nsec;
+}
+
+/**
+ * Runs the client thread of the scheduler of 'fiber' on its client
+ * connection, and switches back to the scheduler thread for good.
+ */
+static void fiber_main(struct fiber *fiber);
+
+#if defined(__x86_64__)
+
+/**
+ * Prepares 'fiber' to call 'fiber_main' on the stack below 'top' the
+ * first time it is switched to. The initial frame holds the return
+ * address and registers that 'fiber_switch' pops, with the default
+ * floating-point control words.
+ */
+static void fiber_context_init(struct fiber *fiber, void *top)
+{
+	uint64_t *sp = (uint64_t *)((uintptr_t)top & ~(uintptr_t)15);
+
+	*--sp = (uint64_t)(uintptr_t)fiber_trampoline;
+	*--sp = 0;
+	*--sp = (uint64_t)(uintptr_t)fiber;
+	*--sp = (uint64_t)(uintptr_t)fiber_main;
+	*--sp = 0;
+	*--sp = 0;
+	*--sp = 0;
+	*--sp = 0x1f80 | (uint64_t)0x037f << 32;
+
+	fiber->ctx.sp = sp;
+}
+
+/**
+ * Suspends the caller in 'from' and resumes 'to'.
+ */
+static void fiber_context_switch(
+	struct fiber_context *from,
+	struct fiber_context *to
+)
+{
+	fiber_switch(&from->sp, to->sp);
+}
+
+#else
+
+/**
+ * Calls 'fiber_main' on the fiber whose address is split into 'hi'
+ * and 'lo', since 'makecontext' only passes int arguments.
+ */
+static void fiber_entry(unsigned int hi, unsigned int lo)
+{
+	fiber_main((struct fiber *)(uintptr_t)(
+		(unsigned long long)hi << 32 | lo
+	));
+}
+
+/**
+ * Prepares 'fiber' to call 'fiber_main' on the stack between the end
+ * of its guard page and 'top' the first time it is switched to.
+ */
+static void fiber_context_init(struct fiber *fiber, void *top)
+{
+	unsigned long long addr = (uintptr_t)fiber;
+	char *base = (char *)fiber->map + sysconf(_SC_PAGESIZE);
+
+	getcontext(&fiber->ctx.uc);
+	fiber->ctx.uc.uc_stack.ss_sp = base;
+	fiber->ctx.uc.uc_stack.ss_size = (size_t)((char *)top - base);
+	fiber->ctx.uc.uc_link = NULL;
+	makecontext(
+		&fiber->ctx.uc,
+		(void (*)(void))fiber_entry,
+		2,
+		(unsigned int)(addr >> 32),
+		(unsigned int)addr
+	);
+}
+
+/**
+ * Suspends the caller in 'from' and resumes 'to'.
+ */
+static void fiber_context_switch(
+	struct fiber_context *from,
+	struct fiber_context *to
+)
+{
+	swapcontext(&from->uc, &to->uc);
+}
+
+#endif
+
+/**
+ * Swaps the fibers at indexes 'i' and 'j' of the timer heap of
+ * 'thread'.
+ */
+static void fiber_timers_swap(
+	struct fiber_thread *thread,
+	size_t i,
+	size_t j
+)
+{
+	struct fiber *fiber = thread->timers[i];
+
+	thread->timers[i] = thread->timers[j];
+	thread->timers[j] = fiber;
+	thread->timers[i]->timer = i + 1;
+	thread->timers[j]->timer = j + 1;
+}
+
+/**
+ * Restores the heap order of the timer heap of 'thread' around index
+ * 'i', moving the fiber there up or down.
+ */
+static void fiber_timers_fix(struct fiber_thread *thread, size_t i)
+{
+	struct fiber **timers = thread->timers;
+	size_t child;
+
+	while (i > 0 &&
+		timers[i]->deadline < timers[(i - 1) / 2]->deadline) {
+		fiber_timers_swap(thread, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	for (;;) {
+		child = 2 * i + 1;
+
+		if (child >= thread->timers_len) {
+			break;
+		}
+
+		if (child + 1 < thread->timers_len &&
+			timers[child + 1]->deadline < timers[child]->deadline) {
+			++child;
+		}
+
+		if (timers[i]->deadline <= timers[child]->deadline) {
+			break;
+		}
+
+		fiber_timers_swap(thread, i, child);
+		i = child;
+	}
+}
+
+/**
+ * Inserts 'fiber' into the timer heap of its scheduler thread.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int fiber_timers_insert(struct fiber *fiber)
+{
+	struct fiber_thread *thread = fiber->thread;
+	struct fiber **timers;
+	size_t cap;
+
+	if (thread->timers_len == thread->timers_cap) {
+		cap = thread->timers_cap == 0 ? 64 : thread->timers_cap * 2;
+		timers = realloc(thread->timers, sizeof(struct fiber *) * cap);
+
+		if (timers == NULL) {
+			print_error_errno("fiber_timers_insert:realloc");
+			return -1;
+		}
+
+		thread->timers = timers;
+		thread->timers_cap = cap;
+	}
+
+	thread->timers[thread->timers_len] = fiber;
+	fiber->timer = ++thread->timers_len;
+	fiber_timers_fix(thread, fiber->timer - 1);
+
+	return 0;
+}
+
+/**
+ * Removes 'fiber' from the timer heap of its scheduler thread.
+ */
+static void fiber_timers_remove(struct fiber *fiber)
+{
+	struct fiber_thread *thread = fiber->thread;
+	size_t i = fiber->timer - 1;
+
+	fiber->timer = 0;
+
+	if (i == --thread->timers_len) {
+		return;
+	}
+
+	thread->timers[i] = thread->timers[thread->timers_len];
+	thread->timers[i]->timer = i + 1;
+	fiber_timers_fix(thread, i);
+}
+
+/**
+ * Appends 'fiber' to the ready fibers of its scheduler thread.
+ */
+static void fiber_ready(struct fiber *fiber)
+{
+	struct fiber_thread *thread = fiber->thread;
+
+	fiber->state = FIBER_READY;
+	fiber->ready_next = NULL;
+
+	if (thread->ready_tail != NULL) {
+		thread->ready_tail->ready_next = fiber;
+	} else {
+		thread->ready = fiber;
+	}
+
+	thread->ready_tail = fiber;
+}
+
+/**
+ * Makes waiting 'fiber' ready with 'result' as the result of
+ * 'fiber_wait'. Unless its file descriptor became ready, its epoll
+ * registration is removed, so that no event can reach it after it
+ * has moved on.
+ */
+static void fiber_wake(struct fiber *fiber, int result)
+{
+	if (fiber->timer != 0) {
+		fiber_timers_remove(fiber);
+	}
+
+	if (fiber->waiting_fd && result != 1) {
+		epoll_ctl(fiber->thread->epfd, EPOLL_CTL_DEL, fiber->fd, NULL);
+		fiber->fd = -1;
+	}
+
+	fiber->waiting_fd = 0;
+	fiber->result = result;
+	fiber_ready(fiber);
+}
+
+/**
+ * Allocates a fiber for 'conn' on 'thread', reusing a cached stack if
+ * there is one, and makes it ready.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int fiber_start(
+	struct fiber_thread *thread,
+	struct maxserver_conn *conn
+)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t map_len;
+	struct fiber *fiber;
+	void *map;
+
+	fiber = thread->cache;
+
+	if (fiber != NULL) {
+		thread->cache = fiber->ready_next;
+		--thread->cache_len;
+		map = fiber->map;
+		map_len = fiber->map_len;
+	} else {
+		/* Map the stack with a guard page below it, and place the
+		   fiber itself at its top. */
+		map_len = page + thread->sched->stack_size;
+		map = mmap(
+			NULL,
+			map_len,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+			-1,
+			0
+		);
+
+		if (map == MAP_FAILED) {
+			print_error_errno("fiber_start:mmap");
+			return -1;
+		}
+
+		if (mprotect(map, page, PROT_NONE) == -1) {
+			print_error_errno("fiber_start:mprotect");
+			munmap(map, map_len);
+			return -1;
+		}
+
+		fiber = (struct fiber *)(((uintptr_t)map + map_len -
+			sizeof(struct fiber)) & ~(uintptr_t)63);
+	}
+
+	memset(fiber, 0, sizeof(struct fiber));
+	fiber->thread = thread;
+	fiber->conn = conn;
+	fiber->fd = -1;
+	fiber->map = map;
+	fiber->map_len = map_len;
+	fiber_context_init(fiber, fiber);
+
+	/* Link fiber into the fibers of the scheduler thread. */
+	fiber->next = thread->fibers;
+
+	if (thread->fibers != NULL) {
+		thread->fibers->prev = fiber;
+	}
+
+	thread->fibers = fiber;
+	fiber_ready(fiber);
+
+	return 0;
+}
+
+/**
+ * Unlinks returned 'fiber' from its scheduler thread, and caches its
+ * stack for the next fiber, or unmaps it if the cache is full.
+ */
+static void fiber_release(struct fiber *fiber)
+{
+	struct fiber_thread *thread = fiber->thread;
+
+	if (fiber->prev != NULL) {
+		fiber->prev->next = fiber->next;
+	} else {
+		thread->fibers = fiber->next;
+	}
+
+	if (fiber->next != NULL) {
+		fiber->next->prev = fiber->prev;
+	}
+
+	if (thread->cache_len == FIBER_CACHE_LEN) {
+		munmap(fiber->map, fiber->map_len);
+		return;
+	}
+
+	fiber->ready_next = thread->cache;
+	thread->cache = fiber;
+	++thread->cache_len;
+}
+
+static void fiber_main(struct fiber *fiber)
+{
+	struct fiber_sched *sched = fiber->thread->sched;
+
+	conn_handle(fiber->conn, sched->client_thread, sched->sigpipe);
+
+	fiber->state = FIBER_DONE;
+	fiber_context_switch(&fiber->ctx, &fiber->thread->ctx);
+}
+
+/**
+ * Starts a fiber for every client connection submitted to 'thread'.
+ * Client connections that no fiber could be started for are closed.
+ */
+static void fiber_thread_accept(struct fiber_thread *thread)
+{
+	struct maxserver_conn *conn, *next;
+	uint64_t count;
+
+	/* Reset the event before taking the client connections, so
+	   that any submitted after it signals it again. */
+	read(thread->event, &count, sizeof(uint64_t));
+
+	pthread_mutex_lock(&thread->lock);
+	conn = thread->incoming;
+	thread->incoming = NULL;
+	thread->incoming_tail = NULL;
+	pthread_mutex_unlock(&thread->lock);
+
+	for (; conn != NULL; conn = next) {
+		next = conn->next;
+
+		if (fiber_start(thread, conn) == -1) {
+			close(conn->fd);
+			conn_destroy(conn);
+		}
+	}
+}
+
+/**
+ * Makes 'thread' stop waiting for the signal pipe, and wakes every
+ * waiting fiber with ECANCELED, as every later 'fiber_wait' returns.
+ */
+static void fiber_thread_stop(struct fiber_thread *thread)
+{
+	struct fiber *fiber;
+
+	thread->stopping = 1;
+	epoll_ctl(thread->epfd, EPOLL_CTL_DEL, thread->sched->sigpipe, NULL);
+
+	for (fiber = thread->fibers; fiber != NULL; fiber = fiber->next) {
+		if (fiber->state == FIBER_WAITING) {
+			fiber_wake(fiber, -1);
+		}
+	}
+}
+
+/**
+ * Runs every ready fiber of 'thread' until it waits or returns.
+ */
+static void fiber_thread_run(struct fiber_thread *thread)
+{
+	struct fiber *fiber;
+
+	while ((fiber = thread->ready) != NULL) {
+		thread->ready = fiber->ready_next;
+
+		if (thread->ready == NULL) {
+			thread->ready_tail = NULL;
+		}
+
+		/* Client connections are tracked per thread, so restore
+		   the one of the fiber. */
+		fiber->state = FIBER_RUNNING;
+		thread->current = fiber;
+		conn_set_current(fiber->conn);
+		fiber_context_switch(&thread->ctx, &fiber->ctx);
+		conn_set_current(NULL);
+		thread->current = NULL;
+
+		if (fiber->state == FIBER_DONE) {
+			fiber_release(fiber);
+		}
+	}
+}
+
+/**
+ * Returns the number of milliseconds until the earliest deadline of
+ * the fibers of 'thread', rounded up, or -1 if none of them has one.
+ */
+static int fiber_thread_timeout(struct fiber_thread *thread)
+{
+	unsigned long long now, deadline;
+
+	if (thread->timers_len == 0) {
+		return -1;
+	}
+
+	now = fiber_now();
+	deadline = thread->timers[0]->deadline;
+
+	if (deadline <= now) {
+		return 0;
+	}
+
+	return (int)((deadline - now + 999999) / 1000000);
+}
+
+/**
+ * Makes every fiber of 'thread' whose deadline has passed ready.
+ */
+static void fiber_thread_expire(struct fiber_thread *thread)
+{
+	unsigned long long now;
+
+	if (thread->timers_len == 0) {
+		return;
+	}
+
+	now = fiber_now();
+
+	while (thread->timers_len > 0 &&
+		thread->timers[0]->deadline <= now) {
+		fiber_wake(thread->timers[0], 0);
+	}
+}
+
+/**
+ * Runs the fibers of 'arg', and waits for their file descriptors and
+ * deadlines, until the signal pipe has become readable and every
+ * fiber has returned.
+ */
+static void *fiber_thread(void *arg)
+{
+	struct fiber_thread *thread;
+	struct epoll_event events[FIBER_MAX_EVENTS];
+	struct fiber *fiber;
+	int n, i;
+
+	thread = (struct fiber_thread *)arg;
+	fiber_thread_current = thread;
+
+	for (;;) {
+		fiber_thread_run(thread);
+
+		if (thread->stopping && thread->fibers == NULL) {
+			break;
+		}
+
+		n = epoll_wait(
+			thread->epfd,
+			events,
+			FIBER_MAX_EVENTS,
+			fiber_thread_timeout(thread)
+		);
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			print_error_errno("fiber_thread:epoll_wait");
+			break;
+		}
+
+		/* Wake fibers before running any of them, so that no
+		   event is handled after its fiber has returned. */
+		for (i = 0; i < n; ++i) {
+			/* The signal pipe is registered without a
+			   fiber, and the event with the thread. */
+			if (events[i].data.ptr == NULL) {
+				fiber_thread_stop(thread);
+				continue;
+			}
+
+			if (events[i].data.ptr == thread) {
+				fiber_thread_accept(thread);
+				continue;
+			}
+
+			fiber = events[i].data.ptr;
+
+			if (fiber->state == FIBER_WAITING &&
+				fiber->waiting_fd) {
+				fiber_wake(fiber, 1);
+			}
+		}
+
+		fiber_thread_expire(thread);
+	}
+
+	return NULL;
+}
+
+/**
+ * Closes and frees every client connection left on 'thread', unmaps
+ * the stacks of its fibers, and frees its data structures.
+ */
+static void fiber_thread_clear(struct fiber_thread *thread)
+{
+	struct maxserver_conn *conn, *next;
+	struct fiber *fiber;
+
+	for (conn = thread->incoming; conn != NULL; conn = next) {
+		next = conn->next;
+		close(conn->fd);
+		conn_destroy(conn);
+	}
+
+	/* Fibers are only left if the scheduler thread failed, and are
+	   dropped without returning. */
+	while ((fiber = thread->fibers) != NULL) {
+		thread->fibers = fiber->next;
+		deadlines_conn_stop(fiber->conn);
+		close(fiber->conn->fd);
+		conn_destroy(fiber->conn);
+		munmap(fiber->map, fiber->map_len);
+	}
+
+	while ((fiber = thread->cache) != NULL) {
+		thread->cache = fiber->ready_next;
+		munmap(fiber->map, fiber->map_len);
+	}
+
+	free(thread->timers);
+	close(thread->event);
+	close(thread->epfd);
+	pthread_mutex_destroy(&thread->lock);
+}
+
+/**
+ * Cancels and joins started scheduler threads, and frees 'sched'.
+ * Used when the scheduler threads have not been given any client
+ * connection.
+ */
+static void fiber_sched_abort(struct fiber_sched *sched)
+{
+	struct fiber_thread *thread;
+	size_t i;
+
+	for (i = 0; i < sched->len; ++i) {
+		thread = &sched->threads[i];
+
+		if (thread->started) {
+			pthread_cancel(thread->tid);
+			pthread_join(thread->tid, NULL);
+		}
+
+		if (thread->epfd != -1) {
+			close(thread->epfd);
+		}
+
+		if (thread->event != -1) {
+			close(thread->event);
+		}
+
+		pthread_mutex_destroy(&thread->lock);
+	}
+
+	free(sched->threads);
+	free(sched);
+}
+
+/**
+ * Creates 'threads' scheduler threads that each run 'client_thread'
+ * on client connections submitted to them, in a fiber with a stack of
+ * 'stack_size' bytes per client connection, and quit once 'sigpipe'
+ * has become readable and every fiber has returned.
+ * On success, a pointer to the new fiber scheduler is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
+ */
+struct fiber_sched *fiber_sched_create(
+	size_t threads,
+	size_t stack_size,
+	void (*client_thread)(int cfd, int sigpipe),
+	int sigpipe
+)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	struct fiber_sched *sched;
+	struct fiber_thread *thread;
+	struct epoll_event ev;
+	int err;
+	size_t i;
+
+	if (threads == 0) {
+		print_error_str(
+			"fiber_sched_create",
+			"Invalid number of fiber threads."
+		);
+		return NULL;
+	}
+
+	/* Allocate scheduler data structures. */
+	sched = calloc(1, sizeof(struct fiber_sched));
+
+	if (sched == NULL) {
+		print_error_errno("fiber_sched_create:calloc");
+		return NULL;
+	}
+
+	sched->threads = calloc(threads, sizeof(struct fiber_thread));
+
+	if (sched->threads == NULL) {
+		print_error_errno("fiber_sched_create:calloc");
+		free(sched);
+		return NULL;
+	}
+
+	/* Round the stack size up to whole pages, leaving room for
+	   the fiber itself at its top. */
+	if (stack_size < FIBER_STACK_MIN) {
+		stack_size = FIBER_STACK_MIN;
+	}
+
+	sched->stack_size = (stack_size + page - 1) / page * page;
+	sched->len = threads;
+	sched->client_thread = client_thread;
+	sched->sigpipe = sigpipe;
+
+	for (i = 0; i < threads; ++i) {
+		thread = &sched->threads[i];
+		thread->epfd = -1;
+		thread->event = -1;
+		thread->sched = sched;
+		pthread_mutex_init(&thread->lock, NULL);
+	}
+
+	for (i = 0; i < threads; ++i) {
+		thread = &sched->threads[i];
+
+		/* Create epoll instance watching the signal pipe and
+		   the event. */
+		thread->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+		if (thread->epfd == -1) {
+			print_error_errno("fiber_sched_create:epoll_create1");
+			fiber_sched_abort(sched);
+			return NULL;
+		}
+
+		thread->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if (thread->event == -1) {
+			print_error_errno("fiber_sched_create:eventfd");
+			fiber_sched_abort(sched);
+			return NULL;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		err = epoll_ctl(thread->epfd, EPOLL_CTL_ADD, sigpipe, &ev);
+
+		if (err != -1) {
+			ev.data.ptr = thread;
+			err = epoll_ctl(
+				thread->epfd,
+				EPOLL_CTL_ADD,
+				thread->event,
+				&ev
+			);
+		}
+
+		if (err == -1) {
+			print_error_errno("fiber_sched_create:epoll_ctl");
+			fiber_sched_abort(sched);
+			return NULL;
+		}
+
+		/* Start scheduler thread. */
+		err = pthread_create(&thread->tid, NULL, fiber_thread, thread);
+
+		if (err != 0) {
+			print_error("fiber_sched_create:pthread_create", err);
+			fiber_sched_abort(sched);
+			return NULL;
+		}
+
+		thread->started = 1;
+	}
+
+	return sched;
+}
+
+/**
+ * Hands 'conn', whose client socket must be non-blocking, to one of
+ * the scheduler threads of 'sched', which starts a fiber for it.
+ */
+void fiber_sched_submit(
+	struct fiber_sched *sched,
+	struct maxserver_conn *conn
+)
+{
+	struct fiber_thread *thread;
+	uint64_t one = 1;
+	int empty;
+
+	/* Pick scheduler thread in round-robin order. */
+	thread = &sched->threads[
+		__atomic_fetch_add(&sched->next, 1, __ATOMIC_RELAXED) %
+		sched->len
+	];
+
+	conn->next = NULL;
+
+	pthread_mutex_lock(&thread->lock);
+
+	empty = thread->incoming == NULL;
+
+	if (empty) {
+		thread->incoming = conn;
+	} else {
+		thread->incoming_tail->next = conn;
+	}
+
+	thread->incoming_tail = conn;
+
+	pthread_mutex_unlock(&thread->lock);
+
+	/* Only the first client connection needs to wake the
+	   thread. */
+	if (empty) {
+		write(thread->event, &one, sizeof(uint64_t));
+	}
+}
+
+/**
+ * Waits for the scheduler threads of 'sched' to quit, closes every
+ * remaining client connection and frees 'sched'. The caller must
+ * already have signalled 'sigpipe'.
+ */
+void fiber_sched_destroy(struct fiber_sched *sched)
+{
+	struct fiber_thread *thread;
+	int err;
+	size_t i;
+
+	for (i = 0; i < sched->len; ++i) {
+		thread = &sched->threads[i];
+
+		/* Wait for scheduler thread to quit. */
+		err = pthread_join(thread->tid, NULL);
+
+		if (err != 0) {
+			print_error("fiber_sched_destroy:pthread_join", err);
+		}
+
+		fiber_thread_clear(thread);
+	}
+
+	free(sched->threads);
+	free(sched);
+}
+
+/**
+ * Returns non-zero if the caller runs in a fiber.
+ */
+int fiber_running()
+{
+	return fiber_thread_current != NULL &&
+		fiber_thread_current->current != NULL;
+}
+
+/**
+ * Suspends the calling fiber until 'fd' gets any of the poll events
+ * 'events', or up to 'timeout_ms' milliseconds, where -1 means no
+ * timeout. If 'fd' is -1, only the timeout is waited for. Other
+ * fibers of the same scheduler thread run in the meantime. May only
+ * be called from a fiber.
+ * Returns 1 if 'fd' is ready, 0 if the timeout expired, and -1 with
+ * errno set to ECANCELED if the server is stopping. On error, -1 is
+ * returned, and an appropriate error message is printed to standard
+ * error.
+ */
+int fiber_wait(int fd, short events, int timeout_ms)
+{
+	struct fiber_thread *thread = fiber_thread_current;
+	struct fiber *fiber = thread->current;
+	struct epoll_event ev;
+	struct pollfd pfd;
+	int op, err;
+
+	if (thread->stopping) {
+		errno = ECANCELED;
+		return -1;
+	}
+
+	/* A zero timeout only polls. */
+	if (timeout_ms == 0) {
+		pfd.fd = fd;
+		pfd.events = events;
+		err = poll(&pfd, 1, 0);
+
+		if (err == -1) {
+			print_error_errno("fiber_wait:poll");
+			return -1;
+		}
+
+		return err;
+	}
+
+	if (timeout_ms > 0) {
+		fiber->deadline = fiber_now() +
+			(unsigned long long)timeout_ms * 1000000;
+
+		if (fiber_timers_insert(fiber) == -1) {
+			return -1;
+		}
+	}
+
+	/* Arm a one-shot registration of the file descriptor, keeping
+	   it registered between waits on the same one. */
+	if (fd != -1) {
+		ev.events = EPOLLONESHOT;
+		ev.events |= (events & POLLIN) ? EPOLLIN | EPOLLRDHUP : 0;
+		ev.events |= (events & POLLOUT) ? EPOLLOUT : 0;
+		ev.data.ptr = fiber;
+		op = fiber->fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		err = epoll_ctl(thread->epfd, op, fd, &ev);
+
+		/* The file descriptor may have been closed and reused,
+		   or still be registered by a returned fiber. */
+		if (err == -1 && (errno == ENOENT || errno == EEXIST)) {
+			op = errno == ENOENT ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+			err = epoll_ctl(thread->epfd, op, fd, &ev);
+		}
+
+		if (err == -1) {
+			print_error_errno("fiber_wait:epoll_ctl");
+			fiber->fd = -1;
+
+			if (fiber->timer != 0) {
+				fiber_timers_remove(fiber);
+			}
+
+			return -1;
+		}
+
+		fiber->fd = fd;
+		fiber->waiting_fd = 1;
+	}
+
+	/* Switch to the scheduler thread until woken. */
+	fiber->state = FIBER_WAITING;
+	fiber_context_switch(&fiber->ctx, &thread->ctx);
+
+	if (fiber->result == -1) {
+		errno = ECANCELED;
+	}
+
+	return fiber->result;
+}
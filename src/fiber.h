@@ -0,0 +1,86 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef FIBER_H
+#define FIBER_H
+
+#include <stddef.h>
+
+#include "maxserver.h"
+
+/**
+ * Opaque data structure representing a set of fiber scheduler
+ * threads.
+ */
+struct fiber_sched;
+
+/**
+ * Creates 'threads' scheduler threads that each run 'client_thread'
+ * on client connections submitted to them, in a fiber with a stack of
+ * 'stack_size' bytes per client connection, and quit once 'sigpipe'
+ * has become readable and every fiber has returned.
+ * On success, a pointer to the new fiber scheduler is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
+ */
+struct fiber_sched *fiber_sched_create(
+	size_t threads,
+	size_t stack_size,
+	void (*client_thread)(int cfd, int sigpipe),
+	int sigpipe
+);
+
+/**
+ * Hands 'conn', whose client socket must be non-blocking, to one of
+ * the scheduler threads of 'sched', which starts a fiber for it.
+ */
+void fiber_sched_submit(
+	struct fiber_sched *sched,
+	struct maxserver_conn *conn
+);
+
+/**
+ * Waits for the scheduler threads of 'sched' to quit, closes every
+ * remaining client connection and frees 'sched'. The caller must
+ * already have signalled 'sigpipe'.
+ */
+void fiber_sched_destroy(struct fiber_sched *sched);
+
+/**
+ * Returns non-zero if the caller runs in a fiber.
+ */
+int fiber_running();
+
+/**
+ * Suspends the calling fiber until 'fd' gets any of the poll events
+ * 'events', or up to 'timeout_ms' milliseconds, where -1 means no
+ * timeout. If 'fd' is -1, only the timeout is waited for. Other
+ * fibers of the same scheduler thread run in the meantime. May only
+ * be called from a fiber.
+ * Returns 1 if 'fd' is ready, 0 if the timeout expired, and -1 with
+ * errno set to ECANCELED if the server is stopping. On error, -1 is
+ * returned, and an appropriate error message is printed to standard
+ * error.
+ */
+int fiber_wait(int fd, short events, int timeout_ms);
+
+#endif
@@ -0,0 +1,521 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define LOG_RECORD_LEN 248
+#define LOG_RING_LEN 32
+#define LOG_BATCH_LEN (LOG_RING_LEN * LOG_RECORD_LEN)
+#define LOG_FLUSH_INTERVAL_MS 5
+#define LOG_DROP_REPORT_INTERVAL_S 1
+
+/**
+ * Data structure representing a formatted message.
+ */
+struct log_record {
+	unsigned int len;
+	int level;
+	char text[LOG_RECORD_LEN];
+};
+
+/**
+ * Data structure representing the log buffer of a thread, which is a
+ * single-producer single-consumer ring of messages. 'head' is only
+ * written by the owning thread and 'tail' only by the log flusher,
+ * and they are kept on separate cache lines. 'next' and 'orphaned'
+ * are protected by 'log_lock'. The ring is kept small, so that
+ * threads that log only a few messages, such as client threads, take
+ * little memory for it.
+ */
+struct log_ring {
+	struct log_record records[LOG_RING_LEN];
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+	int orphaned;
+	struct log_ring *next;
+};
+
+/**
+ * Data structure representing messages copied out of log buffers,
+ * gathered per file descriptor: 'text[0]' holds 'len[0]' bytes for
+ * standard output and 'text[1]' holds 'len[1]' bytes for standard
+ * error.
+ */
+struct log_batch {
+	char text[2][LOG_BATCH_LEN];
+	size_t len[2];
+};
+
+/**
+ * Global variable holding the mutex lock that protects the list of
+ * log buffers and the state of the log flusher. It is never taken
+ * when a message is written to a log buffer, and never held while
+ * writing to a file descriptor.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Global variable holding the condition variable that wakes up the
+ * log flusher early when it is stopped.
+ */
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Global variable holding the list of log buffers.
+ */
+static struct log_ring *log_rings = NULL;
+
+/**
+ * Global variable holding the number of references to the log
+ * flusher.
+ */
+static int log_refs = 0;
+
+/**
+ * Global variable that is non-zero while the log flusher is running.
+ * Read without 'log_lock' by threads writing messages.
+ */
+static int log_running = 0;
+
+/**
+ * Global variable that is non-zero when the log flusher should quit.
+ */
+static int log_stopping = 0;
+
+/**
+ * Global variable holding the thread ID of the log flusher.
+ */
+static pthread_t log_flusher_id;
+
+/**
+ * Global variable holding the key whose destructor releases the log
+ * buffer of an exiting thread.
+ */
+static pthread_key_t log_key;
+
+/**
+ * Global variable making sure that 'log_key' is created once.
+ */
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Global variable holding the messages that the log flusher has
+ * copied out of log buffers and writes next.
+ */
+static struct log_batch log_flusher_batch;
+
+/**
+ * Global variable holding the number of dropped messages.
+ */
+static unsigned long long log_dropped_count = 0;
+
+/**
+ * Thread-local variable holding the log buffer of the calling thread.
+ */
+static __thread struct log_ring *log_ring_self = NULL;
+
+/**
+ * Returns the file descriptor that messages of level 'level' are
+ * written to.
+ */
+static int log_level_fd(int level)
+{
+	return level <= LOG_LEVEL_WARN ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+/**
+ * Copies the messages in 'ring' to 'batch' and frees their records
+ * for reuse, until 'batch' is full. Must be called with 'log_lock'
+ * held, or by the only thread that can reach 'ring'.
+ * Returns 1 if every message was copied, and 0 otherwise.
+ */
+static int log_ring_drain(struct log_ring *ring, struct log_batch *batch)
+{
+	struct log_record *record;
+	unsigned long head, tail;
+	int i;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	for (; tail != head; ++tail) {
+		record = &ring->records[tail % LOG_RING_LEN];
+		i = log_level_fd(record->level) == STDERR_FILENO;
+
+		if (batch->len[i] + record->len > LOG_BATCH_LEN) {
+			break;
+		}
+
+		memcpy(
+			batch->text[i] + batch->len[i],
+			record->text,
+			record->len
+		);
+		batch->len[i] += record->len;
+	}
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	return tail == head;
+}
+
+/**
+ * Writes the messages in 'batch' with a single system call per file
+ * descriptor, and empties it. Must be called without 'log_lock' held.
+ */
+static void log_batch_write(struct log_batch *batch)
+{
+	if (batch->len[0] > 0) {
+		write(STDOUT_FILENO, batch->text[0], batch->len[0]);
+		batch->len[0] = 0;
+	}
+
+	if (batch->len[1] > 0) {
+		write(STDERR_FILENO, batch->text[1], batch->len[1]);
+		batch->len[1] = 0;
+	}
+}
+
+/**
+ * Copies buffered messages to 'batch', frees the log buffers of
+ * exited threads once they are empty, and reports dropped messages at
+ * most once every LOG_DROP_REPORT_INTERVAL_S seconds, or right away
+ * if 'final' is non-zero. Must be called with 'log_lock' held.
+ * Returns 1 if every message was copied, and 0 if 'batch' filled up
+ * first.
+ */
+static int log_drain_all(struct log_batch *batch, int final)
+{
+	static unsigned long long reported = 0;
+	static time_t reported_time = 0;
+	struct log_ring **p, *ring;
+	unsigned long long dropped;
+	struct timespec now;
+	int drained = 1;
+	int len;
+
+	p = &log_rings;
+
+	while ((ring = *p) != NULL) {
+		if (!log_ring_drain(ring, batch)) {
+			drained = 0;
+			p = &ring->next;
+		} else if (ring->orphaned) {
+			*p = ring->next;
+			free(ring);
+		} else {
+			p = &ring->next;
+		}
+	}
+
+	dropped = __atomic_load_n(&log_dropped_count, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (
+		dropped != reported &&
+		batch->len[1] + 64 <= LOG_BATCH_LEN && (
+			final ||
+			now.tv_sec - reported_time >= LOG_DROP_REPORT_INTERVAL_S
+		)
+	) {
+		len = snprintf(
+			batch->text[1] + batch->len[1],
+			64,
+			"log: %llu messages dropped\n",
+			dropped - reported
+		);
+		batch->len[1] += len;
+		reported = dropped;
+		reported_time = now.tv_sec;
+	}
+
+	return drained;
+}
+
+/**
+ * Releases the log buffer 'arg' of an exiting thread. Its messages
+ * are written by the log flusher, or right away, after it has been
+ * unlinked, if the log flusher is not running.
+ */
+static void log_ring_release(void *arg)
+{
+	struct log_ring *ring, **p;
+	struct log_record *record;
+	unsigned long tail;
+
+	ring = (struct log_ring *)arg;
+
+	pthread_mutex_lock(&log_lock);
+
+	if (log_running) {
+		ring->orphaned = 1;
+		pthread_mutex_unlock(&log_lock);
+		return;
+	}
+
+	for (p = &log_rings; *p != NULL; p = &(*p)->next) {
+		if (*p == ring) {
+			*p = ring->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&log_lock);
+
+	/* No other thread can reach the log buffer any more. */
+	for (tail = ring->tail; tail != ring->head; ++tail) {
+		record = &ring->records[tail % LOG_RING_LEN];
+		write(log_level_fd(record->level), record->text, record->len);
+	}
+
+	free(ring);
+}
+
+/**
+ * Creates the key that releases log buffers of exiting threads.
+ */
+static void log_key_create()
+{
+	pthread_key_create(&log_key, log_ring_release);
+}
+
+/**
+ * Returns the log buffer of the calling thread, allocating it on
+ * first use.
+ * Returns NULL if no log buffer could be allocated.
+ */
+static struct log_ring *log_ring_get()
+{
+	struct log_ring *ring;
+
+	if (log_ring_self != NULL) {
+		return log_ring_self;
+	}
+
+	pthread_once(&log_key_once, log_key_create);
+
+	ring = aligned_alloc(64, sizeof(struct log_ring));
+
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	memset(ring, 0, sizeof(struct log_ring));
+
+	pthread_mutex_lock(&log_lock);
+	ring->next = log_rings;
+	log_rings = ring;
+	pthread_mutex_unlock(&log_lock);
+
+	pthread_setspecific(log_key, ring);
+	log_ring_self = ring;
+
+	return ring;
+}
+
+/**
+ * Writes buffered messages every LOG_FLUSH_INTERVAL_MS milliseconds
+ * until signalled to quit, and once more before quitting. Messages
+ * are copied out under 'log_lock' and written after releasing it, so
+ * that a slow standard output or standard error does not block
+ * threads that start or exit meanwhile.
+ */
+static void *log_flusher(void *arg __attribute__((unused)))
+{
+	struct log_batch *batch = &log_flusher_batch;
+	struct timespec deadline;
+	int stopping, drained;
+
+	pthread_mutex_lock(&log_lock);
+
+	for (;;) {
+		stopping = log_stopping;
+		drained = log_drain_all(batch, stopping);
+
+		pthread_mutex_unlock(&log_lock);
+		log_batch_write(batch);
+		pthread_mutex_lock(&log_lock);
+
+		/* Drain right away what did not fit in the batch. */
+		if (!drained) {
+			continue;
+		}
+
+		if (stopping) {
+			break;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		if (!log_stopping) {
+			pthread_cond_timedwait(&log_cond, &log_lock, &deadline);
+		}
+	}
+
+	pthread_mutex_unlock(&log_lock);
+	return NULL;
+}
+
+/**
+ * Starts the background log flusher, or adds a reference to it if it
+ * is already running. Until the log flusher is started, messages are
+ * written directly.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int log_start()
+{
+	int err;
+
+	pthread_mutex_lock(&log_lock);
+
+	if (log_refs > 0) {
+		++log_refs;
+		pthread_mutex_unlock(&log_lock);
+		return 0;
+	}
+
+	log_stopping = 0;
+	err = pthread_create(&log_flusher_id, NULL, log_flusher, NULL);
+
+	if (err != 0) {
+		pthread_mutex_unlock(&log_lock);
+		log_error("log_start:pthread_create: %s", strerror(err));
+		return -1;
+	}
+
+	log_refs = 1;
+	__atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&log_lock);
+
+	return 0;
+}
+
+/**
+ * Removes a reference to the background log flusher. When the last
+ * reference is removed, every buffered message is written and the log
+ * flusher is stopped.
+ */
+void log_stop()
+{
+	pthread_mutex_lock(&log_lock);
+
+	if (log_refs == 0 || --log_refs > 0) {
+		pthread_mutex_unlock(&log_lock);
+		return;
+	}
+
+	/* From now on, messages are written directly, and the log
+	   flusher writes what is already buffered before quitting. */
+	__atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+	log_stopping = 1;
+	pthread_cond_signal(&log_cond);
+
+	pthread_mutex_unlock(&log_lock);
+
+	pthread_join(log_flusher_id, NULL);
+}
+
+/**
+ * Formats a message of level 'level' like 'printf' and appends a
+ * newline. While the log flusher is running, the message is copied to
+ * the calling thread's log buffer without taking any lock or making
+ * any system call, and is dropped if the buffer is full.
+ */
+void log_write(int level, const char *format, ...)
+{
+	struct log_ring *ring = NULL;
+	struct log_record *record, direct;
+	unsigned long head, tail;
+	va_list ap;
+	int len;
+
+	if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		ring = log_ring_get();
+	}
+
+	if (ring != NULL) {
+		/* Reserve the next record of the log buffer. */
+		head = ring->head;
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+		if (head - tail == LOG_RING_LEN) {
+			__atomic_add_fetch(
+				&log_dropped_count,
+				1,
+				__ATOMIC_RELAXED
+			);
+			return;
+		}
+
+		record = &ring->records[head % LOG_RING_LEN];
+	} else {
+		record = &direct;
+	}
+
+	/* Format message, truncating it to fit the record. */
+	va_start(ap, format);
+	len = vsnprintf(record->text, LOG_RECORD_LEN - 1, format, ap);
+	va_end(ap);
+
+	if (len < 0) {
+		len = 0;
+	} else if (len > LOG_RECORD_LEN - 2) {
+		len = LOG_RECORD_LEN - 2;
+	}
+
+	record->text[len++] = '\n';
+	record->len = len;
+	record->level = level;
+
+	if (ring != NULL) {
+		/* Publish record to the log flusher. */
+		__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	} else {
+		write(log_level_fd(level), record->text, record->len);
+	}
+}
+
+/**
+ * Returns the number of messages dropped because a log buffer was
+ * full.
+ */
+unsigned long long log_dropped()
+{
+	return __atomic_load_n(&log_dropped_count, __ATOMIC_RELAXED);
+}
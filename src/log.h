@@ -0,0 +1,98 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LOG_H
+#define LOG_H
+
+/**
+ * Log levels. Messages of level LOG_LEVEL_ERROR and LOG_LEVEL_WARN
+ * are written to standard error, and messages of level LOG_LEVEL_INFO
+ * and LOG_LEVEL_DEBUG to standard output.
+ */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+/**
+ * Messages above MAXSERVER_LOG_LEVEL are compiled out. Build with,
+ * for example, -DMAXSERVER_LOG_LEVEL=0 to keep only errors.
+ */
+#ifndef MAXSERVER_LOG_LEVEL
+#define MAXSERVER_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#if MAXSERVER_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define log_error(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define log_error(...) ((void)0)
+#endif
+
+#if MAXSERVER_LOG_LEVEL >= LOG_LEVEL_WARN
+#define log_warn(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define log_warn(...) ((void)0)
+#endif
+
+#if MAXSERVER_LOG_LEVEL >= LOG_LEVEL_INFO
+#define log_info(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define log_info(...) ((void)0)
+#endif
+
+#if MAXSERVER_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) ((void)0)
+#endif
+
+/**
+ * Starts the background log flusher, or adds a reference to it if it
+ * is already running. Until the log flusher is started, messages are
+ * written directly.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int log_start();
+
+/**
+ * Removes a reference to the background log flusher. When the last
+ * reference is removed, every buffered message is written and the log
+ * flusher is stopped.
+ */
+void log_stop();
+
+/**
+ * Formats a message of level 'level' like 'printf' and appends a
+ * newline. While the log flusher is running, the message is copied to
+ * the calling thread's log buffer without taking any lock or making
+ * any system call, and is dropped if the buffer is full.
+ */
+void log_write(int level, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/**
+ * Returns the number of messages dropped because a log buffer was
+ * full.
+ */
+unsigned long long log_dropped();
+
+#endif
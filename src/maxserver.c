@@ -18,204 +18,1882 @@
  * <http://www.gnu.org/licenses/>.
  */
 
-#include "maxserver.h"
+#define _GNU_SOURCE
 
+#include "maxserver.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sched.h>
 #include <signal.h>
-#include <fcntl.h>
-#include <sys/select.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "print_error.h"
+#include "log.h"
 #include "server_socket.h"
 #include "accept_thread.h"
+#include "client_thread.h"
+#include "worker_pool.h"
+#include "evloop.h"
+#include "fiber.h"
+#include "uring.h"
+#include "resolver.h"
+#include "deadline.h"
+#include "slab.h"
+#include "arena.h"
+#include "metrics.h"
+#include "buf.h"
+#include "conn.h"
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define MAXSERVER_POOL_MIN_THREADS 4
+#define MAXSERVER_POOL_MAX_THREADS 64
+#define MAXSERVER_POOL_QUEUE_LEN 1024
+#define MAXSERVER_POOL_IDLE_TIMEOUT_MS 10000
+#define MAXSERVER_FIBER_THREADS 0
+#define MAXSERVER_FIBER_STACK_SIZE 65536
+#define MAXSERVER_CONN_SLAB_LEN 1024
+#define MAXSERVER_CONN_BUFFER_LEN 16384
+#define MAXSERVER_SEND_HIGH_WATER 1048576
+#define MAXSERVER_SEND_LOW_WATER 262144
+#define MAXSERVER_FRAME_MAX_LEN 16777216
+#define MAXSERVER_ARENA_CHUNK_LEN 4096
+#define MAXSERVER_ARENA_GROWTH 2
+#define MAXSERVER_EVLOOP_THREADS 0
+#define MAXSERVER_ACCEPT_SHARDS 1
+#define MAXSERVER_ACCEPT_BATCH 64
+#define MAXSERVER_CLIENT_THREAD_SHARDS 1
+#define MAXSERVER_RESOLVE_CACHE_LEN 1024
+#define MAXSERVER_RESOLVE_TTL_MS 300000
+#define MAXSERVER_SIGNAL_SERVERS_MAX 64
+#define MAXSERVER_BUF_POOL_LEN 268435456
 
 /**
- * Global variable holding the signal pipe.
+ * Data structure representing a server.
+ *
+ * Client connections are handled by 'callbacks' if it is set, and by
+ * 'client_thread' otherwise. 'sigpipe' signals client threads and
+ * event loop threads to quit, 'acceptpipe' signals accept threads to
+ * quit, and 'waitpipe' wakes 'maxserver_wait' when a stop is
+ * requested. All three are eventfds, which stay readable once
+ * signalled and can be polled at any file descriptor number. 'open'
+ * counts dispatched client connections that have not been freed yet,
+ * and 'idlepipe' is signalled whenever it drops to zero.
+ *
+ * 'stop_lock' is held for the whole of 'maxserver_stop', so that
+ * concurrent stops return only once the server has stopped. 'lock'
+ * protects 'running' against the statistics functions, which read
+ * the objects of the server only while it runs, since a stop clears
+ * 'running' under 'lock' before it frees them.
+ *
+ * 'dispatch' is the function that the accept threads, or the io_uring
+ * event loop threads, dispatch batches of client connections with,
+ * with the server as its argument. At most one of 'threads', 'pool',
+ * 'fibers', 'loop' and 'uring' is set while the server runs, depending
+ * on how client connections are dispatched.
+ *
+ * 'metrics' holds the runtime metrics of the server while it runs,
+ * unless they are turned off.
  */
-static int maxserver_sigpipe[2];
+struct maxserver {
+	char *service;
+	struct maxserver_config config;
+	void (*client_thread)(int cfd, int sigpipe);
+	const struct maxserver_evloop_callbacks *callbacks;
+	int sigpipe;
+	int acceptpipe;
+	int waitpipe;
+	int idlepipe;
+	pthread_mutex_t stop_lock;
+	pthread_mutex_t lock;
+	int started;
+	int running;
+	size_t open;
+	int *sfds;
+	struct accept_thread **accept_threads;
+	size_t shards;
+	struct slab **slabs;
+	size_t slabs_len;
+	size_t (*dispatch)(
+		struct maxserver_conn **conns,
+		size_t len,
+		void *arg
+	);
+	struct client_threads *threads;
+	struct worker_pool *pool;
+	struct fiber_sched *fibers;
+	struct evloop *loop;
+	struct uring *uring;
+	struct resolver *resolver;
+	struct deadlines *deadlines;
+	struct metrics *metrics;
+};
 
 /**
- * Global variable holding the server's socket file descriptor.
+ * Global variable holding the write ends of the wait pipes of the
+ * running servers that handle signals, plus one, so that zero marks a
+ * free entry. The SIGINT handler requests every server in it to stop.
  */
-static int maxserver_sfd;
+static int maxserver_signal_pipes[MAXSERVER_SIGNAL_SERVERS_MAX];
 
 /**
- * Clears any data held by the server.
+ * Makes eventfd 'fd' readable for good, waking every thread that
+ * polls it.
  */
-static void maxserver_clear()
+static void maxserver_event_signal(int fd)
 {
-	accept_thread_stop();
-	close(maxserver_sigpipe[0]);
-	close(maxserver_sigpipe[1]);
-	close(maxserver_sfd);
+	uint64_t one = 1;
+
+	write(fd, &one, sizeof(uint64_t));
 }
 
 /**
- * Function that is called when SIGINT is raised. Signals the program
- * to quit.
+ * Makes 'server' the server of client connection 'conn', counts
+ * 'conn' as open until it is freed, and sizes its read-ahead buffer
+ * and arena, corks its output and keeps its deadlines and metrics as
+ * configured.
  */
-static void maxserver_signal_handler(int signum)
+static void maxserver_conn_attach(
+	struct maxserver *server,
+	struct maxserver_conn *conn
+)
 {
-	char sig = 0;
+	conn->server = server;
+	conn->open = &server->open;
+	conn->idlepipe = server->idlepipe;
+	conn->in_cap = MAX(server->config.conn_buffer_len, 1);
+	conn->frame_max = server->config.frame_max_len;
+	conn->cork = server->config.output_cork;
+	conn->send_high = server->config.send_high_water;
+	conn->send_low = MIN(
+		server->config.send_low_water,
+		server->config.send_high_water
+	);
+	arena_init(
+		&conn->arena,
+		server->config.arena_chunk_len,
+		server->config.arena_growth,
+		server->config.arena_poison
+	);
+	conn->deadlines = server->deadlines;
+	conn->metrics = server->metrics;
+	__atomic_add_fetch(&server->open, 1, __ATOMIC_RELAXED);
+}
 
-	if (signum == SIGINT) {
-		write(maxserver_sigpipe[1], &sig, 1);
-		fputc('\n', stdout);
+/**
+ * Starts a new client thread for each of the 'len' client
+ * connections of 'conns' of server 'arg'.
+ * Returns the number of client connections at the front of 'conns'
+ * that got a client thread. An appropriate error message is printed
+ * to standard error for the first one that did not.
+ */
+static size_t maxserver_dispatch_thread(
+	struct maxserver_conn **conns,
+	size_t len,
+	void *arg
+)
+{
+	struct maxserver *server = (struct maxserver *)arg;
+	size_t i;
+	int err;
+
+	for (i = 0; i < len; ++i) {
+		maxserver_conn_attach(server, conns[i]);
+
+		err = client_thread_start(
+			server->threads,
+			conns[i],
+			server->client_thread,
+			server->sigpipe
+		);
+
+		if (err == -1) {
+			break;
+		}
 	}
+
+	return i;
 }
 
 /**
- * Registers 'maxserver_signal_handler' to be called when SIGINT is
- * raised.
+ * Queues the 'len' client connections of 'conns' to the worker pool
+ * of server 'arg' at once.
+ * Returns the number of client connections at the front of 'conns'
+ * that were queued, which is less than 'len' if the worker pool is
+ * full.
+ */
+static size_t maxserver_dispatch_pool(
+	struct maxserver_conn **conns,
+	size_t len,
+	void *arg
+)
+{
+	struct maxserver *server = (struct maxserver *)arg;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		maxserver_conn_attach(server, conns[i]);
+	}
+
+	return worker_pool_submit(server->pool, conns, len);
+}
+
+/**
+ * Hands the 'len' client connections of 'conns' to the fiber
+ * scheduler of server 'arg', which runs each of them in a fiber.
+ * Always takes all of them.
+ */
+static size_t maxserver_dispatch_fiber(
+	struct maxserver_conn **conns,
+	size_t len,
+	void *arg
+)
+{
+	struct maxserver *server = (struct maxserver *)arg;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		maxserver_conn_attach(server, conns[i]);
+		fiber_sched_submit(server->fibers, conns[i]);
+	}
+
+	return len;
+}
+
+/**
+ * Hands the 'len' client connections of 'conns' to the event loop of
+ * server 'arg'.
+ * Returns the number of client connections at the front of 'conns'
+ * that were handed over. An appropriate error message is printed to
+ * standard error for the first one that was not.
+ */
+static size_t maxserver_dispatch_evloop(
+	struct maxserver_conn **conns,
+	size_t len,
+	void *arg
+)
+{
+	struct maxserver *server = (struct maxserver *)arg;
+	size_t i;
+	int err;
+
+	for (i = 0; i < len; ++i) {
+		maxserver_conn_attach(server, conns[i]);
+
+		err = evloop_submit(server->loop, conns[i]);
+
+		if (err == -1) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/**
+ * Counts the 'len' client connections of 'conns', accepted by an
+ * io_uring event loop thread, as client connections of server 'arg'.
+ * Always takes all of them.
+ */
+static size_t maxserver_dispatch_uring(
+	struct maxserver_conn **conns,
+	size_t len,
+	void *arg
+)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		maxserver_conn_attach((struct maxserver *)arg, conns[i]);
+	}
+
+	return len;
+}
+
+/**
+ * Starts the io_uring event loop threads of 'server' if its
+ * configuration asks for them and the kernel supports them.
+ * Returns one if they were started, zero if the epoll event loop
+ * should be used instead, and -1 on error, in which case an
+ * appropriate error message is printed to standard error.
+ */
+static int maxserver_dispatch_init_uring(
+	struct maxserver *server,
+	size_t threads
+)
+{
+	if (server->config.evloop_backend != MAXSERVER_EVLOOP_URING) {
+		return 0;
+	}
+
+	if (server->callbacks->on_data == NULL) {
+		log_warn(
+			"io_uring event loop requires on_data, "
+			"falling back to epoll"
+		);
+		return 0;
+	}
+
+	if (!uring_available()) {
+		log_warn("io_uring is unavailable, falling back to epoll");
+		return 0;
+	}
+
+	server->uring = uring_create(
+		threads,
+		server->sfds,
+		server->shards,
+		server->callbacks,
+		maxserver_dispatch_uring,
+		server,
+		server->config.conn_slab_len,
+		server->config.conn_slab_lock,
+		server->metrics,
+		server->acceptpipe,
+		server->sigpipe
+	);
+	server->dispatch = maxserver_dispatch_uring;
+
+	return server->uring == NULL ? -1 : 1;
+}
+
+/**
+ * Starts the data structures that client connections of 'server' are
+ * dispatched to, as described by its configuration.
  * On success, zero is returned. On error, -1 is returned, and an
  * appropriate error message is printed to standard error.
  */
-static int maxserver_register_signal_handler()
+static int maxserver_dispatch_init(struct maxserver *server)
 {
-	struct sigaction sa;
+	const struct maxserver_config *config = &server->config;
+	struct client_thread_attr attr;
+	size_t threads;
 	int err;
 
-	/* Initialise 'sa' data structure. */
-	sa.sa_handler = maxserver_signal_handler;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = 0;
+	if (server->callbacks != NULL) {
+		/* Default to one event loop thread per online CPU. */
+		threads = config->evloop_threads;
 
-	/* Register signal handler. */
-	err = sigaction(SIGINT, &sa, NULL);
+		if (threads == 0) {
+			threads = (size_t)MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+		}
 
-	if (err == -1) {
-		print_error_errno(
-			"maxserver_register_signal_handler:sigaction"
+		err = maxserver_dispatch_init_uring(server, threads);
+
+		if (err != 0) {
+			return err == -1 ? -1 : 0;
+		}
+
+		server->loop = evloop_create(
+			threads,
+			server->callbacks,
+			server->sigpipe
 		);
-		return -1;
+		server->dispatch = maxserver_dispatch_evloop;
+
+		return server->loop == NULL ? -1 : 0;
 	}
 
-	return 0;
+	if (config->dispatch == MAXSERVER_DISPATCH_POOL) {
+		server->pool = worker_pool_create(
+			config->pool_min_threads,
+			config->pool_max_threads,
+			config->pool_queue_len,
+			config->pool_idle_timeout_ms,
+			config->pool_scheduler,
+			server->client_thread,
+			server->sigpipe,
+			server->metrics
+		);
+		server->dispatch = maxserver_dispatch_pool;
+
+		return server->pool == NULL ? -1 : 0;
+	}
+
+	if (config->dispatch == MAXSERVER_DISPATCH_FIBER) {
+		/* Default to one scheduler thread per online CPU. */
+		threads = config->fiber_threads;
+
+		if (threads == 0) {
+			threads = (size_t)MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+		}
+
+		server->fibers = fiber_sched_create(
+			threads,
+			config->fiber_stack_size != 0 ?
+				config->fiber_stack_size :
+				MAXSERVER_FIBER_STACK_SIZE,
+			server->client_thread,
+			server->sigpipe
+		);
+		server->dispatch = maxserver_dispatch_fiber;
+
+		return server->fibers == NULL ? -1 : 0;
+	}
+
+	/* Default to one client threads registry shard per online
+	   CPU. */
+	threads = config->client_thread_shards;
+
+	if (threads == 0) {
+		threads = (size_t)MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	}
+
+	attr.stack_size = config->client_thread_stack_size;
+	attr.guard_size = config->client_thread_guard_size;
+	attr.affinity = config->client_thread_affinity;
+	attr.sched_policy = config->client_thread_sched_policy;
+	attr.sched_priority = config->client_thread_sched_priority;
+
+	server->threads = client_threads_create(
+		threads,
+		&attr,
+		server->metrics
+	);
+	server->dispatch = maxserver_dispatch_thread;
+
+	return server->threads == NULL ? -1 : 0;
 }
 
 /**
- * Starts the server on port 'service', and calls 'client_thread' on
- * every incoming client connection. This function blocks until
- * SIGINT is raised or end-of-file is read from standard input.
+ * Stops every thread that client connections of 'server' have been
+ * dispatched to, and clears their data structures.
+ */
+static void maxserver_dispatch_clear(struct maxserver *server)
+{
+	if (server->uring != NULL) {
+		uring_destroy(server->uring);
+		server->uring = NULL;
+	}
+
+	if (server->loop != NULL) {
+		evloop_destroy(server->loop);
+		server->loop = NULL;
+	}
+
+	if (server->pool != NULL) {
+		worker_pool_destroy(server->pool);
+		server->pool = NULL;
+	}
+
+	if (server->fibers != NULL) {
+		fiber_sched_destroy(server->fibers);
+		server->fibers = NULL;
+	}
+
+	if (server->threads != NULL) {
+		client_threads_destroy(server->threads);
+		server->threads = NULL;
+	}
+}
+
+/**
+ * Closes the server sockets of 'server'.
+ */
+static void maxserver_sockets_close(struct maxserver *server)
+{
+	size_t i;
+
+	for (i = 0; i < server->shards; ++i) {
+		close(server->sfds[i]);
+	}
+
+	free(server->sfds);
+	free(server->accept_threads);
+	server->sfds = NULL;
+	server->accept_threads = NULL;
+	server->shards = 0;
+}
+
+/**
+ * Opens 'shards' server sockets for 'server'. Since server sockets
+ * are created with SO_REUSEPORT, the kernel spreads incoming client
+ * connections across them.
  * On success, zero is returned. On error, -1 is returned, and an
  * appropriate error message is printed to standard error.
  */
-int maxserver(
-	const char *service,
-	void (*client_thread)(int cfd, int sigpipe)
-)
+static int maxserver_sockets_open(struct maxserver *server, size_t shards)
 {
-	fd_set rfds, rfds_copy;
-	int maxfd;
-	char sig = 0;
-	int err;
+	size_t i;
 
-	/* Create TCP server socket. */
-	maxserver_sfd = server_socket(service);
+	server->sfds = malloc(sizeof(int) * shards);
+	server->accept_threads = calloc(
+		shards,
+		sizeof(struct accept_thread *)
+	);
 
-	if (maxserver_sfd == -1) {
+	if (server->sfds == NULL || server->accept_threads == NULL) {
+		print_error_errno("maxserver_sockets_open:malloc");
+		free(server->sfds);
+		free(server->accept_threads);
+		server->sfds = NULL;
+		server->accept_threads = NULL;
 		return -1;
 	}
 
-	/* Set up signal pipe. */
-	err = pipe(maxserver_sigpipe);
+	for (i = 0; i < shards; ++i) {
+		server->sfds[i] = server_socket(server->service);
 
-	if (err == -1) {
-		print_error_errno("maxserver:pipe");
-		close(maxserver_sfd);
-		return -1;
+		if (server->sfds[i] == -1) {
+			server->shards = i;
+			maxserver_sockets_close(server);
+			return -1;
+		}
 	}
 
-	/* Mark signal pipe as non-blocking. */
-	err = fcntl(maxserver_sigpipe[0], F_SETFL, O_NONBLOCK);
+	server->shards = shards;
 
-	if (err == -1) {
-		print_error_errno("maxserver:fcntl");
-		close(maxserver_sigpipe[0]);
-		close(maxserver_sigpipe[1]);
-		close(maxserver_sfd);
+	return 0;
+}
+
+/**
+ * Returns the CPU that the accept thread of accept shard 'shard' of
+ * 'server' is pinned to, cycling through the CPUs that the process
+ * may run on. With a single accept shard, no CPU is picked and -1 is
+ * returned.
+ */
+static int maxserver_shard_cpu(const struct maxserver *server, size_t shard)
+{
+	cpu_set_t cpuset;
+	int count, cpu;
+	int err;
+
+	if (server->shards == 1) {
 		return -1;
 	}
 
-	err = fcntl(maxserver_sigpipe[1], F_SETFL, O_NONBLOCK);
+	err = sched_getaffinity(0, sizeof(cpu_set_t), &cpuset);
 
-	if (err == -1) {
-		print_error_errno("maxserver:fcntl");
-		close(maxserver_sigpipe[0]);
-		close(maxserver_sigpipe[1]);
-		close(maxserver_sfd);
+	if (err == -1 || (count = CPU_COUNT(&cpuset)) == 0) {
 		return -1;
 	}
 
-	/* Initialise 'rfds' and add signal pipe and standard input. */
-	FD_ZERO(&rfds);
-	FD_ZERO(&rfds_copy);
-	FD_SET(maxserver_sigpipe[0], &rfds);
-	FD_SET(STDIN_FILENO, &rfds);
-	maxfd = MAX(maxserver_sigpipe[0], STDIN_FILENO);
-
-	/* Register signal handler. */
-	err = maxserver_register_signal_handler();
+	shard %= count;
 
-	if (err == -1) {
-		close(maxserver_sigpipe[0]);
-		close(maxserver_sigpipe[1]);
-		close(maxserver_sfd);
-		return -1;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &cpuset) && shard-- == 0) {
+			return cpu;
+		}
 	}
 
-	/* Start accept thread. */
-	err = accept_thread_start(
-		maxserver_sfd,
-		maxserver_sigpipe[0],
-		client_thread
-	);
+	return -1;
+}
 
-	if (err == -1) {
-		close(maxserver_sigpipe[0]);
-		close(maxserver_sigpipe[1]);
-		close(maxserver_sfd);
+/**
+ * Starts one accept thread per accept shard of 'server'.
+ * On success, zero is returned. On error, -1 is returned, an
+ * appropriate error message is printed to standard error, and the
+ * caller must signal the accept pipe and call 'maxserver_accept_stop'.
+ */
+static int maxserver_accept_start(struct maxserver *server)
+{
+	size_t i;
+
+	/* Allocate one slab of client connections per accept thread,
+	   which outlives it until the client connections are gone. */
+	server->slabs = calloc(server->shards, sizeof(struct slab *));
+
+	if (server->slabs == NULL) {
+		print_error_errno("maxserver_accept_start:calloc");
 		return -1;
 	}
 
-	/* Read from standard input until end-of-file is read or the
-	   signal pipe receives input. */
-	for (;;) {
-		rfds_copy = rfds;
-		err = select(
-			maxfd + 1,
-			&rfds_copy,
-			NULL,
-			NULL,
-			NULL
+	server->slabs_len = server->shards;
+
+	for (i = 0; i < server->shards; ++i) {
+		server->slabs[i] = slab_create(
+			sizeof(struct maxserver_conn),
+			server->config.conn_slab_len,
+			server->config.conn_slab_lock
 		);
 
-		if (err == -1) {
-			if (errno == EINTR) {
-				continue;
-			}
+		if (server->slabs[i] == NULL) {
+			return -1;
+		}
+	}
+
+	for (i = 0; i < server->shards; ++i) {
+		/* Event loops and fibers need non-blocking client
+		   sockets. */
+		server->accept_threads[i] = accept_thread_start(
+			server->sfds[i],
+			server->acceptpipe,
+			maxserver_shard_cpu(server, i),
+			server->config.accept_batch,
+			server->loop != NULL || server->fibers != NULL ?
+				SOCK_NONBLOCK : 0,
+			server->slabs[i],
+			server->metrics,
+			server->dispatch,
+			server
+		);
 
-			print_error_errno("maxserver:select");
-			maxserver_clear();
+		if (server->accept_threads[i] == NULL) {
 			return -1;
 		}
+	}
+
+	return 0;
+}
+
+/**
+ * Waits for every started accept thread of 'server' to quit after the
+ * accept pipe has been signalled.
+ */
+static void maxserver_accept_stop(struct maxserver *server)
+{
+	size_t i;
+
+	for (i = 0; i < server->shards; ++i) {
+		if (server->accept_threads[i] != NULL) {
+			accept_thread_stop(server->accept_threads[i]);
+			server->accept_threads[i] = NULL;
+		}
+	}
+}
 
-		if (FD_ISSET(maxserver_sigpipe[0], &rfds_copy)) {
-			break;
-		} else if (FD_ISSET(STDIN_FILENO, &rfds_copy)) {
-			if (fgetc(stdin) == EOF) {
-				write(maxserver_sigpipe[1], &sig, 1);
-				break;
+/**
+ * Frees the slabs of client connections of the accept threads of
+ * 'server' once every client connection has been freed.
+ */
+static void maxserver_slabs_destroy(struct maxserver *server)
+{
+	size_t i;
+
+	for (i = 0; i < server->slabs_len; ++i) {
+		if (server->slabs[i] != NULL) {
+			slab_destroy(server->slabs[i]);
+		}
+	}
+
+	free(server->slabs);
+	server->slabs = NULL;
+	server->slabs_len = 0;
+}
+
+/**
+ * Clears any data held by 'server' while it runs.
+ */
+static void maxserver_clear(struct maxserver *server)
+{
+	maxserver_accept_stop(server);
+	maxserver_dispatch_clear(server);
+	maxserver_slabs_destroy(server);
+
+	if (server->resolver != NULL) {
+		resolver_destroy(server->resolver);
+		server->resolver = NULL;
+	}
+
+	if (server->deadlines != NULL) {
+		deadlines_destroy(server->deadlines);
+		server->deadlines = NULL;
+	}
+
+	metrics_destroy(server->metrics);
+	server->metrics = NULL;
+
+	maxserver_sockets_close(server);
+}
+
+/**
+ * Function that is called when SIGINT is raised. Requests every
+ * running server that handles signals to stop.
+ */
+static void maxserver_signal_handler(int signum)
+{
+	uint64_t one = 1;
+	int fd;
+	size_t i;
+
+	if (signum == SIGINT) {
+		for (i = 0; i < MAXSERVER_SIGNAL_SERVERS_MAX; ++i) {
+			fd = __atomic_load_n(
+				&maxserver_signal_pipes[i],
+				__ATOMIC_ACQUIRE
+			);
+
+			if (fd != 0) {
+				write(fd - 1, &one, sizeof(uint64_t));
 			}
 		}
+
+		write(STDOUT_FILENO, "\n", 1);
+	}
+}
+
+/**
+ * Registers 'maxserver_signal_handler' to be called when SIGINT is
+ * raised, and adds 'server' to the servers that it requests to stop.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int maxserver_register_signal_handler(struct maxserver *server)
+{
+	struct sigaction sa;
+	int expected;
+	int err;
+	size_t i;
+
+	/* Add signal pipe to the servers signalled on SIGINT. */
+	for (i = 0; i < MAXSERVER_SIGNAL_SERVERS_MAX; ++i) {
+		expected = 0;
+
+		if (__atomic_compare_exchange_n(
+			&maxserver_signal_pipes[i],
+			&expected,
+			server->waitpipe + 1,
+			0,
+			__ATOMIC_RELEASE,
+			__ATOMIC_RELAXED
+		)) {
+			break;
+		}
 	}
 
-	/* Clear any data held by the server. */
-	maxserver_clear();
+	if (i == MAXSERVER_SIGNAL_SERVERS_MAX) {
+		print_error_str(
+			"maxserver_register_signal_handler",
+			"Too many running servers."
+		);
+		return -1;
+	}
 
-	return 0;
+	/* Initialise 'sa' data structure. */
+	sa.sa_handler = maxserver_signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+
+	/* Register signal handler. */
+	err = sigaction(SIGINT, &sa, NULL);
+
+	if (err == -1) {
+		print_error_errno(
+			"maxserver_register_signal_handler:sigaction"
+		);
+		maxserver_signal_pipes[i] = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Removes 'server' from the servers that are requested to stop on
+ * SIGINT.
+ */
+static void maxserver_unregister_signal_handler(struct maxserver *server)
+{
+	int expected;
+	size_t i;
+
+	for (i = 0; i < MAXSERVER_SIGNAL_SERVERS_MAX; ++i) {
+		expected = server->waitpipe + 1;
+
+		if (__atomic_compare_exchange_n(
+			&maxserver_signal_pipes[i],
+			&expected,
+			0,
+			0,
+			__ATOMIC_RELEASE,
+			__ATOMIC_RELAXED
+		)) {
+			break;
+		}
+	}
+}
+
+/**
+ * Initialises 'config' with the default configuration, which starts
+ * a new thread for every client connection.
+ */
+void maxserver_config_init(struct maxserver_config *config)
+{
+	config->dispatch = MAXSERVER_DISPATCH_THREAD;
+	config->pool_min_threads = MAXSERVER_POOL_MIN_THREADS;
+	config->pool_max_threads = MAXSERVER_POOL_MAX_THREADS;
+	config->pool_queue_len = MAXSERVER_POOL_QUEUE_LEN;
+	config->pool_idle_timeout_ms = MAXSERVER_POOL_IDLE_TIMEOUT_MS;
+	config->pool_scheduler = MAXSERVER_POOL_SHARED;
+	config->fiber_threads = MAXSERVER_FIBER_THREADS;
+	config->fiber_stack_size = 0;
+	config->conn_slab_len = MAXSERVER_CONN_SLAB_LEN;
+	config->conn_slab_lock = 0;
+	config->conn_buffer_len = MAXSERVER_CONN_BUFFER_LEN;
+	config->frame_max_len = MAXSERVER_FRAME_MAX_LEN;
+	config->output_cork = MAXSERVER_CORK_NONE;
+	config->send_high_water = MAXSERVER_SEND_HIGH_WATER;
+	config->send_low_water = MAXSERVER_SEND_LOW_WATER;
+	config->arena_chunk_len = MAXSERVER_ARENA_CHUNK_LEN;
+	config->arena_growth = MAXSERVER_ARENA_GROWTH;
+	config->arena_poison = 0;
+	config->idle_timeout_ms = 0;
+	config->read_timeout_ms = 0;
+	config->handler_timeout_ms = 0;
+	config->evloop_threads = MAXSERVER_EVLOOP_THREADS;
+	config->evloop_backend = MAXSERVER_EVLOOP_EPOLL;
+	config->accept_shards = MAXSERVER_ACCEPT_SHARDS;
+	config->accept_batch = MAXSERVER_ACCEPT_BATCH;
+	config->client_thread_shards = MAXSERVER_CLIENT_THREAD_SHARDS;
+	config->client_thread_stack_size = 0;
+	config->client_thread_guard_size = 0;
+	config->client_thread_affinity = MAXSERVER_AFFINITY_NONE;
+	config->client_thread_sched_policy = SCHED_OTHER;
+	config->client_thread_sched_priority = 0;
+	config->resolve_hosts = 0;
+	config->resolve_cache_len = MAXSERVER_RESOLVE_CACHE_LEN;
+	config->resolve_ttl_ms = MAXSERVER_RESOLVE_TTL_MS;
+	config->buf_pool_len = MAXSERVER_BUF_POOL_LEN;
+	config->buf_pool_hugepages = MAXSERVER_HUGEPAGES_NONE;
+	config->metrics = 1;
+	config->handle_stdin = 1;
+	config->handle_signals = 1;
+}
+
+/**
+ * Opens a non-blocking eventfd into 'fd'.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int maxserver_event_open(int *fd)
+{
+	*fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (*fd == -1) {
+		print_error_errno("maxserver_event_open:eventfd");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Creates a server on port 'service' as described by 'config' whose
+ * client connections are handled by 'callbacks' if it is not NULL,
+ * and by 'client_thread' otherwise.
+ * On success, a pointer to the new server is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+static maxserver_t *maxserver_create_common(
+	const char *service,
+	void (*client_thread)(int cfd, int sigpipe),
+	const struct maxserver_evloop_callbacks *callbacks,
+	const struct maxserver_config *config
+)
+{
+	struct maxserver *server;
+	int err;
+
+	server = calloc(1, sizeof(struct maxserver));
+
+	if (server == NULL) {
+		print_error_errno("maxserver_create:calloc");
+		return NULL;
+	}
+
+	server->service = strdup(service);
+
+	if (server->service == NULL) {
+		print_error_errno("maxserver_create:strdup");
+		free(server);
+		return NULL;
+	}
+
+	if (config != NULL) {
+		server->config = *config;
+	} else {
+		maxserver_config_init(&server->config);
+	}
+
+	server->client_thread = client_thread;
+	server->callbacks = callbacks;
+
+	/* Set up signal pipe, accept pipe, wait pipe and idle pipe. */
+	err = maxserver_event_open(&server->sigpipe);
+
+	if (err == -1) {
+		free(server->service);
+		free(server);
+		return NULL;
+	}
+
+	err = maxserver_event_open(&server->acceptpipe);
+
+	if (err == -1) {
+		close(server->sigpipe);
+		free(server->service);
+		free(server);
+		return NULL;
+	}
+
+	err = maxserver_event_open(&server->waitpipe);
+
+	if (err == -1) {
+		close(server->acceptpipe);
+		close(server->sigpipe);
+		free(server->service);
+		free(server);
+		return NULL;
+	}
+
+	err = maxserver_event_open(&server->idlepipe);
+
+	if (err == -1) {
+		close(server->waitpipe);
+		close(server->acceptpipe);
+		close(server->sigpipe);
+		free(server->service);
+		free(server);
+		return NULL;
+	}
+
+	pthread_mutex_init(&server->stop_lock, NULL);
+	pthread_mutex_init(&server->lock, NULL);
+
+	return server;
+}
+
+/**
+ * Creates a server on port 'service' that calls 'client_thread' on
+ * every incoming client connection, dispatched as described by
+ * 'config'. If 'config' is NULL, the default configuration is used.
+ * The server does not listen until it is started with
+ * 'maxserver_start'.
+ * On success, a pointer to the new server is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+maxserver_t *maxserver_create(
+	const char *service,
+	void (*client_thread)(int cfd, int sigpipe),
+	const struct maxserver_config *config
+)
+{
+	return maxserver_create_common(service, client_thread, NULL, config);
+}
+
+/**
+ * Creates a server on port 'service' that runs
+ * 'config->evloop_threads' event loop threads that call 'callbacks'
+ * on non-blocking client sockets. If 'config' is NULL,
+ * the default configuration is used. The server does not listen until
+ * it is started with 'maxserver_start'.
+ * On success, a pointer to the new server is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+maxserver_t *maxserver_create_evloop(
+	const char *service,
+	const struct maxserver_evloop_callbacks *callbacks,
+	const struct maxserver_config *config
+)
+{
+	return maxserver_create_common(service, NULL, callbacks, config);
+}
+
+/**
+ * Starts 'server', and returns as soon as it listens on its port.
+ * Messages are logged by a background log flusher while the server
+ * runs. A server can only be started once.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_start(maxserver_t *server)
+{
+	int err;
+
+	if (__atomic_exchange_n(&server->started, 1, __ATOMIC_ACQ_REL)) {
+		print_error_str("maxserver_start", "Server already started.");
+		return -1;
+	}
+
+	err = log_start();
+
+	if (err == -1) {
+		return -1;
+	}
+
+	/* Configure the buffer pool unless another server already
+	   has. */
+	buf_pool_configure(
+		server->config.buf_pool_len,
+		server->config.buf_pool_hugepages
+	);
+
+	/* Create one TCP server socket per accept shard. */
+	err = maxserver_sockets_open(
+		server,
+		server->config.accept_shards > 0 ?
+			server->config.accept_shards : 1
+	);
+
+	if (err == -1) {
+		log_stop();
+		return -1;
+	}
+
+	/* Register signal handler. */
+	if (server->config.handle_signals) {
+		err = maxserver_register_signal_handler(server);
+
+		if (err == -1) {
+			maxserver_sockets_close(server);
+			log_stop();
+			return -1;
+		}
+	}
+
+	/* Keep runtime metrics, which every thread that client
+	   connections are dispatched to updates. */
+	if (server->config.metrics) {
+		server->metrics = metrics_create();
+
+		if (server->metrics == NULL) {
+			err = -1;
+		}
+	}
+
+	/* Start background host name resolver. */
+	if (err != -1 && server->config.resolve_hosts) {
+		server->resolver = resolver_create(
+			server->config.resolve_cache_len,
+			server->config.resolve_ttl_ms
+		);
+
+		if (server->resolver == NULL) {
+			err = -1;
+		}
+	}
+
+	/* Start timer thread of client connection timeouts. */
+	if (err != -1 &&
+		(server->config.idle_timeout_ms != 0 ||
+		server->config.read_timeout_ms != 0 ||
+		server->config.handler_timeout_ms != 0)) {
+		server->deadlines = deadlines_create(
+			(size_t)MAX(sysconf(_SC_NPROCESSORS_ONLN), 1),
+			server->config.idle_timeout_ms,
+			server->config.read_timeout_ms,
+			server->config.handler_timeout_ms,
+			server->sigpipe
+		);
+
+		if (server->deadlines == NULL) {
+			err = -1;
+		}
+	}
+
+	/* Start the threads that client connections are dispatched
+	   to, and the accept threads, which io_uring event loop threads
+	   do without. */
+	if (err != -1) {
+		err = maxserver_dispatch_init(server);
+	}
+
+	if (err != -1 && server->uring == NULL) {
+		err = maxserver_accept_start(server);
+	}
+
+	if (err == -1) {
+		maxserver_event_signal(server->acceptpipe);
+		maxserver_event_signal(server->sigpipe);
+		maxserver_unregister_signal_handler(server);
+		maxserver_clear(server);
+		log_stop();
+		return -1;
+	}
+
+	pthread_mutex_lock(&server->lock);
+	server->running = 1;
+	pthread_mutex_unlock(&server->lock);
+
+	return 0;
+}
+
+/**
+ * Blocks until a stop of 'server' is requested, which happens when
+ * 'maxserver_stop' is called, when SIGINT is raised if
+ * 'config->handle_signals' is set, and when end-of-file is read from
+ * standard input if 'config->handle_stdin' is set. Returns at once if
+ * a stop has already been requested.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_wait(maxserver_t *server)
+{
+	struct pollfd fds[2];
+	nfds_t nfds = 1;
+	int err;
+
+	/* Poll wait pipe and standard input. */
+	fds[0].fd = server->waitpipe;
+	fds[0].events = POLLIN;
+
+	if (server->config.handle_stdin) {
+		fds[1].fd = STDIN_FILENO;
+		fds[1].events = POLLIN;
+		nfds = 2;
+	}
+
+	/* Read from standard input until end-of-file is read or the
+	   wait pipe is signalled. */
+	for (;;) {
+		err = poll(fds, nfds, -1);
+
+		if (err == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			print_error_errno("maxserver_wait:poll");
+			return -1;
+		}
+
+		if (fds[0].revents != 0) {
+			return 0;
+		} else if (nfds == 2 && fds[1].revents != 0) {
+			if (fgetc(stdin) == EOF) {
+				maxserver_event_signal(server->waitpipe);
+				return 0;
+			}
+		}
+	}
+}
+
+/**
+ * Waits until no client connection of 'server' is open, or until
+ * 'timeout_ms' milliseconds have passed since 'start'.
+ * Returns the number of client connections that are still open.
+ */
+static size_t maxserver_wait_idle(
+	struct maxserver *server,
+	const struct timespec *start,
+	unsigned int timeout_ms
+)
+{
+	struct timespec now;
+	struct pollfd fds;
+	long long elapsed;
+	uint64_t count;
+	size_t open;
+
+	fds.fd = server->idlepipe;
+	fds.events = POLLIN;
+
+	for (;;) {
+		/* The idle pipe may still be signalled from an earlier
+		   time that no client connection was open, so check. */
+		open = __atomic_load_n(&server->open, __ATOMIC_ACQUIRE);
+
+		if (open == 0) {
+			return 0;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (long long)(now.tv_sec - start->tv_sec) * 1000 +
+			(now.tv_nsec - start->tv_nsec) / 1000000;
+
+		if (elapsed >= (long long)timeout_ms) {
+			return open;
+		}
+
+		if (poll(&fds, 1, (int)((long long)timeout_ms - elapsed)) > 0) {
+			read(server->idlepipe, &count, sizeof(uint64_t));
+		}
+	}
+}
+
+/**
+ * Stops 'server' gracefully. The server stops listening at once, and
+ * its client connections get up to 'timeout_ms' milliseconds to
+ * finish before their client threads are signalled through
+ * 'sigpipe' to quit. Returns once every thread of the server has
+ * quit. Does nothing if 'server' is not running. May be called from
+ * any thread but those of 'server', and if another thread is already
+ * stopping 'server', waits for that stop to complete.
+ * Returns the number of client connections that were still open
+ * when the timeout expired.
+ */
+size_t maxserver_stop(maxserver_t *server, unsigned int timeout_ms)
+{
+	struct timespec start;
+	size_t open;
+	int running;
+
+	pthread_mutex_lock(&server->stop_lock);
+
+	/* From now on, the statistics functions leave the objects of
+	   the server alone. */
+	pthread_mutex_lock(&server->lock);
+	running = server->running;
+	server->running = 0;
+	pthread_mutex_unlock(&server->lock);
+
+	if (!running) {
+		pthread_mutex_unlock(&server->stop_lock);
+		return 0;
+	}
+
+	/* Stop accepting client connections. */
+	maxserver_event_signal(server->acceptpipe);
+	maxserver_accept_stop(server);
+	maxserver_sockets_close(server);
+
+	/* Give client connections time to finish. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	open = maxserver_wait_idle(server, &start, timeout_ms);
+
+	/* Signal remaining client threads to quit, and clear any data
+	   held by the server. */
+	maxserver_event_signal(server->sigpipe);
+	maxserver_unregister_signal_handler(server);
+	maxserver_clear(server);
+
+	/* Wake any caller of 'maxserver_wait'. */
+	maxserver_event_signal(server->waitpipe);
+
+	log_stop();
+
+	pthread_mutex_unlock(&server->stop_lock);
+
+	return open;
+}
+
+/**
+ * Frees 'server', stopping it at once first if it is running, or
+ * waiting for a stop in progress to complete.
+ */
+void maxserver_destroy(maxserver_t *server)
+{
+	maxserver_stop(server, 0);
+	pthread_mutex_destroy(&server->lock);
+	pthread_mutex_destroy(&server->stop_lock);
+	close(server->idlepipe);
+	close(server->waitpipe);
+	close(server->acceptpipe);
+	close(server->sigpipe);
+	free(server->service);
+	free(server);
+}
+
+/**
+ * Creates and starts a server as described by the arguments of
+ * 'maxserver_create_common', and stops and destroys it when a stop
+ * is requested.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int maxserver_run(
+	const char *service,
+	void (*client_thread)(int cfd, int sigpipe),
+	const struct maxserver_evloop_callbacks *callbacks,
+	const struct maxserver_config *config
+)
+{
+	maxserver_t *server;
+	int err;
+
+	server = maxserver_create_common(
+		service,
+		client_thread,
+		callbacks,
+		config
+	);
+
+	if (server == NULL) {
+		return -1;
+	}
+
+	err = maxserver_start(server);
+
+	if (err == 0) {
+		err = maxserver_wait(server);
+	}
+
+	maxserver_destroy(server);
+
+	return err;
+}
+
+/**
+ * Starts the server on port 'service', and calls 'client_thread' on
+ * every incoming client connection. This function blocks until
+ * SIGINT is raised or end-of-file is read from standard input.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver(
+	const char *service,
+	void (*client_thread)(int cfd, int sigpipe)
+)
+{
+	return maxserver_run(service, client_thread, NULL, NULL);
+}
+
+/**
+ * Works like 'maxserver', but dispatches client connections as
+ * described by 'config'. If 'config' is NULL, the default
+ * configuration is used.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_with_config(
+	const char *service,
+	void (*client_thread)(int cfd, int sigpipe),
+	const struct maxserver_config *config
+)
+{
+	return maxserver_run(service, client_thread, NULL, config);
+}
+
+/**
+ * Starts the server on port 'service', and runs
+ * 'config->evloop_threads' event loop threads that call 'callbacks'
+ * on non-blocking client sockets. If 'config' is NULL,
+ * the default configuration is used. This function blocks until
+ * SIGINT is raised or end-of-file is read from standard input.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_evloop(
+	const char *service,
+	const struct maxserver_evloop_callbacks *callbacks,
+	const struct maxserver_config *config
+)
+{
+	return maxserver_run(service, NULL, callbacks, config);
+}
+
+/**
+ * Locks 'server' for a statistics function while it runs, so that a
+ * stop does not free its objects in the meantime.
+ * Returns 1 if 'server' runs and is locked, and 0 otherwise.
+ */
+static int maxserver_stats_lock(const struct maxserver *server)
+{
+	pthread_mutex_t *lock = (pthread_mutex_t *)&server->lock;
+
+	pthread_mutex_lock(lock);
+
+	if (server->running) {
+		return 1;
+	}
+
+	pthread_mutex_unlock(lock);
+
+	return 0;
+}
+
+/**
+ * Unlocks 'server' after 'maxserver_stats_lock' has locked it.
+ */
+static void maxserver_stats_unlock(const struct maxserver *server)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)&server->lock);
+}
+
+/**
+ * Stores client connection allocation statistics of 'server', summed
+ * over all of its slabs, in 'stats'.
+ * On success, zero is returned. If 'server' is not running, -1 is
+ * returned.
+ */
+int maxserver_conn_stats(
+	const maxserver_t *server,
+	struct maxserver_conn_stats *stats
+)
+{
+	size_t i;
+
+	if (!maxserver_stats_lock(server)) {
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(struct maxserver_conn_stats));
+
+	for (i = 0; i < server->slabs_len; ++i) {
+		if (server->slabs[i] != NULL) {
+			slab_stats_add(server->slabs[i], stats);
+		}
+	}
+
+	if (server->uring != NULL) {
+		uring_conn_stats(server->uring, stats);
+	}
+
+	maxserver_stats_unlock(server);
+
+	return 0;
+}
+
+/**
+ * Stores the runtime metrics of 'server' in 'stats'. Metrics are kept
+ * in per-thread shards that are added up without stopping the threads
+ * that update them, so counters may be mutually inconsistent by the
+ * updates in flight.
+ * On success, zero is returned. If 'server' is not running or does
+ * not keep metrics, -1 is returned.
+ */
+int maxserver_stats_snapshot(
+	const maxserver_t *server,
+	struct maxserver_stats *stats
+)
+{
+	struct maxserver_pool_stats pool;
+
+	if (!maxserver_stats_lock(server)) {
+		return -1;
+	}
+
+	if (server->metrics == NULL) {
+		maxserver_stats_unlock(server);
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(struct maxserver_stats));
+	metrics_snapshot(server->metrics, stats);
+	stats->conns = __atomic_load_n(&server->open, __ATOMIC_RELAXED);
+
+	if (server->pool != NULL) {
+		worker_pool_stats(server->pool, &pool);
+		stats->queued = pool.queued;
+	}
+
+	maxserver_stats_unlock(server);
+
+	return 0;
+}
+
+/**
+ * Stores statistics of the worker pool of 'server' in 'stats'.
+ * On success, zero is returned. If 'server' is not running with
+ * MAXSERVER_DISPATCH_POOL, -1 is returned.
+ */
+int maxserver_pool_stats(
+	const maxserver_t *server,
+	struct maxserver_pool_stats *stats
+)
+{
+	int err = -1;
+
+	if (!maxserver_stats_lock(server)) {
+		return -1;
+	}
+
+	if (server->pool != NULL) {
+		worker_pool_stats(server->pool, stats);
+		err = 0;
+	}
+
+	maxserver_stats_unlock(server);
+
+	return err;
+}
+
+/**
+ * Stores statistics of each worker thread of 'server' in 'stats',
+ * which has room for 'len' worker threads. Returns the number of
+ * worker threads, which is zero unless 'server' is running with
+ * MAXSERVER_DISPATCH_POOL and a scheduler that gives every worker
+ * thread its own queue.
+ */
+size_t maxserver_pool_worker_stats(
+	const maxserver_t *server,
+	struct maxserver_pool_worker_stats *stats,
+	size_t len
+)
+{
+	size_t n = 0;
+
+	if (!maxserver_stats_lock(server)) {
+		return 0;
+	}
+
+	if (server->pool != NULL) {
+		n = worker_pool_worker_stats(server->pool, stats, len);
+	}
+
+	maxserver_stats_unlock(server);
+
+	return n;
+}
+
+/**
+ * Stores statistics of each accept shard of 'server' in 'stats',
+ * which has room for 'len' accept shards. Returns the number of
+ * accept shards, which is zero if 'server' is not running.
+ */
+size_t maxserver_accept_stats(
+	const maxserver_t *server,
+	struct maxserver_accept_stats *stats,
+	size_t len
+)
+{
+	size_t i, shards;
+
+	if (!maxserver_stats_lock(server)) {
+		return 0;
+	}
+
+	for (i = 0; i < server->shards && i < len; ++i) {
+		if (server->accept_threads[i] != NULL) {
+			accept_thread_stats(
+				server->accept_threads[i],
+				&stats[i]
+			);
+		} else {
+			memset(
+				&stats[i],
+				0,
+				sizeof(struct maxserver_accept_stats)
+			);
+		}
+	}
+
+	shards = server->shards;
+	maxserver_stats_unlock(server);
+
+	return shards;
+}
+
+/**
+ * Waits up to 'timeout_ms' milliseconds, where -1 means no timeout,
+ * for 'fd' to get any of the poll events 'events', or only for the
+ * timeout if 'fd' is -1, on behalf of client connection 'conn', which
+ * may be NULL. A fiber lets other fibers run in the meantime, and
+ * both fibers and client threads wake as soon as the server of their
+ * client connection stops.
+ * Returns 1 if 'fd' is ready, 0 if the timeout expired, and -1 with
+ * errno set to ECANCELED if the server is stopping. On error, -1 is
+ * returned, and an appropriate error message is printed to standard
+ * error.
+ */
+static int maxserver_wait_poll(
+	struct maxserver_conn *conn,
+	int fd,
+	short events,
+	int timeout_ms
+)
+{
+	struct pollfd fds[2];
+	nfds_t nfds = 1;
+	int err;
+
+	if (fiber_running()) {
+		return fiber_wait(fd, events, timeout_ms);
+	}
+
+	/* Poll ignores a negative file descriptor. */
+	fds[0].fd = fd;
+	fds[0].events = events;
+
+	/* Client threads also wait for the signal pipe. */
+	if (conn != NULL && conn->server != NULL) {
+		fds[1].fd = conn->server->sigpipe;
+		fds[1].events = POLLIN;
+		nfds = 2;
+	}
+
+	for (;;) {
+		err = poll(fds, nfds, timeout_ms);
+
+		if (err == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			print_error_errno("maxserver_wait_poll:poll");
+			return -1;
+		}
+
+		if (nfds == 2 && fds[1].revents != 0) {
+			errno = ECANCELED;
+			return -1;
+		}
+
+		return err > 0 ? 1 : 0;
+	}
+}
+
+/**
+ * Works like 'maxserver_wait_poll' on behalf of the current client
+ * connection. Queued output of the current client connection is
+ * flushed before waiting for it to become readable, and waiting for
+ * its client socket counts against its idle timeout.
+ * Returns 1 if 'fd' is ready, 0 if the timeout expired, and -1 with
+ * errno set to ECANCELED if the server is stopping, or to ETIMEDOUT
+ * if the current client connection has timed out. On error, -1 is
+ * returned, and an appropriate error message is printed to standard
+ * error.
+ */
+static int maxserver_wait_fd(int fd, short events, int timeout_ms)
+{
+	struct maxserver_conn *conn;
+	int err;
+
+	conn = maxserver_conn_current();
+
+	if (conn == NULL || conn->fd != fd) {
+		return maxserver_wait_poll(conn, fd, events, timeout_ms);
+	}
+
+	/* Flush queued output before waiting for input, which the
+	   client may only send once it has the output. */
+	if ((events & POLLIN) && conn_output_pending(conn)) {
+		maxserver_conn_flush(conn);
+	}
+
+	if (deadlines_expired(conn)) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	deadlines_wait_begin(conn);
+	err = maxserver_wait_poll(conn, fd, events, timeout_ms);
+	deadlines_wait_end(conn);
+
+	/* A timeout shuts the client socket down, which wakes the
+	   wait. */
+	if (deadlines_expired(conn)) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return err;
+}
+
+/**
+ * Returns non-zero if 'fd' is the client socket of the current client
+ * connection, and it has timed out, so that errors and end-of-file on
+ * 'fd' are due to the timeout.
+ */
+static int maxserver_timed_out(int fd)
+{
+	struct maxserver_conn *conn = maxserver_conn_current();
+
+	return conn != NULL && conn->fd == fd && deadlines_expired(conn);
+}
+
+/**
+ * Waits up to 'timeout_ms' milliseconds for 'cfd' to become readable,
+ * where -1 means no timeout. When called from a client thread, it
+ * also wakes as soon as the server of the client connection stops,
+ * and a fiber lets other fibers run in the meantime.
+ * Unlike 'select', it works with file descriptors of any number.
+ * Returns 1 if 'cfd' is readable or has hung up, 0 if the timeout
+ * expired, and -1 if the server is stopping. On error, -1 is
+ * returned, and an appropriate error message is printed to standard
+ * error.
+ */
+int maxserver_wait_readable(int cfd, int timeout_ms)
+{
+	return maxserver_wait_fd(cfd, POLLIN, timeout_ms);
+}
+
+/**
+ * Works like 'maxserver_wait_readable', but waits for 'cfd' to become
+ * writable.
+ * Returns 1 if 'cfd' is writable or has failed, 0 if the timeout
+ * expired, and -1 if the server is stopping. On error, -1 is
+ * returned, and an appropriate error message is printed to standard
+ * error.
+ */
+int maxserver_wait_writable(int cfd, int timeout_ms)
+{
+	return maxserver_wait_fd(cfd, POLLOUT, timeout_ms);
+}
+
+/**
+ * Reads up to 'len' bytes from 'fd' into 'buf' like 'read'. A fiber
+ * waits for data while other fibers run, and a client thread waits
+ * for data while also waking as soon as the server of its client
+ * connection stops.
+ * Returns the number of bytes read, which is zero at end-of-file. On
+ * error, -1 is returned, and errno is set appropriately, to
+ * ECANCELED if the server is stopping, and to ETIMEDOUT if the
+ * current client connection has timed out.
+ */
+ssize_t maxserver_read(int fd, void *buf, size_t len)
+{
+	struct maxserver_conn *conn = maxserver_conn_current();
+	ssize_t n;
+
+	/* Client threads wait before reading, so that a blocking read
+	   cannot outlast a stop. Fibers read non-blocking sockets
+	   right away. */
+	if (!fiber_running() && conn != NULL &&
+		maxserver_wait_fd(fd, POLLIN, -1) == -1) {
+		return -1;
+	}
+
+	for (;;) {
+		n = read(fd, buf, len);
+
+		/* A timeout shuts the client socket down, which reads as
+		   end-of-file. */
+		if (n == 0 && len > 0 && maxserver_timed_out(fd)) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		if (n != -1) {
+			if (n > 0 && conn != NULL && conn->fd == fd) {
+				conn_count(conn, (size_t)n, 0);
+			}
+
+			return n;
+		}
+
+		if (errno == EINTR) {
+			continue;
+		}
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+
+		if (maxserver_wait_fd(fd, POLLIN, -1) == -1) {
+			return -1;
+		}
+	}
+}
+
+/**
+ * Writes all 'len' bytes of 'buf' to 'fd'. Whenever a non-blocking
+ * 'fd' is full, it waits in the same way as 'maxserver_read', while a
+ * blocking 'fd' blocks like 'write'. Writing
+ * to a socket whose peer has gone away fails with EPIPE instead of
+ * raising SIGPIPE.
+ * Returns 'len'. On error, -1 is returned, and errno is set
+ * appropriately, to ECANCELED if the server is stopping, and to
+ * ETIMEDOUT if the current client connection has timed out. Some of the
+ * bytes may have been written.
+ */
+ssize_t maxserver_write(int fd, const void *buf, size_t len)
+{
+	struct maxserver_conn *conn = maxserver_conn_current();
+	const char *p = buf;
+	size_t off = 0;
+	int sock = 1;
+	ssize_t n;
+
+	/* Keep the output in order with queued output. */
+	if (conn != NULL && conn->fd == fd && conn_output_pending(conn) &&
+		maxserver_conn_flush(conn) == -1) {
+		return -1;
+	}
+
+	while (off < len) {
+		/* Fall back to 'write' for anything but sockets. */
+		if (sock) {
+			n = send(fd, p + off, len - off, MSG_NOSIGNAL);
+
+			if (n == -1 && errno == ENOTSOCK) {
+				sock = 0;
+				continue;
+			}
+		} else {
+			n = write(fd, p + off, len - off);
+		}
+
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno == EPIPE && maxserver_timed_out(fd)) {
+				errno = ETIMEDOUT;
+			}
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return -1;
+			}
+
+			if (maxserver_wait_fd(fd, POLLOUT, -1) == -1) {
+				return -1;
+			}
+
+			continue;
+		}
+
+		off += (size_t)n;
+	}
+
+	if (conn != NULL && conn->fd == fd) {
+		conn_count(conn, 0, len);
+	}
+
+	return (ssize_t)len;
+}
+
+/**
+ * Sleeps for 'ms' milliseconds. A fiber lets other fibers run in the
+ * meantime, and both fibers and client threads wake as soon as the
+ * server of their client connection stops.
+ * Returns zero after sleeping, and -1 if the server is stopping.
+ */
+int maxserver_sleep(unsigned int ms)
+{
+	if (ms > INT_MAX) {
+		ms = INT_MAX;
+	}
+
+	return maxserver_wait_fd(-1, 0, (int)ms) == -1 ? -1 : 0;
+}
+
+/**
+ * Copies the host name of the address that 'conn' is connected from
+ * to 'host', which has room for 'hostlen' bytes. If the server does
+ * not resolve host names, or the host name has not been resolved
+ * yet, the numeric host is copied instead. Never blocks on name
+ * resolution.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_conn_peer_name(
+	const struct maxserver_conn *conn,
+	char *host,
+	size_t hostlen
+)
+{
+	const struct sockaddr *addr;
+	socklen_t addrlen;
+	int err;
+
+	addr = maxserver_conn_peer(conn, &addrlen);
+
+	if (conn->server != NULL && conn->server->resolver != NULL) {
+		err = resolver_lookup(
+			conn->server->resolver,
+			addr,
+			addrlen,
+			host,
+			hostlen
+		);
+
+		if (err == 0) {
+			return 0;
+		}
+	}
+
+	return maxserver_conn_peer_numeric(conn, host, hostlen, NULL, 0);
+}
+
+/**
+ * Returns the number of log messages dropped because a log buffer was
+ * full.
+ */
+unsigned long long maxserver_log_dropped()
+{
+	return log_dropped();
 }
@@ -21,6 +21,559 @@
 #ifndef MAXSERVER_H
 #define MAXSERVER_H
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/**
+ * Number of buckets of the handler duration histogram of
+ * 'maxserver_stats_snapshot', which covers durations of up to 2^40
+ * nanoseconds.
+ */
+#define MAXSERVER_STATS_BUCKETS 304
+
+/**
+ * Ways of dispatching accepted client connections to 'client_thread'.
+ * MAXSERVER_DISPATCH_THREAD starts a new thread for every client
+ * connection. MAXSERVER_DISPATCH_POOL queues client connections to a
+ * pool of pre-spawned worker threads. MAXSERVER_DISPATCH_FIBER runs
+ * every client connection in a fiber with a small stack of its own,
+ * on a few scheduler threads that switch to another fiber whenever
+ * one waits in 'maxserver_read', 'maxserver_write', 'maxserver_sleep'
+ * or 'maxserver_wait_readable'. Client sockets are non-blocking, so
+ * 'client_thread' must only wait through those functions.
+ */
+enum maxserver_dispatch {
+	MAXSERVER_DISPATCH_THREAD,
+	MAXSERVER_DISPATCH_POOL,
+	MAXSERVER_DISPATCH_FIBER
+};
+
+/**
+ * Ways of scheduling client connections on the worker threads of
+ * MAXSERVER_DISPATCH_POOL. MAXSERVER_POOL_SHARED queues every client
+ * connection in one queue that every worker thread takes from.
+ * MAXSERVER_POOL_ROUND_ROBIN queues client connections to the worker
+ * threads in turn, each of which only handles its own queue.
+ * MAXSERVER_POOL_STEALING does the same, but lets worker threads that
+ * run out of client connections steal queued ones from busy worker
+ * threads, so that a few slow handlers do not hold up the client
+ * connections queued behind them.
+ */
+enum maxserver_pool_scheduler {
+	MAXSERVER_POOL_SHARED,
+	MAXSERVER_POOL_ROUND_ROBIN,
+	MAXSERVER_POOL_STEALING
+};
+
+/**
+ * Ways of placing client threads on CPUs. MAXSERVER_AFFINITY_NONE
+ * leaves placement to the scheduler. MAXSERVER_AFFINITY_ROUND_ROBIN
+ * pins client threads to the CPUs that the process may run on in
+ * turn. MAXSERVER_AFFINITY_ACCEPT_SHARD pins every client thread to
+ * the CPU of the accept thread that accepted its client connection,
+ * which only has an effect with more than one accept shard.
+ */
+enum maxserver_affinity {
+	MAXSERVER_AFFINITY_NONE,
+	MAXSERVER_AFFINITY_ROUND_ROBIN,
+	MAXSERVER_AFFINITY_ACCEPT_SHARD
+};
+
+/**
+ * Backends of the event loop threads of 'maxserver_evloop'.
+ * MAXSERVER_EVLOOP_EPOLL waits for client sockets with epoll and
+ * hands them to an accept thread per accept shard.
+ * MAXSERVER_EVLOOP_URING lets every event loop thread accept and
+ * receive through its own io_uring instance, with multishot accepts,
+ * multishot receives into kernel-provided buffers and linked sends.
+ * It requires the 'on_data' callback, and falls back to
+ * MAXSERVER_EVLOOP_EPOLL with a warning if the kernel does not
+ * support it.
+ */
+enum maxserver_evloop_backend {
+	MAXSERVER_EVLOOP_EPOLL,
+	MAXSERVER_EVLOOP_URING
+};
+
+/**
+ * Ways of coalescing the output chain of a client connection into
+ * few TCP segments. MAXSERVER_CORK_NONE sends the output chain as it
+ * is. MAXSERVER_CORK_MSG_MORE sends the parts of the output chain
+ * that are sent early, because it ran full, with MSG_MORE, so that
+ * the kernel holds back a partial segment until the rest follows.
+ * MAXSERVER_CORK_TCP also sets TCP_CORK on the client socket while
+ * output is queued, and clears it when the output chain is flushed,
+ * which costs two more system calls per flush but also coalesces
+ * data written to the client socket in between.
+ */
+enum maxserver_cork {
+	MAXSERVER_CORK_NONE,
+	MAXSERVER_CORK_MSG_MORE,
+	MAXSERVER_CORK_TCP
+};
+
+/**
+ * Ways of backing the buffer pool with huge pages.
+ * MAXSERVER_HUGEPAGES_NONE uses normal pages.
+ * MAXSERVER_HUGEPAGES_TRANSPARENT asks for transparent huge pages
+ * with 'madvise'. MAXSERVER_HUGEPAGES_EXPLICIT maps the buffer pool
+ * with MAP_HUGETLB, from huge pages that must have been reserved, and
+ * falls back to normal pages if that fails.
+ */
+enum maxserver_hugepages {
+	MAXSERVER_HUGEPAGES_NONE,
+	MAXSERVER_HUGEPAGES_TRANSPARENT,
+	MAXSERVER_HUGEPAGES_EXPLICIT
+};
+
+/**
+ * Data structure representing the server configuration. Should be
+ * initialised with 'maxserver_config_init' before any field is set.
+ *
+ * 'pool_min_threads' worker threads are spawned when the server
+ * starts, and more are spawned on demand up to 'pool_max_threads'.
+ * Worker threads above the minimum quit after being idle for
+ * 'pool_idle_timeout_ms' milliseconds. At most 'pool_queue_len'
+ * client connections wait for a worker thread, and any client
+ * connection accepted while the queue is full is closed.
+ * 'pool_scheduler' is the way client connections are scheduled on
+ * worker threads. With MAXSERVER_POOL_ROUND_ROBIN and
+ * MAXSERVER_POOL_STEALING, 'pool_max_threads' worker threads are
+ * spawned when the server starts and never quit, and each of them
+ * queues an equal share of 'pool_queue_len' client connections.
+ *
+ * 'fiber_threads' is the number of scheduler threads of
+ * MAXSERVER_DISPATCH_FIBER, where zero means one per online CPU, and
+ * 'fiber_stack_size' is the stack size of every fiber, where zero
+ * means 64 KiB. Stacks are only backed by memory as deep as they are
+ * used, and have a guard page below them.
+ *
+ * Every thread that accepts client connections allocates them from a
+ * slab of its own, which maps room for 'conn_slab_len' of them when
+ * the server starts and again whenever all are in use, and locks
+ * them into memory if 'conn_slab_lock' is non-zero. Allocating a
+ * client connection then never calls 'malloc'.
+ *
+ * 'conn_buffer_len' is the size of the read-ahead buffer that a
+ * client connection allocates the first time it is read with
+ * 'maxserver_frame_next', which grows to hold frames of up to
+ * 'frame_max_len' bytes. 'output_cork' is the way the output chain
+ * of a client connection is coalesced into TCP segments. Event loops
+ * throttle a client connection that has more than 'send_high_water'
+ * bytes of output queued by 'maxserver_conn_send' until fewer than
+ * 'send_low_water' bytes are queued, so that a client that sends
+ * without reading cannot make the server queue output without bound.
+ *
+ * Every client connection has an arena for temporary allocations of
+ * its handler, returned by 'maxserver_conn_arena', which takes chunks
+ * of 'arena_chunk_len' bytes from the buffer pool when first used,
+ * each 'arena_growth' times as large as the one before, and poisons
+ * freed memory if 'arena_poison' is non-zero.
+ *
+ * Client connections handled by client threads, worker threads and
+ * fibers time out once they have waited on their client socket for
+ * 'idle_timeout_ms' milliseconds in one wait, once a frame that the
+ * client has started has taken 'read_timeout_ms' milliseconds to
+ * arrive, or once their handler has run for 'handler_timeout_ms'
+ * milliseconds, where zero means no timeout for either. A client
+ * connection that times out has its client socket shut down, which
+ * makes waits and frames fail with ETIMEDOUT. Event loops time client
+ * connections out once nothing has been received from them for
+ * 'idle_timeout_ms' milliseconds, or once 'read_timeout_ms'
+ * milliseconds have passed between receiving data and answering it
+ * with 'maxserver_conn_send', and then close them. Timeouts are kept
+ * on timer wheels with a resolution of 10 ms.
+ *
+ * 'evloop_threads' is the number of event loop threads run by
+ * 'maxserver_evloop', where zero means one per online CPU, and
+ * 'evloop_backend' is the backend that they run on.
+ *
+ * 'accept_shards' is the number of server sockets opened on the same
+ * port with SO_REUSEPORT, each with its own accept thread. With more
+ * than one accept shard, the accept threads are pinned to the CPUs
+ * that the process may run on in turn. Every time its server socket
+ * becomes readable, an accept thread accepts client connections
+ * until the backlog is empty or 'accept_batch' have been accepted,
+ * and dispatches them at once.
+ *
+ * 'client_thread_shards' is the number of independently locked shards
+ * of the registry of client threads started with
+ * MAXSERVER_DISPATCH_THREAD, where zero means one per online CPU.
+ *
+ * Client threads started with MAXSERVER_DISPATCH_THREAD get stacks of
+ * 'client_thread_stack_size' bytes with guard areas of
+ * 'client_thread_guard_size' bytes, where zero means the system
+ * default for either, are placed on CPUs as described by
+ * 'client_thread_affinity', and are scheduled with policy
+ * 'client_thread_sched_policy' and priority
+ * 'client_thread_sched_priority', as in 'sched_setscheduler'.
+ *
+ * Client addresses are never resolved while accepting client
+ * connections. If 'resolve_hosts' is non-zero, host names requested
+ * with 'maxserver_conn_peer_name' are resolved by a background
+ * thread, and up to 'resolve_cache_len' of them are cached for
+ * 'resolve_ttl_ms' milliseconds.
+ *
+ * The buffer pool of 'maxserver_buf_get' is shared by every server in
+ * the process, and reserves 'buf_pool_len' bytes of address space,
+ * backed by pages as described by 'buf_pool_hugepages', the first
+ * time that a buffer is taken from it. It is set up as configured by
+ * the first server that starts before then.
+ *
+ * If 'metrics' is non-zero, the server counts accepts, handler
+ * invocations and their durations, bytes received and sent, and
+ * client threads and worker threads started and joined, for
+ * 'maxserver_stats_snapshot'. It is on by default. Only one in 16
+ * handler invocations on every thread is timed, so that the others
+ * are counted without reading the clock.
+ *
+ * If 'handle_signals' is non-zero, SIGINT requests the server to
+ * stop. If 'handle_stdin' is non-zero, end-of-file on standard input
+ * requests the server to stop. Both only wake 'maxserver_wait', and
+ * should be cleared when the server is embedded in a process that
+ * has its own main loop or runs with standard input closed.
+ */
+struct maxserver_config {
+	enum maxserver_dispatch dispatch;
+	size_t pool_min_threads;
+	size_t pool_max_threads;
+	size_t pool_queue_len;
+	unsigned int pool_idle_timeout_ms;
+	enum maxserver_pool_scheduler pool_scheduler;
+	size_t fiber_threads;
+	size_t fiber_stack_size;
+	size_t conn_slab_len;
+	int conn_slab_lock;
+	size_t conn_buffer_len;
+	size_t frame_max_len;
+	enum maxserver_cork output_cork;
+	size_t send_high_water;
+	size_t send_low_water;
+	size_t arena_chunk_len;
+	unsigned int arena_growth;
+	int arena_poison;
+	unsigned int idle_timeout_ms;
+	unsigned int read_timeout_ms;
+	unsigned int handler_timeout_ms;
+	size_t evloop_threads;
+	enum maxserver_evloop_backend evloop_backend;
+	size_t accept_shards;
+	size_t accept_batch;
+	size_t client_thread_shards;
+	size_t client_thread_stack_size;
+	size_t client_thread_guard_size;
+	enum maxserver_affinity client_thread_affinity;
+	int client_thread_sched_policy;
+	int client_thread_sched_priority;
+	int resolve_hosts;
+	size_t resolve_cache_len;
+	unsigned int resolve_ttl_ms;
+	size_t buf_pool_len;
+	enum maxserver_hugepages buf_pool_hugepages;
+	int metrics;
+	int handle_stdin;
+	int handle_signals;
+};
+
+/**
+ * Opaque data structure representing a server. Several servers may
+ * run in one process, each on its own port and with its own handlers.
+ */
+typedef struct maxserver maxserver_t;
+
+/**
+ * Opaque data structure representing a client connection.
+ */
+struct maxserver_conn;
+
+/**
+ * Opaque data structure representing an arena, which allocates
+ * memory by bumping a pointer and frees all of it at once.
+ */
+struct maxserver_arena;
+
+/**
+ * Data structure representing a frame returned by
+ * 'maxserver_frame_next': 'len' bytes of data at 'data'.
+ */
+struct maxserver_frame {
+	const void *data;
+	size_t len;
+};
+
+/**
+ * Data structure holding the callbacks of 'maxserver_evloop'. Every
+ * callback of a client connection is called from the same event loop
+ * thread, and any callback may be NULL.
+ *
+ * 'on_open' is called when the client connection is accepted, and
+ * may return -1 to close it. 'on_readable' and 'on_writable' are
+ * edge-triggered: they are called when the client socket becomes
+ * readable or writable, so 'on_readable' should read until 'read'
+ * fails with EAGAIN. 'on_close' is called exactly once before the
+ * client socket is closed, if 'on_open' has returned zero.
+ *
+ * If 'on_data' is set, the event loop reads the client socket itself
+ * and calls 'on_data' with every chunk of data received instead of
+ * calling 'on_readable', and replies are sent with
+ * 'maxserver_conn_send'. The data is only valid until 'on_data'
+ * returns.
+ */
+struct maxserver_evloop_callbacks {
+	int (*on_open)(struct maxserver_conn *conn);
+	void (*on_readable)(struct maxserver_conn *conn);
+	void (*on_writable)(struct maxserver_conn *conn);
+	void (*on_close)(struct maxserver_conn *conn);
+	void (*on_data)(
+		struct maxserver_conn *conn,
+		const void *data,
+		size_t len
+	);
+};
+
+/**
+ * Data structure representing accept shard statistics.
+ *
+ * 'wakeups' counts the times the accept thread woke up to a readable
+ * server socket, so 'accepts' divided by 'wakeups' is the mean number
+ * of client connections accepted per wakeup, and 'batch_max' is the
+ * most client connections accepted in one wakeup. They stay zero for
+ * io_uring event loop threads, which accept without accept threads.
+ */
+struct maxserver_accept_stats {
+	unsigned long long accepts;
+	unsigned long long wakeups;
+	size_t batch_max;
+};
+
+/**
+ * Data structure representing client connection allocation
+ * statistics.
+ *
+ * Client connections are allocated from slabs owned by the threads
+ * that accept them. 'allocs' and 'frees' count the client
+ * connections allocated and freed, 'in_use' is the number allocated
+ * now, and 'capacity' is the number the slabs have room for. 'grows'
+ * counts the times a slab had to map more room after it had been
+ * created, which are the only times that allocating a client
+ * connection makes a system call. 'bytes' is the memory mapped for
+ * the slabs, of which 'locked' bytes are locked into memory.
+ */
+struct maxserver_conn_stats {
+	unsigned long long allocs;
+	unsigned long long frees;
+	size_t in_use;
+	size_t capacity;
+	unsigned long long grows;
+	size_t bytes;
+	size_t locked;
+};
+
+/**
+ * Data structure representing buffer pool statistics.
+ *
+ * 'gets' and 'puts' count buffers taken and returned. Of the buffers
+ * taken, 'cache_hits' came from the cache of the calling thread,
+ * 'depot_hits' from the depot shared by all threads, 'carved' were
+ * new to the buffer pool, and 'fallbacks' were allocated outside it,
+ * because they were too large or it was full. 'region_len' bytes of
+ * address space are reserved for the buffer pool, of which
+ * 'region_used' bytes have been carved into buffers and 'resident'
+ * bytes are backed by memory. 'hugepages' is the kind of pages that
+ * the buffer pool got. Counts are gathered from thread caches in
+ * batches, and may lag behind by a few hundred per thread.
+ */
+struct maxserver_buf_stats {
+	unsigned long long gets;
+	unsigned long long puts;
+	unsigned long long cache_hits;
+	unsigned long long depot_hits;
+	unsigned long long carved;
+	unsigned long long fallbacks;
+	size_t region_len;
+	size_t region_used;
+	size_t resident;
+	enum maxserver_hugepages hugepages;
+};
+
+/**
+ * Data structure representing arena statistics.
+ *
+ * 'allocs' counts allocations and 'resets' the times the arena was
+ * reset. 'chunks' chunks of 'bytes' bytes in all have been taken from
+ * the buffer pool, of which 'used' bytes are allocated now, and at
+ * most 'peak' bytes have been allocated between two resets.
+ */
+struct maxserver_arena_stats {
+	unsigned long long allocs;
+	unsigned long long resets;
+	size_t chunks;
+	size_t bytes;
+	size_t used;
+	size_t peak;
+};
+
+/**
+ * Data structure representing the runtime metrics of a server.
+ *
+ * 'accepts' counts client sockets accepted and 'accept_errors' the
+ * times accepting failed, and 'conns' is the number of client
+ * connections open now. 'handled' counts handler invocations: client
+ * threads, worker threads and fibers invoke their handler once per
+ * client connection, and event loops once per callback.
+ * 'handler_buckets' counts the one in 16 of them that are timed by
+ * duration: bucket 'i' counts durations from
+ * 'maxserver_stats_bucket_ns(i)' nanoseconds up to the start of the
+ * next bucket, which is at most 12.5% later. Their total duration
+ * 'handler_ns' is summed from the middles of the buckets, which is
+ * accurate to 6.25%, and scaled up to all of 'handled'. 'bytes_in'
+ * and 'bytes_out' count bytes received from and sent to clients
+ * through maxserver: frames, output chains, 'maxserver_read',
+ * 'maxserver_write', 'maxserver_sendfile', 'maxserver_splice', and
+ * the reads and sends of event loops, but not reads of client
+ * sockets in 'on_readable'. Every client connection adds its bytes
+ * every 64 KiB and when it closes, so that open client connections
+ * may hold back up to 64 KiB each. 'thread_spawns' and
+ * 'thread_joins' count client threads and worker threads started and
+ * joined, and 'queued' is the number of client connections waiting
+ * for a worker thread.
+ */
+struct maxserver_stats {
+	unsigned long long accepts;
+	unsigned long long accept_errors;
+	size_t conns;
+	unsigned long long handled;
+	unsigned long long handler_ns;
+	unsigned long long handler_buckets[MAXSERVER_STATS_BUCKETS];
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long thread_spawns;
+	unsigned long long thread_joins;
+	size_t queued;
+};
+
+/**
+ * Data structure representing worker pool statistics.
+ *
+ * 'saturated' counts client connections that had to wait in the
+ * queue because every worker thread was busy and no more worker
+ * threads could be spawned, and 'rejected' counts client
+ * connections that were closed because the queue was full. 'steals'
+ * counts client connections that a worker thread took from the
+ * queue of another worker thread with MAXSERVER_POOL_STEALING.
+ */
+struct maxserver_pool_stats {
+	size_t threads;
+	size_t busy;
+	size_t queued;
+	size_t queued_max;
+	unsigned long long dispatched;
+	unsigned long long spawned;
+	unsigned long long saturated;
+	unsigned long long rejected;
+	unsigned long long steals;
+};
+
+/**
+ * Data structure representing statistics of a worker thread with its
+ * own queue, as with MAXSERVER_POOL_ROUND_ROBIN and
+ * MAXSERVER_POOL_STEALING.
+ *
+ * 'queued' is the number of client connections in its queue and
+ * 'queued_max' the most there have been. 'handled' counts the client
+ * connections it has handled, and 'steals' those of them that it took
+ * from the queue of another worker thread.
+ */
+struct maxserver_pool_worker_stats {
+	size_t queued;
+	size_t queued_max;
+	unsigned long long handled;
+	unsigned long long steals;
+};
+
+/**
+ * Initialises 'config' with the default configuration, which starts
+ * a new thread for every client connection.
+ */
+void maxserver_config_init(struct maxserver_config *config);
+
+/**
+ * Creates a server on port 'service' that calls 'client_thread' on
+ * every incoming client connection, dispatched as described by
+ * 'config'. If 'config' is NULL, the default configuration is used.
+ * The server does not listen until it is started with
+ * 'maxserver_start'.
+ * 'client_thread' gets the client socket 'cfd' and 'sigpipe', which
+ * becomes readable when the server stops. Both should be waited for
+ * with 'maxserver_wait_readable', 'poll' or 'epoll', but never with
+ * 'select', since file descriptors may be above FD_SETSIZE.
+ * On success, a pointer to the new server is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+maxserver_t *maxserver_create(
+	const char *service,
+	void (*client_thread)(int cfd, int sigpipe),
+	const struct maxserver_config *config
+);
+
+/**
+ * Creates a server on port 'service' that runs
+ * 'config->evloop_threads' event loop threads that call 'callbacks'
+ * on non-blocking client sockets. If 'config' is NULL,
+ * the default configuration is used. The server does not listen until
+ * it is started with 'maxserver_start'.
+ * On success, a pointer to the new server is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+maxserver_t *maxserver_create_evloop(
+	const char *service,
+	const struct maxserver_evloop_callbacks *callbacks,
+	const struct maxserver_config *config
+);
+
+/**
+ * Starts 'server', and returns as soon as it listens on its port.
+ * Messages are logged by a background log flusher while the server
+ * runs. A server can only be started once.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_start(maxserver_t *server);
+
+/**
+ * Blocks until a stop of 'server' is requested, which happens when
+ * 'maxserver_stop' is called, when SIGINT is raised if
+ * 'config->handle_signals' is set, and when end-of-file is read from
+ * standard input if 'config->handle_stdin' is set. Returns at once if
+ * a stop has already been requested.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_wait(maxserver_t *server);
+
+/**
+ * Stops 'server' gracefully. The server stops listening at once, and
+ * its client connections get up to 'timeout_ms' milliseconds to
+ * finish before their client threads are signalled through
+ * 'sigpipe' to quit. Returns once every thread of the server has
+ * quit. Does nothing if 'server' is not running. May be called from
+ * any thread but those of 'server', and if another thread is already
+ * stopping 'server', waits for that stop to complete. The statistics
+ * functions treat 'server' as not running from the start of the stop.
+ * Returns the number of client connections that were still open
+ * when the timeout expired.
+ */
+size_t maxserver_stop(maxserver_t *server, unsigned int timeout_ms);
+
+/**
+ * Frees 'server', stopping it at once first if it is running, or
+ * waiting for a stop in progress to complete.
+ */
+void maxserver_destroy(maxserver_t *server);
+
 /**
  * Starts the server on port 'service', and calls 'client_thread' on
  * every incoming client connection. This function blocks until
@@ -33,4 +586,467 @@ int maxserver(
 	void (*client_thread)(int cfd, int sigpipe)
 );
 
+/**
+ * Works like 'maxserver', but dispatches client connections as
+ * described by 'config'. If 'config' is NULL, the default
+ * configuration is used.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_with_config(
+	const char *service,
+	void (*client_thread)(int cfd, int sigpipe),
+	const struct maxserver_config *config
+);
+
+/**
+ * Starts the server on port 'service', and runs
+ * 'config->evloop_threads' event loop threads that call 'callbacks'
+ * on non-blocking client sockets. If 'config' is NULL,
+ * the default configuration is used. This function blocks until
+ * SIGINT is raised or end-of-file is read from standard input.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_evloop(
+	const char *service,
+	const struct maxserver_evloop_callbacks *callbacks,
+	const struct maxserver_config *config
+);
+
+/**
+ * Returns the client connection that the calling client thread is
+ * handling, or NULL if it is not handling any.
+ */
+struct maxserver_conn *maxserver_conn_current();
+
+/**
+ * Returns the client socket file descriptor of 'conn'.
+ */
+int maxserver_conn_fd(const struct maxserver_conn *conn);
+
+/**
+ * Returns the user data of 'conn', which is NULL until set with
+ * 'maxserver_conn_set_data'.
+ */
+void *maxserver_conn_data(const struct maxserver_conn *conn);
+
+/**
+ * Sets the user data of 'conn' to 'data'.
+ */
+void maxserver_conn_set_data(struct maxserver_conn *conn, void *data);
+
+/**
+ * Closes 'conn' once the current callback returns. 'on_close' is
+ * called before the client socket is closed. May only be called from
+ * a callback of 'conn'.
+ */
+void maxserver_conn_close(struct maxserver_conn *conn);
+
+/**
+ * Sends 'len' bytes of 'data' to 'conn'. Event loops copy 'data' and
+ * send it in order once the client socket is writable, so the call
+ * never blocks and 'data' may be reused when it returns. Client
+ * threads block until every byte has been written, and fibers wait
+ * for it while other fibers run. If the client socket fails, an
+ * event loop closes 'conn' once the current callback returns.
+ * Once an event loop has more than 'send_high_water' bytes queued
+ * for 'conn', it throttles 'conn': it stops reading the client
+ * socket, and calls neither 'on_data' nor 'on_readable' for data that
+ * it has not received yet, until fewer than 'send_low_water' bytes
+ * are queued.
+ * On success, zero is returned, or 1 if 'data' was queued but 'conn'
+ * is throttled, so that the caller should stop sending. On error, -1
+ * is returned, and an appropriate error message is printed to
+ * standard error unless the client has gone away.
+ */
+int maxserver_conn_send(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len
+);
+
+/**
+ * Waits up to 'timeout_ms' milliseconds for 'cfd' to become readable,
+ * where -1 means no timeout. When called from a client thread, it
+ * also wakes as soon as the server of the client connection stops,
+ * and a fiber lets other fibers run in the meantime.
+ * Unlike 'select', it works with file descriptors of any number.
+ * Returns 1 if 'cfd' is readable or has hung up, 0 if the timeout
+ * expired, and -1 if the server is stopping. On error, -1 is
+ * returned, and an appropriate error message is printed to standard
+ * error.
+ */
+int maxserver_wait_readable(int cfd, int timeout_ms);
+
+/**
+ * Works like 'maxserver_wait_readable', but waits for 'cfd' to become
+ * writable.
+ * Returns 1 if 'cfd' is writable or has failed, 0 if the timeout
+ * expired, and -1 if the server is stopping. On error, -1 is
+ * returned, and an appropriate error message is printed to standard
+ * error.
+ */
+int maxserver_wait_writable(int cfd, int timeout_ms);
+
+/**
+ * Reads up to 'len' bytes from 'fd' into 'buf' like 'read'. A fiber
+ * waits for data while other fibers run, and a client thread waits
+ * for data while also waking as soon as the server of its client
+ * connection stops.
+ * Returns the number of bytes read, which is zero at end-of-file. On
+ * error, -1 is returned, and errno is set appropriately, to
+ * ECANCELED if the server is stopping.
+ */
+ssize_t maxserver_read(int fd, void *buf, size_t len);
+
+/**
+ * Writes all 'len' bytes of 'buf' to 'fd'. Whenever a non-blocking
+ * 'fd' is full, it waits in the same way as 'maxserver_read', while a
+ * blocking 'fd' blocks like 'write'. Writing
+ * to a socket whose peer has gone away fails with EPIPE instead of
+ * raising SIGPIPE.
+ * Returns 'len'. On error, -1 is returned, and errno is set
+ * appropriately, to ECANCELED if the server is stopping. Some of the
+ * bytes may have been written.
+ */
+ssize_t maxserver_write(int fd, const void *buf, size_t len);
+
+/**
+ * Sleeps for 'ms' milliseconds. A fiber lets other fibers run in the
+ * meantime, and both fibers and client threads wake as soon as the
+ * server of their client connection stops.
+ * Returns zero after sleeping, and -1 if the server is stopping.
+ */
+int maxserver_sleep(unsigned int ms);
+
+/**
+ * Returns the next frame received from 'conn' in 'frame'. A frame is
+ * a length of type size_t, in host byte order, followed by that many
+ * bytes of data. Input is read ahead into a buffer of the client
+ * connection, so frames that arrive together are returned without
+ * reading the client socket again. 'frame' points into that buffer,
+ * and is only valid until the next call, unless it is queued with
+ * 'maxserver_conn_queue', since the output chain is flushed before
+ * the buffer is refilled. Waits for input like
+ * 'maxserver_read'. May only be called from the client thread or
+ * fiber of 'conn', and should not be mixed with reading the client
+ * socket directly.
+ * Returns 1 if a frame was returned, and 0 if the client closed the
+ * connection between frames. On error, -1 is returned, and errno is
+ * set appropriately: to ECANCELED if the server is stopping, to
+ * ETIMEDOUT if 'conn' has timed out, to EPROTO if the client closed
+ * the connection in the middle of a frame, and to EMSGSIZE if a frame
+ * is longer than 'frame_max_len'.
+ * An appropriate error message is printed to standard error if
+ * memory runs out.
+ */
+int maxserver_frame_next(
+	struct maxserver_conn *conn,
+	struct maxserver_frame *frame
+);
+
+/**
+ * Returns the number of bytes received from 'conn' that
+ * 'maxserver_frame_next' has read ahead but not returned yet.
+ */
+size_t maxserver_conn_buffered(const struct maxserver_conn *conn);
+
+/**
+ * Returns the arena of 'conn', for memory that the handler only needs
+ * while it handles one request. The arena is reset whenever
+ * 'maxserver_frame_next' is called, unless queued output may still
+ * point into it, in which case it is reset once the output chain has
+ * been flushed, and after every callback of 'maxserver_evloop'. It
+ * is freed with 'conn'.
+ */
+struct maxserver_arena *maxserver_conn_arena(struct maxserver_conn *conn);
+
+/**
+ * Queues 'len' bytes of 'data' to the output chain of 'conn' without
+ * copying them, so 'data' must stay valid until the output chain is
+ * flushed. The output chain is flushed with 'maxserver_conn_flush',
+ * before the client thread or fiber of 'conn' waits for input from
+ * it, and when its client thread or fiber returns, and is sent early
+ * once it holds IOV_MAX entries or 64 KiB. May only be called from
+ * the client thread or fiber of 'conn'.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error unless the
+ * client has gone away.
+ */
+int maxserver_conn_queue(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len
+);
+
+/**
+ * Works like 'maxserver_conn_queue', but copies 'data', so that it
+ * may be reused at once. Small pieces queued in a row, such as
+ * headers, share one entry of the output chain.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error unless the
+ * client has gone away.
+ */
+int maxserver_conn_queue_copy(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len
+);
+
+/**
+ * Sends the output chain of 'conn' with as few system calls as
+ * possible, waiting while the client socket is full like
+ * 'maxserver_write', and clears TCP_CORK if 'conn' is corked so that
+ * the last segment goes out at once.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error unless the
+ * client has gone away.
+ */
+int maxserver_conn_flush(struct maxserver_conn *conn);
+
+/**
+ * Sends up to 'len' bytes of file 'fd' from offset 'off' to 'conn'
+ * with 'sendfile', after any queued output, so that the data never
+ * passes through user space. Waits while the client socket is full
+ * like 'maxserver_write', and wakes as soon as the server stops. The
+ * file offset of 'fd' is left unchanged. May only be called from the
+ * client thread or fiber of 'conn'.
+ * Returns the number of bytes sent, which is less than 'len' only if
+ * the file ends first. On error, -1 is returned, and errno is set
+ * appropriately, to ECANCELED if the server is stopping. Some of the
+ * bytes may have been sent.
+ */
+ssize_t maxserver_sendfile(
+	struct maxserver_conn *conn,
+	int fd,
+	off_t off,
+	size_t len
+);
+
+/**
+ * Moves up to 'len' bytes from 'fd', which may be a pipe, a socket or
+ * a file, at its current offset, to 'conn' with 'splice', after any
+ * queued output, so that the data never passes through user space.
+ * Waits for 'fd' and the client socket like 'maxserver_read' and
+ * 'maxserver_write', so a socket or pipe 'fd' should be non-blocking
+ * in a fiber. May only be called from the client thread or fiber of
+ * 'conn'.
+ * Returns the number of bytes moved, which is less than 'len' only at
+ * end-of-file. On error, -1 is returned, and errno is set
+ * appropriately, to ECANCELED if the server is stopping. Some of the
+ * bytes may have been moved.
+ */
+ssize_t maxserver_splice(struct maxserver_conn *conn, int fd, size_t len);
+
+/**
+ * Returns the address that 'conn' is connected from, and stores its
+ * length in 'addrlen' if 'addrlen' is not NULL.
+ */
+const struct sockaddr *maxserver_conn_peer(
+	const struct maxserver_conn *conn,
+	socklen_t *addrlen
+);
+
+/**
+ * Formats the numeric host and port of the address that 'conn' is
+ * connected from into 'host' and 'serv', which have room for
+ * 'hostlen' and 'servlen' bytes. Either may be NULL. Never blocks.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_conn_peer_numeric(
+	const struct maxserver_conn *conn,
+	char *host,
+	size_t hostlen,
+	char *serv,
+	size_t servlen
+);
+
+/**
+ * Copies the host name of the address that 'conn' is connected from
+ * to 'host', which has room for 'hostlen' bytes. If the server does
+ * not resolve host names, or the host name has not been resolved
+ * yet, the numeric host is copied instead. Never blocks on name
+ * resolution.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+int maxserver_conn_peer_name(
+	const struct maxserver_conn *conn,
+	char *host,
+	size_t hostlen
+);
+
+/**
+ * Stores statistics of each accept shard of 'server' in 'stats',
+ * which has room for 'len' accept shards. Returns the number of
+ * accept shards, which is zero if 'server' is not running.
+ */
+size_t maxserver_accept_stats(
+	const maxserver_t *server,
+	struct maxserver_accept_stats *stats,
+	size_t len
+);
+
+/**
+ * Takes a buffer of at least 'len' bytes from the buffer pool, with
+ * one reference. Buffers come in power-of-two sizes from 64 bytes to
+ * 1 MiB, and larger ones are mapped on their own. Every thread caches
+ * a few buffers of each size, so that buffers are mostly taken and
+ * returned without synchronisation, and buffers may be returned by
+ * any thread.
+ * On success, a pointer to the buffer is returned, aligned to a cache
+ * line. On error, NULL is returned, and an appropriate error message
+ * is printed to standard error.
+ */
+void *maxserver_buf_get(size_t len);
+
+/**
+ * Adds a reference to buffer 'buf', so that it can be shared, for
+ * instance by queueing it to several client connections. Every
+ * reference is returned with 'maxserver_buf_put'.
+ * Returns 'buf'.
+ */
+void *maxserver_buf_ref(void *buf);
+
+/**
+ * Removes a reference to buffer 'buf', and returns it to the buffer
+ * pool once no reference is left. A buffer queued with
+ * 'maxserver_conn_queue' must not be returned before the output
+ * chain has been flushed. May be called from any thread.
+ */
+void maxserver_buf_put(void *buf);
+
+/**
+ * Returns the size of buffer 'buf', which may be more than was asked
+ * for.
+ */
+size_t maxserver_buf_size(const void *buf);
+
+/**
+ * Stores statistics of the buffer pool in 'stats'.
+ */
+void maxserver_buf_stats(struct maxserver_buf_stats *stats);
+
+/**
+ * Creates an arena of its own, which takes chunks of 'chunk_len'
+ * bytes from the buffer pool as it needs them, and makes every new
+ * chunk 'growth' times as large as the one before, up to 1 MiB. A
+ * 'chunk_len' of zero means 4 KiB, and a 'growth' of zero or one
+ * keeps every chunk the same size. If 'poison' is non-zero, memory is
+ * overwritten with a pattern when it is freed, so that use after a
+ * reset shows.
+ * On success, a pointer to the new arena is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct maxserver_arena *maxserver_arena_create(
+	size_t chunk_len,
+	unsigned int growth,
+	int poison
+);
+
+/**
+ * Frees 'arena', created with 'maxserver_arena_create', and all of
+ * its allocations.
+ */
+void maxserver_arena_destroy(struct maxserver_arena *arena);
+
+/**
+ * Allocates 'len' bytes from 'arena', aligned to 16 bytes. The
+ * memory stays valid until 'arena' is reset, and is never freed on
+ * its own. An arena may only be used by one thread at a time.
+ * On success, a pointer to the allocated memory is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
+ */
+void *maxserver_arena_alloc(struct maxserver_arena *arena, size_t len);
+
+/**
+ * Frees every allocation of 'arena' at once, in constant time unless
+ * it poisons freed memory. Its chunks are kept for the allocations
+ * that follow.
+ */
+void maxserver_arena_reset(struct maxserver_arena *arena);
+
+/**
+ * Stores statistics of 'arena' in 'stats'.
+ */
+void maxserver_arena_stats(
+	const struct maxserver_arena *arena,
+	struct maxserver_arena_stats *stats
+);
+
+/**
+ * Stores client connection allocation statistics of 'server', summed
+ * over all of its slabs, in 'stats'.
+ * On success, zero is returned. If 'server' is not running, -1 is
+ * returned.
+ */
+int maxserver_conn_stats(
+	const maxserver_t *server,
+	struct maxserver_conn_stats *stats
+);
+
+/**
+ * Stores the runtime metrics of 'server' in 'stats'. Metrics are kept
+ * in per-thread shards that are added up without stopping the threads
+ * that update them, so counters may be mutually inconsistent by the
+ * updates in flight.
+ * On success, zero is returned. If 'server' is not running or does
+ * not keep metrics, -1 is returned.
+ */
+int maxserver_stats_snapshot(
+	const maxserver_t *server,
+	struct maxserver_stats *stats
+);
+
+/**
+ * Returns the smallest duration in nanoseconds that is counted in
+ * bucket 'bucket' of 'handler_buckets', which must be below
+ * MAXSERVER_STATS_BUCKETS.
+ */
+unsigned long long maxserver_stats_bucket_ns(size_t bucket);
+
+/**
+ * Returns the handler duration in nanoseconds that 'percentile'
+ * percent of the handler invocations counted in 'stats' took at
+ * most, rounded up to the end of its histogram bucket, or zero if
+ * none was counted.
+ */
+unsigned long long maxserver_stats_percentile(
+	const struct maxserver_stats *stats,
+	double percentile
+);
+
+/**
+ * Stores statistics of the worker pool of 'server' in 'stats'.
+ * On success, zero is returned. If 'server' is not running with
+ * MAXSERVER_DISPATCH_POOL, -1 is returned.
+ */
+int maxserver_pool_stats(
+	const maxserver_t *server,
+	struct maxserver_pool_stats *stats
+);
+
+/**
+ * Stores statistics of each worker thread of 'server' in 'stats',
+ * which has room for 'len' worker threads. Returns the number of
+ * worker threads, which is zero unless 'server' is running with
+ * MAXSERVER_DISPATCH_POOL and a scheduler that gives every worker
+ * thread its own queue.
+ */
+size_t maxserver_pool_worker_stats(
+	const maxserver_t *server,
+	struct maxserver_pool_worker_stats *stats,
+	size_t len
+);
+
+/**
+ * Returns the number of log messages dropped because a log buffer was
+ * full.
+ */
+unsigned long long maxserver_log_dropped();
+
 #endif
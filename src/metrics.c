@@ -0,0 +1,377 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "print_error.h"
+
+#define METRICS_ALIGN 64
+#define METRICS_SHARDS_MAX 256
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+
+/**
+ * Data structure representing a shard of metrics, which threads add
+ * to with relaxed atomic operations. 'buckets' counts timed handler
+ * invocations by duration, which also gives their number and their
+ * approximate total duration.
+ */
+struct metrics_shard {
+	unsigned long long counters[METRICS_COUNTERS];
+	unsigned long long buckets[MAXSERVER_STATS_BUCKETS];
+} __attribute__((aligned(METRICS_ALIGN)));
+
+/**
+ * Data structure representing metrics, with 'mask' plus one shards.
+ */
+struct metrics {
+	struct metrics_shard *shards;
+	size_t mask;
+};
+
+/**
+ * Global variable holding the number of threads that have been
+ * given a shard index.
+ */
+static size_t metrics_threads;
+
+/**
+ * Thread-local variable holding the shard index of the calling
+ * thread plus one, or zero if it has none yet. Threads are given
+ * indices in turn, so that threads started one after the other use
+ * different shards.
+ */
+static __thread size_t metrics_thread_index;
+
+/**
+ * Thread-local variable holding the number of handler invocations
+ * that the calling thread has started, which picks the ones to time.
+ */
+static __thread unsigned int metrics_thread_calls;
+
+/**
+ * Returns the shard of 'metrics' that the calling thread adds to.
+ */
+static struct metrics_shard *metrics_shard(const struct metrics *metrics)
+{
+	if (metrics_thread_index == 0) {
+		metrics_thread_index = __atomic_add_fetch(
+			&metrics_threads,
+			1,
+			__ATOMIC_RELAXED
+		);
+	}
+
+	return &metrics->shards[(metrics_thread_index - 1) & metrics->mask];
+}
+
+/**
+ * Returns the histogram bucket of a duration of 'ns' nanoseconds.
+ * Durations below 8 ns have a bucket each, and every power of two
+ * above is split into 8 buckets, so that a bucket is at most 12.5%
+ * wide. Durations beyond the last bucket are counted in it.
+ */
+static size_t metrics_bucket(unsigned long long ns)
+{
+	size_t bucket;
+	int bits;
+
+	if (ns < METRICS_SUB) {
+		return (size_t)ns;
+	}
+
+	bits = 63 - __builtin_clzll(ns);
+	bucket = (size_t)(bits - METRICS_SUB_BITS + 1) * METRICS_SUB +
+		(size_t)((ns >> (bits - METRICS_SUB_BITS)) &
+			(METRICS_SUB - 1));
+
+	return bucket < MAXSERVER_STATS_BUCKETS ?
+		bucket :
+		MAXSERVER_STATS_BUCKETS - 1;
+}
+
+/**
+ * Returns the duration in nanoseconds in the middle of histogram
+ * bucket 'bucket', or the start of the last bucket, which has no end.
+ */
+static unsigned long long metrics_bucket_mid(size_t bucket)
+{
+	unsigned long long start = maxserver_stats_bucket_ns(bucket);
+
+	if (bucket + 1 >= MAXSERVER_STATS_BUCKETS) {
+		return start;
+	}
+
+	return start + (maxserver_stats_bucket_ns(bucket + 1) - start) / 2;
+}
+
+/**
+ * Creates metrics with a shard for every two threads that may run at
+ * once, so that threads rarely share a shard.
+ * On success, a pointer to the new metrics is returned. On error,
+ * NULL is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct metrics *metrics_create()
+{
+	struct metrics *metrics;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t len = 1;
+
+	while (len < METRICS_SHARDS_MAX && (long)len < cpus * 2) {
+		len *= 2;
+	}
+
+	metrics = malloc(sizeof(struct metrics));
+
+	if (metrics == NULL) {
+		print_error_errno("metrics_create:malloc");
+		return NULL;
+	}
+
+	metrics->shards = aligned_alloc(
+		METRICS_ALIGN,
+		sizeof(struct metrics_shard) * len
+	);
+
+	if (metrics->shards == NULL) {
+		print_error_errno("metrics_create:aligned_alloc");
+		free(metrics);
+		return NULL;
+	}
+
+	memset(metrics->shards, 0, sizeof(struct metrics_shard) * len);
+	metrics->mask = len - 1;
+
+	return metrics;
+}
+
+/**
+ * Frees 'metrics'. Does nothing if 'metrics' is NULL.
+ */
+void metrics_destroy(struct metrics *metrics)
+{
+	if (metrics == NULL) {
+		return;
+	}
+
+	free(metrics->shards);
+	free(metrics);
+}
+
+/**
+ * Adds 'n' to counter 'counter' of 'metrics' in the shard of the
+ * calling thread. Does nothing if 'metrics' is NULL, as for every
+ * function below.
+ */
+void metrics_add(
+	struct metrics *metrics,
+	enum metrics_counter counter,
+	unsigned long long n
+)
+{
+	if (metrics == NULL) {
+		return;
+	}
+
+	__atomic_add_fetch(
+		&metrics_shard(metrics)->counters[counter],
+		n,
+		__ATOMIC_RELAXED
+	);
+}
+
+/**
+ * Returns the monotonic time in nanoseconds.
+ */
+static unsigned long long metrics_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+		(unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * Returns the monotonic time in nanoseconds at which a handler
+ * invocation starts, to be passed to 'metrics_handled' when it
+ * returns. Only one in METRICS_SAMPLE invocations on every thread is
+ * timed, and zero is returned without reading the clock for the
+ * others and if 'metrics' is NULL.
+ */
+unsigned long long metrics_start(const struct metrics *metrics)
+{
+	if (metrics == NULL || metrics_thread_calls++ % METRICS_SAMPLE != 0) {
+		return 0;
+	}
+
+	return metrics_now();
+}
+
+/**
+ * Counts a handler invocation that started at 'start', as returned by
+ * 'metrics_start', in the histogram of handler durations if it was
+ * timed, and in METRICS_HANDLED otherwise, with one atomic operation.
+ */
+void metrics_handled(struct metrics *metrics, unsigned long long start)
+{
+	if (metrics == NULL) {
+		return;
+	}
+
+	if (start == 0) {
+		metrics_add(metrics, METRICS_HANDLED, 1);
+		return;
+	}
+
+	__atomic_add_fetch(
+		&metrics_shard(metrics)->buckets[
+			metrics_bucket(metrics_now() - start)
+		],
+		1,
+		__ATOMIC_RELAXED
+	);
+}
+
+/**
+ * Adds up the shards of 'metrics' into 'stats', without stopping the
+ * threads that update them, so that counters that are updated
+ * together may be off by the updates in flight.
+ */
+void metrics_snapshot(
+	const struct metrics *metrics,
+	struct maxserver_stats *stats
+)
+{
+	const struct metrics_shard *shard;
+	unsigned long long counters[METRICS_COUNTERS];
+	unsigned long long timed = 0, timed_ns = 0;
+	size_t i, j;
+
+	if (metrics == NULL) {
+		return;
+	}
+
+	memset(counters, 0, sizeof(counters));
+
+	for (i = 0; i <= metrics->mask; ++i) {
+		shard = &metrics->shards[i];
+
+		for (j = 0; j < METRICS_COUNTERS; ++j) {
+			counters[j] += __atomic_load_n(
+				&shard->counters[j],
+				__ATOMIC_RELAXED
+			);
+		}
+
+		for (j = 0; j < MAXSERVER_STATS_BUCKETS; ++j) {
+			stats->handler_buckets[j] += __atomic_load_n(
+				&shard->buckets[j],
+				__ATOMIC_RELAXED
+			);
+		}
+	}
+
+	/* Sum the timed handler invocations and their duration from
+	   the histogram, taking the middle of every bucket, and scale
+	   the duration up to every handler invocation. */
+	for (j = 0; j < MAXSERVER_STATS_BUCKETS; ++j) {
+		timed += stats->handler_buckets[j];
+		timed_ns += stats->handler_buckets[j] * metrics_bucket_mid(j);
+	}
+
+	stats->handled = timed + counters[METRICS_HANDLED];
+
+	if (timed > 0) {
+		stats->handler_ns = (unsigned long long)((double)timed_ns *
+			(double)stats->handled / (double)timed);
+	}
+
+	stats->accepts = counters[METRICS_ACCEPTS];
+	stats->accept_errors = counters[METRICS_ACCEPT_ERRORS];
+	stats->bytes_in = counters[METRICS_BYTES_IN];
+	stats->bytes_out = counters[METRICS_BYTES_OUT];
+	stats->thread_spawns = counters[METRICS_THREAD_SPAWNS];
+	stats->thread_joins = counters[METRICS_THREAD_JOINS];
+}
+
+/**
+ * Returns the smallest duration in nanoseconds that is counted in
+ * bucket 'bucket' of 'handler_buckets', which must be below
+ * MAXSERVER_STATS_BUCKETS.
+ */
+unsigned long long maxserver_stats_bucket_ns(size_t bucket)
+{
+	int bits;
+
+	if (bucket < METRICS_SUB) {
+		return (unsigned long long)bucket;
+	}
+
+	bits = (int)(bucket / METRICS_SUB) + METRICS_SUB_BITS - 1;
+
+	return (unsigned long long)(METRICS_SUB + bucket % METRICS_SUB) <<
+		(bits - METRICS_SUB_BITS);
+}
+
+/**
+ * Returns the handler duration in nanoseconds that 'percentile'
+ * percent of the handler invocations counted in 'stats' took at
+ * most, rounded up to the end of its histogram bucket, or zero if
+ * none was counted.
+ */
+unsigned long long maxserver_stats_percentile(
+	const struct maxserver_stats *stats,
+	double percentile
+)
+{
+	unsigned long long total = 0, seen = 0, rank;
+	size_t i;
+
+	for (i = 0; i < MAXSERVER_STATS_BUCKETS; ++i) {
+		total += stats->handler_buckets[i];
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	rank = percentile > 0.0 ?
+		(unsigned long long)((double)total * percentile / 100.0) :
+		0;
+	rank = rank > 0 ? (rank < total ? rank : total) : 1;
+
+	for (i = 0; i < MAXSERVER_STATS_BUCKETS - 1; ++i) {
+		seen += stats->handler_buckets[i];
+
+		if (seen >= rank) {
+			return maxserver_stats_bucket_ns(i + 1) - 1;
+		}
+	}
+
+	return maxserver_stats_bucket_ns(MAXSERVER_STATS_BUCKETS - 1);
+}
@@ -0,0 +1,108 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+
+#include "maxserver.h"
+
+#define METRICS_SAMPLE 16
+
+/**
+ * Counters kept by metrics. METRICS_ACCEPTS and METRICS_ACCEPT_ERRORS
+ * count client sockets accepted and failed accepts, METRICS_BYTES_IN
+ * and METRICS_BYTES_OUT count bytes received from and sent to
+ * clients, and METRICS_THREAD_SPAWNS and METRICS_THREAD_JOINS count
+ * client threads and worker threads started and joined, and
+ * METRICS_HANDLED counts handler invocations that were not timed. The
+ * timed ones are counted in the histogram of handler durations.
+ */
+enum metrics_counter {
+	METRICS_ACCEPTS,
+	METRICS_ACCEPT_ERRORS,
+	METRICS_BYTES_IN,
+	METRICS_BYTES_OUT,
+	METRICS_THREAD_SPAWNS,
+	METRICS_THREAD_JOINS,
+	METRICS_HANDLED,
+	METRICS_COUNTERS
+};
+
+/**
+ * Opaque data structure representing the runtime metrics of a server,
+ * kept in shards that each sit on cache lines of their own, and that
+ * threads update without locks.
+ */
+struct metrics;
+
+/**
+ * Creates metrics with a shard for every two threads that may run at
+ * once, so that threads rarely share a shard.
+ * On success, a pointer to the new metrics is returned. On error,
+ * NULL is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct metrics *metrics_create();
+
+/**
+ * Frees 'metrics'. Does nothing if 'metrics' is NULL.
+ */
+void metrics_destroy(struct metrics *metrics);
+
+/**
+ * Adds 'n' to counter 'counter' of 'metrics' in the shard of the
+ * calling thread. Does nothing if 'metrics' is NULL, as for every
+ * function below.
+ */
+void metrics_add(
+	struct metrics *metrics,
+	enum metrics_counter counter,
+	unsigned long long n
+);
+
+/**
+ * Returns the monotonic time in nanoseconds at which a handler
+ * invocation starts, to be passed to 'metrics_handled' when it
+ * returns. Only one in METRICS_SAMPLE invocations on every thread is
+ * timed, and zero is returned without reading the clock for the
+ * others and if 'metrics' is NULL.
+ */
+unsigned long long metrics_start(const struct metrics *metrics);
+
+/**
+ * Counts a handler invocation that started at 'start', as returned by
+ * 'metrics_start', in the histogram of handler durations if it was
+ * timed, and in METRICS_HANDLED otherwise, with one atomic operation.
+ */
+void metrics_handled(struct metrics *metrics, unsigned long long start);
+
+/**
+ * Adds up the shards of 'metrics' into 'stats', without stopping the
+ * threads that update them, so that counters that are updated
+ * together may be off by the updates in flight.
+ */
+void metrics_snapshot(
+	const struct metrics *metrics,
+	struct maxserver_stats *stats
+);
+
+#endif
@@ -0,0 +1,346 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mpmc.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "print_error.h"
+
+#define MPMC_CACHE_LINE 64
+
+/**
+ * Data structure representing a slot of a ring. 'seq' equals the
+ * position of the next push into the slot while it is free, and that
+ * position plus one once the push has stored 'item'.
+ */
+struct mpmc_cell {
+	size_t seq;
+	void *item;
+};
+
+/**
+ * Data structure representing a bounded ring after Dmitry Vyukov's
+ * MPMC queue. Producers only contend on 'tail' and consumers only on
+ * 'head', which live on separate cache lines, and a slot is handed
+ * from producer to consumer through its sequence number.
+ */
+struct mpmc {
+	size_t head;
+	char head_pad[MPMC_CACHE_LINE - sizeof(size_t)];
+	size_t tail;
+	char tail_pad[MPMC_CACHE_LINE - sizeof(size_t)];
+	unsigned int futex;
+	unsigned int sleepers;
+	char futex_pad[MPMC_CACHE_LINE - 2 * sizeof(unsigned int)];
+	size_t len;
+	struct mpmc_cell *cells;
+};
+
+/**
+ * Creates a ring that holds at most 'len' pointers.
+ * On success, a pointer to the new ring is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct mpmc *mpmc_create(size_t len)
+{
+	struct mpmc *ring;
+	void *mem;
+	int err;
+	size_t i;
+
+	if (len == 0) {
+		print_error_str("mpmc_create", "Invalid ring length.");
+		return NULL;
+	}
+
+	/* Allocate the ring aligned to a cache line, so that 'head',
+	   'tail' and the futex word never share one. */
+	err = posix_memalign(&mem, MPMC_CACHE_LINE, sizeof(struct mpmc));
+
+	if (err != 0) {
+		print_error("mpmc_create:posix_memalign", err);
+		return NULL;
+	}
+
+	ring = (struct mpmc *)mem;
+	err = posix_memalign(
+		&mem,
+		MPMC_CACHE_LINE,
+		sizeof(struct mpmc_cell) * len
+	);
+
+	if (err != 0) {
+		print_error("mpmc_create:posix_memalign", err);
+		free(ring);
+		return NULL;
+	}
+
+	ring->head = 0;
+	ring->tail = 0;
+	ring->futex = 0;
+	ring->sleepers = 0;
+	ring->len = len;
+	ring->cells = (struct mpmc_cell *)mem;
+
+	for (i = 0; i < len; ++i) {
+		ring->cells[i].seq = i;
+		ring->cells[i].item = NULL;
+	}
+
+	return ring;
+}
+
+/**
+ * Adds 'item', which must not be NULL, to the back of 'ring' without
+ * taking any lock. Does not wake waiting consumers; see 'mpmc_wake'.
+ * On success, zero is returned. If 'ring' is full, -1 is returned.
+ */
+int mpmc_push(struct mpmc *ring, void *item)
+{
+	struct mpmc_cell *cell;
+	size_t pos;
+	size_t seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		cell = &ring->cells[pos % ring->len];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			/* The slot is free, claim its position. */
+			if (__atomic_compare_exchange_n(
+				&ring->tail,
+				&pos,
+				pos + 1,
+				1,
+				__ATOMIC_RELAXED,
+				__ATOMIC_RELAXED
+			)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* The slot still holds the item from one lap
+			   ago. */
+			return -1;
+		} else {
+			/* Another producer claimed the position. */
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* Publish the item to consumers. */
+	cell->item = item;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * Removes the pointer at the front of 'ring' without taking any lock.
+ * Returns the pointer, or NULL if 'ring' is empty.
+ */
+void *mpmc_pop(struct mpmc *ring)
+{
+	struct mpmc_cell *cell;
+	size_t pos;
+	size_t seq;
+	intptr_t diff;
+	void *item;
+
+	pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		cell = &ring->cells[pos % ring->len];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if (diff == 0) {
+			/* The slot is full, claim its position. */
+			if (__atomic_compare_exchange_n(
+				&ring->head,
+				&pos,
+				pos + 1,
+				1,
+				__ATOMIC_RELAXED,
+				__ATOMIC_RELAXED
+			)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* No producer has published this position
+			   yet. */
+			return NULL;
+		} else {
+			/* Another consumer claimed the position. */
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* Hand the slot to the producer of the next lap. */
+	item = cell->item;
+	__atomic_store_n(&cell->seq, pos + ring->len, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+/**
+ * Removes the pointer at the front of 'ring' like 'mpmc_pop', but if
+ * 'ring' is empty yields the processor and tries again, up to 'spins'
+ * times, before giving up. Lets a consumer catch an item that is
+ * about to be pushed without the cost of sleeping on the futex.
+ * Returns the pointer, or NULL if 'ring' stayed empty.
+ */
+void *mpmc_pop_spin(struct mpmc *ring, unsigned int spins)
+{
+	void *item;
+	unsigned int i;
+
+	item = mpmc_pop(ring);
+
+	for (i = 0; item == NULL && i < spins; ++i) {
+		sched_yield();
+		item = mpmc_pop(ring);
+	}
+
+	return item;
+}
+
+/**
+ * Returns the number of pointers in 'ring'. The count is only a
+ * snapshot while producers or consumers are running.
+ */
+size_t mpmc_count(struct mpmc *ring)
+{
+	size_t head;
+	size_t tail;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	if (tail < head) {
+		return 0;
+	}
+
+	return tail - head < ring->len ? tail - head : ring->len;
+}
+
+/**
+ * Announces that the calling consumer is about to sleep on 'ring'.
+ * The consumer must then check 'ring', and any other condition it
+ * waits for, once more before calling 'mpmc_wait' with the returned
+ * value, or call 'mpmc_wait_cancel' instead. A 'mpmc_wake' after this
+ * call is never lost.
+ */
+unsigned int mpmc_wait_prepare(struct mpmc *ring)
+{
+	unsigned int seq;
+
+	/* Pairs with the fence in 'mpmc_wake': either the producer
+	   sees this sleeper, or this consumer sees its item. */
+	__atomic_add_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return seq;
+}
+
+/**
+ * Withdraws the announcement of a previous 'mpmc_wait_prepare'.
+ */
+void mpmc_wait_cancel(struct mpmc *ring)
+{
+	__atomic_sub_fetch(&ring->sleepers, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sleeps on a futex until 'mpmc_wake' is called on 'ring' after the
+ * 'mpmc_wait_prepare' that returned 'seq', or until the absolute
+ * CLOCK_MONOTONIC time 'deadline' unless it is NULL. May also return
+ * spuriously, so the caller must check 'ring' again.
+ * Returns zero, or -1 if 'deadline' has passed.
+ */
+int mpmc_wait(
+	struct mpmc *ring,
+	unsigned int seq,
+	const struct timespec *deadline
+)
+{
+	long ret;
+
+	/* FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC
+	   deadline, unlike FUTEX_WAIT, so spurious wakeups do not
+	   extend the wait. */
+	ret = syscall(
+		SYS_futex,
+		&ring->futex,
+		FUTEX_WAIT_BITSET_PRIVATE,
+		seq,
+		deadline,
+		NULL,
+		FUTEX_BITSET_MATCH_ANY
+	);
+
+	__atomic_sub_fetch(&ring->sleepers, 1, __ATOMIC_RELAXED);
+
+	if (ret == -1 && errno == ETIMEDOUT) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Wakes at most 'n' consumers sleeping on 'ring'. Makes no system
+ * call when no consumer is sleeping.
+ */
+void mpmc_wake(struct mpmc *ring, int n)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ring->sleepers, __ATOMIC_SEQ_CST) == 0) {
+		return;
+	}
+
+	/* Change the futex word first, so that a consumer that has
+	   not reached the futex yet does not go to sleep. */
+	__atomic_add_fetch(&ring->futex, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &ring->futex, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/**
+ * Frees 'ring'. Pointers still in it are not touched.
+ */
+void mpmc_destroy(struct mpmc *ring)
+{
+	free(ring->cells);
+	free(ring);
+}
@@ -0,0 +1,108 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MPMC_H
+#define MPMC_H
+
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * Opaque data structure representing a bounded lock-free
+ * multi-producer multi-consumer ring of pointers.
+ */
+struct mpmc;
+
+/**
+ * Creates a ring that holds at most 'len' pointers.
+ * On success, a pointer to the new ring is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct mpmc *mpmc_create(size_t len);
+
+/**
+ * Adds 'item', which must not be NULL, to the back of 'ring' without
+ * taking any lock. Does not wake waiting consumers; see 'mpmc_wake'.
+ * On success, zero is returned. If 'ring' is full, -1 is returned.
+ */
+int mpmc_push(struct mpmc *ring, void *item);
+
+/**
+ * Removes the pointer at the front of 'ring' without taking any lock.
+ * Returns the pointer, or NULL if 'ring' is empty.
+ */
+void *mpmc_pop(struct mpmc *ring);
+
+/**
+ * Removes the pointer at the front of 'ring' like 'mpmc_pop', but if
+ * 'ring' is empty yields the processor and tries again, up to 'spins'
+ * times, before giving up. Lets a consumer catch an item that is
+ * about to be pushed without the cost of sleeping on the futex.
+ * Returns the pointer, or NULL if 'ring' stayed empty.
+ */
+void *mpmc_pop_spin(struct mpmc *ring, unsigned int spins);
+
+/**
+ * Returns the number of pointers in 'ring'. The count is only a
+ * snapshot while producers or consumers are running.
+ */
+size_t mpmc_count(struct mpmc *ring);
+
+/**
+ * Announces that the calling consumer is about to sleep on 'ring'.
+ * The consumer must then check 'ring', and any other condition it
+ * waits for, once more before calling 'mpmc_wait' with the returned
+ * value, or call 'mpmc_wait_cancel' instead. A 'mpmc_wake' after this
+ * call is never lost.
+ */
+unsigned int mpmc_wait_prepare(struct mpmc *ring);
+
+/**
+ * Withdraws the announcement of a previous 'mpmc_wait_prepare'.
+ */
+void mpmc_wait_cancel(struct mpmc *ring);
+
+/**
+ * Sleeps on a futex until 'mpmc_wake' is called on 'ring' after the
+ * 'mpmc_wait_prepare' that returned 'seq', or until the absolute
+ * CLOCK_MONOTONIC time 'deadline' unless it is NULL. May also return
+ * spuriously, so the caller must check 'ring' again.
+ * Returns zero, or -1 if 'deadline' has passed.
+ */
+int mpmc_wait(
+	struct mpmc *ring,
+	unsigned int seq,
+	const struct timespec *deadline
+);
+
+/**
+ * Wakes at most 'n' consumers sleeping on 'ring'. Makes no system
+ * call when no consumer is sleeping.
+ */
+void mpmc_wake(struct mpmc *ring, int n);
+
+/**
+ * Frees 'ring'. Pointers still in it are not touched.
+ */
+void mpmc_destroy(struct mpmc *ring);
+
+#endif
@@ -18,15 +18,32 @@
  * <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include "print_error.h"
 
-#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
+#include "log.h"
+
+/**
+ * Logs error message 'str' as an error. If 'prefix' is not NULL and
+ * 'prefix[0]' is not '\0', it will be printed before the error
+ * message followed by a colon and a space.
+ */
+static void print_error_log(const char *prefix, const char *str)
+{
+	if (prefix != NULL && prefix[0] != '\0') {
+		log_error("%s: %s", prefix, str);
+	} else {
+		log_error("%s", str);
+	}
+}
+
 /**
  * Prints an error message to standard error corresponding to error
  * number 'err'. If 'prefix' is not NULL and 'prefix[0]' is not '\0',
@@ -35,11 +52,9 @@
  */
 void print_error(const char *prefix, int err)
 {
-	if (prefix != NULL && prefix[0] != '\0') {
-		fprintf(stderr, "%s: ", prefix);
-	}
+	char buf[128];
 
-	fprintf(stderr, "%s\n", strerror(err));
+	print_error_log(prefix, strerror_r(err, buf, sizeof(buf)));
 }
 
 /**
@@ -50,11 +65,7 @@ void print_error(const char *prefix, int err)
  */
 void print_error_gai(const char *prefix, int err)
 {
-	if (prefix != NULL && prefix[0] != '\0') {
-		fprintf(stderr, "%s: ", prefix);
-	}
-
-	fprintf(stderr, "%s\n", gai_strerror(err));
+	print_error_log(prefix, gai_strerror(err));
 }
 
 /**
@@ -75,9 +86,5 @@ void print_error_errno(const char *prefix)
  */
 void print_error_str(const char *prefix, const char *str)
 {
-	if (prefix != NULL && prefix[0] != '\0') {
-		fprintf(stderr, "%s: ", prefix);
-	}
-
-	fprintf(stderr, "%s\n", str);
+	print_error_log(prefix, str);
 }
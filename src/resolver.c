@@ -0,0 +1,445 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "resolver.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "print_error.h"
+
+#define RESOLVER_PROBES 8
+#define RESOLVER_QUEUE_LEN 256
+
+/**
+ * States of a resolver cache entry.
+ */
+enum resolver_state {
+	RESOLVER_EMPTY,
+	RESOLVER_PENDING,
+	RESOLVER_RESOLVED
+};
+
+/**
+ * Data structure representing the host part of an address.
+ */
+struct resolver_key {
+	sa_family_t family;
+	unsigned char addr[16];
+};
+
+/**
+ * Data structure representing a resolver cache entry.
+ */
+struct resolver_entry {
+	struct resolver_key key;
+	enum resolver_state state;
+	unsigned long long expires_ms;
+	char host[NI_MAXHOST];
+};
+
+/**
+ * Data structure representing a background host name resolver. Every
+ * field except the constant configuration is protected by 'lock'.
+ */
+struct resolver {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct resolver_entry *entries;
+	size_t capacity;
+	unsigned int ttl_ms;
+	struct resolver_key queue[RESOLVER_QUEUE_LEN];
+	size_t queue_head;
+	size_t queue_count;
+	int stopping;
+};
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in milliseconds.
+ */
+static unsigned long long resolver_now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Stores the host part of 'addr' in 'key'.
+ * On success, zero is returned. If 'addr' is neither an IPv4 nor an
+ * IPv6 address, -1 is returned.
+ */
+static int resolver_key_init(
+	struct resolver_key *key,
+	const struct sockaddr *addr,
+	socklen_t addrlen
+)
+{
+	memset(key, 0, sizeof(struct resolver_key));
+	key->family = addr->sa_family;
+
+	if (
+		addr->sa_family == AF_INET &&
+		addrlen >= sizeof(struct sockaddr_in)
+	) {
+		memcpy(
+			key->addr,
+			&((const struct sockaddr_in *)addr)->sin_addr,
+			sizeof(struct in_addr)
+		);
+		return 0;
+	}
+
+	if (
+		addr->sa_family == AF_INET6 &&
+		addrlen >= sizeof(struct sockaddr_in6)
+	) {
+		memcpy(
+			key->addr,
+			&((const struct sockaddr_in6 *)addr)->sin6_addr,
+			sizeof(struct in6_addr)
+		);
+		return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Returns the hash of 'key' (FNV-1a).
+ */
+static size_t resolver_key_hash(const struct resolver_key *key)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	unsigned long long hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < sizeof(struct resolver_key); ++i) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return (size_t)hash;
+}
+
+/**
+ * Finds the cache entry of 'key' in 'resolver'. If there is none and
+ * 'victim' is not NULL, the least useful entry that 'key' may replace
+ * is stored in 'victim'. Must be called with the resolver mutex lock
+ * held.
+ * Returns the cache entry of 'key', or NULL if there is none.
+ */
+static struct resolver_entry *resolver_find(
+	struct resolver *resolver,
+	const struct resolver_key *key,
+	struct resolver_entry **victim
+)
+{
+	struct resolver_entry *entry, *best = NULL;
+	size_t hash;
+	size_t i;
+
+	hash = resolver_key_hash(key);
+
+	for (i = 0; i < RESOLVER_PROBES; ++i) {
+		entry = &resolver->entries[(hash + i) % resolver->capacity];
+
+		if (
+			entry->state != RESOLVER_EMPTY &&
+			memcmp(&entry->key, key, sizeof(struct resolver_key)) == 0
+		) {
+			return entry;
+		}
+
+		/* Prefer empty entries, then the entry that expires
+		   first. Pending entries are never replaced. */
+		if (entry->state == RESOLVER_EMPTY) {
+			if (best == NULL || best->state != RESOLVER_EMPTY) {
+				best = entry;
+			}
+		} else if (
+			entry->state == RESOLVER_RESOLVED && (
+				best == NULL || (
+					best->state == RESOLVER_RESOLVED &&
+					entry->expires_ms < best->expires_ms
+				)
+			)
+		) {
+			best = entry;
+		}
+	}
+
+	if (victim != NULL) {
+		*victim = best;
+	}
+
+	return NULL;
+}
+
+/**
+ * Resolves queued host names until 'arg' is stopped.
+ */
+static void *resolver_thread(void *arg)
+{
+	struct resolver *resolver;
+	struct resolver_entry *entry;
+	struct resolver_key key;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char host[NI_MAXHOST];
+	int err;
+
+	resolver = (struct resolver *)arg;
+
+	pthread_mutex_lock(&resolver->lock);
+
+	for (;;) {
+		while (resolver->queue_count == 0 && !resolver->stopping) {
+			pthread_cond_wait(&resolver->cond, &resolver->lock);
+		}
+
+		if (resolver->stopping) {
+			break;
+		}
+
+		/* Take address from queue. */
+		key = resolver->queue[resolver->queue_head];
+		resolver->queue_head =
+			(resolver->queue_head + 1) % RESOLVER_QUEUE_LEN;
+		--resolver->queue_count;
+
+		pthread_mutex_unlock(&resolver->lock);
+
+		/* Build socket address of 'key'. */
+		memset(&addr, 0, sizeof(struct sockaddr_storage));
+		addr.ss_family = key.family;
+
+		if (key.family == AF_INET) {
+			memcpy(
+				&((struct sockaddr_in *)&addr)->sin_addr,
+				key.addr,
+				sizeof(struct in_addr)
+			);
+			addrlen = sizeof(struct sockaddr_in);
+		} else {
+			memcpy(
+				&((struct sockaddr_in6 *)&addr)->sin6_addr,
+				key.addr,
+				sizeof(struct in6_addr)
+			);
+			addrlen = sizeof(struct sockaddr_in6);
+		}
+
+		/* Resolve host name, and cache the numeric host if it
+		   has none, so that it is not looked up again until the
+		   entry expires. */
+		err = getnameinfo(
+			(struct sockaddr *)&addr,
+			addrlen,
+			host,
+			NI_MAXHOST,
+			NULL,
+			0,
+			NI_NAMEREQD
+		);
+
+		if (err != 0) {
+			err = getnameinfo(
+				(struct sockaddr *)&addr,
+				addrlen,
+				host,
+				NI_MAXHOST,
+				NULL,
+				0,
+				NI_NUMERICHOST
+			);
+		}
+
+		pthread_mutex_lock(&resolver->lock);
+
+		entry = resolver_find(resolver, &key, NULL);
+
+		if (entry != NULL && entry->state == RESOLVER_PENDING) {
+			if (err == 0) {
+				memcpy(entry->host, host, NI_MAXHOST);
+			} else {
+				entry->host[0] = '\0';
+			}
+
+			entry->state = RESOLVER_RESOLVED;
+			entry->expires_ms = resolver_now_ms() + resolver->ttl_ms;
+		}
+	}
+
+	pthread_mutex_unlock(&resolver->lock);
+	return NULL;
+}
+
+/**
+ * Creates a resolver with room for 'capacity' cached host names,
+ * which expire after 'ttl_ms' milliseconds, and starts its resolver
+ * thread.
+ * On success, a pointer to the new resolver is returned. On error,
+ * NULL is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct resolver *resolver_create(size_t capacity, unsigned int ttl_ms)
+{
+	struct resolver *resolver;
+	int err;
+
+	if (capacity < RESOLVER_PROBES) {
+		capacity = RESOLVER_PROBES;
+	}
+
+	resolver = calloc(1, sizeof(struct resolver));
+
+	if (resolver == NULL) {
+		print_error_errno("resolver_create:calloc");
+		return NULL;
+	}
+
+	resolver->entries = calloc(capacity, sizeof(struct resolver_entry));
+
+	if (resolver->entries == NULL) {
+		print_error_errno("resolver_create:calloc");
+		free(resolver);
+		return NULL;
+	}
+
+	resolver->capacity = capacity;
+	resolver->ttl_ms = ttl_ms;
+	pthread_mutex_init(&resolver->lock, NULL);
+	pthread_cond_init(&resolver->cond, NULL);
+
+	/* Start resolver thread. */
+	err = pthread_create(&resolver->tid, NULL, resolver_thread, resolver);
+
+	if (err != 0) {
+		print_error("resolver_create:pthread_create", err);
+		pthread_cond_destroy(&resolver->cond);
+		pthread_mutex_destroy(&resolver->lock);
+		free(resolver->entries);
+		free(resolver);
+		return NULL;
+	}
+
+	return resolver;
+}
+
+/**
+ * Copies the cached host name of the host part of 'addr' to 'host',
+ * which has room for 'hostlen' bytes. Never blocks on name
+ * resolution: if no unexpired host name is cached, the host name is
+ * resolved in the background.
+ * If a host name was copied, zero is returned. Otherwise, -1 is
+ * returned.
+ */
+int resolver_lookup(
+	struct resolver *resolver,
+	const struct sockaddr *addr,
+	socklen_t addrlen,
+	char *host,
+	size_t hostlen
+)
+{
+	struct resolver_entry *entry, *victim;
+	struct resolver_key key;
+	size_t tail;
+	int err = -1;
+
+	if (hostlen == 0 || resolver_key_init(&key, addr, addrlen) == -1) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&resolver->lock);
+
+	entry = resolver_find(resolver, &key, &victim);
+
+	if (entry != NULL && entry->state == RESOLVER_PENDING) {
+		pthread_mutex_unlock(&resolver->lock);
+		return -1;
+	}
+
+	if (
+		entry != NULL &&
+		entry->host[0] != '\0' &&
+		entry->expires_ms > resolver_now_ms()
+	) {
+		/* Copy cached host name. */
+		strncpy(host, entry->host, hostlen - 1);
+		host[hostlen - 1] = '\0';
+		err = 0;
+	} else if (resolver->queue_count < RESOLVER_QUEUE_LEN) {
+		/* Queue address to be resolved in the background. */
+		if (entry == NULL) {
+			entry = victim;
+		}
+
+		if (entry != NULL) {
+			entry->key = key;
+			entry->state = RESOLVER_PENDING;
+
+			tail = (resolver->queue_head + resolver->queue_count) %
+				RESOLVER_QUEUE_LEN;
+			resolver->queue[tail] = key;
+			++resolver->queue_count;
+			pthread_cond_signal(&resolver->cond);
+		}
+	}
+
+	pthread_mutex_unlock(&resolver->lock);
+
+	return err;
+}
+
+/**
+ * Stops the resolver thread of 'resolver' and frees 'resolver'.
+ */
+void resolver_destroy(struct resolver *resolver)
+{
+	int err;
+
+	/* Signal resolver thread to quit. An ongoing lookup finishes
+	   first. */
+	pthread_mutex_lock(&resolver->lock);
+	resolver->stopping = 1;
+	pthread_cond_broadcast(&resolver->cond);
+	pthread_mutex_unlock(&resolver->lock);
+
+	err = pthread_join(resolver->tid, NULL);
+
+	if (err != 0) {
+		print_error("resolver_destroy:pthread_join", err);
+	}
+
+	pthread_cond_destroy(&resolver->cond);
+	pthread_mutex_destroy(&resolver->lock);
+	free(resolver->entries);
+	free(resolver);
+}
@@ -0,0 +1,66 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/**
+ * Opaque data structure representing a background host name resolver
+ * with a cache of resolved host names.
+ */
+struct resolver;
+
+/**
+ * Creates a resolver with room for 'capacity' cached host names,
+ * which expire after 'ttl_ms' milliseconds, and starts its resolver
+ * thread.
+ * On success, a pointer to the new resolver is returned. On error,
+ * NULL is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct resolver *resolver_create(size_t capacity, unsigned int ttl_ms);
+
+/**
+ * Copies the cached host name of the host part of 'addr' to 'host',
+ * which has room for 'hostlen' bytes. Never blocks on name
+ * resolution: if no unexpired host name is cached, the host name is
+ * resolved in the background.
+ * If a host name was copied, zero is returned. Otherwise, -1 is
+ * returned.
+ */
+int resolver_lookup(
+	struct resolver *resolver,
+	const struct sockaddr *addr,
+	socklen_t addrlen,
+	char *host,
+	size_t hostlen
+);
+
+/**
+ * Stops the resolver thread of 'resolver' and frees 'resolver'.
+ */
+void resolver_destroy(struct resolver *resolver);
+
+#endif
@@ -29,8 +29,8 @@
 #include "print_error.h"
 
 /**
- * Creates a TCP server socket on port 'service', ready to accept
- * incoming connections.
+ * Creates a non-blocking TCP server socket on port 'service', ready
+ * to accept incoming connections.
  * On success, a file descriptor for the new socket is returned. On
  * error, -1 is returned, and an appropriate error message is printed
  * to standard error.
@@ -62,7 +62,7 @@ int server_socket(const char *service)
 		/* Create socket. */
 		sfd = socket(
 			rp->ai_family,
-			rp->ai_socktype,
+			rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
 			rp->ai_protocol
 		);
 
@@ -22,8 +22,8 @@
 #define SERVER_SOCKET_H
 
 /**
- * Creates a TCP server socket on port 'service', ready to accept
- * incoming connections.
+ * Creates a non-blocking TCP server socket on port 'service', ready
+ * to accept incoming connections.
  * On success, a file descriptor for the new socket is returned. On
  * error, -1 is returned, and an appropriate error message is printed
  * to standard error.
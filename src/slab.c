@@ -0,0 +1,284 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "slab.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "print_error.h"
+
+#define SLAB_ALIGN 64
+
+/**
+ * Data structure right in front of every object of a slab, which
+ * links the object into a free list while it is free.
+ */
+struct slab_obj {
+	struct slab *slab;
+	struct slab_obj *next;
+};
+
+/**
+ * Data structure at the start of every memory mapping of a slab,
+ * followed by its objects from the next cache line on.
+ */
+struct slab_chunk {
+	struct slab_chunk *next;
+	size_t len;
+};
+
+/**
+ * Data structure representing a slab.
+ *
+ * Every object starts on a cache line, with its header in the bytes
+ * just before it, so that objects take 'stride' bytes each, header
+ * included, and chunks of 'len' objects are mapped at a time.
+ *
+ * 'local' is the free list that the owner allocates from without
+ * synchronisation, and 'remote' is the free list that every thread
+ * frees to, which the owner takes over at once when 'local' runs
+ * out. Since objects are only ever taken from 'remote' all together,
+ * pushing to it with compare-and-swap is not subject to ABA. The
+ * counters are written by the owner, except for 'frees', which sits
+ * on its own cache line with 'remote'.
+ */
+struct slab {
+	struct slab_obj *local;
+	struct slab_chunk *chunks;
+	size_t stride;
+	size_t len;
+	int lock;
+	size_t objects;
+	size_t bytes;
+	size_t locked;
+	unsigned long long allocs;
+	unsigned long long grows;
+	struct slab_obj *remote __attribute__((aligned(SLAB_ALIGN)));
+	unsigned long long frees;
+};
+
+/**
+ * Maps a chunk of objects for 'slab' and adds them to its local free
+ * list.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int slab_grow(struct slab *slab)
+{
+	struct slab_chunk *chunk;
+	struct slab_obj *obj;
+	size_t bytes, i;
+	int err;
+
+	bytes = SLAB_ALIGN + slab->stride * slab->len;
+	chunk = mmap(
+		NULL,
+		bytes,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+
+	if (chunk == MAP_FAILED) {
+		print_error_errno("slab_grow:mmap");
+		return -1;
+	}
+
+	/* Fault the chunk in now rather than on the accept path. */
+	if (slab->lock) {
+		err = mlock(chunk, bytes);
+
+		if (err == -1) {
+			print_error_errno("slab_grow:mlock");
+		} else {
+			__atomic_add_fetch(
+				&slab->locked,
+				bytes,
+				__ATOMIC_RELAXED
+			);
+		}
+	}
+
+	chunk->next = slab->chunks;
+	chunk->len = bytes;
+	slab->chunks = chunk;
+
+	/* Push the objects in reverse, so that they are handed out in
+	   address order. */
+	for (i = slab->len; i > 0; --i) {
+		obj = (struct slab_obj *)((char *)chunk + SLAB_ALIGN +
+			slab->stride * (i - 1) - sizeof(struct slab_obj));
+		obj->slab = slab;
+		obj->next = slab->local;
+		slab->local = obj;
+	}
+
+	__atomic_add_fetch(&slab->objects, slab->len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&slab->bytes, bytes, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/**
+ * Creates a slab of objects of 'size' bytes, and maps room for 'len'
+ * of them at once, locked into memory with 'mlock' if 'lock' is
+ * non-zero. Whenever every object is in use, room for 'len' more is
+ * mapped in the same way. A failure to lock memory is printed to
+ * standard error but does not fail the slab.
+ * On success, a pointer to the new slab is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct slab *slab_create(size_t size, size_t len, int lock)
+{
+	struct slab *slab;
+
+	slab = aligned_alloc(SLAB_ALIGN, sizeof(struct slab));
+
+	if (slab == NULL) {
+		print_error_errno("slab_create:aligned_alloc");
+		return NULL;
+	}
+
+	/* Leave room for the header of the next object. */
+	slab->local = NULL;
+	slab->chunks = NULL;
+	slab->stride = (sizeof(struct slab_obj) + size + SLAB_ALIGN - 1) /
+		SLAB_ALIGN * SLAB_ALIGN;
+	slab->len = len > 0 ? len : 1;
+	slab->lock = lock;
+	slab->objects = 0;
+	slab->bytes = 0;
+	slab->locked = 0;
+	slab->allocs = 0;
+	slab->grows = 0;
+	slab->remote = NULL;
+	slab->frees = 0;
+
+	if (slab_grow(slab) == -1) {
+		free(slab);
+		return NULL;
+	}
+
+	return slab;
+}
+
+/**
+ * Unmaps every object of 'slab', and frees 'slab'. Every object must
+ * have been freed.
+ */
+void slab_destroy(struct slab *slab)
+{
+	struct slab_chunk *chunk, *next;
+
+	for (chunk = slab->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		munmap(chunk, chunk->len);
+	}
+
+	free(slab);
+}
+
+/**
+ * Returns an uninitialised object of 'slab', aligned to a cache line.
+ * Must only be called by the thread that owns 'slab'.
+ * On success, a pointer to the object is returned. On error, NULL is
+ * returned, and an appropriate error message is printed to standard
+ * error.
+ */
+void *slab_alloc(struct slab *slab)
+{
+	struct slab_obj *obj;
+
+	/* Take over the objects freed by other threads, and map more
+	   only if there are none. */
+	if (slab->local == NULL) {
+		slab->local = __atomic_exchange_n(
+			&slab->remote,
+			NULL,
+			__ATOMIC_ACQUIRE
+		);
+	}
+
+	if (slab->local == NULL) {
+		if (slab_grow(slab) == -1) {
+			return NULL;
+		}
+
+		__atomic_add_fetch(&slab->grows, 1, __ATOMIC_RELAXED);
+	}
+
+	obj = slab->local;
+	slab->local = obj->next;
+	__atomic_add_fetch(&slab->allocs, 1, __ATOMIC_RELAXED);
+
+	return (char *)obj + sizeof(struct slab_obj);
+}
+
+/**
+ * Returns 'obj' to the slab that it was allocated from. May be called
+ * from any thread.
+ */
+void slab_free(void *obj)
+{
+	struct slab_obj *head = (struct slab_obj *)((char *)obj -
+		sizeof(struct slab_obj));
+	struct slab *slab = head->slab;
+
+	head->next = __atomic_load_n(&slab->remote, __ATOMIC_RELAXED);
+
+	while (!__atomic_compare_exchange_n(
+		&slab->remote,
+		&head->next,
+		head,
+		1,
+		__ATOMIC_RELEASE,
+		__ATOMIC_RELAXED
+	)) {
+	}
+
+	__atomic_add_fetch(&slab->frees, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds the statistics of 'slab' to 'stats'. May be called from any
+ * thread.
+ */
+void slab_stats_add(
+	const struct slab *slab,
+	struct maxserver_conn_stats *stats
+)
+{
+	unsigned long long allocs, frees;
+
+	allocs = __atomic_load_n(&slab->allocs, __ATOMIC_RELAXED);
+	frees = __atomic_load_n(&slab->frees, __ATOMIC_RELAXED);
+
+	stats->allocs += allocs;
+	stats->frees += frees;
+	stats->in_use += allocs > frees ? (size_t)(allocs - frees) : 0;
+	stats->grows += __atomic_load_n(&slab->grows, __ATOMIC_RELAXED);
+	stats->capacity += __atomic_load_n(&slab->objects, __ATOMIC_RELAXED);
+	stats->bytes += __atomic_load_n(&slab->bytes, __ATOMIC_RELAXED);
+	stats->locked += __atomic_load_n(&slab->locked, __ATOMIC_RELAXED);
+}
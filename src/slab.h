@@ -0,0 +1,77 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#include "maxserver.h"
+
+/**
+ * Opaque data structure representing a slab of equally sized objects
+ * that one thread allocates and any thread frees.
+ */
+struct slab;
+
+/**
+ * Creates a slab of objects of 'size' bytes, and maps room for 'len'
+ * of them at once, locked into memory with 'mlock' if 'lock' is
+ * non-zero. Whenever every object is in use, room for 'len' more is
+ * mapped in the same way. A failure to lock memory is printed to
+ * standard error but does not fail the slab.
+ * On success, a pointer to the new slab is returned. On error, NULL
+ * is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct slab *slab_create(size_t size, size_t len, int lock);
+
+/**
+ * Unmaps every object of 'slab', and frees 'slab'. Every object must
+ * have been freed.
+ */
+void slab_destroy(struct slab *slab);
+
+/**
+ * Returns an uninitialised object of 'slab', aligned to a cache line.
+ * Must only be called by the thread that owns 'slab'.
+ * On success, a pointer to the object is returned. On error, NULL is
+ * returned, and an appropriate error message is printed to standard
+ * error.
+ */
+void *slab_alloc(struct slab *slab);
+
+/**
+ * Returns 'obj' to the slab that it was allocated from. May be called
+ * from any thread.
+ */
+void slab_free(void *obj);
+
+/**
+ * Adds the statistics of 'slab' to 'stats'. May be called from any
+ * thread.
+ */
+void slab_stats_add(
+	const struct slab *slab,
+	struct maxserver_conn_stats *stats
+);
+
+#endif
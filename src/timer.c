@@ -0,0 +1,234 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "timer.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_RANGE (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS))
+
+/**
+ * Initialises 'wheel' with no armed timers and 'now' as its next
+ * tick to expire.
+ */
+void timer_wheel_init(struct timer_wheel *wheel, unsigned long long now)
+{
+	size_t i;
+
+	wheel->now = now;
+	wheel->len = 0;
+
+	for (i = 0; i < TIMER_LEVELS * TIMER_SLOTS; ++i) {
+		wheel->slots[i].prev = &wheel->slots[i];
+		wheel->slots[i].next = &wheel->slots[i];
+	}
+}
+
+/**
+ * Initialises 'timer' as not armed.
+ */
+void timer_init(struct timer *timer)
+{
+	timer->prev = NULL;
+	timer->next = NULL;
+	timer->expires = 0;
+}
+
+/**
+ * Returns non-zero if 'timer' is armed.
+ */
+int timer_armed(const struct timer *timer)
+{
+	return timer->prev != NULL;
+}
+
+/**
+ * Links 'timer' into the slot of 'wheel' that it expires in, as seen
+ * from the next tick of 'wheel'.
+ */
+static void timer_wheel_insert(struct timer_wheel *wheel, struct timer *timer)
+{
+	unsigned long long expires = timer->expires;
+	unsigned long long delta;
+	struct timer *slot;
+	int level = 0;
+
+	if (expires < wheel->now) {
+		expires = wheel->now;
+	}
+
+	delta = expires - wheel->now;
+
+	/* Park timers beyond the top level in its furthest slot, from
+	   which they are moved down and parked again until in reach. */
+	if (delta >= TIMER_RANGE) {
+		expires = wheel->now + TIMER_RANGE - 1;
+		delta = TIMER_RANGE - 1;
+	}
+
+	while (level < TIMER_LEVELS - 1 &&
+		delta >= 1ULL << (TIMER_SLOT_BITS * (level + 1))) {
+		++level;
+	}
+
+	slot = &wheel->slots[level * TIMER_SLOTS +
+		((expires >> (TIMER_SLOT_BITS * level)) & TIMER_MASK)];
+
+	timer->prev = slot->prev;
+	timer->next = slot;
+	slot->prev->next = timer;
+	slot->prev = timer;
+}
+
+/**
+ * Unlinks 'timer' from its slot.
+ */
+static void timer_unlink(struct timer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+
+/**
+ * Arms 'timer' on 'wheel' to expire at tick 'expires', cancelling it
+ * first if it is armed. A timer that expires before the next tick of
+ * 'wheel' expires at that tick.
+ */
+void timer_arm(
+	struct timer_wheel *wheel,
+	struct timer *timer,
+	unsigned long long expires
+)
+{
+	if (timer->prev != NULL) {
+		timer_unlink(timer);
+	} else {
+		++wheel->len;
+	}
+
+	timer->expires = expires;
+	timer_wheel_insert(wheel, timer);
+}
+
+/**
+ * Cancels 'timer' on 'wheel' if it is armed.
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+	if (timer->prev != NULL) {
+		timer_unlink(timer);
+		--wheel->len;
+	}
+}
+
+/**
+ * Moves every timer in slot 'index' of level 'level' of 'wheel' to
+ * the slot it expires in as seen from the next tick of 'wheel'.
+ */
+static void timer_wheel_cascade(
+	struct timer_wheel *wheel,
+	int level,
+	unsigned long long index
+)
+{
+	struct timer *slot, *timer, *next;
+
+	slot = &wheel->slots[level * TIMER_SLOTS + index];
+	timer = slot->next;
+	slot->prev = slot;
+	slot->next = slot;
+
+	for (; timer != slot; timer = next) {
+		next = timer->next;
+		timer_wheel_insert(wheel, timer);
+	}
+}
+
+/**
+ * Turns 'wheel' up to and including tick 'now', and disarms every
+ * timer that has expired.
+ * Returns the expired timers in order of expiry, linked through
+ * 'next' and ending with NULL, or NULL if no timer has expired. Each
+ * may be armed again once its 'next' has been read.
+ */
+struct timer *timer_wheel_advance(
+	struct timer_wheel *wheel,
+	unsigned long long now
+)
+{
+	struct timer *expired = NULL, **tail = &expired;
+	struct timer *slot, *timer, *next;
+	unsigned long long index, lap;
+	int level;
+
+	while (wheel->now <= now) {
+		/* Skip the ticks left at once if no timer is armed. */
+		if (wheel->len == 0) {
+			wheel->now = now + 1;
+			break;
+		}
+
+		index = wheel->now & TIMER_MASK;
+
+		/* Whenever a level has turned all the way, move the
+		   timers of the next slot of the level above down. */
+		for (level = 1; level < TIMER_LEVELS; ++level) {
+			lap = (1ULL << (TIMER_SLOT_BITS * level)) - 1;
+
+			if ((wheel->now & lap) != 0) {
+				break;
+			}
+
+			timer_wheel_cascade(
+				wheel,
+				level,
+				(wheel->now >> (TIMER_SLOT_BITS * level)) &
+					TIMER_MASK
+			);
+		}
+
+		/* Expire the timers of this tick, and park again any
+		   that only reached it because they were parked. */
+		slot = &wheel->slots[index];
+
+		for (timer = slot->next; timer != slot; timer = next) {
+			next = timer->next;
+
+			if (timer->expires > wheel->now) {
+				timer_wheel_insert(wheel, timer);
+				continue;
+			}
+
+			timer->prev = NULL;
+			timer->next = NULL;
+			*tail = timer;
+			tail = &timer->next;
+			--wheel->len;
+		}
+
+		slot->prev = slot;
+		slot->next = slot;
+		++wheel->now;
+	}
+
+	return expired;
+}
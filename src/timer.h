@@ -0,0 +1,106 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+
+/**
+ * A timer wheel has TIMER_LEVELS levels of TIMER_SLOTS slots each.
+ * Level 0 holds timers that expire within TIMER_SLOTS ticks, one
+ * slot per tick, and every level above holds timers that expire
+ * TIMER_SLOTS times further away, in slots that are TIMER_SLOTS times
+ * wider, which are moved down a level as the wheel turns. Timers
+ * further away than the top level reaches wait in its last slots.
+ */
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 6
+
+/**
+ * Data structure representing a timer that expires at tick
+ * 'expires'. 'prev' is NULL while the timer is not armed.
+ */
+struct timer {
+	struct timer *prev;
+	struct timer *next;
+	unsigned long long expires;
+};
+
+/**
+ * Data structure representing a hierarchical timer wheel, which arms
+ * and cancels timers in constant time, whose next tick to expire is
+ * 'now', and which holds 'len' armed timers. Every slot is a circular
+ * list of timers with a sentinel timer of its own. A timer wheel
+ * takes no lock.
+ */
+struct timer_wheel {
+	unsigned long long now;
+	size_t len;
+	struct timer slots[TIMER_LEVELS * TIMER_SLOTS];
+};
+
+/**
+ * Initialises 'wheel' with no armed timers and 'now' as its next
+ * tick to expire.
+ */
+void timer_wheel_init(struct timer_wheel *wheel, unsigned long long now);
+
+/**
+ * Initialises 'timer' as not armed.
+ */
+void timer_init(struct timer *timer);
+
+/**
+ * Returns non-zero if 'timer' is armed.
+ */
+int timer_armed(const struct timer *timer);
+
+/**
+ * Arms 'timer' on 'wheel' to expire at tick 'expires', cancelling it
+ * first if it is armed. A timer that expires before the next tick of
+ * 'wheel' expires at that tick.
+ */
+void timer_arm(
+	struct timer_wheel *wheel,
+	struct timer *timer,
+	unsigned long long expires
+);
+
+/**
+ * Cancels 'timer' on 'wheel' if it is armed.
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * Turns 'wheel' up to and including tick 'now', and disarms every
+ * timer that has expired.
+ * Returns the expired timers in order of expiry, linked through
+ * 'next' and ending with NULL, or NULL if no timer has expired. Each
+ * may be armed again once its 'next' has been read.
+ */
+struct timer *timer_wheel_advance(
+	struct timer_wheel *wheel,
+	unsigned long long now
+);
+
+#endif
@@ -0,0 +1,1416 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "uring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "print_error.h"
+#include "log.h"
+#include "conn.h"
+#include "deadline.h"
+#include "metrics.h"
+#include "slab.h"
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFS 256
+#define URING_BUF_LEN 16384
+#define URING_BUF_GROUP 0
+
+/**
+ * Operations tagged into the low bits of the user data of submission
+ * queue entries. The rest of the user data is a pointer to the client
+ * connection of URING_OP_RECV and the send of URING_OP_SEND.
+ */
+#define URING_OP_ACCEPT 1
+#define URING_OP_ACCEPTPIPE 2
+#define URING_OP_SIGPIPE 3
+#define URING_OP_RECV 4
+#define URING_OP_SEND 5
+#define URING_OP_CANCEL 6
+#define URING_OP_MASK 7
+
+/**
+ * Data structure representing data queued by 'maxserver_conn_send'.
+ */
+struct uring_send {
+	struct uring_send *next;
+	struct maxserver_conn *conn;
+	size_t len;
+	char data[];
+};
+
+/**
+ * Data structure representing the memory mapped submission and
+ * completion queues of an io_uring instance. 'sq_local_tail' runs
+ * ahead of the shared tail by the entries prepared since the last
+ * submission.
+ */
+struct uring_ring {
+	int fd;
+	void *mem;
+	size_t mem_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/**
+ * Data structure representing an io_uring event loop thread. 'br' is
+ * the provided buffer ring that multishot receives pick buffers of
+ * 'bufs' from, and 'conns' links every client connection owned by
+ * the thread, which are allocated from 'slab'.
+ */
+struct uring_thread {
+	pthread_t tid;
+	int started;
+	struct uring_ring ring;
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned short br_tail;
+	int sfd;
+	int accepting;
+	int accept_stopped;
+	int acceptpipe_armed;
+	int quit;
+	struct maxserver_conn *conns;
+	struct slab *slab;
+	struct uring *uring;
+};
+
+/**
+ * Data structure representing a set of io_uring event loop threads.
+ * The threads wait for 'state' to leave zero before they start, and
+ * quit at once if it becomes -1 because another thread could not be
+ * created.
+ */
+struct uring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int state;
+	struct maxserver_evloop_callbacks callbacks;
+	size_t (*dispatch)(
+		struct maxserver_conn **conns,
+		size_t len,
+		void *arg
+	);
+	void *arg;
+	struct metrics *metrics;
+	int acceptpipe;
+	int sigpipe;
+	struct uring_thread *threads;
+	size_t len;
+};
+
+/**
+ * Wrappers around the io_uring system calls, which the C library does
+ * not provide.
+ */
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(
+	int fd,
+	unsigned int to_submit,
+	unsigned int min_complete,
+	unsigned int flags
+)
+{
+	return (int)syscall(
+		__NR_io_uring_enter,
+		fd,
+		to_submit,
+		min_complete,
+		flags,
+		NULL,
+		0
+	);
+}
+
+static int uring_register(
+	int fd,
+	unsigned int opcode,
+	void *arg,
+	unsigned int nr_args
+)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Sets up the io_uring instance of 'ring' disabled, so that the
+ * thread that enables it with IORING_REGISTER_ENABLE_RINGS becomes
+ * its only submitter. Kernels that do not support single issuer rings
+ * get an ordinary ring.
+ * On success, zero is returned. On error, -1 is returned, and errno
+ * is set to indicate the error.
+ */
+static int uring_ring_init(struct uring_ring *ring)
+{
+	struct io_uring_params p;
+	unsigned int flags;
+	size_t sq_len, cq_len;
+	unsigned int i;
+	int err;
+
+	flags = IORING_SETUP_CQSIZE | IORING_SETUP_R_DISABLED |
+		IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER |
+		IORING_SETUP_DEFER_TASKRUN;
+
+	memset(&p, 0, sizeof(struct io_uring_params));
+	p.flags = flags;
+	p.cq_entries = URING_CQ_ENTRIES;
+	ring->fd = uring_setup(URING_SQ_ENTRIES, &p);
+
+	if (ring->fd == -1 && errno == EINVAL) {
+		memset(&p, 0, sizeof(struct io_uring_params));
+		p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_R_DISABLED;
+		p.cq_entries = URING_CQ_ENTRIES;
+		ring->fd = uring_setup(URING_SQ_ENTRIES, &p);
+	}
+
+	if (ring->fd == -1) {
+		return -1;
+	}
+
+	/* Both queues share one mapping on every kernel with multishot
+	   receive. */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->mem_len = sq_len > cq_len ? sq_len : cq_len;
+	ring->mem = mmap(
+		NULL,
+		ring->mem_len,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,
+		ring->fd,
+		IORING_OFF_SQ_RING
+	);
+
+	if (ring->mem == MAP_FAILED) {
+		err = errno;
+		close(ring->fd);
+		errno = err;
+		return -1;
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(
+		NULL,
+		ring->sqes_len,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE,
+		ring->fd,
+		IORING_OFF_SQES
+	);
+
+	if (ring->sqes == MAP_FAILED) {
+		err = errno;
+		munmap(ring->mem, ring->mem_len);
+		close(ring->fd);
+		errno = err;
+		return -1;
+	}
+
+	ring->sq_head = (unsigned int *)((char *)ring->mem + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->mem + p.sq_off.tail);
+	ring->sq_array = (unsigned int *)((char *)ring->mem + p.sq_off.array);
+	ring->sq_mask = *(unsigned int *)((char *)ring->mem +
+		p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned int *)((char *)ring->mem + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->mem + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)((char *)ring->mem +
+		p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->mem +
+		p.cq_off.cqes);
+
+	/* Submission queue entries are used in order. */
+	for (i = 0; i < ring->sq_entries; ++i) {
+		ring->sq_array[i] = i;
+	}
+
+	return 0;
+}
+
+/**
+ * Unmaps the queues of 'ring' and closes its io_uring instance, which
+ * cancels every pending operation.
+ */
+static void uring_ring_clear(struct uring_ring *ring)
+{
+	munmap(ring->sqes, ring->sqes_len);
+	munmap(ring->mem, ring->mem_len);
+	close(ring->fd);
+}
+
+/**
+ * Submits the submission queue entries prepared in 'ring', waits
+ * for at least 'wait' completions, and runs pending completion work.
+ * On success, zero is returned. On error, -1 is returned, and errno
+ * is set to indicate the error.
+ */
+static int uring_ring_submit(struct uring_ring *ring, unsigned int wait)
+{
+	unsigned int pending;
+	int n;
+
+	pending = ring->sq_local_tail - *ring->sq_tail;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	n = uring_enter(
+		ring->fd,
+		pending,
+		wait,
+		wait > 0 ? IORING_ENTER_GETEVENTS : 0
+	);
+
+	if (n == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Returns a cleared submission queue entry of 'ring', submitting the
+ * prepared ones first if the submission queue is full. If the kernel
+ * does not consume any of them, NULL is returned, and an appropriate
+ * error message is printed to standard error.
+ */
+static struct io_uring_sqe *uring_ring_get_sqe(struct uring_ring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring->sq_local_tail - head == ring->sq_entries) {
+		if (uring_ring_submit(ring, 0) == -1) {
+			print_error_errno("uring_ring_get_sqe:io_uring_enter");
+			return NULL;
+		}
+
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+		if (ring->sq_local_tail - head == ring->sq_entries) {
+			print_error_str(
+				"uring_ring_get_sqe",
+				"Submission queue is full."
+			);
+			return NULL;
+		}
+	}
+
+	sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+	++ring->sq_local_tail;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	return sqe;
+}
+
+/**
+ * Returns the number of submission queue entries of 'ring' that can
+ * be prepared without submitting.
+ */
+static unsigned int uring_ring_space(struct uring_ring *ring)
+{
+	unsigned int head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	return ring->sq_entries - (ring->sq_local_tail - head);
+}
+
+/**
+ * Hands buffer 'bid' back to the provided buffer ring of 'thread'.
+ */
+static void uring_buf_recycle(struct uring_thread *thread, unsigned int bid)
+{
+	struct io_uring_buf *buf;
+
+	/* The tail overlays the reserved field of the first buffer, so
+	   buffers are written field by field. */
+	buf = &thread->br->bufs[thread->br_tail & (URING_BUFS - 1)];
+	buf->addr = (unsigned long)(thread->bufs + (size_t)bid * URING_BUF_LEN);
+	buf->len = URING_BUF_LEN;
+	buf->bid = (unsigned short)bid;
+	++thread->br_tail;
+
+	__atomic_store_n(&thread->br->tail, thread->br_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sets up the io_uring instance and provided buffer ring of 'thread'.
+ * The io_uring instance must be enabled by the thread that uses it.
+ * On success, zero is returned. On error, -1 is returned, and errno
+ * is set to indicate the error.
+ */
+static int uring_thread_init(struct uring_thread *thread)
+{
+	struct io_uring_buf_reg reg;
+	size_t br_len = URING_BUFS * sizeof(struct io_uring_buf);
+	unsigned int i;
+	int err;
+
+	if (uring_ring_init(&thread->ring) == -1) {
+		return -1;
+	}
+
+	/* The buffer ring must be page aligned. */
+	thread->br = mmap(
+		NULL,
+		br_len,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+
+	if (thread->br == MAP_FAILED) {
+		err = errno;
+		uring_ring_clear(&thread->ring);
+		errno = err;
+		return -1;
+	}
+
+	thread->bufs = malloc((size_t)URING_BUFS * URING_BUF_LEN);
+
+	if (thread->bufs == NULL) {
+		munmap(thread->br, br_len);
+		uring_ring_clear(&thread->ring);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+	reg.ring_addr = (unsigned long)thread->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BUF_GROUP;
+
+	if (uring_register(
+		thread->ring.fd,
+		IORING_REGISTER_PBUF_RING,
+		&reg,
+		1
+	) == -1) {
+		err = errno;
+		free(thread->bufs);
+		munmap(thread->br, br_len);
+		uring_ring_clear(&thread->ring);
+		errno = err;
+		return -1;
+	}
+
+	thread->br_tail = 0;
+
+	for (i = 0; i < URING_BUFS; ++i) {
+		uring_buf_recycle(thread, i);
+	}
+
+	return 0;
+}
+
+/**
+ * Closes the io_uring instance of 'thread' and frees its buffers.
+ */
+static void uring_thread_clear(struct uring_thread *thread)
+{
+	uring_ring_clear(&thread->ring);
+	free(thread->bufs);
+	munmap(thread->br, URING_BUFS * sizeof(struct io_uring_buf));
+}
+
+/**
+ * Makes the calling thread the submitter of the io_uring instance of
+ * 'thread'.
+ * On success, zero is returned. On error, -1 is returned, and errno
+ * is set to indicate the error.
+ */
+static int uring_thread_enable(struct uring_thread *thread)
+{
+	return uring_register(
+		thread->ring.fd,
+		IORING_REGISTER_ENABLE_RINGS,
+		NULL,
+		0
+	);
+}
+
+/**
+ * Returns non-zero if the kernel supports every io_uring feature that
+ * the io_uring event loop needs: multishot accept, multishot receive
+ * into provided buffer rings and linked sends. Never prints an error.
+ */
+int uring_available()
+{
+	struct uring_thread thread;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int sv[2];
+	int ok = 0;
+
+	memset(&thread, 0, sizeof(struct uring_thread));
+
+	if (uring_thread_init(&thread) == -1) {
+		return 0;
+	}
+
+	if (
+		uring_thread_enable(&thread) == -1 ||
+		socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1
+	) {
+		uring_thread_clear(&thread);
+		return 0;
+	}
+
+	/* Multishot receive was added after multishot accept and
+	   provided buffer rings, and keeps a receive armed after its
+	   first completion where it is supported. */
+	sqe = uring_ring_get_sqe(&thread.ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+
+	if (
+		write(sv[1], "", 1) == 1 &&
+		uring_ring_submit(&thread.ring, 1) == 0 &&
+		*thread.ring.cq_head !=
+			__atomic_load_n(thread.ring.cq_tail, __ATOMIC_ACQUIRE)
+	) {
+		cqe = &thread.ring.cqes[*thread.ring.cq_head &
+			thread.ring.cq_mask];
+		ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE);
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+	uring_thread_clear(&thread);
+
+	return ok;
+}
+
+/**
+ * Prepares a multishot accept on the server socket of 'thread'.
+ */
+static void uring_arm_accept(struct uring_thread *thread)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_ring_get_sqe(&thread->ring);
+
+	if (sqe == NULL) {
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = thread->sfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = URING_OP_ACCEPT;
+	thread->accepting = 1;
+}
+
+/**
+ * Prepares a poll for 'fd' becoming readable, completing with user
+ * data 'op'.
+ */
+static int uring_arm_poll(struct uring_thread *thread, int fd, int op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_ring_get_sqe(&thread->ring);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = op;
+
+	return 0;
+}
+
+/**
+ * Prepares a cancellation of the operation with user data
+ * 'user_data'.
+ */
+static void uring_arm_cancel(struct uring_thread *thread, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_ring_get_sqe(&thread->ring);
+
+	if (sqe == NULL) {
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = user_data;
+	sqe->user_data = URING_OP_CANCEL;
+}
+
+/**
+ * Prepares a multishot receive on the client socket of 'conn' into
+ * the provided buffer ring of 'thread'. Marks 'conn' as closing if
+ * no submission queue entry is available.
+ */
+static void uring_arm_recv(
+	struct uring_thread *thread,
+	struct maxserver_conn *conn
+)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_ring_get_sqe(&thread->ring);
+
+	if (sqe == NULL) {
+		conn->closing = 1;
+		return;
+	}
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->user_data = (uint64_t)(uintptr_t)conn | URING_OP_RECV;
+	conn->recv_armed = 1;
+}
+
+/**
+ * Queues 'len' bytes of 'data' to be sent to 'conn' once the current
+ * callback returns. Ends the read deadline of 'conn', since the
+ * client has been answered, and throttles 'conn' once more than
+ * 'send_high' bytes are queued or in flight.
+ * On success, zero is returned, or 1 if 'conn' is throttled. On
+ * error, -1 is returned, and an appropriate error message is printed
+ * to standard error if the data could not be queued.
+ */
+static int uring_conn_send(
+	struct maxserver_conn *conn,
+	const void *data,
+	size_t len
+)
+{
+	struct uring_send *send;
+
+	if (conn->closing || conn->closed) {
+		return -1;
+	}
+
+	deadlines_frame_end(conn);
+
+	if (len == 0) {
+		return conn->throttled;
+	}
+
+	send = malloc(sizeof(struct uring_send) + len);
+
+	if (send == NULL) {
+		print_error_errno("uring_conn_send:malloc");
+		conn->closing = 1;
+		return -1;
+	}
+
+	send->next = NULL;
+	send->conn = conn;
+	send->len = len;
+	memcpy(send->data, data, len);
+
+	if (conn->sends_tail != NULL) {
+		conn->sends_tail->next = send;
+	} else {
+		conn->sends = send;
+	}
+
+	conn->sends_tail = send;
+	conn->sends_bytes += len;
+
+	if (conn->sends_bytes > conn->send_high) {
+		conn->throttled = 1;
+	}
+
+	return conn->throttled;
+}
+
+/**
+ * Frees the queued sends of 'conn' that have not been submitted.
+ */
+static void uring_conn_sends_free(struct maxserver_conn *conn)
+{
+	struct uring_send *send;
+
+	while (conn->sends != NULL) {
+		send = conn->sends;
+		conn->sends = send->next;
+		conn->sends_bytes -= send->len;
+		free(send);
+	}
+
+	conn->sends_tail = NULL;
+}
+
+/**
+ * Submits the queued sends of 'conn' as one chain of linked sends,
+ * unless sends of 'conn' are already in flight. Since each send of
+ * the chain only starts when the previous one has completed, and the
+ * next chain only when the whole chain has completed, data is never
+ * reordered.
+ */
+static void uring_conn_flush(
+	struct uring_thread *thread,
+	struct maxserver_conn *conn
+)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_send *send;
+	unsigned int len = 0;
+
+	if (conn->sends_inflight > 0 || conn->sends == NULL) {
+		return;
+	}
+
+	/* A chain must not be split across submissions. */
+	for (send = conn->sends; send != NULL; send = send->next) {
+		++len;
+	}
+
+	if (len > thread->ring.sq_entries) {
+		len = thread->ring.sq_entries;
+	}
+
+	if (uring_ring_space(&thread->ring) < len) {
+		if (uring_ring_submit(&thread->ring, 0) == -1) {
+			print_error_errno("uring_conn_flush:io_uring_enter");
+			conn->closing = 1;
+			return;
+		}
+	}
+
+	while (len-- > 0) {
+		send = conn->sends;
+		sqe = uring_ring_get_sqe(&thread->ring);
+
+		if (sqe == NULL) {
+			conn->closing = 1;
+			return;
+		}
+
+		conn->sends = send->next;
+
+		if (conn->sends == NULL) {
+			conn->sends_tail = NULL;
+		}
+
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = conn->fd;
+		sqe->addr = (unsigned long)send->data;
+		sqe->len = (unsigned int)send->len;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		sqe->user_data = (uint64_t)(uintptr_t)send | URING_OP_SEND;
+
+		if (len > 0) {
+			sqe->flags = IOSQE_IO_LINK;
+		}
+
+		++conn->sends_inflight;
+	}
+}
+
+/**
+ * Inserts 'conn' into the client connections of 'thread'.
+ */
+static void uring_conns_insert(
+	struct uring_thread *thread,
+	struct maxserver_conn *conn
+)
+{
+	conn->uring = thread;
+	conn->prev = NULL;
+	conn->next = thread->conns;
+
+	if (thread->conns != NULL) {
+		thread->conns->prev = conn;
+	}
+
+	thread->conns = conn;
+}
+
+/**
+ * Removes 'conn' from the client connections of its thread.
+ */
+static void uring_conns_remove(struct maxserver_conn *conn)
+{
+	struct uring_thread *thread = conn->uring;
+
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	} else {
+		thread->conns = conn->next;
+	}
+
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+}
+
+/**
+ * Calls 'on_close' if 'conn' has been opened, and cancels its
+ * receive. Queued sends are still submitted, and 'conn' is freed by
+ * 'uring_conn_update' once none of its operations is in flight.
+ */
+static void uring_conn_close(
+	struct uring_thread *thread,
+	struct maxserver_conn *conn
+)
+{
+	struct uring *uring = thread->uring;
+
+	conn->closed = 1;
+
+	if (conn->opened && uring->callbacks.on_close != NULL) {
+		uring->callbacks.on_close(conn);
+	}
+
+	if (conn->recv_armed) {
+		uring_arm_cancel(
+			thread,
+			(uint64_t)(uintptr_t)conn | URING_OP_RECV
+		);
+	}
+}
+
+/**
+ * Acts on the state of 'conn' after one of its operations completed
+ * or one of its callbacks returned: closes it if it is closing,
+ * cancels its receive if it is throttled, submits its queued sends,
+ * and cancels its deadlines, closes its client socket and frees it
+ * once none of its operations is in flight.
+ */
+static void uring_conn_update(
+	struct uring_thread *thread,
+	struct maxserver_conn *conn
+)
+{
+	if (conn->closing && !conn->closed) {
+		uring_conn_close(thread, conn);
+	}
+
+	if (conn->throttled && conn->recv_armed && !conn->recv_cancelled) {
+		uring_arm_cancel(
+			thread,
+			(uint64_t)(uintptr_t)conn | URING_OP_RECV
+		);
+		conn->recv_cancelled = 1;
+	}
+
+	uring_conn_flush(thread, conn);
+
+	if (
+		conn->closed &&
+		!conn->recv_armed &&
+		conn->sends_inflight == 0 &&
+		conn->sends == NULL
+	) {
+		uring_conns_remove(conn);
+		deadlines_conn_stop(conn);
+		close(conn->fd);
+		conn_destroy(conn);
+	}
+}
+
+/**
+ * Takes over client socket 'cfd' accepted by 'thread': dispatches a
+ * new client connection for it, calls 'on_open', and arms its
+ * receive.
+ */
+static void uring_conn_open(struct uring_thread *thread, int cfd)
+{
+	struct uring *uring = thread->uring;
+	struct maxserver_conn *conn;
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(struct sockaddr_storage);
+#if MAXSERVER_LOG_LEVEL >= LOG_LEVEL_INFO
+	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+#endif
+	int err;
+
+	/* Multishot accepts share one address buffer, so the client
+	   address is looked up afterwards. */
+	err = getpeername(cfd, (struct sockaddr *)&addr, &addrlen);
+
+	if (err == -1) {
+		close(cfd);
+		return;
+	}
+
+	conn = conn_create(
+		thread->slab,
+		cfd,
+		(struct sockaddr *)&addr,
+		addrlen
+	);
+
+	if (conn == NULL) {
+		close(cfd);
+		return;
+	}
+
+#if MAXSERVER_LOG_LEVEL >= LOG_LEVEL_INFO
+	/* Log numeric address of client, which never involves a name
+	   lookup. */
+	err = maxserver_conn_peer_numeric(
+		conn,
+		hbuf,
+		NI_MAXHOST,
+		sbuf,
+		NI_MAXSERV
+	);
+
+	if (err == 0) {
+		log_info("accepted connection from %s:%s", hbuf, sbuf);
+	}
+#endif
+
+	if (uring->dispatch(&conn, 1, uring->arg) == 0) {
+		close(cfd);
+		conn_destroy(conn);
+		return;
+	}
+
+	conn->send = uring_conn_send;
+	uring_conns_insert(thread, conn);
+
+	if (uring->callbacks.on_open != NULL) {
+		err = uring->callbacks.on_open(conn);
+
+		if (err == -1) {
+			conn->closed = 1;
+			uring_conn_sends_free(conn);
+			uring_conn_update(thread, conn);
+			return;
+		}
+
+		maxserver_arena_reset(&conn->arena);
+	}
+
+	conn->opened = 1;
+	deadlines_wait_begin(conn);
+
+	if (!conn->closing && !conn->throttled) {
+		uring_arm_recv(thread, conn);
+	}
+
+	uring_conn_update(thread, conn);
+}
+
+/**
+ * Handles a completion of the multishot accept of 'thread'.
+ */
+static void uring_accept_complete(
+	struct uring_thread *thread,
+	int res,
+	unsigned int flags
+)
+{
+	if (!(flags & IORING_CQE_F_MORE)) {
+		thread->accepting = 0;
+	}
+
+	if (res >= 0) {
+		metrics_add(thread->uring->metrics, METRICS_ACCEPTS, 1);
+		uring_conn_open(thread, res);
+	} else if (res != -ECANCELED) {
+		metrics_add(thread->uring->metrics, METRICS_ACCEPT_ERRORS, 1);
+		print_error("uring_thread:accept", -res);
+	}
+
+	if (!thread->accepting && !thread->accept_stopped) {
+		uring_arm_accept(thread);
+	}
+}
+
+/**
+ * Handles a completion of the multishot receive of 'conn', passing
+ * the received data to 'on_data', resetting the arena of 'conn'
+ * afterwards, and handing its buffer back. Received data restarts
+ * the idle deadline of 'conn', and starts its read deadline unless
+ * it is running. Data received before the receive of a throttled
+ * 'conn' is cancelled is still passed on, but the receive is not
+ * armed again until 'conn' is no longer throttled.
+ */
+static void uring_recv_complete(
+	struct uring_thread *thread,
+	struct maxserver_conn *conn,
+	int res,
+	unsigned int flags
+)
+{
+	struct uring *uring = thread->uring;
+	unsigned long long start;
+	unsigned int bid;
+
+	if (!(flags & IORING_CQE_F_MORE)) {
+		conn->recv_armed = 0;
+		conn->recv_cancelled = 0;
+	}
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+		if (res > 0 && !conn->closing && !conn->closed) {
+			conn_count(conn, (size_t)res, 0);
+			deadlines_wait_begin(conn);
+			deadlines_frame_begin(conn);
+			start = metrics_start(conn->metrics);
+			uring->callbacks.on_data(
+				conn,
+				thread->bufs + (size_t)bid * URING_BUF_LEN,
+				(size_t)res
+			);
+			metrics_handled(conn->metrics, start);
+			maxserver_arena_reset(&conn->arena);
+		}
+
+		uring_buf_recycle(thread, bid);
+	}
+
+	/* A multishot receive stops on end-of-file, on errors, and
+	   when the buffer ring runs dry, and is armed again in the last
+	   case. */
+	if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+		conn->closing = 1;
+	}
+
+	if (
+		!conn->recv_armed &&
+		!conn->throttled &&
+		!conn->closing &&
+		!conn->closed
+	) {
+		uring_arm_recv(thread, conn);
+	}
+
+	uring_conn_update(thread, conn);
+}
+
+/**
+ * Handles a completion of send 'send'. A short or failed send closes
+ * its client connection, and fails the rest of its chain. Once fewer
+ * than 'send_low' bytes of a throttled client connection are queued
+ * or in flight, its receive is armed again.
+ */
+static void uring_send_complete(
+	struct uring_thread *thread,
+	struct uring_send *send,
+	int res
+)
+{
+	struct maxserver_conn *conn = send->conn;
+
+	--conn->sends_inflight;
+	conn->sends_bytes -= send->len;
+
+	if (res > 0) {
+		conn_count(conn, 0, (size_t)res);
+	}
+
+	if (res < 0 || (size_t)res < send->len) {
+		conn->closing = 1;
+		uring_conn_sends_free(conn);
+	}
+
+	free(send);
+
+	if (conn->throttled && conn->sends_bytes < conn->send_low) {
+		conn->throttled = 0;
+
+		if (!conn->recv_armed && !conn->closing && !conn->closed) {
+			uring_arm_recv(thread, conn);
+		}
+	}
+
+	uring_conn_update(thread, conn);
+}
+
+/**
+ * Stops accepting client connections on 'thread', and closes every
+ * client connection of 'thread' once the signal pipe has been
+ * signalled. Client sockets are shut down so that sends in flight
+ * fail at once.
+ */
+static void uring_thread_quit(struct uring_thread *thread)
+{
+	struct maxserver_conn *conn, *next;
+
+	thread->quit = 1;
+	thread->accept_stopped = 1;
+
+	if (thread->accepting) {
+		uring_arm_cancel(thread, URING_OP_ACCEPT);
+	}
+
+	if (thread->acceptpipe_armed) {
+		uring_arm_cancel(thread, URING_OP_ACCEPTPIPE);
+	}
+
+	for (conn = thread->conns; conn != NULL; conn = next) {
+		next = conn->next;
+		shutdown(conn->fd, SHUT_RDWR);
+		conn->closing = 1;
+		uring_conn_update(thread, conn);
+	}
+}
+
+/**
+ * Handles completion 'cqe' of 'thread'.
+ */
+static void uring_thread_complete(
+	struct uring_thread *thread,
+	const struct io_uring_cqe *cqe
+)
+{
+	void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+	switch (cqe->user_data & URING_OP_MASK) {
+	case URING_OP_ACCEPT:
+		uring_accept_complete(thread, cqe->res, cqe->flags);
+		break;
+	case URING_OP_ACCEPTPIPE:
+		thread->acceptpipe_armed = 0;
+
+		if (cqe->res != -ECANCELED) {
+			thread->accept_stopped = 1;
+
+			if (thread->accepting) {
+				uring_arm_cancel(thread, URING_OP_ACCEPT);
+			}
+		}
+
+		break;
+	case URING_OP_SIGPIPE:
+		uring_thread_quit(thread);
+		break;
+	case URING_OP_RECV:
+		uring_recv_complete(thread, ptr, cqe->res, cqe->flags);
+		break;
+	case URING_OP_SEND:
+		uring_send_complete(thread, ptr, cqe->res);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Accepts and serves client connections until the signal pipe
+ * becomes readable and every client connection of 'arg' is closed.
+ */
+static void *uring_thread(void *arg)
+{
+	struct uring_thread *thread = (struct uring_thread *)arg;
+	struct uring *uring = thread->uring;
+	struct maxserver_conn *conn;
+	unsigned int head, tail;
+	int err;
+
+	/* Wait for every other thread to be created. */
+	pthread_mutex_lock(&uring->lock);
+
+	while (uring->state == 0) {
+		pthread_cond_wait(&uring->cond, &uring->lock);
+	}
+
+	pthread_mutex_unlock(&uring->lock);
+
+	if (uring->state == -1) {
+		return NULL;
+	}
+
+	err = uring_thread_enable(thread);
+
+	if (err == -1) {
+		print_error_errno("uring_thread:io_uring_register");
+		return NULL;
+	}
+
+	uring_arm_poll(thread, uring->sigpipe, URING_OP_SIGPIPE);
+
+	if (uring_arm_poll(thread, uring->acceptpipe, URING_OP_ACCEPTPIPE) == 0) {
+		thread->acceptpipe_armed = 1;
+	}
+
+	uring_arm_accept(thread);
+
+	while (
+		!thread->quit ||
+		thread->accepting ||
+		thread->acceptpipe_armed ||
+		thread->conns != NULL
+	) {
+		err = uring_ring_submit(&thread->ring, 1);
+
+		if (err == -1) {
+			print_error_errno("uring_thread:io_uring_enter");
+			break;
+		}
+
+		head = *thread->ring.cq_head;
+		tail = __atomic_load_n(thread->ring.cq_tail, __ATOMIC_ACQUIRE);
+
+		while (head != tail) {
+			uring_thread_complete(
+				thread,
+				&thread->ring.cqes[head & thread->ring.cq_mask]
+			);
+			++head;
+		}
+
+		__atomic_store_n(thread->ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	/* Only reached early if the io_uring instance fails, in which
+	   case sends in flight are abandoned with it. */
+	while (thread->conns != NULL) {
+		conn = thread->conns;
+
+		if (!conn->closed && conn->opened &&
+			uring->callbacks.on_close != NULL) {
+			uring->callbacks.on_close(conn);
+		}
+
+		uring_conn_sends_free(conn);
+		uring_conns_remove(conn);
+		deadlines_conn_stop(conn);
+		close(conn->fd);
+		conn_destroy(conn);
+	}
+
+	return NULL;
+}
+
+/**
+ * Creates 'threads' io_uring event loop threads. Thread 'i' accepts
+ * client connections on server socket 'sfds[i % shards]' until
+ * 'acceptpipe' becomes readable, hands each of them to 'dispatch'
+ * with 'arg' as its last argument, and calls 'callbacks' on them until
+ * 'sigpipe' becomes readable. 'callbacks->on_data' must be set, and
+ * 'on_readable' and 'on_writable' are never called. Client
+ * connections that 'dispatch' does not take are closed. Every thread
+ * allocates its client connections from a slab of its own, with room
+ * for 'slab_len' of them at a time, locked into memory if 'slab_lock'
+ * is non-zero. Accepts are counted in 'metrics', which may be NULL.
+ * On success, a pointer to the new event loop is returned. On error,
+ * NULL is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct uring *uring_create(
+	size_t threads,
+	const int *sfds,
+	size_t shards,
+	const struct maxserver_evloop_callbacks *callbacks,
+	size_t (*dispatch)(
+		struct maxserver_conn **conns,
+		size_t len,
+		void *arg
+	),
+	void *arg,
+	size_t slab_len,
+	int slab_lock,
+	struct metrics *metrics,
+	int acceptpipe,
+	int sigpipe
+)
+{
+	struct uring *uring;
+	struct uring_thread *thread;
+	int err;
+	size_t i;
+
+	if (threads == 0 || shards == 0 || callbacks->on_data == NULL) {
+		print_error_str(
+			"uring_create",
+			"Invalid io_uring event loop configuration."
+		);
+		return NULL;
+	}
+
+	/* Allocate event loop data structures. */
+	uring = calloc(1, sizeof(struct uring));
+
+	if (uring == NULL) {
+		print_error_errno("uring_create:calloc");
+		return NULL;
+	}
+
+	uring->threads = calloc(threads, sizeof(struct uring_thread));
+
+	if (uring->threads == NULL) {
+		print_error_errno("uring_create:calloc");
+		free(uring);
+		return NULL;
+	}
+
+	pthread_mutex_init(&uring->lock, NULL);
+	pthread_cond_init(&uring->cond, NULL);
+	uring->callbacks = *callbacks;
+	uring->dispatch = dispatch;
+	uring->arg = arg;
+	uring->metrics = metrics;
+	uring->acceptpipe = acceptpipe;
+	uring->sigpipe = sigpipe;
+
+	for (i = 0; i < threads; ++i) {
+		thread = &uring->threads[i];
+		thread->uring = uring;
+		thread->sfd = sfds[i % shards];
+
+		/* Set up io_uring instance and buffer ring. */
+		err = uring_thread_init(thread);
+
+		if (err == -1) {
+			print_error_errno("uring_create:io_uring_setup");
+			break;
+		}
+
+		++uring->len;
+		thread->slab = slab_create(
+			sizeof(struct maxserver_conn),
+			slab_len,
+			slab_lock
+		);
+
+		if (thread->slab == NULL) {
+			break;
+		}
+
+		/* Start event loop thread. */
+		err = pthread_create(&thread->tid, NULL, uring_thread, thread);
+
+		if (err != 0) {
+			print_error("uring_create:pthread_create", err);
+			break;
+		}
+
+		thread->started = 1;
+	}
+
+	/* Let the threads start, or make them quit at once. */
+	pthread_mutex_lock(&uring->lock);
+	uring->state = i < threads ? -1 : 1;
+	pthread_cond_broadcast(&uring->cond);
+	pthread_mutex_unlock(&uring->lock);
+
+	if (i < threads) {
+		uring_destroy(uring);
+		return NULL;
+	}
+
+	return uring;
+}
+
+/**
+ * Waits for the event loop threads of 'uring' to close their client
+ * connections and quit, and frees 'uring'. The caller must already
+ * have signalled 'sigpipe'.
+ */
+void uring_destroy(struct uring *uring)
+{
+	struct uring_thread *thread;
+	int err;
+	size_t i;
+
+	for (i = 0; i < uring->len; ++i) {
+		thread = &uring->threads[i];
+
+		if (thread->started) {
+			err = pthread_join(thread->tid, NULL);
+
+			if (err != 0) {
+				print_error("uring_destroy:pthread_join", err);
+			}
+		}
+
+		uring_thread_clear(thread);
+
+		if (thread->slab != NULL) {
+			slab_destroy(thread->slab);
+		}
+	}
+
+	pthread_cond_destroy(&uring->cond);
+	pthread_mutex_destroy(&uring->lock);
+	free(uring->threads);
+	free(uring);
+}
+
+/**
+ * Adds the client connection allocation statistics of the event loop
+ * threads of 'uring' to 'stats'. May be called from any thread.
+ */
+void uring_conn_stats(
+	const struct uring *uring,
+	struct maxserver_conn_stats *stats
+)
+{
+	size_t i;
+
+	for (i = 0; i < uring->len; ++i) {
+		if (uring->threads[i].slab != NULL) {
+			slab_stats_add(uring->threads[i].slab, stats);
+		}
+	}
+}
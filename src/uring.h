@@ -0,0 +1,93 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+
+#include "maxserver.h"
+
+struct metrics;
+
+/**
+ * Opaque data structure representing a set of io_uring event loop
+ * threads.
+ */
+struct uring;
+
+/**
+ * Returns non-zero if the kernel supports every io_uring feature that
+ * the io_uring event loop needs: multishot accept, multishot receive
+ * into provided buffer rings and linked sends. Never prints an error.
+ */
+int uring_available();
+
+/**
+ * Creates 'threads' io_uring event loop threads. Thread 'i' accepts
+ * client connections on server socket 'sfds[i % shards]' until
+ * 'acceptpipe' becomes readable, hands each of them to 'dispatch'
+ * with 'arg' as its last argument, and calls 'callbacks' on them until
+ * 'sigpipe' becomes readable. 'callbacks->on_data' must be set, and
+ * 'on_readable' and 'on_writable' are never called. Client
+ * connections that 'dispatch' does not take are closed. Every thread
+ * allocates its client connections from a slab of its own, with room
+ * for 'slab_len' of them at a time, locked into memory if 'slab_lock'
+ * is non-zero. Accepts are counted in 'metrics', which may be NULL.
+ * On success, a pointer to the new event loop is returned. On error,
+ * NULL is returned, and an appropriate error message is printed to
+ * standard error.
+ */
+struct uring *uring_create(
+	size_t threads,
+	const int *sfds,
+	size_t shards,
+	const struct maxserver_evloop_callbacks *callbacks,
+	size_t (*dispatch)(
+		struct maxserver_conn **conns,
+		size_t len,
+		void *arg
+	),
+	void *arg,
+	size_t slab_len,
+	int slab_lock,
+	struct metrics *metrics,
+	int acceptpipe,
+	int sigpipe
+);
+
+/**
+ * Waits for the event loop threads of 'uring' to close their client
+ * connections and quit, and frees 'uring'. The caller must already
+ * have signalled 'sigpipe'.
+ */
+void uring_destroy(struct uring *uring);
+
+/**
+ * Adds the client connection allocation statistics of the event loop
+ * threads of 'uring' to 'stats'. May be called from any thread.
+ */
+void uring_conn_stats(
+	const struct uring *uring,
+	struct maxserver_conn_stats *stats
+);
+
+#endif
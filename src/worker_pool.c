@@ -0,0 +1,1021 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "worker_pool.h"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "print_error.h"
+#include "log.h"
+#include "conn.h"
+#include "mpmc.h"
+#include "deque.h"
+#include "metrics.h"
+
+/**
+ * Number of times an idle worker thread yields and checks the queue
+ * again before it sleeps on the futex. Client connections often
+ * arrive in bursts, and catching the next one this way is cheaper
+ * than a futex wait and wakeup.
+ */
+#define WORKER_POOL_SPINS 16
+
+/**
+ * States of a worker thread slot.
+ */
+enum worker_state {
+	WORKER_UNUSED,
+	WORKER_RUNNING,
+	WORKER_EXITED
+};
+
+/**
+ * Data structure representing a worker thread slot. With a scheduler
+ * that gives every worker thread its own queue, client connections
+ * are submitted to 'inbox', and the worker thread moves them into
+ * 'deque', from which idle worker threads may steal them. 'busy' is
+ * set while it handles a client connection, and 'sleeping' while it
+ * sleeps on the futex of 'inbox'.
+ */
+struct worker {
+	pthread_t tid;
+	enum worker_state state;
+	struct worker_pool *pool;
+	struct mpmc *inbox;
+	struct deque *deque;
+	int busy;
+	int sleeping;
+	size_t queued_max;
+	unsigned long long handled;
+	unsigned long long steals;
+};
+
+/**
+ * Data structure representing a pool of worker threads. With
+ * MAXSERVER_POOL_SHARED, client connections are handed to worker
+ * threads through the lock-free ring 'queue', and idle worker threads
+ * sleep on its futex. 'idle' then counts worker threads that no
+ * queued client connection has been reserved for yet. With the other
+ * schedulers, client connections are handed to the worker thread
+ * after 'next' in turn, and 'idle' counts the worker threads that
+ * are not busy. 'lock' only serialises spawning worker threads and
+ * the slots in 'workers'. Every other field except the constant
+ * configuration is accessed atomically. Worker threads are counted in
+ * 'metrics' when they are spawned and joined.
+ */
+struct worker_pool {
+	pthread_mutex_t lock;
+	struct worker *workers;
+	enum maxserver_pool_scheduler scheduler;
+	struct mpmc *queue;
+	size_t next;
+	size_t min_threads;
+	size_t max_threads;
+	size_t threads;
+	size_t idle;
+	size_t queue_count_max;
+	unsigned int idle_timeout_ms;
+	void (*client_thread)(int cfd, int sigpipe);
+	int sigpipe;
+	struct metrics *metrics;
+	int stopping;
+	int saturated_state;
+	unsigned long long dispatched;
+	unsigned long long spawned;
+	unsigned long long saturated;
+	unsigned long long rejected;
+	unsigned long long steals;
+};
+
+/**
+ * Computes the absolute CLOCK_MONOTONIC time 'ms' milliseconds from
+ * now, and stores it in 'ts'.
+ */
+static void worker_pool_deadline(struct timespec *ts, unsigned int ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000;
+
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec += 1;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/**
+ * Decrements '*counter' unless it is at most 'floor'.
+ * Returns non-zero if '*counter' was decremented.
+ */
+static int worker_pool_take(size_t *counter, size_t floor)
+{
+	size_t value;
+
+	value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+	while (value > floor) {
+		if (__atomic_compare_exchange_n(
+			counter,
+			&value,
+			value - 1,
+			1,
+			__ATOMIC_RELAXED,
+			__ATOMIC_RELAXED
+		)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Raises '*max' to 'value' if it is lower.
+ */
+static void worker_pool_raise(size_t *max, size_t value)
+{
+	size_t old;
+
+	old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while (value > old && !__atomic_compare_exchange_n(
+		max,
+		&old,
+		value,
+		1,
+		__ATOMIC_RELAXED,
+		__ATOMIC_RELAXED
+	)) {
+	}
+}
+
+/**
+ * Counts a client connection that has to wait in the queue of 'pool'
+ * if 'saturated' is set, and reports saturation once every time the
+ * pool becomes saturated.
+ */
+static void worker_pool_saturate(struct worker_pool *pool, int saturated)
+{
+	if (!saturated) {
+		__atomic_store_n(&pool->saturated_state, 0, __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_add_fetch(&pool->saturated, 1, __ATOMIC_RELAXED);
+
+	if (!__atomic_exchange_n(&pool->saturated_state, 1, __ATOMIC_RELAXED)) {
+		log_warn(
+			"worker_pool_submit: "
+			"All worker threads are busy, "
+			"client connections are queued."
+		);
+	}
+}
+
+/**
+ * Removes one idle worker thread from 'pool' if there are more worker
+ * threads than the minimum, and no queued client connection has been
+ * reserved for it.
+ * Returns non-zero if the calling worker thread should quit.
+ */
+static int worker_pool_retire(struct worker_pool *pool)
+{
+	if (!worker_pool_take(&pool->idle, 0)) {
+		return 0;
+	}
+
+	if (!worker_pool_take(&pool->threads, pool->min_threads)) {
+		__atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Sleeps until a client connection is queued in 'pool'.
+ * Returns the client connection, or NULL if 'pool' is stopped or this
+ * worker thread has been idle for too long and has left the thread
+ * count of 'pool'. Sets '*retired' in the latter case.
+ */
+static struct maxserver_conn *worker_pool_wait(
+	struct worker_pool *pool,
+	int *retired
+)
+{
+	struct maxserver_conn *conn;
+	struct timespec deadline;
+	unsigned int seq;
+	int timed;
+
+	worker_pool_deadline(&deadline, pool->idle_timeout_ms);
+
+	for (;;) {
+		/* Announce the sleep, then check the queue and the
+		   stopping flag again, so that no wakeup is lost. */
+		seq = mpmc_wait_prepare(pool->queue);
+		conn = mpmc_pop(pool->queue);
+
+		if (conn != NULL ||
+			__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) {
+			mpmc_wait_cancel(pool->queue);
+			return conn;
+		}
+
+		/* Worker threads above the minimum quit once they
+		   have been idle for the idle timeout. */
+		timed = __atomic_load_n(&pool->threads, __ATOMIC_RELAXED) >
+			pool->min_threads;
+
+		if (mpmc_wait(pool->queue, seq, timed ? &deadline : NULL)
+			== -1) {
+			if (worker_pool_retire(pool)) {
+				*retired = 1;
+				return NULL;
+			}
+
+			/* A client connection is on its way to this
+			   worker thread, so start a new idle period. */
+			worker_pool_deadline(
+				&deadline,
+				pool->idle_timeout_ms
+			);
+		}
+	}
+}
+
+/**
+ * Calls client thread on queued client connections until 'pool' is
+ * stopped, or until this worker thread has been idle for too long
+ * and there are more worker threads than the minimum.
+ */
+static void *worker_thread(void *arg)
+{
+	struct worker *worker;
+	struct worker_pool *pool;
+	struct maxserver_conn *conn;
+	int retired = 0;
+
+	worker = (struct worker *)arg;
+	pool = worker->pool;
+
+	for (;;) {
+		/* Take a queued client connection, and only sleep
+		   when the queue stays empty. */
+		conn = mpmc_pop_spin(pool->queue, WORKER_POOL_SPINS);
+
+		if (conn == NULL) {
+			conn = worker_pool_wait(pool, &retired);
+		}
+
+		if (conn == NULL) {
+			break;
+		}
+
+		/* Call client thread, which closes and frees 'conn'.
+		   'submit' already counted this worker thread as busy
+		   when it queued 'conn'. */
+		conn_handle(conn, pool->client_thread, pool->sigpipe);
+
+		__atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+	}
+
+	/* Leave the pool. The slot is joined by whoever reuses it. */
+	pthread_mutex_lock(&pool->lock);
+
+	if (!retired) {
+		__atomic_sub_fetch(&pool->threads, 1, __ATOMIC_RELAXED);
+		worker_pool_take(&pool->idle, 0);
+	}
+
+	worker->state = WORKER_EXITED;
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/**
+ * Takes a client connection queued for another worker thread of the
+ * pool of 'worker', visiting the others in turn starting after it.
+ * Takes the oldest client connection that the other worker thread
+ * has moved into its deque, or failing that, one still in its inbox.
+ * Returns the client connection, or NULL if there was none to take.
+ */
+static struct maxserver_conn *worker_steal(struct worker *worker)
+{
+	struct worker_pool *pool = worker->pool;
+	struct maxserver_conn *conn;
+	struct worker *victim;
+	size_t self;
+	size_t i;
+
+	self = (size_t)(worker - pool->workers);
+
+	for (i = 1; i < pool->max_threads; ++i) {
+		victim = &pool->workers[(self + i) % pool->max_threads];
+		conn = deque_steal(victim->deque);
+
+		if (conn == NULL) {
+			conn = mpmc_pop(victim->inbox);
+		}
+
+		if (conn != NULL) {
+			__atomic_add_fetch(
+				&worker->steals,
+				1,
+				__ATOMIC_RELAXED
+			);
+			__atomic_add_fetch(&pool->steals, 1, __ATOMIC_RELAXED);
+			return conn;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Takes the next client connection for 'worker' from its own queue,
+ * or with MAXSERVER_POOL_STEALING from the queue of another worker
+ * thread if its own is empty.
+ * Returns the client connection, or NULL if there was none to take.
+ */
+static struct maxserver_conn *worker_next(struct worker *worker)
+{
+	struct maxserver_conn *conn;
+	size_t cap;
+
+	/* Move client connections submitted to this worker thread into
+	   its deque, from which other worker threads can steal them
+	   while this one is busy. */
+	cap = deque_capacity(worker->deque);
+
+	while (deque_count(worker->deque) < cap) {
+		conn = mpmc_pop(worker->inbox);
+
+		if (conn == NULL) {
+			break;
+		}
+
+		deque_push(worker->deque, conn);
+	}
+
+	/* Take the oldest client connection from the top, like a
+	   thief, so that client connections are handled in the order
+	   they were accepted. The top only fails to move when a thief
+	   takes the same client connection. */
+	do {
+		conn = deque_steal(worker->deque);
+	} while (conn == NULL && deque_count(worker->deque) > 0);
+
+	if (conn == NULL &&
+		worker->pool->scheduler == MAXSERVER_POOL_STEALING) {
+		conn = worker_steal(worker);
+	}
+
+	return conn;
+}
+
+/**
+ * Sleeps on the inbox of 'worker' until a client connection may have
+ * been queued for it, or its pool is stopped.
+ * Returns a client connection found before sleeping, or NULL.
+ */
+static struct maxserver_conn *worker_sleep(struct worker *worker)
+{
+	struct maxserver_conn *conn;
+	unsigned int seq;
+
+	/* Announce the sleep, then look again, so that no wakeup is
+	   lost. */
+	__atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+	seq = mpmc_wait_prepare(worker->inbox);
+	conn = worker_next(worker);
+
+	if (conn != NULL ||
+		__atomic_load_n(&worker->pool->stopping, __ATOMIC_ACQUIRE)) {
+		mpmc_wait_cancel(worker->inbox);
+	} else {
+		mpmc_wait(worker->inbox, seq, NULL);
+	}
+
+	__atomic_store_n(&worker->sleeping, 0, __ATOMIC_RELAXED);
+
+	return conn;
+}
+
+/**
+ * Calls client thread on the client connections queued for this
+ * worker thread, or stolen from others, until 'pool' is stopped.
+ */
+static void *worker_thread_own(void *arg)
+{
+	struct worker *worker;
+	struct worker_pool *pool;
+	struct maxserver_conn *conn;
+	unsigned int i;
+
+	worker = (struct worker *)arg;
+	pool = worker->pool;
+
+	while (!__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) {
+		/* Take a client connection, and only sleep when none
+		   turns up after a few yields. */
+		conn = worker_next(worker);
+
+		for (i = 0; conn == NULL && i < WORKER_POOL_SPINS; ++i) {
+			sched_yield();
+			conn = worker_next(worker);
+		}
+
+		if (conn == NULL) {
+			conn = worker_sleep(worker);
+		}
+
+		if (conn == NULL) {
+			continue;
+		}
+
+		/* Call client thread, which closes and frees 'conn'. */
+		__atomic_store_n(&worker->busy, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+
+		conn_handle(conn, pool->client_thread, pool->sigpipe);
+
+		__atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&worker->busy, 0, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&worker->handled, 1, __ATOMIC_RELAXED);
+	}
+
+	/* Leave the pool. */
+	pthread_mutex_lock(&pool->lock);
+
+	__atomic_sub_fetch(&pool->threads, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+	worker->state = WORKER_EXITED;
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/**
+ * Spawns one worker thread in 'pool', which counts as busy until it
+ * has taken a client connection. Must be called with the pool mutex
+ * lock held.
+ * On success, zero is returned. On error, -1 is returned, and an
+ * appropriate error message is printed to standard error.
+ */
+static int worker_pool_spawn(struct worker_pool *pool)
+{
+	struct worker *worker;
+	int err;
+	size_t i;
+
+	/* Find a free worker thread slot. */
+	for (i = 0; i < pool->max_threads; ++i) {
+		if (pool->workers[i].state != WORKER_RUNNING) {
+			break;
+		}
+	}
+
+	if (i == pool->max_threads) {
+		return -1;
+	}
+
+	worker = &pool->workers[i];
+
+	/* Join previous worker thread in this slot. It has already
+	   released its hold on the pool. */
+	if (worker->state == WORKER_EXITED) {
+		err = pthread_join(worker->tid, NULL);
+
+		if (err != 0) {
+			print_error("worker_pool_spawn:pthread_join", err);
+		} else {
+			metrics_add(pool->metrics, METRICS_THREAD_JOINS, 1);
+		}
+
+		worker->state = WORKER_UNUSED;
+	}
+
+	/* Start worker thread. */
+	err = pthread_create(
+		&worker->tid,
+		NULL,
+		pool->scheduler == MAXSERVER_POOL_SHARED ?
+			worker_thread : worker_thread_own,
+		worker
+	);
+
+	if (err != 0) {
+		print_error("worker_pool_spawn:pthread_create", err);
+		return -1;
+	}
+
+	worker->state = WORKER_RUNNING;
+	__atomic_add_fetch(&pool->threads, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool->spawned, 1, __ATOMIC_RELAXED);
+	metrics_add(pool->metrics, METRICS_THREAD_SPAWNS, 1);
+
+	return 0;
+}
+
+/**
+ * Frees the queues of 'pool', its worker thread slots and 'pool'
+ * itself.
+ */
+static void worker_pool_free(struct worker_pool *pool)
+{
+	size_t i;
+
+	for (i = 0; i < pool->max_threads; ++i) {
+		if (pool->workers[i].inbox != NULL) {
+			mpmc_destroy(pool->workers[i].inbox);
+		}
+
+		if (pool->workers[i].deque != NULL) {
+			deque_destroy(pool->workers[i].deque);
+		}
+	}
+
+	if (pool->queue != NULL) {
+		mpmc_destroy(pool->queue);
+	}
+
+	free(pool->workers);
+	free(pool);
+}
+
+/**
+ * Creates a worker pool that calls 'client_thread' on every client
+ * connection submitted to it, scheduled as described by 'scheduler'.
+ * With MAXSERVER_POOL_SHARED, it spawns 'min_threads' worker
+ * threads. More worker threads are spawned on demand, up to
+ * 'max_threads', and worker threads above 'min_threads' quit after
+ * being idle for 'idle_timeout_ms' milliseconds. With the other
+ * schedulers, it spawns 'max_threads' worker threads, which never
+ * quit. At most 'queue_len' client connections can wait for a worker
+ * thread, split evenly between the worker threads unless the queue
+ * is shared. Worker threads are counted in 'metrics', which may be
+ * NULL, when they are spawned and joined.
+ * On success, a pointer to the new worker pool is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
+ */
+struct worker_pool *worker_pool_create(
+	size_t min_threads,
+	size_t max_threads,
+	size_t queue_len,
+	unsigned int idle_timeout_ms,
+	enum maxserver_pool_scheduler scheduler,
+	void (*client_thread)(int cfd, int sigpipe),
+	int sigpipe,
+	struct metrics *metrics
+)
+{
+	struct worker_pool *pool;
+	size_t share;
+	int err = 0;
+	size_t i;
+
+	if (max_threads == 0 || min_threads > max_threads || queue_len == 0) {
+		print_error_str(
+			"worker_pool_create",
+			"Invalid worker pool configuration."
+		);
+		return NULL;
+	}
+
+	/* Allocate worker pool data structure. */
+	pool = calloc(1, sizeof(struct worker_pool));
+
+	if (pool == NULL) {
+		print_error_errno("worker_pool_create:calloc");
+		return NULL;
+	}
+
+	/* Worker threads with their own queues are all spawned at
+	   once and never quit. */
+	if (scheduler != MAXSERVER_POOL_SHARED) {
+		min_threads = max_threads;
+	}
+
+	pool->min_threads = min_threads;
+	pool->max_threads = max_threads;
+	pool->idle_timeout_ms = idle_timeout_ms;
+	pool->scheduler = scheduler;
+	pool->client_thread = client_thread;
+	pool->sigpipe = sigpipe;
+	pool->metrics = metrics;
+
+	/* Allocate worker thread slots. */
+	pool->workers = calloc(max_threads, sizeof(struct worker));
+
+	if (pool->workers == NULL) {
+		print_error_errno("worker_pool_create:calloc");
+		free(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < max_threads; ++i) {
+		pool->workers[i].state = WORKER_UNUSED;
+		pool->workers[i].pool = pool;
+	}
+
+	/* Allocate the shared queue, or a queue for every worker
+	   thread. */
+	if (scheduler == MAXSERVER_POOL_SHARED) {
+		pool->queue = mpmc_create(queue_len);
+		err = pool->queue == NULL ? -1 : 0;
+	} else {
+		share = (queue_len + max_threads - 1) / max_threads;
+
+		for (i = 0; i < max_threads && err == 0; ++i) {
+			pool->workers[i].inbox = mpmc_create(share);
+
+			if (pool->workers[i].inbox != NULL) {
+				pool->workers[i].deque = deque_create(share);
+			}
+
+			if (pool->workers[i].deque == NULL) {
+				err = -1;
+			}
+		}
+	}
+
+	if (err == -1) {
+		worker_pool_free(pool);
+		return NULL;
+	}
+
+	/* Initialise worker pool mutex lock. */
+	err = pthread_mutex_init(&pool->lock, NULL);
+
+	if (err != 0) {
+		print_error("worker_pool_create:pthread_mutex_init", err);
+		worker_pool_free(pool);
+		return NULL;
+	}
+
+	/* Spawn the minimum number of worker threads. */
+	pthread_mutex_lock(&pool->lock);
+
+	for (i = 0; i < min_threads; ++i) {
+		err = worker_pool_spawn(pool);
+
+		if (err == -1) {
+			pthread_mutex_unlock(&pool->lock);
+			worker_pool_destroy(pool);
+			return NULL;
+		}
+
+		__atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return pool;
+}
+
+/**
+ * Wakes one sleeping worker thread of 'pool' other than 'worker', so
+ * that it steals the client connection just queued for 'worker'
+ * while 'worker' is busy.
+ */
+static void worker_pool_wake_thief(
+	struct worker_pool *pool,
+	struct worker *worker
+)
+{
+	struct worker *thief;
+	size_t self;
+	size_t i;
+
+	self = (size_t)(worker - pool->workers);
+
+	for (i = 1; i < pool->max_threads; ++i) {
+		thief = &pool->workers[(self + i) % pool->max_threads];
+
+		if (__atomic_load_n(&thief->sleeping, __ATOMIC_SEQ_CST)) {
+			mpmc_wake(thief->inbox, 1);
+			return;
+		}
+	}
+}
+
+/**
+ * Queues the 'len' client connections of 'conns' to the worker
+ * threads of 'pool' in turn, skipping worker threads whose queues are
+ * full, as 'worker_pool_submit' does for schedulers that give every
+ * worker thread its own queue.
+ * Returns the number of client connections at the front of 'conns'
+ * that were queued.
+ */
+static size_t worker_pool_submit_own(
+	struct worker_pool *pool,
+	struct maxserver_conn **conns,
+	size_t len
+)
+{
+	struct worker *worker = NULL;
+	size_t next;
+	size_t i;
+	size_t n;
+
+	for (n = 0; n < len; ++n) {
+		if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		/* Insert client connection into the queue of the next
+		   worker thread with room for it. */
+		next = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+
+		for (i = 0; i < pool->max_threads; ++i) {
+			worker = &pool->workers[(next + i) % pool->max_threads];
+
+			if (mpmc_push(worker->inbox, conns[n]) == 0) {
+				break;
+			}
+		}
+
+		if (i == pool->max_threads) {
+			break;
+		}
+
+		__atomic_add_fetch(&pool->dispatched, 1, __ATOMIC_RELAXED);
+		worker_pool_raise(
+			&worker->queued_max,
+			mpmc_count(worker->inbox) + deque_count(worker->deque)
+		);
+		worker_pool_raise(&pool->queue_count_max, worker->queued_max);
+
+		/* Wake the worker thread, and if it is busy, another
+		   one to steal the client connection. */
+		mpmc_wake(worker->inbox, 1);
+
+		if (pool->scheduler == MAXSERVER_POOL_STEALING &&
+			__atomic_load_n(&worker->busy, __ATOMIC_RELAXED)) {
+			worker_pool_wake_thief(pool, worker);
+		}
+
+		worker_pool_saturate(
+			pool,
+			__atomic_load_n(&pool->idle, __ATOMIC_RELAXED) == 0
+		);
+	}
+
+	return n;
+}
+
+/**
+ * Queues the 'len' client connections of 'conns' to be handled by
+ * worker threads in 'pool' without taking any lock unless a worker
+ * thread has to be spawned, and wakes sleeping worker threads once
+ * for all of them. A worker thread closes and frees each client
+ * connection when 'client_thread' returns. Must not be called
+ * concurrently with 'worker_pool_destroy'.
+ * Returns the number of client connections at the front of 'conns'
+ * that were queued. The caller remains responsible for the rest,
+ * which did not fit in the queue.
+ */
+size_t worker_pool_submit(
+	struct worker_pool *pool,
+	struct maxserver_conn **conns,
+	size_t len
+)
+{
+	size_t n;
+	int ready;
+
+	if (pool->scheduler != MAXSERVER_POOL_SHARED) {
+		n = worker_pool_submit_own(pool, conns, len);
+		__atomic_add_fetch(&pool->rejected, len - n, __ATOMIC_RELAXED);
+		return n;
+	}
+
+	for (n = 0; n < len; ++n) {
+		if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+
+		/* Insert client connection into queue. */
+		if (mpmc_push(pool->queue, conns[n]) == -1) {
+			break;
+		}
+
+		__atomic_add_fetch(&pool->dispatched, 1, __ATOMIC_RELAXED);
+		worker_pool_raise(
+			&pool->queue_count_max,
+			mpmc_count(pool->queue)
+		);
+
+		/* Reserve an idle worker thread for the client
+		   connection, or spawn another one if every idle worker
+		   thread already has a client connection to take. */
+		ready = worker_pool_take(&pool->idle, 0);
+
+		if (!ready && __atomic_load_n(
+			&pool->threads,
+			__ATOMIC_RELAXED
+		) < pool->max_threads) {
+			pthread_mutex_lock(&pool->lock);
+
+			if (__atomic_load_n(
+				&pool->threads,
+				__ATOMIC_RELAXED
+			) < pool->max_threads) {
+				ready = worker_pool_spawn(pool) == 0;
+			}
+
+			pthread_mutex_unlock(&pool->lock);
+		}
+
+		worker_pool_saturate(pool, !ready);
+	}
+
+	__atomic_add_fetch(&pool->rejected, len - n, __ATOMIC_RELAXED);
+
+	if (n > 0) {
+		mpmc_wake(pool->queue, n < INT_MAX ? (int)n : INT_MAX);
+	}
+
+	return n;
+}
+
+/**
+ * Stores statistics of 'pool' in 'stats'. The counters are read
+ * without a lock, so they may be mutually inconsistent while client
+ * connections are being dispatched.
+ */
+void worker_pool_stats(
+	struct worker_pool *pool,
+	struct maxserver_pool_stats *stats
+)
+{
+	size_t idle;
+	size_t i;
+
+	stats->threads = __atomic_load_n(&pool->threads, __ATOMIC_RELAXED);
+	idle = __atomic_load_n(&pool->idle, __ATOMIC_RELAXED);
+	stats->busy = stats->threads > idle ? stats->threads - idle : 0;
+
+	if (pool->scheduler == MAXSERVER_POOL_SHARED) {
+		stats->queued = mpmc_count(pool->queue);
+	} else {
+		stats->queued = 0;
+
+		for (i = 0; i < pool->max_threads; ++i) {
+			stats->queued += mpmc_count(pool->workers[i].inbox) +
+				deque_count(pool->workers[i].deque);
+		}
+	}
+
+	stats->queued_max = __atomic_load_n(
+		&pool->queue_count_max,
+		__ATOMIC_RELAXED
+	);
+	stats->dispatched = __atomic_load_n(
+		&pool->dispatched,
+		__ATOMIC_RELAXED
+	);
+	stats->spawned = __atomic_load_n(&pool->spawned, __ATOMIC_RELAXED);
+	stats->saturated = __atomic_load_n(
+		&pool->saturated,
+		__ATOMIC_RELAXED
+	);
+	stats->rejected = __atomic_load_n(&pool->rejected, __ATOMIC_RELAXED);
+	stats->steals = __atomic_load_n(&pool->steals, __ATOMIC_RELAXED);
+}
+
+/**
+ * Stores statistics of each worker thread of 'pool' in 'stats', which
+ * has room for 'len' worker threads. Returns the number of worker
+ * threads, which is zero with MAXSERVER_POOL_SHARED.
+ */
+size_t worker_pool_worker_stats(
+	struct worker_pool *pool,
+	struct maxserver_pool_worker_stats *stats,
+	size_t len
+)
+{
+	struct worker *worker;
+	size_t i;
+
+	if (pool->scheduler == MAXSERVER_POOL_SHARED) {
+		return 0;
+	}
+
+	for (i = 0; i < pool->max_threads && i < len; ++i) {
+		worker = &pool->workers[i];
+		stats[i].queued = mpmc_count(worker->inbox) +
+			deque_count(worker->deque);
+		stats[i].queued_max = __atomic_load_n(
+			&worker->queued_max,
+			__ATOMIC_RELAXED
+		);
+		stats[i].handled = __atomic_load_n(
+			&worker->handled,
+			__ATOMIC_RELAXED
+		);
+		stats[i].steals = __atomic_load_n(
+			&worker->steals,
+			__ATOMIC_RELAXED
+		);
+	}
+
+	return pool->max_threads;
+}
+
+/**
+ * Closes and frees every client connection still waiting in 'queue'.
+ */
+static void worker_pool_drain(struct mpmc *queue)
+{
+	struct maxserver_conn *conn;
+
+	while ((conn = mpmc_pop(queue)) != NULL) {
+		close(conn->fd);
+		conn_destroy(conn);
+	}
+}
+
+/**
+ * Stops all worker threads in 'pool', closes any client connection
+ * still waiting in the queue and frees 'pool'. The caller must
+ * already have signalled 'sigpipe', so that running client threads
+ * return.
+ */
+void worker_pool_destroy(struct worker_pool *pool)
+{
+	struct maxserver_conn *conn;
+	int err;
+	size_t i;
+
+	/* Signal worker threads to quit. */
+	__atomic_store_n(&pool->stopping, 1, __ATOMIC_RELEASE);
+
+	if (pool->scheduler == MAXSERVER_POOL_SHARED) {
+		mpmc_wake(pool->queue, INT_MAX);
+	} else {
+		for (i = 0; i < pool->max_threads; ++i) {
+			mpmc_wake(pool->workers[i].inbox, 1);
+		}
+	}
+
+	/* Join worker threads. No new worker thread can be spawned
+	   once 'stopping' is set. */
+	for (i = 0; i < pool->max_threads; ++i) {
+		if (pool->workers[i].state == WORKER_UNUSED) {
+			continue;
+		}
+
+		err = pthread_join(pool->workers[i].tid, NULL);
+
+		if (err != 0) {
+			print_error("worker_pool_destroy:pthread_join", err);
+		} else {
+			metrics_add(pool->metrics, METRICS_THREAD_JOINS, 1);
+		}
+	}
+
+	/* Close client connections still waiting in the queues. */
+	if (pool->scheduler == MAXSERVER_POOL_SHARED) {
+		worker_pool_drain(pool->queue);
+	} else {
+		for (i = 0; i < pool->max_threads; ++i) {
+			while ((conn = deque_pop(pool->workers[i].deque))
+				!= NULL) {
+				close(conn->fd);
+				conn_destroy(conn);
+			}
+
+			worker_pool_drain(pool->workers[i].inbox);
+		}
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	worker_pool_free(pool);
+}
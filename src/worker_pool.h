@@ -0,0 +1,109 @@
+/**
+ * Copyright © 2018  Max Wällstedt <max.wallstedt@gmail.com>
+ *
+ * This file is part of maxserver.
+ *
+ * maxserver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * maxserver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with maxserver.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+
+#include "maxserver.h"
+
+struct metrics;
+
+/**
+ * Opaque data structure representing a pool of worker threads.
+ */
+struct worker_pool;
+
+/**
+ * Creates a worker pool that calls 'client_thread' on every client
+ * connection submitted to it, scheduled as described by 'scheduler'.
+ * With MAXSERVER_POOL_SHARED, it spawns 'min_threads' worker
+ * threads. More worker threads are spawned on demand, up to
+ * 'max_threads', and worker threads above 'min_threads' quit after
+ * being idle for 'idle_timeout_ms' milliseconds. With the other
+ * schedulers, it spawns 'max_threads' worker threads, which never
+ * quit. At most 'queue_len' client connections can wait for a worker
+ * thread, split evenly between the worker threads unless the queue
+ * is shared. Worker threads are counted in 'metrics', which may be
+ * NULL, when they are spawned and joined.
+ * On success, a pointer to the new worker pool is returned. On
+ * error, NULL is returned, and an appropriate error message is
+ * printed to standard error.
+ */
+struct worker_pool *worker_pool_create(
+	size_t min_threads,
+	size_t max_threads,
+	size_t queue_len,
+	unsigned int idle_timeout_ms,
+	enum maxserver_pool_scheduler scheduler,
+	void (*client_thread)(int cfd, int sigpipe),
+	int sigpipe,
+	struct metrics *metrics
+);
+
+/**
+ * Queues the 'len' client connections of 'conns' to be handled by
+ * worker threads in 'pool' without taking any lock unless a worker
+ * thread has to be spawned, and wakes sleeping worker threads once
+ * for all of them. A worker thread closes and frees each client
+ * connection when 'client_thread' returns. Must not be called
+ * concurrently with 'worker_pool_destroy'.
+ * Returns the number of client connections at the front of 'conns'
+ * that were queued. The caller remains responsible for the rest,
+ * which did not fit in the queue.
+ */
+size_t worker_pool_submit(
+	struct worker_pool *pool,
+	struct maxserver_conn **conns,
+	size_t len
+);
+
+/**
+ * Stores statistics of 'pool' in 'stats'. The counters are read
+ * without a lock, so they may be mutually inconsistent while client
+ * connections are being dispatched.
+ */
+void worker_pool_stats(
+	struct worker_pool *pool,
+	struct maxserver_pool_stats *stats
+);
+
+/**
+ * Stores statistics of each worker thread of 'pool' in 'stats', which
+ * has room for 'len' worker threads. Returns the number of worker
+ * threads, which is zero with MAXSERVER_POOL_SHARED.
+ */
+size_t worker_pool_worker_stats(
+	struct worker_pool *pool,
+	struct maxserver_pool_worker_stats *stats,
+	size_t len
+);
+
+/**
+ * Stops all worker threads in 'pool', closes any client connection
+ * still waiting in the queue and frees 'pool'. The caller must
+ * already have signalled 'sigpipe', so that running client threads
+ * return.
+ */
+void worker_pool_destroy(struct worker_pool *pool);
+
+#endif